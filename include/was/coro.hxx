@@ -0,0 +1,633 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <mk@cm4all.com>
+
+/*
+ * A C++20 coroutine API on top of the non-blocking mode of
+ * <was/simple.h>.  Each WAS connection is handled by one coroutine;
+ * a #Was::Scheduler runs many of them in one thread.
+ *
+ * This header is optional and header-only; it requires C++20 and
+ * Linux (epoll).
+ */
+
+#pragma once
+
+#include "simple.h"
+
+#include <coroutine>
+#include <cstddef>
+#include <cstdlib>
+#include <exception>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#include <errno.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+namespace Was {
+
+class Connection;
+class Scheduler;
+
+/**
+ * A small free list of coroutine frames owned by one #Connection.
+ * A connection typically runs the same (nested) coroutines for each
+ * request, so after the first request, their frames are recycled
+ * instead of being allocated from the heap again.
+ */
+class FramePool {
+    struct alignas(__STDCPP_DEFAULT_NEW_ALIGNMENT__) Header {
+        /**
+         * The pool this frame will be returned to; nullptr if it
+         * was allocated without a pool.
+         */
+        FramePool *pool;
+
+        /**
+         * The next free frame (only while it is in the free
+         * list).
+         */
+        Header *next;
+
+        std::size_t size;
+    };
+
+    static constexpr unsigned MAX_IDLE = 8;
+
+    Header *free_list = nullptr;
+    unsigned n_idle = 0;
+
+public:
+    FramePool() noexcept = default;
+
+    ~FramePool() noexcept {
+        while (free_list != nullptr) {
+            Header *h = free_list;
+            free_list = h->next;
+            ::operator delete(h);
+        }
+    }
+
+    FramePool(const FramePool &) = delete;
+    FramePool &operator=(const FramePool &) = delete;
+
+    void *Allocate(std::size_t size) {
+        for (Header **p = &free_list; *p != nullptr; p = &(*p)->next) {
+            Header *h = *p;
+            if (h->size >= size) {
+                *p = h->next;
+                --n_idle;
+                return h + 1;
+            }
+        }
+
+        Header *h = NewHeader(size);
+        h->pool = this;
+        return h + 1;
+    }
+
+    /**
+     * Allocate a frame which is not managed by a pool.
+     */
+    static void *AllocateUnpooled(std::size_t size) {
+        Header *h = NewHeader(size);
+        h->pool = nullptr;
+        return h + 1;
+    }
+
+    /**
+     * Return a frame allocated by Allocate() or AllocateUnpooled().
+     */
+    static void Free(void *p) noexcept {
+        Header *h = static_cast<Header *>(p) - 1;
+        FramePool *pool = h->pool;
+        if (pool == nullptr || pool->n_idle >= MAX_IDLE) {
+            ::operator delete(h);
+            return;
+        }
+
+        h->next = pool->free_list;
+        pool->free_list = h;
+        ++pool->n_idle;
+    }
+
+private:
+    static Header *NewHeader(std::size_t size) {
+        Header *h = static_cast<Header *>(::operator new(sizeof(Header) + size));
+        h->size = size;
+        return h;
+    }
+};
+
+/**
+ * A coroutine returning nothing.  It starts suspended; it runs when
+ * it is awaited by another #Task (which is resumed when this one
+ * finishes) or when it is passed to Scheduler::Add().
+ *
+ * If the first parameter of the coroutine function is a
+ * #Connection reference, then its frame is allocated from that
+ * connection's #FramePool.
+ */
+class [[nodiscard]] Task {
+public:
+    struct promise_type {
+        /**
+         * The coroutine awaiting this one; nullptr if this is the
+         * connection's main coroutine.
+         */
+        std::coroutine_handle<> continuation;
+
+        Task get_return_object() noexcept {
+            return Task{std::coroutine_handle<promise_type>::from_promise(*this)};
+        }
+
+        std::suspend_always initial_suspend() noexcept {
+            return {};
+        }
+
+        struct FinalAwaitable {
+            bool await_ready() const noexcept {
+                return false;
+            }
+
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> h) noexcept {
+                auto c = h.promise().continuation;
+                return c ? c : std::noop_coroutine();
+            }
+
+            void await_resume() const noexcept {}
+        };
+
+        FinalAwaitable final_suspend() noexcept {
+            return {};
+        }
+
+        void return_void() noexcept {}
+
+        void unhandled_exception() noexcept {
+            std::terminate();
+        }
+
+        template<typename... Args>
+        static void *operator new(std::size_t size, Connection &c, Args &&...);
+
+        static void *operator new(std::size_t size) {
+            return FramePool::AllocateUnpooled(size);
+        }
+
+        static void operator delete(void *p) noexcept {
+            FramePool::Free(p);
+        }
+    };
+
+private:
+    std::coroutine_handle<promise_type> handle;
+
+    explicit Task(std::coroutine_handle<promise_type> _handle) noexcept
+        :handle(_handle) {}
+
+public:
+    Task() noexcept = default;
+
+    Task(Task &&src) noexcept
+        :handle(std::exchange(src.handle, nullptr)) {}
+
+    ~Task() noexcept {
+        if (handle)
+            handle.destroy();
+    }
+
+    Task &operator=(Task &&src) noexcept {
+        using std::swap;
+        swap(handle, src.handle);
+        return *this;
+    }
+
+    bool IsDone() const noexcept {
+        return !handle || handle.done();
+    }
+
+    bool await_ready() const noexcept {
+        return IsDone();
+    }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> c) noexcept {
+        handle.promise().continuation = c;
+        return handle;
+    }
+
+    void await_resume() const noexcept {}
+
+private:
+    friend class Scheduler;
+
+    void Start() noexcept {
+        handle.resume();
+    }
+};
+
+/**
+ * One WAS connection driven by a #Scheduler.  Its methods return
+ * awaitables which wrap the corresponding was_simple_*() function;
+ * while it fails with EAGAIN, the coroutine is suspended until the
+ * scheduler sees one of the connection's file descriptors become
+ * ready.
+ *
+ * Functions which do not wait (e.g. was_simple_status(),
+ * was_simple_set_header()) can be called directly on Get().
+ */
+class Connection {
+    friend class Scheduler;
+
+    /**
+     * A suspended operation.
+     */
+    struct Waiter {
+        std::coroutine_handle<> continuation;
+
+        /**
+         * Try the operation again.
+         *
+         * @return false if it would still block
+         */
+        virtual bool Try() noexcept = 0;
+
+    protected:
+        ~Waiter() noexcept = default;
+    };
+
+    /**
+     * An operation which is tried right away and then again each
+     * time the connection becomes ready, until it does not fail
+     * with EAGAIN anymore.
+     *
+     * @param F a function attempting the operation; it returns the
+     * result and sets the "again" flag if the operation would
+     * block
+     */
+    template<typename F>
+    class Operation final : Waiter {
+        using Result = std::invoke_result_t<F &, bool &>;
+
+        Connection &connection;
+        F f;
+        Result result;
+
+    public:
+        Operation(Connection &_connection, F &&_f) noexcept
+            :connection(_connection), f(std::move(_f)) {}
+
+        bool await_ready() noexcept {
+            return Try();
+        }
+
+        bool await_suspend(std::coroutine_handle<> c) noexcept {
+            continuation = c;
+            return connection.Wait(*this);
+        }
+
+        Result await_resume() const noexcept {
+            return result;
+        }
+
+    private:
+        bool Try() noexcept override {
+            bool again = false;
+            result = f(again);
+            return !again;
+        }
+    };
+
+    template<typename F>
+    Operation<F> MakeOperation(F &&f) noexcept {
+        return {*this, std::forward<F>(f)};
+    }
+
+    Scheduler &scheduler;
+    struct was_simple *const w;
+
+    FramePool frames;
+
+    /**
+     * The main coroutine; declared after #frames so it is
+     * destroyed first.
+     */
+    Task task;
+
+    /**
+     * The operation waiting for this connection to become ready.
+     */
+    Waiter *waiter = nullptr;
+
+    /**
+     * The file descriptor registered with epoll in addition to
+     * the control socket, or -1.
+     */
+    int extra_fd = -1;
+    uint32_t extra_events = 0;
+
+    /**
+     * The next item in the scheduler's list of closed connections.
+     */
+    Connection *next_closed = nullptr;
+    bool closed = false;
+
+    Connection(Scheduler &_scheduler, struct was_simple *_w) noexcept
+        :scheduler(_scheduler), w(_w) {
+        was_simple_set_non_block(w, true);
+    }
+
+    ~Connection() noexcept {
+        /* destroy the frames before the was_simple object they
+           may refer to */
+        task = Task{};
+        was_simple_free(w);
+    }
+
+public:
+    Connection(const Connection &) = delete;
+    Connection &operator=(const Connection &) = delete;
+
+    struct was_simple *Get() const noexcept {
+        return w;
+    }
+
+    FramePool &GetFramePool() noexcept {
+        return frames;
+    }
+
+    /**
+     * Await the next request; see was_simple_accept().
+     *
+     * @return the request URI or nullptr if the connection shall
+     * be closed
+     */
+    auto Accept() noexcept {
+        return MakeOperation([w=w](bool &again) noexcept {
+            const char *uri = was_simple_accept(w);
+            again = uri == nullptr && errno == EAGAIN;
+            return uri;
+        });
+    }
+
+    /**
+     * Read request body data; see was_simple_read().
+     */
+    auto Read(void *buffer, std::size_t length) noexcept {
+        return MakeOperation([w=w, buffer, length](bool &again) noexcept {
+            const ssize_t nbytes = was_simple_read(w, buffer, length);
+            again = nbytes == -1 && errno == EAGAIN;
+            return nbytes;
+        });
+    }
+
+    /**
+     * Write response body data; see was_simple_write().
+     */
+    auto Write(const void *data, std::size_t length) noexcept {
+        return MakeOperation([w=w, data, length](bool &again) noexcept {
+            const bool success = was_simple_write(w, data, length);
+            again = !success && errno == EAGAIN;
+            return success;
+        });
+    }
+
+    /**
+     * Copy request body data to the response body; see
+     * was_simple_splice().
+     */
+    auto Splice(std::size_t max_length) noexcept {
+        return MakeOperation([w=w, max_length](bool &again) noexcept {
+            const ssize_t nbytes = was_simple_splice(w, max_length);
+            again = nbytes == -1 && errno == EAGAIN;
+            return nbytes;
+        });
+    }
+
+    /**
+     * Finish the response; see was_simple_end().
+     */
+    auto End() noexcept {
+        return MakeOperation([w=w](bool &again) noexcept {
+            const bool success = was_simple_end(w);
+            again = !success && errno == EAGAIN;
+            return success;
+        });
+    }
+
+private:
+    /**
+     * Suspend the operation until the connection becomes ready.
+     *
+     * @return false if waiting is not possible; the caller shall
+     * resume the coroutine with the last (failed) result
+     */
+    inline bool Wait(Waiter &_waiter) noexcept;
+    inline void OnReady() noexcept;
+};
+
+template<typename... Args>
+inline void *
+Task::promise_type::operator new(std::size_t size, Connection &c, Args &&...)
+{
+    return c.GetFramePool().Allocate(size);
+}
+
+/**
+ * Runs the coroutines of many WAS connections in one thread, with
+ * one epoll instance.
+ */
+class Scheduler {
+    friend class Connection;
+
+    const int epoll_fd;
+
+    unsigned n_connections = 0;
+
+    /**
+     * Connections which have been closed during the current epoll
+     * batch; they are deleted after it.
+     */
+    Connection *closed = nullptr;
+
+public:
+    Scheduler() noexcept
+        :epoll_fd(epoll_create1(EPOLL_CLOEXEC)) {}
+
+    ~Scheduler() noexcept {
+        DeleteClosed();
+
+        if (epoll_fd >= 0)
+            close(epoll_fd);
+    }
+
+    Scheduler(const Scheduler &) = delete;
+    Scheduler &operator=(const Scheduler &) = delete;
+
+    /**
+     * Did the constructor succeed?  If not, errno is set.
+     */
+    bool IsDefined() const noexcept {
+        return epoll_fd >= 0;
+    }
+
+    /**
+     * Start handling a connection.  The handler coroutine is
+     * invoked with the #Connection and the given arguments
+     * (which are copied into its frame) and runs until it
+     * suspends for the first time.  When it finishes, the
+     * connection is closed.
+     *
+     * @param w the connection; the scheduler takes ownership and
+     * frees it with was_simple_free()
+     * @return false on error (with errno set)
+     */
+    template<typename... Args>
+    bool Add(struct was_simple *w,
+             Task (*handler)(Connection &, Args...),
+             std::type_identity_t<Args>... args) noexcept {
+        auto *c = new Connection(*this, w);
+
+        if (!Register(EPOLL_CTL_ADD, was_simple_control_fd(w), EPOLLIN, *c)) {
+            const int e = errno;
+            delete c;
+            errno = e;
+            return false;
+        }
+
+        ++n_connections;
+
+        c->task = handler(*c, std::move(args)...);
+        c->task.Start();
+        if (c->task.IsDone())
+            Close(*c);
+
+        DeleteClosed();
+        return true;
+    }
+
+    /**
+     * Run until all connections are closed.
+     *
+     * @return false on error (with errno set)
+     */
+    bool Run() noexcept {
+        while (n_connections > 0) {
+            struct epoll_event events[64];
+            const int n = epoll_wait(epoll_fd, events, 64, -1);
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                return false;
+            }
+
+            for (int i = 0; i < n; ++i) {
+                auto &c = *static_cast<Connection *>(events[i].data.ptr);
+                if (!c.closed)
+                    c.OnReady();
+            }
+
+            DeleteClosed();
+        }
+
+        return true;
+    }
+
+private:
+    bool Register(int op, int fd, uint32_t events, Connection &c) noexcept {
+        struct epoll_event e{};
+        e.events = events;
+        e.data.ptr = &c;
+        return epoll_ctl(epoll_fd, op, fd, &e) == 0;
+    }
+
+    void Unregister(int fd) noexcept {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+    }
+
+    void Close(Connection &c) noexcept {
+        if (c.closed)
+            return;
+
+        c.closed = true;
+        --n_connections;
+
+        if (c.extra_fd >= 0)
+            Unregister(c.extra_fd);
+        Unregister(was_simple_control_fd(c.w));
+
+        /* the current epoll batch may still refer to this object;
+           delete it later */
+        c.next_closed = closed;
+        closed = &c;
+    }
+
+    void DeleteClosed() noexcept {
+        while (closed != nullptr) {
+            auto *c = closed;
+            closed = c->next_closed;
+            delete c;
+        }
+    }
+};
+
+inline bool
+Connection::Wait(Waiter &_waiter) noexcept
+{
+    struct pollfd fds[2];
+    const unsigned n = was_simple_get_poll(w, fds);
+
+    int fd = -1;
+    uint32_t events = 0;
+    if (n > 1) {
+        fd = fds[1].fd;
+        if (fds[1].events & POLLIN)
+            events |= EPOLLIN;
+        if (fds[1].events & POLLOUT)
+            events |= EPOLLOUT;
+    }
+
+    if (fd != extra_fd || events != extra_events) {
+        if (extra_fd >= 0 && fd != extra_fd)
+            scheduler.Unregister(extra_fd);
+
+        if (fd >= 0 &&
+            !scheduler.Register(fd == extra_fd ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+                                fd, events, *this)) {
+            extra_fd = -1;
+            extra_events = 0;
+            return false;
+        }
+
+        extra_fd = fd;
+        extra_events = events;
+    }
+
+    waiter = &_waiter;
+    return true;
+}
+
+inline void
+Connection::OnReady() noexcept
+{
+    /* the control socket and the extra file descriptor may both
+       be reported in one batch; the second one finds the
+       operation already completed or waiting again */
+    Waiter *const current = std::exchange(waiter, nullptr);
+    if (current == nullptr)
+        return;
+
+    if (!current->Try() && Wait(*current))
+        return;
+
+    current->continuation.resume();
+
+    if (task.IsDone())
+        scheduler.Close(*this);
+}
+
+} // namespace Was
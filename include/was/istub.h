@@ -22,6 +22,18 @@ xresult
 xios_was_input_create(xmemctx *mctx, struct was_simple *was,
                       xiostub **stub_r);
 
+/**
+ * Write the rest of the request body to a regular file or a pipe
+ * without copying it through userspace (see was_simple_splice_to()).
+ * This bypasses the xios stream, therefore data it has already read
+ * ahead must be consumed first.
+ *
+ * @return 0 when the end of the request body has been reached, -1 on
+ * error
+ */
+int
+xios_was_input_splice(struct was_simple *was, int fd);
+
 #ifdef __cplusplus
 }
 #endif
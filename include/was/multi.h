@@ -5,6 +5,10 @@
 /*
  * Synchronous server implementation of the Multi Web Application
  * Socket protocol.
+ *
+ * Thread safety: a #was_multi object must only be used by one thread
+ * at a time.  The #was_simple objects it creates are independent
+ * (see simple.h).
  */
 
 #ifndef WAS_MULTI_H
@@ -12,6 +16,77 @@
 
 #include "compiler.h"
 
+struct was_simple;
+
+/**
+ * The return value of was_multi_handler.request.
+ */
+enum was_multi_result {
+    /**
+     * The request has been handled (was_simple_end() has been called
+     * or will be called implicitly).  The connection will be reused
+     * for the next request.
+     */
+    WAS_MULTI_RESULT_DONE,
+
+    /**
+     * A libwas function has failed with errno=EAGAIN.  The handler
+     * will be invoked again for the same request as soon as the
+     * connection becomes ready (see was_simple_get_poll()).
+     */
+    WAS_MULTI_RESULT_AGAIN,
+
+    /**
+     * Close this connection (e.g. after an error).
+     */
+    WAS_MULTI_RESULT_CLOSE,
+};
+
+/**
+ * Callbacks for was_multi_run().
+ */
+struct was_multi_handler {
+    /**
+     * A request is ready to be handled (or to be continued after
+     * #WAS_MULTI_RESULT_AGAIN).  The #was_simple object is in
+     * non-blocking mode (see was_simple_set_non_block()); the
+     * handler must not block.
+     *
+     * @param uri the request URI
+     * @param connection_ctx a pointer which may be used by the
+     * handler to store per-connection state; it is NULL for a new
+     * connection
+     * @param ctx the pointer passed to was_multi_run()
+     */
+    enum was_multi_result (*request)(struct was_simple *w, const char *uri,
+                                     void **connection_ctx, void *ctx);
+
+    /**
+     * Optional: the connection is about to be closed.  This is the
+     * chance to free the connection_ctx.
+     */
+    void (*close)(struct was_simple *w, void *connection_ctx, void *ctx);
+};
+
+/**
+ * Flags for was_multi_prefork().
+ */
+enum {
+    /**
+     * Pin each child process to one CPU (round-robin over the CPUs
+     * this process may run on).
+     */
+    WAS_MULTI_PREFORK_PIN_CPU = 0x1,
+
+    /**
+     * Pin each child process to the CPUs of one NUMA node
+     * (round-robin over the online nodes).  Memory allocated by the
+     * child is then usually local to that node (the kernel's
+     * first-touch policy).
+     */
+    WAS_MULTI_PREFORK_PIN_NODE = 0x2,
+};
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -45,6 +120,73 @@ was_multi_fd(struct was_multi *m);
 struct was_simple *
 was_multi_accept_simple(struct was_multi *m);
 
+/**
+ * Run an event loop (epoll) which accepts new connections and
+ * serves requests on all of them concurrently.  Idle connections cost
+ * nothing but memory, so this scales to thousands of keep-alive
+ * connections.
+ *
+ * This function returns after the Multi-WAS socket has been closed
+ * (i.e. this process shall be terminated) and all connections have
+ * been closed.  Malformed packets on the Multi-WAS socket are
+ * discarded, and if the process runs out of file descriptors, new
+ * connections are received again after a short delay.
+ *
+ * @param ctx an opaque pointer passed to the handler
+ * @return 0 on success, -1 on error (with errno set)
+ */
+int
+was_multi_run(struct was_multi *m, const struct was_multi_handler *handler,
+              void *ctx);
+
+/**
+ * Like was_multi_run(), but distribute the connections to a pool of
+ * worker threads, each running its own event loop.  The calling
+ * thread receives new connections and hands them to the workers
+ * through lock-free queues, preferring workers which are not
+ * backlogged; a worker whose connections are all idle takes
+ * connections from the queues of busy workers.
+ *
+ * Each #was_simple object is confined to the worker thread which
+ * took it; the handler is therefore invoked concurrently from
+ * several threads (but never concurrently for the same connection),
+ * and it must synchronize access to the shared "ctx" by itself.
+ *
+ * @param n_threads the number of worker threads (at least 1)
+ * @return 0 on success, -1 on error (with errno set)
+ */
+int
+was_multi_run_threads(struct was_multi *m, unsigned n_threads,
+                      const struct was_multi_handler *handler, void *ctx);
+
+/**
+ * Fork the given number of child processes which share the
+ * Multi-WAS socket, for applications which are not thread-safe.
+ * Each child calls was_multi_accept_simple() (or was_multi_run())
+ * on its copy of the #was_multi object; the children take turns
+ * waiting for new connections, so a new connection wakes up only
+ * one of them.
+ *
+ * The calling process becomes the supervisor: it respawns children
+ * which crash (with an exponential delay if they crash repeatedly
+ * right after startup).  A child which exits with status
+ * EXIT_SUCCESS (i.e. after was_multi_accept_simple() has returned
+ * NULL) initiates the shutdown: no more children are spawned, and
+ * this function returns after all of them have exited.  SIGTERM
+ * received by the supervisor is forwarded to all children and
+ * initiates the shutdown as well.
+ *
+ * This function may be called only once per #was_multi object.
+ *
+ * @param n the number of child processes (at least 1)
+ * @param flags a bit mask of WAS_MULTI_PREFORK_* flags
+ * @return the index of this child process (0 to n-1) in a child,
+ * -1 in the supervisor after all children have exited, or -2 on
+ * error (with errno set)
+ */
+int
+was_multi_prefork(struct was_multi *m, unsigned n, unsigned flags);
+
 #ifdef __cplusplus
 }
 #endif
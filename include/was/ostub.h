@@ -22,6 +22,20 @@ xresult
 xios_was_output_create(xmemctx *mctx, struct was_simple *was,
                        xiostub **stub_r);
 
+/**
+ * Copy data from a pipe (or another file descriptor supporting
+ * splice()) to the response body without copying it through
+ * userspace (see was_simple_splice_from()).  This bypasses the xios
+ * stream, therefore data written to it must be flushed first.
+ *
+ * @param size copy at most this number of bytes
+ * @return the number of bytes copied (less than @size if the end of
+ * the source or of the announced response body was reached), -1 on
+ * error
+ */
+xoffs
+xios_was_output_splice(struct was_simple *was, int fd, xoffs size);
+
 #ifdef __cplusplus
 }
 #endif
@@ -5,6 +5,18 @@
 /*
  * Synchronous server implementation of the Web Application Socket
  * protocol.
+ *
+ * Thread safety: the library's shared state is internally
+ * synchronized: the pool of recycled #was_simple objects (see
+ * was_multi_accept_simple()), the slab which lends control buffers
+ * to active connections, the process-wide counters (see
+ * was_simple_get_stats()) and #was_simple_cache objects, which may
+ * be shared by connections in different threads.  Apart from that,
+ * a #was_simple object (and all pointers obtained from it, e.g.
+ * header values and iterators) must only be used by one thread at a
+ * time, but different objects may be used by different threads
+ * concurrently.  An object may be moved to another thread as long as
+ * the hand-over is synchronized.
  */
 
 #ifndef WAS_SIMPLE_H
@@ -48,11 +60,110 @@ enum was_simple_poll_result {
     WAS_SIMPLE_POLL_CLOSED,
 };
 
+/**
+ * Well-known request headers which can be looked up in constant time
+ * with was_simple_get_header_token().
+ */
+enum was_simple_header {
+    WAS_SIMPLE_HEADER_ACCEPT,
+    WAS_SIMPLE_HEADER_ACCEPT_ENCODING,
+    WAS_SIMPLE_HEADER_ACCEPT_LANGUAGE,
+    WAS_SIMPLE_HEADER_AUTHORIZATION,
+    WAS_SIMPLE_HEADER_CACHE_CONTROL,
+    WAS_SIMPLE_HEADER_CONTENT_ENCODING,
+    WAS_SIMPLE_HEADER_CONTENT_LENGTH,
+    WAS_SIMPLE_HEADER_CONTENT_TYPE,
+    WAS_SIMPLE_HEADER_COOKIE,
+    WAS_SIMPLE_HEADER_HOST,
+    WAS_SIMPLE_HEADER_IF_MATCH,
+    WAS_SIMPLE_HEADER_IF_MODIFIED_SINCE,
+    WAS_SIMPLE_HEADER_IF_NONE_MATCH,
+    WAS_SIMPLE_HEADER_IF_RANGE,
+    WAS_SIMPLE_HEADER_IF_UNMODIFIED_SINCE,
+    WAS_SIMPLE_HEADER_ORIGIN,
+    WAS_SIMPLE_HEADER_RANGE,
+    WAS_SIMPLE_HEADER_REFERER,
+    WAS_SIMPLE_HEADER_USER_AGENT,
+    WAS_SIMPLE_HEADER_X_FORWARDED_FOR,
+
+    /**
+     * The number of well-known headers; not a valid value.
+     */
+    WAS_SIMPLE_HEADER_COUNT,
+};
+
+/**
+ * Process-wide counters, see was_simple_get_stats().  They include
+ * all #was_simple objects and all threads since the library was
+ * loaded.
+ */
+struct was_simple_stats {
+    /**
+     * Requests returned by was_simple_accept().
+     */
+    uint64_t requests;
+
+    /**
+     * recv() and send()/sendmsg() calls on control sockets.
+     */
+    uint64_t control_receives, control_sends;
+
+    /**
+     * Bytes moved inside the control buffers to make room.
+     */
+    uint64_t control_moved_bytes;
+
+    /**
+     * read() calls on request body pipes, write()/writev()/vmsplice()
+     * calls on response body pipes and splice() calls.
+     */
+    uint64_t pipe_reads, pipe_writes, pipe_splices;
+
+    /**
+     * poll() calls and how many of them have timed out.
+     */
+    uint64_t polls, poll_timeouts;
+
+    /**
+     * Control packets discarded because they did not fit into the
+     * control input buffer (E2BIG).
+     */
+    uint64_t packets_too_large;
+
+    /**
+     * #WAS_COMMAND_STOP and #WAS_COMMAND_PREMATURE packets received.
+     */
+    uint64_t stops, prematures;
+
+    /**
+     * Connections received from the Multi-WAS socket (by
+     * was_multi_accept_simple() or was_multi_run()).
+     */
+    uint64_t multi_accepts;
+
+    /**
+     * Response cache lookups which were answered from the cache and
+     * ones which were not (see was_simple_set_cache()).
+     */
+    uint64_t cache_hits, cache_misses;
+
+    /**
+     * Responses added to a response cache and responses evicted to
+     * make room for new ones.
+     */
+    uint64_t cache_stores, cache_evictions;
+};
+
+struct iovec;
+struct pollfd;
+
 struct was_simple_pair {
     const char *name, *value;
 };
 
 struct was_simple_iterator;
+struct was_simple_header_block;
+struct was_simple_cache;
 
 #ifdef __cplusplus
 extern "C" {
@@ -97,9 +208,83 @@ was_simple_accept(struct was_simple *w);
 const char *
 was_simple_accept_non_block(struct was_simple *w, const char *would_block);
 
+/**
+ * Enable or disable non-blocking mode.  In this mode, no function
+ * waits for a pipe or for the control channel; instead, it fails with
+ * errno=EAGAIN (functions returning a pointer return NULL or the
+ * "would_block" pointer, functions returning ssize_t return -1).
+ * errno=EAGAIN is reported only for this condition, never for a
+ * failure which waiting cannot fix.  The caller shall then obtain
+ * the file descriptors to wait for with was_simple_get_poll() and
+ * call the same function again when one of them becomes ready.  This
+ * allows driving many WAS connections from one event loop.
+ *
+ * Response body data which does not fit into the pipe is copied to
+ * an internal buffer; was_simple_write() and friends fail with EAGAIN
+ * (without consuming anything) only if this buffer is already large.
+ * was_simple_flush() and was_simple_end() fail with EAGAIN until
+ * everything has been written.
+ *
+ * Limitations: control packets are still sent with blocking calls
+ * (they are small, and the peer is expected to read them quickly),
+ * and was_simple_send_file() always blocks.
+ */
+void
+was_simple_set_non_block(struct was_simple *w, bool non_block);
+
+/**
+ * After a function has failed with EAGAIN in non-blocking mode (see
+ * was_simple_set_non_block()), obtain the file descriptors and events
+ * to wait for.  The control socket is always included.
+ *
+ * @param fds an array with room for (at least) two elements
+ * @return the number of elements filled
+ */
+unsigned
+was_simple_get_poll(const struct was_simple *w, struct pollfd *fds);
+
+/**
+ * Switch this connection to the io_uring backend: a multishot
+ * receive collects control packets in the background, and
+ * was_simple_end() submits the last control packets and the
+ * buffered response body (see was_simple_set_output_buffer()) with
+ * one system call.  This reduces the number of system calls per
+ * request, especially for small responses.
+ *
+ * After this call, the control socket must not be polled directly;
+ * was_simple_control_fd() and was_simple_get_poll() return an
+ * eventfd instead, which is readable while received control data is
+ * waiting to be processed.  This is not compatible with
+ * was_multi_run().  The backend cannot be disabled again; it is
+ * released by was_simple_free().
+ *
+ * @return true on success, false on error (with errno set; ENOSYS if
+ * the library was built without io_uring support or the kernel lacks
+ * a required feature)
+ */
+bool
+was_simple_enable_io_uring(struct was_simple *w);
+
+/**
+ * Determine how much memory this #was_simple object occupies,
+ * including its buffers.  The control channel buffers are borrowed
+ * from a shared pool only while a request is being handled; an idle
+ * connection in non-blocking mode (after was_simple_accept() or
+ * was_simple_accept_non_block() has returned the "would block"
+ * indication) does not hold them.
+ *
+ * @return the size in bytes
+ */
+was_gcc_pure
+size_t
+was_simple_get_memory_usage(const struct was_simple *w);
+
 /**
  * Obtains the socket descriptor of the control channel.  It can be
- * used for poll() after was_simple_accept_non_block().
+ * used for poll() after was_simple_accept_non_block().  With the
+ * io_uring backend (see was_simple_enable_io_uring()), this is an
+ * eventfd, which is readable while received control packets are
+ * waiting to be processed.
  */
 was_gcc_pure
 int
@@ -144,6 +329,20 @@ was_gcc_pure
 const char *
 was_simple_get_header(const struct was_simple *w, const char *name);
 
+/**
+ * Returns the value of a well-known request header.  This is like
+ * was_simple_get_header(), but the header has been identified while
+ * it was received, so this lookup takes constant time and does not
+ * compare strings.
+ *
+ * If there are multiple headers with that name, the first one is
+ * returned.
+ */
+was_gcc_pure
+const char *
+was_simple_get_header_token(const struct was_simple *w,
+                            enum was_simple_header token);
+
 /**
  * Returns an object that can iterate all request headers with the
  * given name.  It must be freed with was_simple_iterator_free().
@@ -153,6 +352,27 @@ was_simple_get_header(const struct was_simple *w, const char *name);
 struct was_simple_iterator *
 was_simple_get_multi_header(const struct was_simple *w, const char *name);
 
+/**
+ * Invoke a callback for each request header with the given name.
+ * Unlike was_simple_get_multi_header(), this does not allocate
+ * memory.
+ *
+ * The callback receives the name and the value (both
+ * null-terminated) with their lengths; it returns false to stop the
+ * iteration.
+ *
+ * @return true if all headers have been visited, false if the
+ * callback has stopped the iteration
+ */
+bool
+was_simple_foreach_multi_header(const struct was_simple *w, const char *name,
+                                bool (*callback)(const char *name,
+                                                 size_t name_length,
+                                                 const char *value,
+                                                 size_t value_length,
+                                                 void *ctx),
+                                void *ctx);
+
 /**
  * Returns an object that can iterate all request headers.  It must be
  * freed with was_simple_iterator_free().
@@ -160,6 +380,20 @@ was_simple_get_multi_header(const struct was_simple *w, const char *name);
 struct was_simple_iterator *
 was_simple_get_header_iterator(const struct was_simple *w);
 
+/**
+ * Invoke a callback for each request header, sorted by name.  Unlike
+ * was_simple_get_header_iterator(), this does not allocate memory.
+ * See was_simple_foreach_multi_header() for details.
+ */
+bool
+was_simple_foreach_header(const struct was_simple *w,
+                          bool (*callback)(const char *name,
+                                           size_t name_length,
+                                           const char *value,
+                                           size_t value_length,
+                                           void *ctx),
+                          void *ctx);
+
 /**
  * Returns the REMOTE_HOST attribute.
  */
@@ -181,6 +415,20 @@ was_simple_get_parameter(const struct was_simple *w, const char *name);
 struct was_simple_iterator *
 was_simple_get_parameter_iterator(const struct was_simple *w);
 
+/**
+ * Invoke a callback for each request parameter, sorted by name.
+ * Unlike was_simple_get_parameter_iterator(), this does not allocate
+ * memory.  See was_simple_foreach_multi_header() for details.
+ */
+bool
+was_simple_foreach_parameter(const struct was_simple *w,
+                             bool (*callback)(const char *name,
+                                              size_t name_length,
+                                              const char *value,
+                                              size_t value_length,
+                                              void *ctx),
+                             void *ctx);
+
 /**
  * Is a request body present?  (May be empty, though)
  */
@@ -229,6 +477,106 @@ was_simple_received(struct was_simple *w, size_t nbytes);
 ssize_t
 was_simple_read(struct was_simple *w, void *buffer, size_t length);
 
+/**
+ * Write the rest of the request body to the given file descriptor
+ * with splice(), i.e. without copying it to userspace.  This is
+ * meant for spooling large uploads to a (temporary) file.  Data in
+ * the read-ahead buffer (see was_simple_set_input_buffer()) is
+ * written first.
+ *
+ * @param fd a regular file or a pipe
+ * @return true when the end of the request body has been reached,
+ * false on error (with errno set if it was an I/O error) or if the
+ * request body was ended prematurely
+ */
+bool
+was_simple_splice_to(struct was_simple *w, int fd);
+
+/**
+ * Obtain the rest of the request body as one contiguous block of
+ * memory, e.g. for passing it to a parser.  Small bodies are read
+ * into a heap buffer of the exact size; large ones are spliced into
+ * a memfd which is then mapped read-only, without copying the data
+ * through userspace.  If the peer has not announced the length yet,
+ * the body is spliced into a memfd until it does.  This function
+ * always blocks until the whole body has been received, even in
+ * non-blocking mode.
+ *
+ * The memory is owned by the library and remains valid until the
+ * next was_simple_accept() call; calling this function again returns
+ * the same block.  Afterwards, the request body has been consumed.
+ *
+ * @param length_r on success, receives the length of the block
+ * @return a pointer to the body (not null-terminated), or NULL on
+ * error (with errno set if it was an I/O error) or if the request
+ * body was ended prematurely
+ */
+const void *
+was_simple_input_map(struct was_simple *w, size_t *length_r);
+
+/**
+ * Configure a read-ahead buffer for the request body.  Small reads
+ * with was_simple_read() are then served from this buffer, which is
+ * refilled with one large read() from the pipe.  Large reads bypass
+ * the buffer if it is empty.  was_simple_input_peek() and
+ * was_simple_read_line() enable a default buffer implicitly.
+ *
+ * While the buffer is enabled, the caller must not use
+ * was_simple_input_fd() and was_simple_received() (or, to opt out,
+ * must not use the functions mentioned above), because the pipe may
+ * already have been read beyond what the application has consumed.
+ *
+ * The setting applies to all following requests on this object.
+ *
+ * @param size the buffer size in bytes; 0 disables the buffer (the
+ * default)
+ * @return true on success, false on error (with errno set; EBUSY if
+ * the buffer contains more data than the new size)
+ */
+bool
+was_simple_set_input_buffer(struct was_simple *w, size_t size);
+
+/**
+ * Obtain buffered request body data without consuming it.  If the
+ * read-ahead buffer (see was_simple_set_input_buffer()) is empty, it
+ * is filled first.
+ *
+ * @param data_r on success, receives a pointer to the data; it is
+ * valid until the next call to a function reading the request body
+ * @return the number of bytes available, 0 if the end of the request
+ * body has been reached, -1 on I/O error (with errno set), -2 on
+ * other error
+ */
+ssize_t
+was_simple_input_peek(struct was_simple *w, const void **data_r);
+
+/**
+ * Consume data obtained by was_simple_input_peek().
+ *
+ * @param nbytes the number of bytes; must not be larger than the
+ * value returned by was_simple_input_peek()
+ */
+void
+was_simple_input_consume(struct was_simple *w, size_t nbytes);
+
+/**
+ * Read one line from the request body, like fgets(): the line
+ * including the newline character, or (if the line is too long) at
+ * most size-1 bytes, or the last line without a newline character
+ * at the end of the request body.  The result is null-terminated.
+ *
+ * In non-blocking mode, an incomplete line remains in the read-ahead
+ * buffer and this function fails with errno=EAGAIN.
+ *
+ * @param size the size of the buffer; smaller than 2 fails with
+ * errno=EINVAL
+ * @return the number of bytes copied (without the null terminator),
+ * 0 if the end of the request body has been reached, -1 on I/O error
+ * (with errno set), -2 on other error
+ */
+ssize_t
+was_simple_read_line(struct was_simple *w, char *buffer, size_t size);
+
 /**
  * Determine how much request body data is remaining to be read.
  * Returns -1 if the total size of the request body is unknown.
@@ -268,6 +616,42 @@ bool
 was_simple_set_header(struct was_simple *w,
                       const char *name, const char *value);
 
+/**
+ * Create a new (empty) header block: a set of response headers which
+ * is serialized once and can then be sent with
+ * was_simple_send_header_block() on each request, without
+ * formatting each header again.  It is not bound to a #was_simple
+ * object; it may be shared by many of them (also in different
+ * threads), but it must not be modified while it is being used.
+ *
+ * It must be freed with was_simple_header_block_free().
+ */
+struct was_simple_header_block *
+was_simple_header_block_new(void);
+
+void
+was_simple_header_block_free(struct was_simple_header_block *b);
+
+/**
+ * Append a header to the block.  The same restrictions as with
+ * was_simple_set_header() apply.
+ *
+ * @return true on success, false on error (with errno set; E2BIG if
+ * the header is too large for one control packet)
+ */
+bool
+was_simple_header_block_add(struct was_simple_header_block *b,
+                            const char *name, const char *value);
+
+/**
+ * Send all headers of the block.  It is equivalent to calling
+ * was_simple_set_header() for each of them, but the prebuilt
+ * packets are submitted at once.
+ */
+bool
+was_simple_send_header_block(struct was_simple *w,
+                             const struct was_simple_header_block *b);
+
 /**
  * Like was_simple_set_header(), but with string lengths.  The
  * parameters do not need to be null-terminated.
@@ -291,6 +675,109 @@ was_simple_copy_all_headers(struct was_simple *w);
 bool
 was_simple_set_length(struct was_simple *w, uint64_t length);
 
+/**
+ * Compress the response body with the best content coding accepted
+ * by the client (according to the "Accept-Encoding" request header)
+ * which is supported by this build of the library: zstd, brotli or
+ * gzip.  This sets the "content-encoding" and "vary" response
+ * headers, so it must be called after was_simple_status() (if at
+ * all), before the response body begins.
+ *
+ * All functions writing the response body then compress the data on
+ * the fly; data which is usually spliced (for example by
+ * was_simple_send_file()) is then copied through userspace instead.
+ * was_simple_output_fd() and was_simple_sent() cannot be used.  The
+ * compressed stream is finished by was_simple_end(); if nothing has
+ * been written, the response body is an empty compressed stream.
+ *
+ * A length passed to was_simple_set_length() refers to the
+ * uncompressed body; the response body ends when that many bytes have
+ * been written, and the compressed length is announced to the peer
+ * then.  This function fails if the length has already been
+ * announced before.
+ *
+ * Compression is not available in non-blocking mode (see
+ * was_simple_set_non_block()) and for responses which have no body
+ * by definition (e.g. "304 Not Modified").
+ *
+ * @return the content coding ("zstd", "br" or "gzip"), or NULL if the
+ * response body is not going to be compressed
+ */
+const char *
+was_simple_compress(struct was_simple *w);
+
+/**
+ * Create a new in-process response cache.  It is not bound to a
+ * #was_simple object; it may be shared by many of them (also in
+ * different threads), see was_simple_set_cache().
+ *
+ * Responses are looked up by method, URI, query string and the
+ * values of the request headers added with
+ * was_simple_cache_add_key_header().  A request which hits the cache
+ * is answered by was_simple_accept() without returning it to the
+ * caller.
+ *
+ * It must be freed with was_simple_cache_free() after it has been
+ * detached from all #was_simple objects.
+ *
+ * @param max_size the maximum total size of all responses (in
+ * bytes), including the kernel buffers of the pipes which large
+ * bodies are served from
+ * @param max_entry_size the maximum body size of one response (in
+ * bytes)
+ */
+struct was_simple_cache *
+was_simple_cache_new(size_t max_size, size_t max_entry_size);
+
+void
+was_simple_cache_free(struct was_simple_cache *c);
+
+/**
+ * Add a request header (in lower case) to the cache key: requests
+ * whose values of this header differ are cached separately.  For
+ * example, responses compressed with was_simple_compress() need
+ * "accept-encoding" here.  This must be called before the cache is
+ * used.
+ */
+void
+was_simple_cache_add_key_header(struct was_simple_cache *c,
+                                const char *name);
+
+/**
+ * Remove all responses from the cache.
+ */
+void
+was_simple_cache_flush(struct was_simple_cache *c);
+
+/**
+ * Attach a response cache to this #was_simple object (or detach it
+ * by passing NULL).  The cache is only looked up in blocking mode
+ * and for GET requests without a request body.
+ */
+void
+was_simple_set_cache(struct was_simple *w, struct was_simple_cache *c);
+
+/**
+ * Store the response to the current request in the attached cache
+ * when it is finished successfully.  This must be called before
+ * was_simple_status().
+ *
+ * The response is recorded as it is being sent, so it must be
+ * generated only with functions which pass its data through this
+ * library, e.g. was_simple_write(), was_simple_puts() or
+ * was_simple_printf(); was_simple_splice(), was_simple_send_file(),
+ * was_simple_output_fd() and responses with a body larger than the
+ * cache's "max_entry_size" quietly disable caching.
+ *
+ * @param ttl_ms the time (in milliseconds) after which the cached
+ * response expires
+ * @return true if the response is being recorded, false if it cannot
+ * be cached (no cache, non-blocking mode, not a GET request, a
+ * request body or already too late)
+ */
+bool
+was_simple_cache_response(struct was_simple *w, unsigned ttl_ms);
+
 /**
  * Finalize the response headers and announce that a response body
  * will be sent (though it may turn out to be empty).  This allows the
@@ -341,6 +828,18 @@ was_simple_sent(struct was_simple *w, size_t nbytes);
 bool
 was_simple_write(struct was_simple *w, const void *data, size_t length);
 
+/**
+ * Write response body data from multiple buffers.  This is like
+ * was_simple_write(), but the buffers are written with writev(),
+ * which avoids copying them together first.
+ *
+ * @param n the number of elements in the #iovec array
+ * @return true if all data has been written sucessfully, false if
+ * there was an error
+ */
+bool
+was_simple_writev(struct was_simple *w, const struct iovec *v, int n);
+
 /**
  * Write a NULL-terminated string.
  */
@@ -348,12 +847,77 @@ bool
 was_simple_puts(struct was_simple *w, const char *s);
 
 /**
- * Write a formatted string.
+ * Write a formatted string.  If an output buffer is configured (see
+ * was_simple_set_output_buffer()), then the string is formatted
+ * directly into it.  There is no length limit.
  */
 was_gcc_printf(2, 3)
 bool
 was_simple_printf(struct was_simple *w, const char *s, ...);
 
+/**
+ * Configure a buffer for the response body.  Small writes with
+ * was_simple_write(), was_simple_puts() and was_simple_printf() are
+ * collected in this buffer, and are written to the pipe only when it
+ * is full, when was_simple_flush() or was_simple_end() is called, or
+ * when an operation needs direct access to the pipe (e.g.
+ * was_simple_output_poll(), was_simple_output_fd() or
+ * was_simple_splice()).  Control packets (status and headers) are
+ * not sent before the first buffer flush either.
+ *
+ * If the whole response body fits in the buffer, was_simple_end()
+ * announces its length together with the headers, so the response
+ * costs just one send() and one write().
+ *
+ * The setting applies to all following requests on this object.
+ *
+ * @param size the buffer size in bytes; 0 disables the buffer (the
+ * default)
+ * @return true on success, false on error (out of memory or failure
+ * to flush the old buffer)
+ */
+bool
+was_simple_set_output_buffer(struct was_simple *w, size_t size);
+
+/**
+ * Send everything from the response body buffer (see
+ * was_simple_set_output_buffer()) and all pending control packets to
+ * the client (i.e. the web server).  If necessary, this function
+ * blocks until all data has been written.
+ *
+ * @return true on success, false on error
+ */
+bool
+was_simple_flush(struct was_simple *w);
+
+/**
+ * Change the capacity of the request and response pipes
+ * (F_SETPIPE_SZ).  Larger pipes need fewer wakeups for large bodies.
+ * The size is clamped to the system limit
+ * (/proc/sys/fs/pipe-max-size).
+ *
+ * This can also be configured with the environment variable
+ * "WAS_PIPE_SIZE" (a number of bytes or "auto", see
+ * was_simple_set_pipe_auto()).  It is read once per process and
+ * applied by was_simple_new() to each new connection.
+ *
+ * @return true on success, false if resizing a pipe has failed
+ */
+bool
+was_simple_set_pipe_size(struct was_simple *w, size_t size);
+
+/**
+ * Grow the request and response pipes automatically when a large
+ * body is announced by the peer (#WAS_COMMAND_LENGTH) or by
+ * was_simple_set_length().  Pipes are never shrunk.
+ *
+ * @param max_size the maximum pipe capacity in bytes (clamped to
+ * /proc/sys/fs/pipe-max-size; pass SIZE_MAX for the system limit); 0
+ * disables this mode (the default)
+ */
+void
+was_simple_set_pipe_auto(struct was_simple *w, size_t max_size);
+
 /**
  * Copy some data from the request body to the response body.  This
  * function blocks until at least one byte was copied (or until the
@@ -377,6 +941,97 @@ was_simple_splice(struct was_simple *w, size_t max_length);
 bool
 was_simple_splice_all(struct was_simple *w, bool end);
 
+/**
+ * Write data to the response body without copying it: the pages are
+ * mapped into the output pipe with vmsplice(), and the peer reads
+ * directly from them.  Small buffers are copied like
+ * was_simple_write() does.  This function blocks until all data has
+ * been submitted.
+ *
+ * Since the pipe references the caller's memory, the buffer must not
+ * be modified or freed until the peer has consumed the data from the
+ * pipe; the next was_simple_accept() call returning a request implies
+ * that.  Freeing or closing the #was_simple object does not release
+ * the caller's pages from the pipe.  This is best used for large
+ * immutable buffers which outlive many requests; page-aligned
+ * buffers are most efficient.
+ *
+ * @return true on success, false on error
+ */
+bool
+was_simple_write_gift(struct was_simple *w, const void *data, size_t length);
+
+/**
+ * Send a portion of a file as response body.  If no response length
+ * has been declared yet, then this function declares the current
+ * position plus @length (i.e. the file portion concludes the response
+ * body).  The data is transferred with splice() directly from the
+ * file to the response pipe, without copying it through userspace.
+ * This function blocks until all data has been sent (or until the
+ * client sends STOP or an error occurs).
+ *
+ * @param fd a file descriptor opened for reading; its file offset is
+ * not used or modified
+ * @param offset the start offset within the file
+ * @param length the number of bytes to send
+ * @return true on success, false on error
+ */
+bool
+was_simple_send_file(struct was_simple *w, int fd,
+                     uint64_t offset, uint64_t length);
+
+/**
+ * Evaluate the "Range" request header for a file of the given size.
+ * Only a single byte range is supported; other values (and requests
+ * with "If-Range") are ignored, and the whole file shall be sent.
+ *
+ * @param offset_r the start offset of the range is returned here
+ * @param length_r the length of the range is returned here
+ * @return #HTTP_STATUS_PARTIAL_CONTENT if a satisfiable range was
+ * requested, #HTTP_STATUS_REQUESTED_RANGE_NOT_SATISFIABLE if the
+ * range is unsatisfiable or #HTTP_STATUS_OK if the whole file shall
+ * be sent
+ */
+http_status_t
+was_simple_get_range(const struct was_simple *w, uint64_t size,
+                     uint64_t *offset_r, uint64_t *length_r);
+
+/**
+ * Send a file as the response, taking the "Range" request header
+ * into account (see was_simple_get_range()).  This sets the status
+ * and the headers "accept-ranges" and "content-range", and then calls
+ * was_simple_send_file().
+ *
+ * This must be called before the status is set, therefore no other
+ * response headers can be added.  If you need that, call
+ * was_simple_get_range() and was_simple_send_file() instead.
+ *
+ * @param size the size of the file
+ * @return true on success, false on error
+ */
+bool
+was_simple_send_file_range(struct was_simple *w, int fd, uint64_t size);
+
+/**
+ * Copy data from a pipe (or another file descriptor supporting
+ * splice()) to the response body, without copying it through
+ * userspace.  This function blocks until at least one byte was
+ * copied (or until the end of the source is reached or an error
+ * occurs); like was_simple_send_file(), it always blocks, even in
+ * non-blocking mode.
+ *
+ * If a response length has been announced, at most the rest of it is
+ * copied.
+ *
+ * @param fd the source file descriptor; it may be non-blocking
+ * @param max_length copy at most this number of bytes
+ * @return the number of bytes copied, 0 if the end of the source (or
+ * of the announced response body) has been reached, -1 on I/O error
+ * (with errno set), -2 on other error
+ */
+ssize_t
+was_simple_splice_from(struct was_simple *w, int fd, size_t max_length);
+
 /**
  * Mark the end of the current request.  If no status has been set,
  * then "204 No Content" is used.  If no request body has been
@@ -418,6 +1073,38 @@ was_simple_want_metrics(const struct was_simple *w);
 bool
 was_simple_metric(struct was_simple *w, const char *name, float value);
 
+/**
+ * Enable or disable automatic metrics.  If enabled and the peer
+ * requests metrics for a request (see was_simple_want_metrics()),
+ * was_simple_end() sends these #WAS_COMMAND_METRIC packets together
+ * with the end of the response:
+ *
+ * - "was_handler_seconds": the time since was_simple_accept()
+ *   returned the request
+ * - "was_first_byte_seconds": the time until the response body
+ *   began (omitted if there is no response body)
+ * - "was_request_body_bytes", "was_response_body_bytes"
+ * - "was_response_body_spliced_bytes": response body bytes which
+ *   were not copied through userspace (was_simple_splice(),
+ *   was_simple_send_file(), was_simple_write_gift())
+ * - "was_response_body_copied_bytes": all other response body bytes
+ * - "was_waits": the number of times an operation had to wait for
+ *   a pipe or the control channel
+ *
+ * The setting applies to all following requests on this object.
+ * It is disabled by default.
+ */
+void
+was_simple_set_auto_metrics(struct was_simple *w, bool enable);
+
+/**
+ * Obtain a snapshot of the process-wide I/O counters.  The counters
+ * are updated with relaxed atomic operations, so the snapshot is not
+ * necessarily consistent across fields.
+ */
+void
+was_simple_get_stats(struct was_simple_stats *stats);
+
 #ifdef __cplusplus
 }
 #endif
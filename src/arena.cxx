@@ -0,0 +1,86 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <mk@cm4all.com>
+
+#include "arena.hxx"
+
+#include <cstdlib>
+#include <cstring>
+
+char *
+Arena::Allocate(std::size_t size) noexcept
+{
+    if (head != nullptr && head->size - head->position >= size) {
+        char *p = head->GetData() + head->position;
+        head->position += size;
+        return p;
+    }
+
+    const std::size_t new_size = size > chunk_size ? size : chunk_size;
+    auto *chunk = (Chunk *)malloc(sizeof(Chunk) + new_size);
+    if (chunk == nullptr)
+        return nullptr;
+
+    chunk->next = head;
+    chunk->size = new_size;
+    chunk->position = size;
+    head = chunk;
+
+    return chunk->GetData();
+}
+
+const char *
+Arena::DupZ(std::string_view src) noexcept
+{
+    char *p = Allocate(src.size() + 1);
+    if (p == nullptr)
+        return nullptr;
+
+    memcpy(p, src.data(), src.size());
+    p[src.size()] = 0;
+    return p;
+}
+
+void
+Arena::Clear() noexcept
+{
+    while (head != nullptr) {
+        Chunk *next = head->next;
+        free(head);
+        head = next;
+    }
+}
+
+void
+Arena::Reset() noexcept
+{
+    if (head == nullptr)
+        return;
+
+    if (head->next == nullptr) {
+        /* the common case: everything fitted into one chunk, which
+           can be reused as-is */
+        head->position = 0;
+        return;
+    }
+
+    /* the last request needed more than one chunk: free all of
+       them, and allocate one large enough chunk next time */
+
+    std::size_t total = 0;
+    for (const Chunk *i = head; i != nullptr; i = i->next)
+        total += i->size;
+
+    Clear();
+
+    chunk_size = total < MAX_CHUNK_SIZE ? total : MAX_CHUNK_SIZE;
+}
+
+std::size_t
+Arena::GetMemoryUsage() const noexcept
+{
+    std::size_t total = 0;
+    for (const Chunk *i = head; i != nullptr; i = i->next)
+        total += sizeof(*i) + i->size;
+    return total;
+}
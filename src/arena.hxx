@@ -0,0 +1,88 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <mk@cm4all.com>
+
+#pragma once
+
+#include <cstddef>
+#include <string_view>
+
+/**
+ * A simple bump allocator for per-request data.  There is no way to
+ * free individual allocations; all of them are released at once by
+ * Reset(), which keeps the memory for the next request.
+ */
+class Arena {
+    struct Chunk {
+        Chunk *next;
+        std::size_t size, position;
+
+        char *GetData() noexcept {
+            return reinterpret_cast<char *>(this + 1);
+        }
+    };
+
+    /**
+     * The default payload size of a new chunk.  This is enough for
+     * the metadata of most requests.
+     */
+    static constexpr std::size_t DEFAULT_CHUNK_SIZE = 4096 - sizeof(Chunk);
+
+    /**
+     * Never allocate a chunk larger than this just because a
+     * previous request was large.
+     */
+    static constexpr std::size_t MAX_CHUNK_SIZE = 65536 - sizeof(Chunk);
+
+    /**
+     * The most recently allocated chunk; this is the only one which
+     * will be used for further allocations.
+     */
+    Chunk *head = nullptr;
+
+    /**
+     * The payload size of the next chunk to be allocated.  This
+     * grows after a request which needed more than one chunk, so
+     * the following requests fit into a single one.
+     */
+    std::size_t chunk_size = DEFAULT_CHUNK_SIZE;
+
+public:
+    Arena() noexcept = default;
+
+    ~Arena() noexcept {
+        Clear();
+    }
+
+    Arena(const Arena &) = delete;
+    Arena &operator=(const Arena &) = delete;
+
+    /**
+     * Allocate uninitialized memory.
+     *
+     * @return nullptr if out of memory
+     */
+    char *Allocate(std::size_t size) noexcept;
+
+    /**
+     * Copy a string into the arena and null-terminate it.
+     *
+     * @return nullptr if out of memory
+     */
+    const char *DupZ(std::string_view src) noexcept;
+
+    /**
+     * Release all allocations.
+     */
+    void Reset() noexcept;
+
+    /**
+     * The number of bytes allocated from the heap, including
+     * unused chunk space.
+     */
+    [[gnu::pure]]
+    std::size_t GetMemoryUsage() const noexcept;
+
+private:
+    void Clear() noexcept;
+};
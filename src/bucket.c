@@ -18,16 +18,54 @@
 #include <unistd.h>
 #include <errno.h>
 
+/**
+ * The upper limit for the read buffer size.
+ */
+#define WAS_BUCKET_MAX_BUFFER_SIZE (256 * 1024)
+
 struct was_bucket {
     struct was_simple *was;
+
+    /**
+     * The buffer size for the next read if the length of the
+     * request body is unknown.  It starts at #APR_BUCKET_BUFF_SIZE
+     * and doubles each time a read fills the whole buffer, up to
+     * #WAS_BUCKET_MAX_BUFFER_SIZE.
+     */
+    apr_size_t buffer_size;
 };
 
+static apr_bucket *
+apr_bucket_was_make(apr_bucket *b, struct was_bucket *fb);
+
 static void
 wbucket_destroy(void *data)
 {
     struct was_bucket *fb = data;
 
     was_simple_input_close(fb->was);
+    apr_bucket_free(fb);
+}
+
+/**
+ * Determine the size of the next read buffer: large enough for the
+ * rest of the request body (if its length is known), but not larger
+ * than #WAS_BUCKET_MAX_BUFFER_SIZE.
+ */
+static apr_size_t
+wbucket_buffer_size(const struct was_bucket *fb)
+{
+    const int64_t remaining = was_simple_input_remaining(fb->was);
+    if (remaining < 0)
+        return fb->buffer_size;
+
+    if (remaining >= WAS_BUCKET_MAX_BUFFER_SIZE)
+        return WAS_BUCKET_MAX_BUFFER_SIZE;
+
+    if (remaining <= APR_BUCKET_BUFF_SIZE)
+        return APR_BUCKET_BUFF_SIZE;
+
+    return (apr_size_t)remaining;
 }
 
 static apr_status_t
@@ -51,6 +89,7 @@ wbucket_read(apr_bucket *b, const char **data_r, apr_size_t *length_r,
             return APR_EGENERAL;
 
         case WAS_SIMPLE_POLL_END:
+            apr_bucket_free(fb);
             b = apr_bucket_immortal_make(b, "", 0);
             *data_r = b->data;
             *length_r = 0;
@@ -58,9 +97,16 @@ wbucket_read(apr_bucket *b, const char **data_r, apr_size_t *length_r,
         }
     }
 
-    char *buffer = apr_bucket_alloc(APR_BUCKET_BUFF_SIZE, b->list); /* XXX: check for failure? */
+    /* buffers larger than APR_BUCKET_BUFF_SIZE are allocated from
+       the apr_allocator, which recycles freed blocks of the same
+       size */
+    const apr_size_t size = wbucket_buffer_size(fb);
+    char *buffer = apr_bucket_alloc(size, b->list);
+    if (buffer == NULL)
+        /* leave the WAS bucket in place, so the caller may retry */
+        return APR_ENOMEM;
 
-    ssize_t nbytes = was_simple_read(fb->was, buffer, APR_BUCKET_BUFF_SIZE);
+    ssize_t nbytes = was_simple_read(fb->was, buffer, size);
     if (nbytes < 0) {
         apr_status_t status = nbytes == -1
             ? APR_FROM_OS_ERROR(errno)
@@ -71,6 +117,7 @@ wbucket_read(apr_bucket *b, const char **data_r, apr_size_t *length_r,
 
     if (nbytes == 0) {
         apr_bucket_free(buffer);
+        apr_bucket_free(fb);
 
         b = apr_bucket_immortal_make(b, "", 0);
         *data_r = b->data;
@@ -78,12 +125,22 @@ wbucket_read(apr_bucket *b, const char **data_r, apr_size_t *length_r,
         return APR_SUCCESS;
     }
 
+    if ((apr_size_t)nbytes == size &&
+        fb->buffer_size < WAS_BUCKET_MAX_BUFFER_SIZE)
+        fb->buffer_size *= 2;
+
     /* Change the current bucket to refer to what we read */
     b = apr_bucket_heap_make(b, buffer, nbytes, apr_bucket_free);
     apr_bucket_heap *h = b->data;
-    h->alloc_len = APR_BUCKET_BUFF_SIZE; /* note the real buffer size */
+    h->alloc_len = size; /* note the real buffer size */
 
-    APR_BUCKET_INSERT_AFTER(b, apr_bucket_was_create(fb->was, b->list));
+    /* the #was_bucket moves on to the new bucket which reads the
+       rest of the body */
+    apr_bucket *next = apr_bucket_alloc(sizeof(*next), b->list);
+    APR_BUCKET_INIT(next);
+    next->free = apr_bucket_free;
+    next->list = b->list;
+    APR_BUCKET_INSERT_AFTER(b, apr_bucket_was_make(next, fb));
 
     *data_r = buffer;
     *length_r = nbytes;
@@ -101,14 +158,10 @@ static const apr_bucket_type_t apr_bucket_type_was = {
 };
 
 static apr_bucket *
-apr_bucket_was_make(apr_bucket *b, struct was_simple *was)
+apr_bucket_was_make(apr_bucket *b, struct was_bucket *fb)
 {
-    struct was_bucket *fb = apr_bucket_alloc(sizeof(*fb), b->list);
-
     assert(b != NULL);
-    assert(was != NULL);
-
-    fb->was = was;
+    assert(fb != NULL);
 
     b->type = &apr_bucket_type_was;
     b->length = (apr_size_t)(-1);
@@ -125,8 +178,12 @@ apr_bucket_was_create(struct was_simple *was, apr_bucket_alloc_t *list)
 
     assert(was != NULL);
 
+    struct was_bucket *fb = apr_bucket_alloc(sizeof(*fb), list);
+    fb->was = was;
+    fb->buffer_size = APR_BUCKET_BUFF_SIZE;
+
     APR_BUCKET_INIT(b);
     b->free = apr_bucket_free;
     b->list = list;
-    return apr_bucket_was_make(b, was);
+    return apr_bucket_was_make(b, fb);
 }
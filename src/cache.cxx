@@ -0,0 +1,210 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <mk@cm4all.com>
+
+#include "cache.hxx"
+#include "flat_map.hxx"
+#include "stats.hxx"
+
+#include <was/simple.h>
+
+#include <algorithm>
+#include <cassert>
+
+#include <fcntl.h>
+
+/**
+ * Bodies up to this size fit into a pipe with the default capacity.
+ */
+static constexpr std::size_t DEFAULT_PIPE_SIZE = 64 * 1024;
+
+void
+CachedResponse::AppendPacket(enum was_command command,
+                             const struct iovec *payload, size_t n) noexcept
+{
+    size_t length = 0;
+    for (size_t i = 0; i < n; ++i)
+        length += payload[i].iov_len;
+
+    assert(length <= 0xffff);
+
+    struct was_header header{};
+    header.length = length;
+    header.command = command;
+
+    const char *h = (const char *)&header;
+    control.insert(control.end(), h, h + sizeof(header));
+
+    for (size_t i = 0; i < n; ++i) {
+        const char *p = (const char *)payload[i].iov_base;
+        control.insert(control.end(), p, p + payload[i].iov_len);
+    }
+}
+
+void
+CachedResponse::CreatePipe() noexcept
+{
+    assert(pipe < 0);
+
+    if (body.empty())
+        return;
+
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC|O_NONBLOCK) < 0)
+        return;
+
+    if (body.size() > DEFAULT_PIPE_SIZE)
+        /* may fail due to /proc/sys/fs/pipe-max-size; the short write
+           below catches that */
+        fcntl(fds[1], F_SETPIPE_SZ, int(body.size()));
+
+    const ssize_t nbytes = write(fds[1], body.data(), body.size());
+    close(fds[1]);
+
+    if (nbytes != (ssize_t)body.size()) {
+        /* doesn't fit: serve this one from memory */
+        close(fds[0]);
+        return;
+    }
+
+    pipe = fds[0];
+
+    /* the capacity is a multiple of the page size */
+    const int capacity = fcntl(pipe, F_GETPIPE_SZ);
+    pipe_size = capacity > 0
+        ? std::size_t(capacity)
+        : std::max(body.size(), DEFAULT_PIPE_SIZE);
+}
+
+void
+was_simple_cache::MakeKey(std::string &key, http_method_t method,
+                          const char *uri, const char *query_string,
+                          const FlatMultiMap &headers) const noexcept
+{
+    key.clear();
+    key.push_back(char(method));
+    key.append(uri);
+
+    if (query_string != nullptr) {
+        key.push_back('?');
+        key.append(query_string);
+    }
+
+    /* the null byte cannot appear in header values, which makes this
+       encoding unambiguous */
+    for (const auto &name : key_headers) {
+        key.push_back('\0');
+
+        const auto range = headers.equal_range(name);
+        for (auto i = range.first; i != range.second; ++i) {
+            key.append(i->value);
+            key.push_back('\n');
+        }
+    }
+}
+
+inline void
+was_simple_cache::Remove(std::list<Pointer>::iterator i) noexcept
+{
+    if ((*i)->pipe >= 0)
+        --n_pipes;
+
+    size -= (*i)->GetSize();
+    map.erase((*i)->key);
+    lru.erase(i);
+}
+
+was_simple_cache::Pointer
+was_simple_cache::Get(std::string_view key) noexcept
+{
+    const std::lock_guard lock{mutex};
+
+    const auto i = map.find(key);
+    if (i == map.end()) {
+        CountStat(Stat::CACHE_MISSES);
+        return nullptr;
+    }
+
+    const auto j = i->second;
+    if ((*j)->expires <= Clock::now()) {
+        Remove(j);
+        CountStat(Stat::CACHE_MISSES);
+        return nullptr;
+    }
+
+    lru.splice(lru.begin(), lru, j);
+    CountStat(Stat::CACHE_HITS);
+    return *j;
+}
+
+void
+was_simple_cache::Put(std::unique_ptr<CachedResponse> response) noexcept
+{
+    assert(response->pipe < 0);
+
+    if (response->GetSize() > max_size)
+        return;
+
+    const std::lock_guard lock{mutex};
+
+    if (const auto i = map.find(response->key); i != map.end())
+        Remove(i->second);
+
+    if (response->body.size() >= MIN_PIPE_BODY && n_pipes < MAX_PIPES) {
+        response->CreatePipe();
+
+        if (response->GetSize() > max_size)
+            /* the pipe's pages don't fit */
+            response->ClosePipe();
+    }
+
+    const std::size_t response_size = response->GetSize();
+    if (response->pipe >= 0)
+        ++n_pipes;
+
+    while (size + response_size > max_size) {
+        assert(!lru.empty());
+        Remove(std::prev(lru.end()));
+        CountStat(Stat::CACHE_EVICTIONS);
+    }
+
+    lru.push_front(std::move(response));
+    map.emplace(lru.front()->key, lru.begin());
+    size += response_size;
+    CountStat(Stat::CACHE_STORES);
+}
+
+void
+was_simple_cache::Clear() noexcept
+{
+    const std::lock_guard lock{mutex};
+
+    map.clear();
+    lru.clear();
+    size = 0;
+    n_pipes = 0;
+}
+
+struct was_simple_cache *
+was_simple_cache_new(size_t max_size, size_t max_entry_size)
+{
+    return new was_simple_cache(max_size, max_entry_size);
+}
+
+void
+was_simple_cache_free(struct was_simple_cache *c)
+{
+    delete c;
+}
+
+void
+was_simple_cache_add_key_header(struct was_simple_cache *c, const char *name)
+{
+    c->key_headers.emplace_back(name);
+}
+
+void
+was_simple_cache_flush(struct was_simple_cache *c)
+{
+    c->Clear();
+}
@@ -0,0 +1,188 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <mk@cm4all.com>
+
+#pragma once
+
+#include <was/protocol.h>
+
+#include <http/method.h>
+#include <http/status.h>
+
+#include <chrono>
+#include <cstddef>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <unistd.h>
+#include <sys/uio.h>
+
+class FlatMultiMap;
+
+/**
+ * A complete response stored in a #was_simple_cache.  It is
+ * immutable once it has been added to the cache.
+ */
+struct CachedResponse {
+    using Clock = std::chrono::steady_clock;
+
+    std::string key;
+
+    /**
+     * Serialized control packets which can be sent as they are:
+     * STATUS, all HEADER packets and DATA+LENGTH or NO_DATA.
+     */
+    std::vector<char> control;
+
+    std::vector<char> body;
+
+    Clock::time_point expires;
+
+    http_status_t status = HTTP_STATUS_OK;
+
+    /**
+     * The read end of a pipe which contains a copy of #body, for
+     * duplicating it into a response pipe with tee().  -1 if the body
+     * is served from memory.
+     */
+    int pipe = -1;
+
+    /**
+     * The capacity of #pipe, i.e. the kernel memory occupied by it.
+     */
+    std::size_t pipe_size = 0;
+
+    CachedResponse() noexcept = default;
+
+    ~CachedResponse() noexcept {
+        ClosePipe();
+    }
+
+    CachedResponse(const CachedResponse &) = delete;
+    CachedResponse &operator=(const CachedResponse &) = delete;
+
+    std::size_t GetSize() const noexcept {
+        return sizeof(*this) + key.size() + control.size() + body.size() +
+            pipe_size;
+    }
+
+    /**
+     * Append a serialized control packet to #control.
+     */
+    void AppendPacket(enum was_command command,
+                      const struct iovec *payload, size_t n) noexcept;
+
+    void AppendPacket(enum was_command command,
+                      const void *payload, size_t length) noexcept {
+        const struct iovec v{const_cast<void *>(payload), length};
+        AppendPacket(command, &v, 1);
+    }
+
+    void AppendEmpty(enum was_command command) noexcept {
+        AppendPacket(command, (const struct iovec *)nullptr, 0);
+    }
+
+    /**
+     * Copy #body into a new pipe (see #pipe) if it fits.
+     */
+    void CreatePipe() noexcept;
+
+    void ClosePipe() noexcept {
+        if (pipe >= 0) {
+            close(pipe);
+            pipe = -1;
+            pipe_size = 0;
+        }
+    }
+};
+
+/**
+ * An in-process response cache, see was_simple_cache_new().
+ */
+struct was_simple_cache {
+    using Clock = CachedResponse::Clock;
+    using Pointer = std::shared_ptr<const CachedResponse>;
+
+    /**
+     * Smaller bodies are always copied from memory: tee() would not
+     * save much, but the pipe would cost a file descriptor and at
+     * least one page.
+     */
+    static constexpr std::size_t MIN_PIPE_BODY = 16 * 1024;
+
+    /**
+     * The maximum number of responses with a pipe (see
+     * CachedResponse::pipe), which limits the number of file
+     * descriptors held by the cache.
+     */
+    static constexpr unsigned MAX_PIPES = 256;
+
+    const std::size_t max_size, max_entry_size;
+
+    /**
+     * The names of the request headers which are part of the key.
+     */
+    std::vector<std::string> key_headers;
+
+    std::mutex mutex;
+
+    /**
+     * All responses, the most recently used one first.  Protected by
+     * #mutex.
+     */
+    std::list<Pointer> lru;
+
+    /**
+     * Look up responses by CachedResponse::key.  Protected by
+     * #mutex.
+     */
+    std::unordered_map<std::string_view, std::list<Pointer>::iterator> map;
+
+    /**
+     * The sum of CachedResponse::GetSize() of all responses.
+     * Protected by #mutex.
+     */
+    std::size_t size = 0;
+
+    /**
+     * The number of responses in #lru which have a pipe.  Protected
+     * by #mutex.
+     */
+    unsigned n_pipes = 0;
+
+    was_simple_cache(std::size_t _max_size,
+                     std::size_t _max_entry_size) noexcept
+        :max_size(_max_size), max_entry_size(_max_entry_size) {}
+
+    /**
+     * Build the key of a request.
+     */
+    void MakeKey(std::string &key, http_method_t method,
+                 const char *uri, const char *query_string,
+                 const FlatMultiMap &headers) const noexcept;
+
+    /**
+     * Look up a response.  An expired response is removed.
+     *
+     * @return the response or nullptr if there is none
+     */
+    Pointer Get(std::string_view key) noexcept;
+
+    /**
+     * Add a response, replacing one with the same key.  The least
+     * recently used responses are evicted to make room.  A pipe for
+     * the body is created here if it is large enough and
+     * #MAX_PIPES has not been reached.
+     */
+    void Put(std::unique_ptr<CachedResponse> response) noexcept;
+
+    void Clear() noexcept;
+
+private:
+    void Remove(std::list<Pointer>::iterator i) noexcept;
+};
@@ -0,0 +1,454 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <mk@cm4all.com>
+
+#include "compress.hxx"
+
+#include <algorithm>
+#include <cassert>
+#include <climits>
+
+#include <strings.h>
+
+/*
+ * The compression levels are a compromise between CPU usage and
+ * ratio suitable for dynamic responses which are compressed on every
+ * request.
+ */
+
+#ifdef HAVE_ZLIB
+static constexpr int GZIP_LEVEL = 6;
+#endif
+
+#ifdef HAVE_BROTLI
+static constexpr uint32_t BROTLI_QUALITY = 5;
+
+/**
+ * A 1 MB window limits the memory usage per connection.
+ */
+static constexpr uint32_t BROTLI_WINDOW_BITS = 20;
+#endif
+
+#ifdef HAVE_ZSTD
+static constexpr int ZSTD_LEVEL = 3;
+#endif
+
+static constexpr bool
+IsSupported(ContentEncoding encoding) noexcept
+{
+    switch (encoding) {
+    case ContentEncoding::IDENTITY:
+        break;
+
+    case ContentEncoding::GZIP:
+#ifdef HAVE_ZLIB
+        return true;
+#else
+        break;
+#endif
+
+    case ContentEncoding::BROTLI:
+#ifdef HAVE_BROTLI
+        return true;
+#else
+        break;
+#endif
+
+    case ContentEncoding::ZSTD:
+#ifdef HAVE_ZSTD
+        return true;
+#else
+        break;
+#endif
+    }
+
+    return false;
+}
+
+static constexpr bool
+IsWhitespace(char ch) noexcept
+{
+    return ch == ' ' || ch == '\t';
+}
+
+static std::string_view
+Strip(std::string_view s) noexcept
+{
+    while (!s.empty() && IsWhitespace(s.front()))
+        s.remove_prefix(1);
+    while (!s.empty() && IsWhitespace(s.back()))
+        s.remove_suffix(1);
+    return s;
+}
+
+/**
+ * Split the string at the first occurrence of the given separator.
+ *
+ * @return the part before the separator; the separator and
+ * everything before it is removed from the string
+ */
+static std::string_view
+NextToken(std::string_view &s, char separator) noexcept
+{
+    const auto i = s.find(separator);
+    const auto token = s.substr(0, i);
+    s = i == s.npos ? std::string_view{} : s.substr(i + 1);
+    return token;
+}
+
+static bool
+EqualsIgnoreCase(std::string_view a, std::string_view b) noexcept
+{
+    return a.size() == b.size() &&
+        strncasecmp(a.data(), b.data(), a.size()) == 0;
+}
+
+/**
+ * Parse a q-value (RFC 9110 12.4.2).
+ *
+ * @return the value in thousandths (0..1000)
+ */
+static unsigned
+ParseQValue(std::string_view s) noexcept
+{
+    if (s.empty() || s.front() != '0')
+        /* "1", "1.000" or malformed: treat as the default */
+        return s.empty() || s.front() == '1' ? 1000 : 0;
+
+    s.remove_prefix(1);
+    if (s.empty() || s.front() != '.')
+        return 0;
+
+    s.remove_prefix(1);
+
+    unsigned result = 0;
+    for (unsigned factor = 100;
+         factor > 0 && !s.empty() && s.front() >= '0' && s.front() <= '9';
+         factor /= 10, s.remove_prefix(1))
+        result += unsigned(s.front() - '0') * factor;
+
+    return result;
+}
+
+static ContentEncoding
+ParseContentEncoding(std::string_view name) noexcept
+{
+    if (EqualsIgnoreCase(name, "gzip") || EqualsIgnoreCase(name, "x-gzip"))
+        return ContentEncoding::GZIP;
+
+    if (EqualsIgnoreCase(name, "br"))
+        return ContentEncoding::BROTLI;
+
+    if (EqualsIgnoreCase(name, "zstd"))
+        return ContentEncoding::ZSTD;
+
+    return ContentEncoding::IDENTITY;
+}
+
+ContentEncoding
+NegotiateContentEncoding(std::string_view accept_encoding) noexcept
+{
+    /* the q-value of each content coding, indexed by
+       #ContentEncoding; -1 means not mentioned */
+    int q[4] = {-1, -1, -1, -1};
+    int q_any = -1;
+
+    while (!accept_encoding.empty()) {
+        std::string_view params = NextToken(accept_encoding, ',');
+        const auto name = Strip(NextToken(params, ';'));
+
+        int value = 1000;
+        while (!params.empty()) {
+            const auto param = Strip(NextToken(params, ';'));
+            if (param.size() >= 2 &&
+                (param[0] == 'q' || param[0] == 'Q') && param[1] == '=')
+                value = ParseQValue(param.substr(2));
+        }
+
+        if (name == "*")
+            q_any = value;
+        else if (const auto encoding = ParseContentEncoding(name);
+                 encoding != ContentEncoding::IDENTITY)
+            q[unsigned(encoding)] = value;
+    }
+
+    ContentEncoding best = ContentEncoding::IDENTITY;
+    int best_q = 0;
+
+    for (const auto encoding : {ContentEncoding::ZSTD,
+                                ContentEncoding::BROTLI,
+                                ContentEncoding::GZIP}) {
+        if (!IsSupported(encoding))
+            continue;
+
+        const int value = q[unsigned(encoding)] >= 0
+            ? q[unsigned(encoding)]
+            : q_any;
+        if (value > best_q) {
+            best = encoding;
+            best_q = value;
+        }
+    }
+
+    return best;
+}
+
+const char *
+GetContentEncodingName(ContentEncoding encoding) noexcept
+{
+    switch (encoding) {
+    case ContentEncoding::IDENTITY:
+        break;
+
+    case ContentEncoding::GZIP:
+        return "gzip";
+
+    case ContentEncoding::BROTLI:
+        return "br";
+
+    case ContentEncoding::ZSTD:
+        return "zstd";
+    }
+
+    return "identity";
+}
+
+Compressor::~Compressor() noexcept
+{
+#ifdef HAVE_ZLIB
+    if (z_initialized)
+        deflateEnd(&z);
+#endif
+
+#ifdef HAVE_BROTLI
+    if (brotli != nullptr)
+        BrotliEncoderDestroyInstance(brotli);
+#endif
+
+#ifdef HAVE_ZSTD
+    ZSTD_freeCCtx(zstd);
+#endif
+}
+
+bool
+Compressor::Start(ContentEncoding _encoding) noexcept
+{
+    switch (_encoding) {
+    case ContentEncoding::IDENTITY:
+        break;
+
+    case ContentEncoding::GZIP:
+#ifdef HAVE_ZLIB
+        if (z_initialized) {
+            if (deflateReset(&z) != Z_OK)
+                return false;
+        } else {
+            z = {};
+
+            /* 15+16 = maximum window size, gzip header */
+            if (deflateInit2(&z, GZIP_LEVEL, Z_DEFLATED, 15 + 16, 8,
+                             Z_DEFAULT_STRATEGY) != Z_OK)
+                return false;
+
+            z_initialized = true;
+        }
+
+        encoding = _encoding;
+        return true;
+#else
+        break;
+#endif
+
+    case ContentEncoding::BROTLI:
+#ifdef HAVE_BROTLI
+        /* libbrotlienc has no way to reset an instance, so this one
+           is allocated for each stream */
+        if (brotli != nullptr)
+            BrotliEncoderDestroyInstance(brotli);
+
+        brotli = BrotliEncoderCreateInstance(nullptr, nullptr, nullptr);
+        if (brotli == nullptr)
+            return false;
+
+        BrotliEncoderSetParameter(brotli, BROTLI_PARAM_QUALITY,
+                                  BROTLI_QUALITY);
+        BrotliEncoderSetParameter(brotli, BROTLI_PARAM_LGWIN,
+                                  BROTLI_WINDOW_BITS);
+
+        encoding = _encoding;
+        return true;
+#else
+        break;
+#endif
+
+    case ContentEncoding::ZSTD:
+#ifdef HAVE_ZSTD
+        if (zstd != nullptr) {
+            /* keeps the parameters */
+            if (ZSTD_isError(ZSTD_CCtx_reset(zstd, ZSTD_reset_session_only)))
+                return false;
+        } else {
+            zstd = ZSTD_createCCtx();
+            if (zstd == nullptr)
+                return false;
+
+            ZSTD_CCtx_setParameter(zstd, ZSTD_c_compressionLevel,
+                                   ZSTD_LEVEL);
+        }
+
+        encoding = _encoding;
+        return true;
+#else
+        break;
+#endif
+    }
+
+    return false;
+}
+
+#ifdef HAVE_ZLIB
+
+inline ssize_t
+Compressor::ProcessGzip(std::string_view &src, void *dest, size_t dest_size,
+                        Operation op) noexcept
+{
+    const int flush = op == Operation::PROCESS
+        ? Z_NO_FLUSH
+        : op == Operation::FLUSH
+        ? Z_SYNC_FLUSH
+        : Z_FINISH;
+
+    z.next_out = (Bytef *)dest;
+    z.avail_out = uInt(std::min<size_t>(dest_size, UINT_MAX));
+
+    while (true) {
+        /* zlib's lengths are 32 bit; feed huge input in chunks */
+        const uInt chunk = uInt(std::min<size_t>(src.size(), UINT_MAX));
+        const bool last = chunk == src.size();
+
+        z.next_in = (Bytef *)const_cast<char *>(src.data());
+        z.avail_in = chunk;
+
+        const int result = deflate(&z, last ? flush : Z_NO_FLUSH);
+        src.remove_prefix(chunk - z.avail_in);
+
+        if (result == Z_STREAM_ERROR)
+            return -1;
+
+        if (result == Z_STREAM_END || result == Z_BUF_ERROR ||
+            z.avail_out == 0)
+            /* Z_BUF_ERROR means there was nothing to do */
+            break;
+
+        if (last && op != Operation::FINISH)
+            /* output space left: the operation is complete */
+            break;
+    }
+
+    return (char *)z.next_out - (char *)dest;
+}
+
+#endif
+
+#ifdef HAVE_BROTLI
+
+inline ssize_t
+Compressor::ProcessBrotli(std::string_view &src, void *dest, size_t dest_size,
+                          Operation op) noexcept
+{
+    const BrotliEncoderOperation bop = op == Operation::PROCESS
+        ? BROTLI_OPERATION_PROCESS
+        : op == Operation::FLUSH
+        ? BROTLI_OPERATION_FLUSH
+        : BROTLI_OPERATION_FINISH;
+
+    size_t avail_in = src.size();
+    const uint8_t *next_in = (const uint8_t *)src.data();
+    size_t avail_out = dest_size;
+    uint8_t *next_out = (uint8_t *)dest;
+
+    while (avail_out > 0) {
+        if (!BrotliEncoderCompressStream(brotli, bop,
+                                         &avail_in, &next_in,
+                                         &avail_out, &next_out,
+                                         nullptr))
+            return -1;
+
+        if (op == Operation::FINISH
+            ? BrotliEncoderIsFinished(brotli)
+            : avail_in == 0 && !BrotliEncoderHasMoreOutput(brotli))
+            break;
+    }
+
+    src.remove_prefix(src.size() - avail_in);
+    return dest_size - avail_out;
+}
+
+#endif
+
+#ifdef HAVE_ZSTD
+
+inline ssize_t
+Compressor::ProcessZstd(std::string_view &src, void *dest, size_t dest_size,
+                        Operation op) noexcept
+{
+    const ZSTD_EndDirective mode = op == Operation::PROCESS
+        ? ZSTD_e_continue
+        : op == Operation::FLUSH
+        ? ZSTD_e_flush
+        : ZSTD_e_end;
+
+    ZSTD_inBuffer in{src.data(), src.size(), 0};
+    ZSTD_outBuffer out{dest, dest_size, 0};
+
+    while (out.pos < out.size) {
+        const size_t remaining = ZSTD_compressStream2(zstd, &out, &in, mode);
+        if (ZSTD_isError(remaining))
+            return -1;
+
+        if (mode == ZSTD_e_continue ? in.pos == in.size : remaining == 0)
+            break;
+    }
+
+    src.remove_prefix(in.pos);
+    return out.pos;
+}
+
+#endif
+
+ssize_t
+Compressor::Process([[maybe_unused]] std::string_view &src,
+                    [[maybe_unused]] void *dest, size_t dest_size,
+                    [[maybe_unused]] Operation op) noexcept
+{
+    assert(IsActive());
+    assert(dest_size > 0);
+
+    switch (encoding) {
+    case ContentEncoding::IDENTITY:
+        break;
+
+    case ContentEncoding::GZIP:
+#ifdef HAVE_ZLIB
+        return ProcessGzip(src, dest, dest_size, op);
+#else
+        break;
+#endif
+
+    case ContentEncoding::BROTLI:
+#ifdef HAVE_BROTLI
+        return ProcessBrotli(src, dest, dest_size, op);
+#else
+        break;
+#endif
+
+    case ContentEncoding::ZSTD:
+#ifdef HAVE_ZSTD
+        return ProcessZstd(src, dest, dest_size, op);
+#else
+        break;
+#endif
+    }
+
+    return -1;
+}
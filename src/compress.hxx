@@ -0,0 +1,159 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <mk@cm4all.com>
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+#include <sys/types.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef HAVE_BROTLI
+#include <brotli/encode.h>
+#endif
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+/**
+ * A HTTP content coding (RFC 9110 8.4.1) which can be generated by
+ * #Compressor.  Only the ones enabled at compile time are ever
+ * negotiated.
+ */
+enum class ContentEncoding : uint8_t {
+    IDENTITY,
+    GZIP,
+    BROTLI,
+    ZSTD,
+};
+
+/**
+ * Choose the best content coding supported by this build which is
+ * acceptable according to the given "Accept-Encoding" request header
+ * value.  Explicit q-values are honored; on a tie, zstd is preferred
+ * over brotli over gzip.
+ *
+ * @return the content coding or #ContentEncoding::IDENTITY if none
+ * is acceptable
+ */
+[[gnu::pure]]
+ContentEncoding
+NegotiateContentEncoding(std::string_view accept_encoding) noexcept;
+
+/**
+ * @return the "Content-Encoding" value for the given content coding
+ */
+[[gnu::const]]
+const char *
+GetContentEncodingName(ContentEncoding encoding) noexcept;
+
+/**
+ * A streaming compressor for the response body.  The library
+ * contexts are allocated on first use and kept for the next stream,
+ * so a connection which handles many requests does not set them up
+ * again for each response.
+ */
+class Compressor {
+    ContentEncoding encoding = ContentEncoding::IDENTITY;
+
+#ifdef HAVE_ZLIB
+    z_stream z;
+    bool z_initialized = false;
+#endif
+
+#ifdef HAVE_BROTLI
+    BrotliEncoderState *brotli = nullptr;
+#endif
+
+#ifdef HAVE_ZSTD
+    ZSTD_CCtx *zstd = nullptr;
+#endif
+
+public:
+    Compressor() noexcept = default;
+    ~Compressor() noexcept;
+
+    Compressor(const Compressor &) = delete;
+    Compressor &operator=(const Compressor &) = delete;
+
+    bool IsActive() const noexcept {
+        return encoding != ContentEncoding::IDENTITY;
+    }
+
+    ContentEncoding GetEncoding() const noexcept {
+        return encoding;
+    }
+
+    /**
+     * Begin a new stream.
+     *
+     * @return false if the content coding is not supported or if
+     * allocating the context has failed
+     */
+    bool Start(ContentEncoding _encoding) noexcept;
+
+    /**
+     * End the current stream (if any) without finishing it.
+     */
+    void Stop() noexcept {
+        encoding = ContentEncoding::IDENTITY;
+    }
+
+    enum class Operation {
+        /**
+         * Consume input; the library may keep it until more input
+         * arrives.
+         */
+        PROCESS,
+
+        /**
+         * Consume input and then emit everything which has been
+         * submitted so far, so the peer can decode it.
+         */
+        FLUSH,
+
+        /**
+         * Consume input and then finish the stream.
+         */
+        FINISH,
+    };
+
+    /**
+     * Compress data.
+     *
+     * @param src the input data; upon return, the consumed data has
+     * been removed from its front
+     * @param dest the output buffer
+     * @param dest_size the size of the output buffer
+     * @return the number of bytes written to the output buffer, or -1
+     * on error; if it is less than the buffer size, then all input
+     * has been consumed and the operation has been completed,
+     * otherwise this method shall be called again with more output
+     * space
+     */
+    ssize_t Process(std::string_view &src, void *dest, size_t dest_size,
+                    Operation op) noexcept;
+
+private:
+#ifdef HAVE_ZLIB
+    ssize_t ProcessGzip(std::string_view &src, void *dest, size_t dest_size,
+                        Operation op) noexcept;
+#endif
+
+#ifdef HAVE_BROTLI
+    ssize_t ProcessBrotli(std::string_view &src, void *dest, size_t dest_size,
+                          Operation op) noexcept;
+#endif
+
+#ifdef HAVE_ZSTD
+    ssize_t ProcessZstd(std::string_view &src, void *dest, size_t dest_size,
+                        Operation op) noexcept;
+#endif
+};
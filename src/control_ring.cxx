@@ -0,0 +1,324 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <mk@cm4all.com>
+
+#include "control_ring.hxx"
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+ControlRing::ControlRing(int _socket) noexcept
+    :socket(_socket),
+     buffers(static_cast<char *>(malloc(N_BUFFERS * BUFFER_SIZE)))
+{
+}
+
+ControlRing::~ControlRing() noexcept
+{
+    /* cancel the multishot recv and wait for it to finish before
+       freeing the buffers it may write to */
+    if (armed) {
+        if (auto *sqe = GetSqe()) {
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+            sqe->addr = USER_DATA_RECV;
+            sqe->user_data = USER_DATA_CANCEL;
+
+            /* Enter() retries after EINTR */
+            while (armed && ring.Enter(1))
+                Reap();
+        }
+
+        if (armed)
+            /* the cancellation could not be submitted or
+               confirmed: destroy the ring, which cancels the recv,
+               before the kernel can write to freed buffers */
+            ring.Close();
+    }
+
+    free(buffers);
+
+    if (ready_fd >= 0)
+        close(ready_fd);
+}
+
+struct io_uring_sqe *
+ControlRing::GetSqe() noexcept
+{
+    auto *sqe = ring.GetSqe();
+    if (sqe == nullptr && ring.Enter(0))
+        /* the submission queue was full; now it is empty */
+        sqe = ring.GetSqe();
+
+    return sqe;
+}
+
+bool
+ControlRing::ProvideBuffers(uint16_t id, unsigned n) noexcept
+{
+    auto *sqe = GetSqe();
+    if (sqe == nullptr)
+        return false;
+
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+    sqe->fd = int(n);
+    sqe->addr = (uintptr_t)(buffers + id * BUFFER_SIZE);
+    sqe->len = BUFFER_SIZE;
+    sqe->off = id;
+    sqe->buf_group = BUFFER_GROUP;
+    sqe->user_data = USER_DATA_PROVIDE;
+    return true;
+}
+
+bool
+ControlRing::Arm() noexcept
+{
+    assert(!armed);
+
+    auto *sqe = GetSqe();
+    if (sqe == nullptr)
+        return false;
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->fd = socket;
+    sqe->buf_group = BUFFER_GROUP;
+    sqe->user_data = USER_DATA_RECV;
+
+    armed = true;
+    return true;
+}
+
+bool
+ControlRing::Open() noexcept
+{
+    if (buffers == nullptr) {
+        errno = ENOMEM;
+        return false;
+    }
+
+    if (!ring.Init(16))
+        return false;
+
+    ready_fd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+    if (ready_fd < 0 || !ring.RegisterEventFd(ready_fd))
+        return false;
+
+    ProvideBuffers(0, N_BUFFERS);
+
+    Arm();
+
+    if (!ring.Enter(0))
+        return false;
+
+    /* kernels without multishot recv fail immediately */
+    Reap();
+    if (error == EINVAL) {
+        errno = ENOSYS;
+        return false;
+    }
+
+    return true;
+}
+
+void
+ControlRing::Reap() noexcept
+{
+    /* reset the eventfd before looking at the completions; one
+       arriving later signals it again */
+    uint64_t value;
+    [[maybe_unused]] ssize_t nbytes = read(ready_fd, &value, sizeof(value));
+
+    while (const auto *cqe = ring.PeekCqe()) {
+        const int res = cqe->res;
+        const unsigned flags = cqe->flags;
+        const uint64_t user_data = cqe->user_data;
+        ring.SeenCqe();
+
+        switch (user_data) {
+        case USER_DATA_RECV:
+            if (!(flags & IORING_CQE_F_MORE))
+                armed = false;
+
+            if (res > 0) {
+                assert(flags & IORING_CQE_F_BUFFER);
+                assert(n_queued < N_BUFFERS);
+
+                auto &chunk = queue[(queue_start + n_queued++) % N_BUFFERS];
+                chunk.id = uint16_t(flags >> IORING_CQE_BUFFER_SHIFT);
+                chunk.start = 0;
+                chunk.end = uint16_t(res);
+            } else if (res == 0)
+                eof = true;
+            else if (res != -ENOBUFS)
+                /* ENOBUFS: all buffers are queued; re-arm as soon
+                   as one has been consumed */
+                error = -res;
+            break;
+
+        case USER_DATA_PROVIDE:
+            /* only failures are reported */
+            error = -res;
+            break;
+
+        case USER_DATA_SEND:
+            send_result = res;
+            send_done = true;
+            break;
+
+        case USER_DATA_WRITE:
+            write_result = res;
+            write_done = true;
+            break;
+
+        case USER_DATA_CANCEL:
+            /* only failures are reported; the recv has finished
+               already */
+            break;
+        }
+    }
+
+    if (HasQueuedInput()) {
+        /* polling the ring would not report this */
+        value = 1;
+        nbytes = write(ready_fd, &value, sizeof(value));
+    }
+}
+
+bool
+ControlRing::Rearm() noexcept
+{
+    return !armed && !eof && error == 0 && n_queued < N_BUFFERS && Arm();
+}
+
+ssize_t
+ControlRing::Receive(void *dest, std::size_t max_size, bool dontwait) noexcept
+{
+    Reap();
+
+    while (n_queued == 0 && !eof && error == 0) {
+        Rearm();
+
+        if (!ring.Enter(dontwait ? 0 : 1))
+            return -1;
+
+        Reap();
+
+        if (dontwait && n_queued == 0 && !eof && error == 0) {
+            errno = EAGAIN;
+            return -1;
+        }
+    }
+
+    if (n_queued > 0) {
+        /* copy as much as possible, just like recv() would */
+        auto *p = static_cast<char *>(dest);
+        std::size_t total = 0;
+
+        while (n_queued > 0 && total < max_size) {
+            auto &chunk = queue[queue_start];
+            const std::size_t n = std::min<std::size_t>(max_size - total,
+                                                         chunk.end - chunk.start);
+            memcpy(p + total, buffers + chunk.id * BUFFER_SIZE + chunk.start, n);
+            chunk.start += n;
+            total += n;
+
+            if (chunk.start == chunk.end) {
+                /* give the buffer back to the kernel; this is
+                   submitted with the next system call */
+                queue_start = (queue_start + 1) % N_BUFFERS;
+                --n_queued;
+
+                ProvideBuffers(chunk.id);
+            }
+        }
+
+        /* submit a new recv right away, or polling the ring would
+           miss data arriving on the socket */
+        if (Rearm())
+            ring.Enter(0);
+
+        return total;
+    }
+
+    if (eof)
+        return 0;
+
+    errno = error;
+    return -1;
+}
+
+bool
+ControlRing::SendWrite(const void *control, std::size_t control_size,
+                       ssize_t &sent_r,
+                       int pipe, const void *data, std::size_t data_size,
+                       ssize_t &written_r) noexcept
+{
+    send_done = control_size == 0;
+    write_done = data_size == 0;
+    sent_r = written_r = 0;
+
+    /* reserve both entries before filling either one, or a failure
+       would leave the SEND queued, to be submitted by a later
+       Enter() after the caller has discarded its buffer */
+    struct io_uring_sqe *send_sqe = send_done ? nullptr : GetSqe();
+    struct io_uring_sqe *write_sqe = write_done ? nullptr : GetSqe();
+    if ((!send_done && send_sqe == nullptr) ||
+        (!write_done && write_sqe == nullptr)) {
+        /* a reserved entry cannot be given back, but a zeroed one
+           is a NOP */
+        if (send_sqe != nullptr)
+            send_sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+
+        errno = EBUSY;
+        return false;
+    }
+
+    if (!send_done) {
+        send_sqe->opcode = IORING_OP_SEND;
+        send_sqe->fd = socket;
+        send_sqe->addr = (uintptr_t)control;
+        send_sqe->len = control_size;
+        send_sqe->msg_flags = MSG_NOSIGNAL;
+        send_sqe->user_data = USER_DATA_SEND;
+    }
+
+    if (!write_done) {
+        write_sqe->opcode = IORING_OP_WRITE;
+        write_sqe->fd = pipe;
+        write_sqe->addr = (uintptr_t)data;
+        write_sqe->len = data_size;
+        write_sqe->off = (uint64_t)-1;
+        write_sqe->user_data = USER_DATA_WRITE;
+    }
+
+    Rearm();
+
+    /* the first Enter() submits and usually completes both
+       operations inline */
+    unsigned min_complete = unsigned(!send_done) + unsigned(!write_done);
+    while (!send_done || !write_done) {
+        if (!ring.Enter(min_complete))
+            return false;
+
+        Reap();
+        min_complete = 1;
+    }
+
+    sent_r = send_result;
+    written_r = write_result;
+    if (control_size == 0)
+        sent_r = 0;
+    if (data_size == 0)
+        written_r = 0;
+    return true;
+}
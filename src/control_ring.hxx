@@ -0,0 +1,170 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <mk@cm4all.com>
+
+#pragma once
+
+#include "uring.hxx"
+
+#include <cstddef>
+#include <cstdint>
+
+#include <sys/types.h>
+
+/**
+ * The io_uring backend for a WAS control socket.  A multishot recv
+ * (with buffers provided to the kernel) keeps receiving control
+ * packets in the background, so the next request is often already
+ * there when the application asks for it.  Sending the last control
+ * packets and writing the response body are submitted with one
+ * system call.
+ */
+class ControlRing {
+    Uring ring;
+
+    const int socket;
+
+    /**
+     * An eventfd which is signalled by the kernel for each
+     * completion and by Reap() while data is queued; this is what
+     * the application polls.
+     */
+    int ready_fd = -1;
+
+    /**
+     * Each completion occupies one buffer, even if the peer has
+     * sent only a few bytes; therefore, use many small ones.
+     */
+    static constexpr unsigned N_BUFFERS = 16;
+    static constexpr std::size_t BUFFER_SIZE = 1024;
+    static constexpr uint16_t BUFFER_GROUP = 0;
+
+    enum : uint64_t {
+        USER_DATA_RECV = 1,
+        USER_DATA_PROVIDE,
+        USER_DATA_SEND,
+        USER_DATA_WRITE,
+        USER_DATA_CANCEL,
+    };
+
+    char *const buffers;
+
+    /**
+     * A provided buffer which has been filled by the kernel, but
+     * not yet consumed by Receive().
+     */
+    struct Chunk {
+        uint16_t id;
+        uint16_t start, end;
+    };
+
+    Chunk queue[N_BUFFERS];
+    unsigned queue_start = 0, n_queued = 0;
+
+    /**
+     * A sticky error from the multishot recv (errno value); 0 if
+     * there is none.
+     */
+    int error = 0;
+
+    /**
+     * Has the peer closed the socket?
+     */
+    bool eof = false;
+
+    /**
+     * Is a multishot recv currently armed?
+     */
+    bool armed = false;
+
+    /**
+     * Results of SendWrite() operations; valid if the corresponding
+     * "done" flag is set.
+     */
+    int send_result, write_result;
+    bool send_done, write_done;
+
+public:
+    explicit ControlRing(int _socket) noexcept;
+    ~ControlRing() noexcept;
+
+    ControlRing(const ControlRing &) = delete;
+    ControlRing &operator=(const ControlRing &) = delete;
+
+    /**
+     * Set up the ring and arm the multishot recv.
+     *
+     * @return false on error (with errno set); ENOSYS if the kernel
+     * lacks a required feature
+     */
+    bool Open() noexcept;
+
+    /**
+     * The file descriptor to be polled (for POLLIN) instead of the
+     * control socket.  Unlike the ring's own descriptor, it is also
+     * readable while HasQueuedInput() is true.
+     */
+    int GetPollFd() const noexcept {
+        return ready_fd;
+    }
+
+    /**
+     * Has the ring already received data (or an error) which has
+     * not yet been passed to Receive()?  Then polling would not
+     * report it.
+     */
+    bool HasQueuedInput() const noexcept {
+        return n_queued > 0 || eof || error != 0;
+    }
+
+    /**
+     * Copy received data to the given buffer; the semantics are the
+     * same as recv().
+     *
+     * @return the number of bytes, 0 on end of file or -1 on error
+     * (EAGAIN if "dontwait" is set and nothing has been received)
+     */
+    ssize_t Receive(void *dest, std::size_t max_size, bool dontwait) noexcept;
+
+    /**
+     * Send data to the control socket and write data to a pipe,
+     * submitting both with one system call, and wait for both to
+     * complete.  One of the sizes may be 0.
+     *
+     * @param sent_r the number of bytes sent (may be short)
+     * @param written_r the number of bytes written (may be short;
+     * -EAGAIN if the pipe is full)
+     * @return false on error (with errno set)
+     */
+    bool SendWrite(const void *control, std::size_t control_size,
+                   ssize_t &sent_r,
+                   int pipe, const void *data, std::size_t data_size,
+                   ssize_t &written_r) noexcept;
+
+private:
+    /**
+     * Like Uring::GetSqe(), but submit queued entries if the
+     * submission queue is full.
+     */
+    struct io_uring_sqe *GetSqe() noexcept;
+
+    /**
+     * Give buffers (back) to the kernel.
+     */
+    bool ProvideBuffers(uint16_t id, unsigned n=1) noexcept;
+    bool Arm() noexcept;
+
+    /**
+     * Process all completions and update #ready_fd.
+     */
+    void Reap() noexcept;
+
+    /**
+     * Re-arm the multishot recv if it has been terminated and a
+     * buffer is available.
+     *
+     * @return true if a new recv has been queued (to be submitted
+     * with the next Uring::Enter() call)
+     */
+    bool Rearm() noexcept;
+};
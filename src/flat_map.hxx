@@ -0,0 +1,91 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <mk@cm4all.com>
+
+#pragma once
+
+#include <algorithm>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+/**
+ * A sorted list of name/value pairs, a lightweight replacement for
+ * std::multimap.  It does not own the strings; they are usually
+ * allocated from an #Arena.  The vector's capacity is kept by
+ * clear(), so once warmed up, no more heap allocations are needed.
+ */
+class FlatMultiMap {
+public:
+    struct Item {
+        /**
+         * Both strings are null-terminated.
+         */
+        std::string_view name, value;
+    };
+
+    using const_iterator = const Item *;
+
+private:
+    std::vector<Item> items;
+
+    struct Compare {
+        bool operator()(const Item &a, std::string_view b) const noexcept {
+            return a.name < b;
+        }
+
+        bool operator()(std::string_view a, const Item &b) const noexcept {
+            return a < b.name;
+        }
+    };
+
+public:
+    const_iterator begin() const noexcept {
+        return items.data();
+    }
+
+    const_iterator end() const noexcept {
+        return items.data() + items.size();
+    }
+
+    void clear() noexcept {
+        items.clear();
+    }
+
+    /**
+     * The number of bytes allocated from the heap (not including
+     * the strings).
+     */
+    std::size_t GetMemoryUsage() const noexcept {
+        return items.capacity() * sizeof(Item);
+    }
+
+    /**
+     * Insert a new item after all existing items with the same
+     * name, just like std::multimap does.
+     *
+     * @return the new item; the reference is invalidated by the
+     * next insert() call
+     */
+    const Item &insert(std::string_view name, std::string_view value) noexcept {
+        auto i = std::upper_bound(items.begin(), items.end(), name,
+                                  Compare{});
+        return *items.insert(i, Item{name, value});
+    }
+
+    /**
+     * @return the first item with the given name or nullptr
+     */
+    [[gnu::pure]]
+    const Item *find(std::string_view name) const noexcept {
+        auto i = std::lower_bound(begin(), end(), name, Compare{});
+        return i != end() && i->name == name
+            ? i
+            : nullptr;
+    }
+
+    [[gnu::pure]]
+    std::pair<const_iterator, const_iterator> equal_range(std::string_view name) const noexcept {
+        return std::equal_range(begin(), end(), name, Compare{});
+    }
+};
@@ -0,0 +1,48 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <mk@cm4all.com>
+
+#include "header_block.hxx"
+
+#include <was/simple.h>
+#include <was/protocol.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+
+struct was_simple_header_block *
+was_simple_header_block_new(void)
+{
+    return new was_simple_header_block();
+}
+
+void
+was_simple_header_block_free(struct was_simple_header_block *b)
+{
+    delete b;
+}
+
+bool
+was_simple_header_block_add(struct was_simple_header_block *b,
+                            const char *name, const char *value)
+{
+    const size_t name_length = strlen(name);
+    const size_t value_length = strlen(value);
+    const size_t length = name_length + 1 + value_length;
+    if (length > UINT16_MAX) {
+        errno = E2BIG;
+        return false;
+    }
+
+    struct was_header h{};
+    h.length = uint16_t(length);
+    h.command = WAS_COMMAND_HEADER;
+
+    const auto p = reinterpret_cast<const char *>(&h);
+    b->data.insert(b->data.end(), p, p + sizeof(h));
+    b->data.insert(b->data.end(), name, name + name_length);
+    b->data.push_back('=');
+    b->data.insert(b->data.end(), value, value + value_length);
+    return true;
+}
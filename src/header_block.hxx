@@ -0,0 +1,15 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <mk@cm4all.com>
+
+#pragma once
+
+#include <vector>
+
+/**
+ * A sequence of serialized #WAS_COMMAND_HEADER packets, ready to be
+ * sent to the control socket as-is.
+ */
+struct was_simple_header_block {
+    std::vector<char> data;
+};
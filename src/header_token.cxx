@@ -0,0 +1,131 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <mk@cm4all.com>
+
+#include "header_token.hxx"
+
+#include <iterator>
+
+static constexpr std::string_view header_token_names[] = {
+    "accept",
+    "accept-encoding",
+    "accept-language",
+    "authorization",
+    "cache-control",
+    "content-encoding",
+    "content-length",
+    "content-type",
+    "cookie",
+    "host",
+    "if-match",
+    "if-modified-since",
+    "if-none-match",
+    "if-range",
+    "if-unmodified-since",
+    "origin",
+    "range",
+    "referer",
+    "user-agent",
+    "x-forwarded-for",
+};
+
+static_assert(std::size(header_token_names) == WAS_SIMPLE_HEADER_COUNT);
+
+static constexpr enum was_simple_header
+Check(std::string_view name, enum was_simple_header token) noexcept
+{
+    return name == header_token_names[token]
+        ? token
+        : WAS_SIMPLE_HEADER_COUNT;
+}
+
+enum was_simple_header
+LookupHeaderToken(std::string_view name) noexcept
+{
+    /* dispatch on the length and (if necessary) one distinguishing
+       character, so at most one string comparison is needed */
+
+    switch (name.size()) {
+    case 4:
+        return Check(name, WAS_SIMPLE_HEADER_HOST);
+
+    case 5:
+        return Check(name, WAS_SIMPLE_HEADER_RANGE);
+
+    case 6:
+        switch (name[0]) {
+        case 'a':
+            return Check(name, WAS_SIMPLE_HEADER_ACCEPT);
+
+        case 'c':
+            return Check(name, WAS_SIMPLE_HEADER_COOKIE);
+
+        case 'o':
+            return Check(name, WAS_SIMPLE_HEADER_ORIGIN);
+        }
+
+        break;
+
+    case 7:
+        return Check(name, WAS_SIMPLE_HEADER_REFERER);
+
+    case 8:
+        switch (name[3]) {
+        case 'm':
+            return Check(name, WAS_SIMPLE_HEADER_IF_MATCH);
+
+        case 'r':
+            return Check(name, WAS_SIMPLE_HEADER_IF_RANGE);
+        }
+
+        break;
+
+    case 10:
+        return Check(name, WAS_SIMPLE_HEADER_USER_AGENT);
+
+    case 12:
+        return Check(name, WAS_SIMPLE_HEADER_CONTENT_TYPE);
+
+    case 13:
+        switch (name[0]) {
+        case 'a':
+            return Check(name, WAS_SIMPLE_HEADER_AUTHORIZATION);
+
+        case 'c':
+            return Check(name, WAS_SIMPLE_HEADER_CACHE_CONTROL);
+
+        case 'i':
+            return Check(name, WAS_SIMPLE_HEADER_IF_NONE_MATCH);
+        }
+
+        break;
+
+    case 14:
+        return Check(name, WAS_SIMPLE_HEADER_CONTENT_LENGTH);
+
+    case 15:
+        switch (name[7]) {
+        case 'e':
+            return Check(name, WAS_SIMPLE_HEADER_ACCEPT_ENCODING);
+
+        case 'l':
+            return Check(name, WAS_SIMPLE_HEADER_ACCEPT_LANGUAGE);
+
+        case 'r':
+            return Check(name, WAS_SIMPLE_HEADER_X_FORWARDED_FOR);
+        }
+
+        break;
+
+    case 16:
+        return Check(name, WAS_SIMPLE_HEADER_CONTENT_ENCODING);
+
+    case 17:
+        return Check(name, WAS_SIMPLE_HEADER_IF_MODIFIED_SINCE);
+
+    case 19:
+        return Check(name, WAS_SIMPLE_HEADER_IF_UNMODIFIED_SINCE);
+    }
+
+    return WAS_SIMPLE_HEADER_COUNT;
+}
@@ -0,0 +1,19 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <mk@cm4all.com>
+
+#pragma once
+
+#include <was/simple.h>
+
+#include <string_view>
+
+/**
+ * Identify a well-known (lower-case) request header name.
+ *
+ * @return the token or #WAS_SIMPLE_HEADER_COUNT if the name is not
+ * well-known
+ */
+[[gnu::pure]]
+enum was_simple_header
+LookupHeaderToken(std::string_view name) noexcept;
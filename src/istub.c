@@ -46,19 +46,28 @@ xios_was_input_readn(xiostub *stub, was_gcc_unused xioexec *exec, void *ctxt,
 }
 
 static int
-xios_was_input_read(xiostub *stub, xioexec *exec, void *ctxt)
+xios_was_input_read(xiostub *stub, was_gcc_unused xioexec *exec, void *ctxt)
 {
-    uint8_t value;
-    xoffs nbytes = xios_was_input_readn(stub, exec, ctxt,
-                                        (char *)&value, sizeof(value));
-    if (nbytes < 0)
-        return (int)nbytes;
+    struct was_simple *w = ctxt;
 
-    if (nbytes != sizeof(value)) {
-        xios_iostub_seterror(stub, SYSX_R_ILLEGALSTATE);
+    /* take the byte from the read-ahead buffer, which gets refilled
+       with one read() per buffer instead of one per byte */
+    const void *data;
+    ssize_t nbytes = was_simple_input_peek(w, &data);
+    if (nbytes <= 0) {
+        if (nbytes == 0)
+            /* end of request body */
+            return -1;
+
+        xios_iostub_seterror(stub,
+                             nbytes == -1
+                             ? sysx_result_geterrno()
+                             : SYSX_R_FAILURE);
         return -2;
     }
 
+    const uint8_t value = *(const uint8_t *)data;
+    was_simple_input_consume(w, sizeof(value));
     return (int)value;
 }
 
@@ -83,6 +92,15 @@ static const xiodriver xios_was_input_driver = {
     .close = xios_was_input_close,
 };
 
+int
+xios_was_input_splice(struct was_simple *was, int fd)
+{
+    assert(was != NULL);
+    assert(fd >= 0);
+
+    return was_simple_splice_to(was, fd) ? 0 : -1;
+}
+
 xresult
 xios_was_input_create(xmemctx *mctx, struct was_simple *was,
                       xiostub **stub_r)
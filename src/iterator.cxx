@@ -7,14 +7,14 @@
 #include <was/simple.h>
 
 struct was_simple_iterator {
-    std::multimap<std::string, std::string>::const_iterator i, end;
+    FlatMultiMap::const_iterator i, end;
 
     struct was_simple_pair pair;
 };
 
 struct was_simple_iterator *
-was_simple_iterator_new(std::multimap<std::string, std::string>::const_iterator begin,
-                        std::multimap<std::string, std::string>::const_iterator end)
+was_simple_iterator_new(FlatMultiMap::const_iterator begin,
+                        FlatMultiMap::const_iterator end)
 {
     auto *i = new was_simple_iterator();
 
@@ -36,9 +36,25 @@ was_simple_iterator_next(struct was_simple_iterator *i)
     if (i->i == i->end)
         return nullptr;
 
-    i->pair.name = i->i->first.c_str();
-    i->pair.value = i->i->second.c_str();
+    i->pair.name = i->i->name.data();
+    i->pair.value = i->i->value.data();
     ++i->i;
 
     return &i->pair;
 }
+
+bool
+was_simple_foreach(FlatMultiMap::const_iterator begin,
+                   FlatMultiMap::const_iterator end,
+                   bool (*callback)(const char *name, size_t name_length,
+                                    const char *value, size_t value_length,
+                                    void *ctx),
+                   void *ctx) noexcept
+{
+    for (auto i = begin; i != end; ++i)
+        if (!callback(i->name.data(), i->name.size(),
+                      i->value.data(), i->value.size(), ctx))
+            return false;
+
+    return true;
+}
@@ -2,9 +2,21 @@
 // Copyright CM4all GmbH
 // author: Max Kellermann <mk@cm4all.com>
 
-#include <map>
-#include <string>
+#include "flat_map.hxx"
 
 struct was_simple_iterator *
-was_simple_iterator_new(std::multimap<std::string, std::string>::const_iterator begin,
-                        std::multimap<std::string, std::string>::const_iterator end);
+was_simple_iterator_new(FlatMultiMap::const_iterator begin,
+                        FlatMultiMap::const_iterator end);
+
+/**
+ * Invoke a callback for each item in the given range.
+ *
+ * @return false if the callback has stopped the iteration
+ */
+bool
+was_simple_foreach(FlatMultiMap::const_iterator begin,
+                   FlatMultiMap::const_iterator end,
+                   bool (*callback)(const char *name, size_t name_length,
+                                    const char *value, size_t value_length,
+                                    void *ctx),
+                   void *ctx) noexcept;
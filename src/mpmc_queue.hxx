@@ -0,0 +1,103 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <mk@cm4all.com>
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+
+/**
+ * A bounded lock-free multi-producer multi-consumer queue (Dmitry
+ * Vyukov's algorithm).  Each cell carries a sequence number which
+ * tells producers and consumers whether it is free or occupied, so
+ * neither side ever takes a lock.
+ *
+ * @param N the capacity; must be a power of two
+ */
+template<typename T, std::size_t N>
+class MpmcQueue {
+    static_assert(N >= 2 && (N & (N - 1)) == 0, "N must be a power of two");
+
+    struct Cell {
+        std::atomic<std::size_t> sequence;
+        T value;
+    };
+
+    Cell cells[N];
+
+    alignas(64) std::atomic<std::size_t> enqueue_position{0};
+    alignas(64) std::atomic<std::size_t> dequeue_position{0};
+
+public:
+    MpmcQueue() noexcept {
+        for (std::size_t i = 0; i < N; ++i)
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    MpmcQueue(const MpmcQueue &) = delete;
+    MpmcQueue &operator=(const MpmcQueue &) = delete;
+
+    /**
+     * @return false if the queue is full
+     */
+    bool Push(T value) noexcept {
+        std::size_t position = enqueue_position.load(std::memory_order_relaxed);
+
+        while (true) {
+            Cell &cell = cells[position & (N - 1)];
+            const std::size_t sequence =
+                cell.sequence.load(std::memory_order_acquire);
+            const auto diff = (std::ptrdiff_t)sequence - (std::ptrdiff_t)position;
+
+            if (diff == 0) {
+                if (enqueue_position.compare_exchange_weak(position, position + 1,
+                                                           std::memory_order_relaxed)) {
+                    cell.value = value;
+                    cell.sequence.store(position + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0)
+                /* full */
+                return false;
+            else
+                position = enqueue_position.load(std::memory_order_relaxed);
+        }
+    }
+
+    /**
+     * @return false if the queue is empty
+     */
+    bool Pop(T &value_r) noexcept {
+        std::size_t position = dequeue_position.load(std::memory_order_relaxed);
+
+        while (true) {
+            Cell &cell = cells[position & (N - 1)];
+            const std::size_t sequence =
+                cell.sequence.load(std::memory_order_acquire);
+            const auto diff = (std::ptrdiff_t)sequence - (std::ptrdiff_t)(position + 1);
+
+            if (diff == 0) {
+                if (dequeue_position.compare_exchange_weak(position, position + 1,
+                                                           std::memory_order_relaxed)) {
+                    value_r = cell.value;
+                    cell.sequence.store(position + N, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0)
+                /* empty */
+                return false;
+            else
+                position = dequeue_position.load(std::memory_order_relaxed);
+        }
+    }
+
+    /**
+     * Is the queue empty?  This is only a snapshot which may be
+     * outdated when this method returns.
+     */
+    bool IsEmpty() const noexcept {
+        return enqueue_position.load(std::memory_order_relaxed) ==
+            dequeue_position.load(std::memory_order_relaxed);
+    }
+};
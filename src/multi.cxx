@@ -11,16 +11,41 @@
 #include <was/simple.h>
 #include <was/protocol.h>
 
+#include "multi.hxx"
+#include "simple.hxx"
+#include "mpmc_queue.hxx"
+#include "stats.hxx"
+#include "trace.hxx"
+
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cerrno>
 #include <cstddef>
+#include <cstdint>
+#include <utility>
 
+#include <poll.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof(x[0]))
 
-struct was_multi {
-    static constexpr int fd = 0;
-};
+was_multi::~was_multi() noexcept
+{
+    for (std::size_t i = batch_start; i < batch_end; ++i) {
+        close(batch[i].control_fd);
+        close(batch[i].input_fd);
+        close(batch[i].output_fd);
+    }
+
+    if (accept_lock != nullptr)
+        munmap(accept_lock, sizeof(*accept_lock));
+}
 
 struct was_multi *
 was_multi_new()
@@ -81,49 +106,1071 @@ CloseFds(struct msghdr &msg) noexcept
     }
 }
 
-struct was_simple *
-was_multi_accept_simple(struct was_multi *m)
+/**
+ * Receive up to the given number of packets from the Multi-WAS
+ * socket with one recvmmsg() call and append the connections to
+ * was_multi::batch.  The batch must be empty.
+ *
+ * @param flags flags for recvmmsg(), e.g. MSG_DONTWAIT; the call
+ * blocks at most until the first packet arrives
+ * @return false on error (errno=EAGAIN if MSG_DONTWAIT was specified
+ * and no packet is available)
+ */
+static bool
+ReceiveBatch(struct was_multi &m, std::size_t max_batch, int flags) noexcept
 {
-    while (true) {
-        struct was_header h;
+    assert(m.batch_start == m.batch_end);
+    assert(max_batch > 0 && max_batch <= m.MAX_BATCH);
 
-        struct iovec v[] = {
-            {&h, sizeof(h)},
-        };
+    static constexpr std::size_t max_fds = 3;
+    static constexpr std::size_t CMSG_SIZE = max_fds * sizeof(int);
+    static constexpr size_t CMSG_BUFFER_SIZE = CMSG_SPACE(CMSG_SIZE);
+    static constexpr size_t CMSG_N_LONGS = (CMSG_BUFFER_SIZE + sizeof(long) - 1) / sizeof(long);
 
-        static constexpr std::size_t max_fds = 3;
-        static constexpr std::size_t CMSG_SIZE = max_fds * sizeof(int);
-        static constexpr size_t CMSG_BUFFER_SIZE = CMSG_SPACE(CMSG_SIZE);
-        static constexpr size_t CMSG_N_LONGS = (CMSG_BUFFER_SIZE + sizeof(long) - 1) / sizeof(long);
-        long cmsg[CMSG_N_LONGS];
+    struct was_header h[m.MAX_BATCH];
+    struct iovec v[m.MAX_BATCH];
+    long cmsg[m.MAX_BATCH][CMSG_N_LONGS];
+    struct mmsghdr msgs[m.MAX_BATCH];
 
-        struct msghdr msg{};
-        msg.msg_iov = v;
-        msg.msg_iovlen = ARRAY_SIZE(v);
-        msg.msg_control = cmsg;
-        msg.msg_controllen = sizeof(cmsg);
+    for (std::size_t i = 0; i < max_batch; ++i) {
+        v[i] = {&h[i], sizeof(h[i])};
 
-        ssize_t nbytes = recvmsg(m->fd, &msg, MSG_CMSG_CLOEXEC);
-        if (nbytes <= 0)
-            return NULL;
+        auto &msg = msgs[i].msg_hdr;
+        msg = {};
+        msg.msg_iov = &v[i];
+        msg.msg_iovlen = 1;
+        msg.msg_control = cmsg[i];
+        msg.msg_controllen = sizeof(cmsg[i]);
+    }
 
-        if ((std::size_t)nbytes != sizeof(h) ||
+    const int n = recvmmsg(m.fd, msgs, max_batch,
+                           MSG_CMSG_CLOEXEC|MSG_WAITFORONE|flags, nullptr);
+    if (n <= 0) {
+        if (n == 0)
+            errno = ECONNRESET;
+        return false;
+    }
+
+    m.batch_start = m.batch_end = 0;
+
+    for (int i = 0; i < n; ++i) {
+        auto &msg = msgs[i].msg_hdr;
+
+        if (m.batch_error != 0) {
+            /* discard everything after the end of file */
+            CloseFds(msg);
+            continue;
+        }
+
+        if (msgs[i].msg_len == 0) {
+            /* end of file */
+            m.batch_error = ECONNRESET;
+            continue;
+        }
+
+        if (msgs[i].msg_len != sizeof(h[i]) ||
             (msg.msg_flags & (MSG_TRUNC|MSG_CTRUNC))) {
+            /* malformed or truncated (e.g. the file descriptors
+               didn't fit because we've hit RLIMIT_NOFILE): drop
+               only this packet */
             CloseFds(msg);
-            return nullptr;
+            continue;
         }
 
-        switch (h.command) {
+        switch (h[i].command) {
         case MULTI_WAS_COMMAND_NOP:
             CloseFds(msg);
             continue;
 
         case MULTI_WAS_COMMAND_NEW:
-            if (auto fds = ExpectFds(msg, 3))
-                return was_simple_new_fds(fds[0], fds[1], fds[2]);
+            if (auto fds = ExpectFds(msg, 3)) {
+                m.batch[m.batch_end++] = {fds[0], fds[1], fds[2]};
+                continue;
+            }
 
-            CloseFds(msg);
+            break;
+        }
+
+        /* unknown command or wrong number of file descriptors */
+        CloseFds(msg);
+    }
+
+    return true;
+}
+
+/**
+ * Return the next connection from the Multi-WAS socket, receiving a
+ * new batch of packets if necessary.
+ *
+ * @param max_batch the maximum number of packets to receive at once
+ * @param flags flags for recvmmsg(), e.g. MSG_DONTWAIT
+ * @return the new connection or nullptr on error (errno=EAGAIN if
+ * MSG_DONTWAIT was specified and no packet is available)
+ */
+static struct was_simple *
+ReceiveNew(struct was_multi &m, std::size_t max_batch, int flags) noexcept
+{
+    while (true) {
+        if (m.batch_start < m.batch_end) {
+            const auto &b = m.batch[m.batch_start++];
+            CountStat(Stat::MULTI_ACCEPTS);
+            WAS_TRACE1(multi_accept, b.control_fd);
+            return was_simple_new_pooled(b.control_fd, b.input_fd,
+                                         b.output_fd);
+        }
+
+        if (m.batch_error != 0) {
+            errno = std::exchange(m.batch_error, 0);
             return nullptr;
         }
+
+        if (!ReceiveBatch(m, max_batch, flags))
+            return nullptr;
+    }
+}
+
+/**
+ * What to do after ReceiveNew() has failed.
+ */
+enum class ReceiveErrorAction {
+    /**
+     * Try again right away (e.g. interrupted by a signal).
+     */
+    RETRY,
+
+    /**
+     * Out of file descriptors or memory: try again after
+     * #RECEIVE_BACKOFF_MS.
+     */
+    BACKOFF,
+
+    /**
+     * The Multi-WAS socket has been closed: this process shall be
+     * terminated.
+     */
+    CLOSED,
+
+    /**
+     * An unrecoverable error.
+     */
+    FAIL,
+};
+
+static constexpr int RECEIVE_BACKOFF_MS = 100;
+
+static constexpr ReceiveErrorAction
+ClassifyReceiveError(int error) noexcept
+{
+    switch (error) {
+    case EINTR:
+        return ReceiveErrorAction::RETRY;
+
+    case EMFILE:
+    case ENFILE:
+    case ENOBUFS:
+    case ENOMEM:
+        return ReceiveErrorAction::BACKOFF;
+
+    case ECONNRESET:
+        return ReceiveErrorAction::CLOSED;
+
+    default:
+        return ReceiveErrorAction::FAIL;
+    }
+}
+
+struct was_simple *
+was_multi_accept_simple(struct was_multi *m)
+{
+    if (m->accept_lock == nullptr)
+        return ReceiveNew(*m, m->MAX_BATCH, 0);
+
+    /* only one prefork child waits in recvmsg() at a time */
+    const int error = pthread_mutex_lock(m->accept_lock);
+    if (error == EOWNERDEAD)
+        /* the previous owner has crashed; the mutex protects no
+           data, so it is consistent */
+        pthread_mutex_consistent(m->accept_lock);
+    else if (error != 0) {
+        /* e.g. ENOTRECOVERABLE */
+        errno = error;
+        return nullptr;
+    }
+
+    /* receive only one connection at a time, or this process
+       would take connections from its idle siblings */
+    struct was_simple *w = ReceiveNew(*m, 1, 0);
+
+    const int saved_errno = errno;
+    pthread_mutex_unlock(m->accept_lock);
+    errno = saved_errno;
+
+    return w;
+}
+
+namespace {
+
+/**
+ * A WAS connection managed by #MultiLoop.
+ */
+struct MultiConnection {
+    MultiConnection *prev = nullptr, *next = nullptr;
+
+    /**
+     * The WAS connection; nullptr after it has been closed (and
+     * this object waits to be deleted).
+     */
+    struct was_simple *w;
+
+    /**
+     * The URI of the request currently being handled; nullptr if the
+     * connection is idle.
+     */
+    const char *uri = nullptr;
+
+    /**
+     * The handler's per-connection pointer.
+     */
+    void *ctx = nullptr;
+
+    /**
+     * The pipe which is currently registered in epoll in addition to
+     * the control socket; -1 if none.
+     */
+    int extra_fd = -1;
+    uint32_t extra_events = 0;
+
+    explicit MultiConnection(struct was_simple *_w) noexcept
+        :w(_w) {}
+};
+
+class MultiWorker;
+
+/**
+ * The epoll loop implementing was_multi_run().  In thread pool mode
+ * (was_multi_run_threads()), each worker thread runs one instance
+ * which receives its connections from a MultiWorker instead of the
+ * Multi-WAS socket.
+ */
+class MultiLoop {
+    /**
+     * The Multi-WAS socket; nullptr in thread pool mode.
+     */
+    struct was_multi *const multi;
+
+    /**
+     * The worker which feeds connections into this loop; nullptr
+     * unless in thread pool mode.
+     */
+    MultiWorker *const worker;
+
+    const struct was_multi_handler &handler;
+    void *const ctx;
+
+    const int epoll_fd;
+
+    /**
+     * A doubly linked list of all open connections.
+     */
+    MultiConnection *head = nullptr;
+
+    /**
+     * Closed connections to be deleted after the current epoll batch
+     * (singly linked via MultiConnection::next).
+     */
+    MultiConnection *closed = nullptr;
+
+    /**
+     * The number of connections which are currently handling a
+     * request.
+     */
+    unsigned n_busy = 0;
+
+    bool accepting = true;
+
+    /**
+     * Has the Multi-WAS socket been removed from epoll because we
+     * ran out of file descriptors or memory?  It is added again at
+     * #accept_resume.
+     */
+    bool accept_suspended = false;
+
+    std::chrono::steady_clock::time_point accept_resume;
+
+public:
+    MultiLoop(struct was_multi *_multi, MultiWorker *_worker,
+              const struct was_multi_handler &_handler,
+              void *_ctx) noexcept
+        :multi(_multi), worker(_worker), handler(_handler), ctx(_ctx),
+         epoll_fd(epoll_create1(EPOLL_CLOEXEC)) {}
+
+    ~MultiLoop() noexcept {
+        while (head != nullptr)
+            Close(*head);
+        DeleteClosed();
+
+        if (epoll_fd >= 0)
+            close(epoll_fd);
+    }
+
+    MultiLoop(const MultiLoop &) = delete;
+    MultiLoop &operator=(const MultiLoop &) = delete;
+
+    /**
+     * Register the Multi-WAS socket (or the worker's eventfd) in
+     * epoll.  This must be called before Run(); in thread pool mode,
+     * it is called by the thread which starts the worker, so startup
+     * failures are reported to it.
+     *
+     * @return false on error (with errno set)
+     */
+    bool Open() noexcept;
+
+    int Run() noexcept;
+
+    void Add(struct was_simple *w) noexcept;
+
+    /**
+     * No more connections will be added; return from Run() after
+     * all connections have been closed.
+     */
+    void StopAccepting() noexcept {
+        accepting = false;
+    }
+
+private:
+    bool EpollCtl(int op, int fd, uint32_t events, void *ptr) noexcept {
+        struct epoll_event event{};
+        event.events = events;
+        event.data.ptr = ptr;
+        return epoll_ctl(epoll_fd, op, fd, &event) == 0;
+    }
+
+    bool AddMultiSocket() noexcept {
+        /* EPOLLEXCLUSIVE avoids waking up all processes sharing
+           the Multi-WAS socket (e.g. after was_multi_prefork()) */
+        return EpollCtl(EPOLL_CTL_ADD, multi->fd, EPOLLIN|EPOLLEXCLUSIVE,
+                        nullptr);
+    }
+
+    /**
+     * Receive all pending connections from the Multi-WAS socket.
+     *
+     * @return false on an unrecoverable error (with errno set)
+     */
+    bool AcceptAll() noexcept;
+
+    /**
+     * Add the Multi-WAS socket to epoll again after AcceptAll() has
+     * suspended it, if the delay has expired.
+     *
+     * @return the epoll_wait() timeout until the delay expires, or
+     * -1 on error (with errno set)
+     */
+    int CheckAcceptResume() noexcept;
+
+    /**
+     * Handle requests on this connection until it would block.
+     */
+    void Step(MultiConnection &c) noexcept;
+
+    /**
+     * Register the pipe reported by was_simple_get_poll() in epoll.
+     */
+    void UpdateWait(MultiConnection &c) noexcept;
+
+    void Close(MultiConnection &c) noexcept;
+    void DeleteClosed() noexcept;
+
+    /* thread pool mode; implemented below */
+    bool RegisterWorker() noexcept;
+    void SetIdle(bool idle) noexcept;
+    void OnWake() noexcept;
+    void Steal() noexcept;
+};
+
+bool
+MultiLoop::AcceptAll() noexcept
+{
+    while (true) {
+        struct was_simple *w = ReceiveNew(*multi, multi->MAX_BATCH,
+                                          MSG_DONTWAIT);
+        if (w == nullptr) {
+            if (errno == EAGAIN)
+                return true;
+
+            switch (ClassifyReceiveError(errno)) {
+            case ReceiveErrorAction::RETRY:
+                continue;
+
+            case ReceiveErrorAction::BACKOFF:
+                /* the socket stays readable; stop polling it for a
+                   while instead of spinning */
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, multi->fd, nullptr);
+                accept_suspended = true;
+                accept_resume = std::chrono::steady_clock::now() +
+                    std::chrono::milliseconds(RECEIVE_BACKOFF_MS);
+                return true;
+
+            case ReceiveErrorAction::CLOSED:
+                /* this process shall be terminated after all
+                   connections are finished */
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, multi->fd, nullptr);
+                accepting = false;
+                return true;
+
+            case ReceiveErrorAction::FAIL:
+                break;
+            }
+
+            return false;
+        }
+
+        Add(w);
+    }
+}
+
+int
+MultiLoop::CheckAcceptResume() noexcept
+{
+    assert(accept_suspended);
+
+    const auto now = std::chrono::steady_clock::now();
+    if (now < accept_resume) {
+        using std::chrono::milliseconds;
+        return int(std::chrono::ceil<milliseconds>(accept_resume - now).count());
+    }
+
+    if (!AddMultiSocket())
+        return -1;
+
+    accept_suspended = false;
+    return 0;
+}
+
+void
+MultiLoop::Add(struct was_simple *w) noexcept
+{
+    was_simple_set_non_block(w, true);
+
+    auto *c = new MultiConnection(w);
+    c->next = head;
+    if (head != nullptr)
+        head->prev = c;
+    head = c;
+
+    /* level-triggered: a request which has already arrived will be
+       reported by the next epoll_wait() */
+    if (!EpollCtl(EPOLL_CTL_ADD, was_simple_control_fd(w), EPOLLIN, c))
+        Close(*c);
+}
+
+void
+MultiLoop::Step(MultiConnection &c) noexcept
+{
+    while (true) {
+        if (c.uri == nullptr) {
+            c.uri = was_simple_accept(c.w);
+            if (c.uri == nullptr) {
+                if (errno == EAGAIN)
+                    UpdateWait(c);
+                else
+                    Close(c);
+                return;
+            }
+
+            ++n_busy;
+        }
+
+        switch (handler.request(c.w, c.uri, &c.ctx, ctx)) {
+        case WAS_MULTI_RESULT_DONE:
+            /* the next was_simple_accept() call finishes the request
+               if the handler didn't */
+            c.uri = nullptr;
+            --n_busy;
+            break;
+
+        case WAS_MULTI_RESULT_AGAIN:
+            UpdateWait(c);
+            return;
+
+        case WAS_MULTI_RESULT_CLOSE:
+            Close(c);
+            return;
+        }
+    }
+}
+
+void
+MultiLoop::UpdateWait(MultiConnection &c) noexcept
+{
+    struct pollfd fds[2];
+    const unsigned n = was_simple_get_poll(c.w, fds);
+
+    int fd = -1;
+    uint32_t events = 0;
+    if (n > 1) {
+        fd = fds[1].fd;
+        if (fds[1].events & POLLIN)
+            events |= EPOLLIN;
+        if (fds[1].events & POLLOUT)
+            events |= EPOLLOUT;
+    }
+
+    if (fd == c.extra_fd && events == c.extra_events)
+        return;
+
+    if (c.extra_fd >= 0 && fd != c.extra_fd)
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c.extra_fd, nullptr);
+
+    if (fd >= 0 &&
+        !EpollCtl(fd == c.extra_fd ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+                  fd, events, &c)) {
+        c.extra_fd = -1;
+        Close(c);
+        return;
+    }
+
+    c.extra_fd = fd;
+    c.extra_events = events;
+}
+
+void
+MultiLoop::Close(MultiConnection &c) noexcept
+{
+    if (handler.close != nullptr)
+        handler.close(c.w, c.ctx, ctx);
+
+    if (c.uri != nullptr)
+        --n_busy;
+
+    if (c.extra_fd >= 0)
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c.extra_fd, nullptr);
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, was_simple_control_fd(c.w), nullptr);
+
+    was_simple_free(c.w);
+    c.w = nullptr;
+
+    /* unlink */
+    if (c.prev != nullptr)
+        c.prev->next = c.next;
+    else
+        head = c.next;
+    if (c.next != nullptr)
+        c.next->prev = c.prev;
+
+    /* the current epoll batch may still refer to this object; delete
+       it later */
+    c.prev = nullptr;
+    c.next = closed;
+    closed = &c;
+}
+
+void
+MultiLoop::DeleteClosed() noexcept
+{
+    while (closed != nullptr) {
+        auto *c = closed;
+        closed = c->next;
+        delete c;
+    }
+}
+
+bool
+MultiLoop::Open() noexcept
+{
+    return epoll_fd >= 0 &&
+        (multi == nullptr || AddMultiSocket()) &&
+        (worker == nullptr || RegisterWorker());
+}
+
+int
+MultiLoop::Run() noexcept
+{
+    while (accepting || head != nullptr) {
+        if (worker != nullptr && n_busy == 0) {
+            /* all our connections are idle: help other workers
+               whose queues are backlogged, and let them wake us up
+               for that while we're waiting */
+            SetIdle(true);
+            Steal();
+        }
+
+        int timeout = -1;
+        if (accept_suspended) {
+            timeout = CheckAcceptResume();
+            if (timeout < 0)
+                return -1;
+
+            if (!accept_suspended)
+                /* the Multi-WAS socket is back in epoll */
+                timeout = -1;
+        }
+
+        struct epoll_event events[64];
+        int n = epoll_wait(epoll_fd, events, ARRAY_SIZE(events), timeout);
+
+        if (worker != nullptr)
+            SetIdle(false);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        for (int i = 0; i < n; ++i) {
+            void *ptr = events[i].data.ptr;
+            if (ptr == nullptr) {
+                if (!AcceptAll())
+                    return -1;
+            } else if (ptr == this)
+                /* the worker's eventfd */
+                OnWake();
+            else if (auto *c = (MultiConnection *)ptr; c->w != nullptr)
+                Step(*c);
+        }
+
+        DeleteClosed();
+    }
+
+    return 0;
+}
+
+class MultiThreadPool;
+
+/**
+ * A worker thread in thread pool mode.  It owns the connections it
+ * has taken from its queue; they are never touched by other threads
+ * after that.
+ */
+class MultiWorker {
+    MultiThreadPool &pool;
+
+    MpmcQueue<struct was_simple *, 256> queue;
+
+    /**
+     * An eventfd which wakes up the worker after something has been
+     * pushed to the #queue, when another worker's queue is
+     * backlogged (see #idle) or when the pool is stopping.
+     */
+    const int wake_fd;
+
+    /**
+     * The event loop; it is set up by Start() and then used only by
+     * the worker thread.
+     */
+    MultiLoop loop;
+
+    pthread_t thread;
+
+    bool started = false;
+
+    /**
+     * Is the worker thread running?  It is cleared when the event
+     * loop has failed, so no more connections are submitted.
+     */
+    std::atomic_bool alive{false};
+
+    /**
+     * Is the worker waiting for events while all of its connections
+     * are idle?  Then it can steal connections from busy workers.
+     */
+    std::atomic_bool idle{false};
+
+    /**
+     * The errno value of the failed event loop.
+     */
+    int error = 0;
+
+public:
+    MultiWorker(MultiThreadPool &_pool,
+                const struct was_multi_handler &handler,
+                void *ctx) noexcept
+        :pool(_pool), wake_fd(eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC)),
+         loop(nullptr, this, handler, ctx) {}
+
+    ~MultiWorker() noexcept {
+        struct was_simple *w;
+        while (queue.Pop(w))
+            was_simple_free(w);
+
+        if (wake_fd >= 0)
+            close(wake_fd);
+    }
+
+    MultiWorker(const MultiWorker &) = delete;
+    MultiWorker &operator=(const MultiWorker &) = delete;
+
+    MultiThreadPool &GetPool() noexcept {
+        return pool;
+    }
+
+    int GetWakeFd() const noexcept {
+        return wake_fd;
+    }
+
+    bool IsBacklogged() const noexcept {
+        return !queue.IsEmpty();
+    }
+
+    bool IsAlive() const noexcept {
+        return alive.load(std::memory_order_acquire);
+    }
+
+    /**
+     * @return the errno value if the worker has failed
+     */
+    int GetError() const noexcept {
+        return IsAlive() ? 0 : error;
+    }
+
+    /**
+     * Called by the acceptor thread after Submit().
+     */
+    bool IsIdle() const noexcept {
+        /* pairs with the fence in SetIdle(): either we see the
+           worker idle, or it sees what has just been submitted */
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        return idle.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * Called by the worker thread; after setting the flag, it must
+     * check the other queues once more before waiting.
+     */
+    void SetIdle(bool _idle) noexcept {
+        idle.store(_idle, std::memory_order_relaxed);
+        if (_idle)
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+
+    /**
+     * @return false on error (with errno set)
+     */
+    bool Start() noexcept {
+        if (wake_fd < 0 || !loop.Open())
+            return false;
+
+        alive.store(true, std::memory_order_release);
+
+        const int result = pthread_create(&thread, nullptr, Run, this);
+        if (result != 0) {
+            alive.store(false, std::memory_order_release);
+            errno = result;
+            return false;
+        }
+
+        started = true;
+        return true;
+    }
+
+    void Join() noexcept {
+        if (started) {
+            pthread_join(thread, nullptr);
+            started = false;
+        }
+    }
+
+    /**
+     * Called by the acceptor thread.
+     *
+     * @return false if the queue is full
+     */
+    bool Submit(struct was_simple *w) noexcept {
+        if (!queue.Push(w))
+            return false;
+
+        Wake();
+        return true;
+    }
+
+    void Wake() noexcept {
+        static constexpr uint64_t one = 1;
+        [[maybe_unused]] ssize_t nbytes = write(wake_fd, &one, sizeof(one));
+    }
+
+    /**
+     * Move all queued connections to the given loop.
+     */
+    void Drain(MultiLoop &target) noexcept {
+        uint64_t value;
+        [[maybe_unused]] ssize_t nbytes = read(wake_fd, &value, sizeof(value));
+
+        struct was_simple *w;
+        while (queue.Pop(w))
+            target.Add(w);
+    }
+
+    /**
+     * Take one queued connection (called by another worker).
+     */
+    struct was_simple *Steal() noexcept {
+        struct was_simple *w;
+        return queue.Pop(w) ? w : nullptr;
+    }
+
+private:
+    static void *Run(void *arg) noexcept;
+};
+
+/**
+ * The thread pool implementing was_multi_run_threads().
+ */
+class MultiThreadPool {
+    MultiWorker **const workers;
+    const unsigned n_workers;
+
+    /**
+     * The next worker to receive a new connection.
+     */
+    unsigned next_worker = 0;
+
+    std::atomic_bool stopping{false};
+
+public:
+    MultiThreadPool(unsigned n, const struct was_multi_handler &handler,
+                    void *ctx) noexcept
+        :workers(new MultiWorker *[n]), n_workers(n)
+    {
+        for (unsigned i = 0; i < n; ++i)
+            workers[i] = new MultiWorker(*this, handler, ctx);
+    }
+
+    ~MultiThreadPool() noexcept {
+        for (unsigned i = 0; i < n_workers; ++i)
+            delete workers[i];
+        delete[] workers;
+    }
+
+    MultiThreadPool(const MultiThreadPool &) = delete;
+    MultiThreadPool &operator=(const MultiThreadPool &) = delete;
+
+    bool IsStopping() const noexcept {
+        return stopping.load(std::memory_order_acquire);
+    }
+
+    /**
+     * Start all worker threads.
+     *
+     * @return false on error (with errno set)
+     */
+    bool Start() noexcept {
+        for (unsigned i = 0; i < n_workers; ++i) {
+            if (!workers[i]->Start()) {
+                const int saved_errno = errno;
+                Stop();
+                errno = saved_errno;
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    /**
+     * Tell all workers to exit after their connections have been
+     * closed, and wait for them.
+     */
+    void Stop() noexcept {
+        stopping.store(true, std::memory_order_release);
+
+        for (unsigned i = 0; i < n_workers; ++i)
+            workers[i]->Wake();
+
+        for (unsigned i = 0; i < n_workers; ++i)
+            workers[i]->Join();
+    }
+
+    /**
+     * Hand a new connection to a worker.  Workers with an empty
+     * queue are preferred; a non-empty queue means the worker is
+     * busy.
+     *
+     * @return false if all workers have failed (with errno set)
+     */
+    bool Dispatch(struct was_simple *w) noexcept {
+        while (true) {
+            bool any_alive = false;
+
+            for (unsigned pass = 0; pass < 2; ++pass) {
+                for (unsigned i = 0; i < n_workers; ++i) {
+                    auto &worker = *workers[(next_worker + i) % n_workers];
+                    if (!worker.IsAlive())
+                        continue;
+
+                    any_alive = true;
+
+                    if (pass == 0 && worker.IsBacklogged())
+                        continue;
+
+                    if (worker.Submit(w)) {
+                        next_worker = (next_worker + i + 1) % n_workers;
+
+                        if (!worker.IsIdle())
+                            /* it may take a while until this worker
+                               gets to its queue */
+                            WakeIdle(worker);
+                        return true;
+                    }
+                }
+            }
+
+            if (!any_alive) {
+                errno = workers[0]->GetError();
+                return false;
+            }
+
+            /* all queues are full: give the workers some time */
+            usleep(1000);
+        }
+    }
+
+    /**
+     * Wake up an idle worker, which will then steal a connection
+     * from the given one.
+     */
+    void WakeIdle(const MultiWorker &busy) noexcept {
+        for (unsigned i = 0; i < n_workers; ++i) {
+            auto &worker = *workers[i];
+            if (&worker != &busy && worker.IsAlive() && worker.IsIdle()) {
+                worker.Wake();
+                return;
+            }
+        }
+    }
+
+    /**
+     * Take a queued connection from another worker.
+     */
+    struct was_simple *Steal(const MultiWorker &thief) noexcept {
+        for (unsigned i = 0; i < n_workers; ++i) {
+            auto &worker = *workers[i];
+            if (&worker == &thief || !worker.IsBacklogged())
+                continue;
+
+            if (auto *w = worker.Steal())
+                return w;
+        }
+
+        return nullptr;
+    }
+};
+
+void *
+MultiWorker::Run(void *arg) noexcept
+{
+    auto &worker = *(MultiWorker *)arg;
+
+    if (worker.loop.Run() < 0) {
+        worker.error = errno;
+        worker.alive.store(false, std::memory_order_release);
+
+        /* the connections in our queue are left for the other
+           workers to steal */
+        worker.pool.WakeIdle(worker);
+    }
+
+    return nullptr;
+}
+
+bool
+MultiLoop::RegisterWorker() noexcept
+{
+    return EpollCtl(EPOLL_CTL_ADD, worker->GetWakeFd(), EPOLLIN, this);
+}
+
+void
+MultiLoop::SetIdle(bool idle) noexcept
+{
+    worker->SetIdle(idle);
+}
+
+void
+MultiLoop::OnWake() noexcept
+{
+    /* check the flag before draining; the acceptor pushes all
+       connections before setting it */
+    const bool stopping = worker->GetPool().IsStopping();
+
+    worker->Drain(*this);
+
+    if (stopping && accepting) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, worker->GetWakeFd(), nullptr);
+        StopAccepting();
+    }
+}
+
+void
+MultiLoop::Steal() noexcept
+{
+    if (!accepting)
+        return;
+
+    if (auto *w = worker->GetPool().Steal(*worker))
+        Add(w);
+}
+
+} // anonymous namespace
+
+int
+was_multi_run(struct was_multi *m, const struct was_multi_handler *handler,
+              void *ctx)
+{
+    MultiLoop loop(m, nullptr, *handler, ctx);
+    if (!loop.Open())
+        return -1;
+
+    return loop.Run();
+}
+
+int
+was_multi_run_threads(struct was_multi *m, unsigned n_threads,
+                      const struct was_multi_handler *handler, void *ctx)
+{
+    if (n_threads == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    MultiThreadPool pool(n_threads, *handler, ctx);
+    if (!pool.Start())
+        return -1;
+
+    /* this thread is the acceptor */
+    while (true) {
+        auto *w = ReceiveNew(*m, m->MAX_BATCH, 0);
+        if (w == nullptr) {
+            const int error = errno;
+
+            switch (ClassifyReceiveError(error)) {
+            case ReceiveErrorAction::RETRY:
+                continue;
+
+            case ReceiveErrorAction::BACKOFF:
+                poll(nullptr, 0, RECEIVE_BACKOFF_MS);
+                continue;
+
+            case ReceiveErrorAction::CLOSED:
+                /* this process shall be terminated */
+                pool.Stop();
+                return 0;
+
+            case ReceiveErrorAction::FAIL:
+                break;
+            }
+
+            pool.Stop();
+            errno = error;
+            return -1;
+        }
+
+        if (!pool.Dispatch(w)) {
+            const int saved_errno = errno;
+            was_simple_free(w);
+            pool.Stop();
+            errno = saved_errno;
+            return -1;
+        }
     }
 }
@@ -0,0 +1,51 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <mk@cm4all.com>
+
+#pragma once
+
+#include <cstddef>
+
+#include <pthread.h>
+
+struct was_multi {
+    static constexpr int fd = 0;
+
+    /**
+     * A process-shared mutex (in shared memory) which serializes
+     * was_multi_accept_simple() among the children of
+     * was_multi_prefork(), so only one of them is woken up by a new
+     * connection.  nullptr if this process has not been forked by
+     * was_multi_prefork().
+     */
+    pthread_mutex_t *accept_lock = nullptr;
+
+    /**
+     * The maximum number of #MULTI_WAS_COMMAND_NEW packets received
+     * with one recvmmsg() call.
+     */
+    static constexpr std::size_t MAX_BATCH = 16;
+
+    /**
+     * Connections which have been received by recvmmsg() but not
+     * yet returned to the caller.
+     */
+    struct {
+        int control_fd, input_fd, output_fd;
+    } batch[MAX_BATCH];
+
+    std::size_t batch_start = 0, batch_end = 0;
+
+    /**
+     * An errno value to be reported after the #batch has been
+     * consumed (e.g. ECONNRESET after the peer has closed the
+     * socket).
+     */
+    int batch_error = 0;
+
+    was_multi() noexcept = default;
+    ~was_multi() noexcept;
+
+    was_multi(const was_multi &) = delete;
+    was_multi &operator=(const was_multi &) = delete;
+};
@@ -14,104 +14,68 @@
 #include <sysx/result.h>
 
 #include <assert.h>
-#include <unistd.h>
 #include <errno.h>
+#include <sys/uio.h>
 
-static int
-xios_was_output_write_internal(xiostub *stub, was_gcc_unused xioexec *exec,
-                               struct was_simple *w, int fd,
-                               const void *buff, size_t size)
+/**
+ * Translate the failure of was_simple_write() or
+ * was_simple_writev() to a #xresult.  The caller must clear errno
+ * before the call.
+ */
+static xresult
+xios_was_output_failure(struct was_simple *w)
 {
-    ssize_t nbytes = write(fd, buff, size);
-
-    if (nbytes < 0 && errno == EAGAIN) {
-        /* writing blocks: poll for the pipe to become writable again
-           (or for control commands and handle them) */
-        switch (was_simple_output_poll(w, -1)) {
-        case WAS_SIMPLE_POLL_SUCCESS:
-            /* time to try again */
-            nbytes = write(fd, buff, size);
-            break;
-
-        case WAS_SIMPLE_POLL_ERROR:
-            xios_iostub_seterror(stub, sysx_result_geterrno());
-            return -2;
-
-        case WAS_SIMPLE_POLL_TIMEOUT:
-            xios_iostub_seterror(stub, SYSX_R_ILLEGALSTATE);
-            return -2;
-
-        case WAS_SIMPLE_POLL_CLOSED:
-            xios_iostub_seterror(stub, SYSX_R_FAILURE);
-            return -2;
-
-        case WAS_SIMPLE_POLL_END:
-            xios_iostub_seterror(stub, SYSX_R_NOSPACE);
-            return -2;
-        }
-    }
-
-    if (nbytes < 0) {
-        xios_iostub_seterror(stub, sysx_result_geterrno());
-        return -2;
-    }
+    if (errno == EAGAIN)
+        /* non-blocking mode: the pipe did not become writable in
+           time */
+        return SYSX_R_ILLEGALSTATE;
 
-    if (nbytes == 0) {
-        xios_iostub_seterror(stub, SYSX_R_NOSPACE);
-        return -2;
-    }
+    if (errno != 0)
+        return sysx_result_geterrno();
 
-    if (!was_simple_sent(w, nbytes)) {
-        xios_iostub_seterror(stub, SYSX_R_FAILURE);
-        return -2;
-    }
+    if (was_simple_output_poll(w, 0) == WAS_SIMPLE_POLL_END)
+        /* the announced response body is complete */
+        return SYSX_R_NOSPACE;
 
-    return nbytes;
+    return SYSX_R_FAILURE;
 }
 
 static int
-xios_was_output_write(xiostub *stub, xioexec *exec, void *ctxt,
+xios_was_output_write(xiostub *stub, was_gcc_unused xioexec *exec, void *ctxt,
                       int byte)
 {
     struct was_simple *w = ctxt;
-    int fd = was_simple_output_fd(w);
-    if (fd < 0) {
-        xios_iostub_seterror(stub, SYSX_R_ILLEGALSTATE);
-        return -2;
-    }
 
+    /* let libcm4all-was-simple handle back-pressure; with an output
+       buffer (see was_simple_set_output_buffer()), single bytes are
+       collected instead of being written one by one */
     const uint8_t value = byte;
-    ssize_t nbytes = xios_was_output_write_internal(stub, exec, w, fd,
-                                                    &value, sizeof(value));
-    if (nbytes < 0)
-        return nbytes;
-
-    assert(nbytes == sizeof(value));
+    errno = 0;
+    if (!was_simple_write(w, &value, sizeof(value))) {
+        xios_iostub_seterror(stub, xios_was_output_failure(w));
+        return -2;
+    }
 
     return byte;
 }
 
 static int
-xios_was_output_writen(xiostub *stub, xioexec *exec, void *ctxt,
+xios_was_output_writen(xiostub *stub, was_gcc_unused xioexec *exec, void *ctxt,
                        const char *buff, xoffs size)
 {
     struct was_simple *w = ctxt;
-    int fd = was_simple_output_fd(w);
-    if (fd < 0) {
-        xios_iostub_seterror(stub, SYSX_R_ILLEGALSTATE);
-        return -2;
-    }
 
-    while (size > 0) {
-        ssize_t nbytes = xios_was_output_write_internal(stub, exec, w, fd,
-                                                        buff, size);
-        if (nbytes < 0)
-            return nbytes;
+    /* let libcm4all-was-simple handle partial writes and
+       back-pressure */
+    const struct iovec v = {
+        .iov_base = (void *)(uintptr_t)buff, /* cast away "const" */
+        .iov_len = (size_t)size,
+    };
 
-        assert(nbytes > 0);
-
-        buff += nbytes;
-        size -= nbytes;
+    errno = 0;
+    if (!was_simple_writev(w, &v, 1)) {
+        xios_iostub_seterror(stub, xios_was_output_failure(w));
+        return -2;
     }
 
     return 0;
@@ -124,6 +88,30 @@ static const xiodriver xios_was_output_driver = {
     },
 };
 
+xoffs
+xios_was_output_splice(struct was_simple *was, int fd, xoffs size)
+{
+    assert(was != NULL);
+    assert(fd >= 0);
+    assert(size >= 0);
+
+    xoffs done = 0;
+    while (done < size) {
+        ssize_t nbytes = was_simple_splice_from(was, fd,
+                                                (size_t)(size - done));
+        if (nbytes < 0)
+            return -1;
+
+        if (nbytes == 0)
+            /* end of the source or of the response body */
+            break;
+
+        done += nbytes;
+    }
+
+    return done;
+}
+
 xresult
 xios_was_output_create(xmemctx *mctx, struct was_simple *was,
                        xiostub **stub_r)
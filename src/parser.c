@@ -39,9 +39,11 @@
 #include <apr_strings.h>
 #include <apr_lib.h>
 #include <apr_env.h>
+#include <apr_portable.h>
 #include <apreq_util.h>
 
 #include <assert.h>
+#include <errno.h>
 #include <stdlib.h>
 
 #define USER_DATA_KEY "apreq"
@@ -154,6 +156,58 @@ cgi_query_string(apreq_handle_t *handle)
     return was_simple_get_query_string(req->was);
 }
 
+/**
+ * Splice a large request body which is not multipart into a
+ * temporary file, without copying it to userspace.  The parser then
+ * reads it through a file bucket (i.e. mmap()).  Multipart bodies are
+ * not spooled: the multipart parser needs to scan all of the data,
+ * and spools only the file parts by itself.
+ *
+ * @return a file bucket, or NULL if the body is not suitable (the
+ * caller shall read it from the pipe) or on error (body_status is
+ * set)
+ */
+static apr_bucket *
+spool_body(struct was_handle *req)
+{
+    apreq_handle_t *handle = &req->handle;
+    const apreq_parser_t *parser = req->parser;
+
+    if (parser->parser == apreq_parse_multipart)
+        return NULL;
+
+    const int64_t remaining = was_simple_input_remaining(req->was);
+    if (remaining < 0 ||
+        (apr_uint64_t)remaining <= parser->brigade_limit ||
+        (apr_uint64_t)remaining > req->read_limit)
+        return NULL;
+
+    apr_file_t *file;
+    apr_status_t s = apreq_file_mktemp(&file, handle->pool, parser->temp_dir);
+    if (s != APR_SUCCESS) {
+        req->body_status = s;
+        cgi_log_error(CGILOG_MARK, CGILOG_ERR, req->body_status, handle,
+                      "Failed to create a temporary file");
+        return NULL;
+    }
+
+    apr_os_file_t fd;
+    apr_os_file_get(&fd, file);
+
+    errno = 0;
+    if (!was_simple_splice_to(req->was, fd)) {
+        req->body_status = errno != 0
+            ? APR_FROM_OS_ERROR(errno)
+            : APR_EGENERAL;
+        cgi_log_error(CGILOG_MARK, CGILOG_ERR, req->body_status, handle,
+                      "Failed to spool the request body");
+        return NULL;
+    }
+
+    return apr_bucket_file_create(file, 0, (apr_size_t)remaining,
+                                  handle->pool, handle->bucket_alloc);
+}
+
 static void init_body(apreq_handle_t *handle)
 {
     struct was_handle *req = (struct was_handle *)handle;
@@ -223,7 +277,15 @@ static void init_body(apreq_handle_t *handle)
     req->in         = apr_brigade_create(pool, ba);
     req->tmpbb      = apr_brigade_create(pool, ba);
 
-    pipe = apr_bucket_was_create(req->was, ba);
+    pipe = spool_body(req);
+    if (pipe == NULL) {
+        if (req->body_status != APR_EINIT)
+            /* spooling has failed */
+            return;
+
+        pipe = apr_bucket_was_create(req->was, ba);
+    }
+
     eos = apr_bucket_eos_create(ba);
 
     APR_BRIGADE_INSERT_HEAD(req->in, pipe);
@@ -0,0 +1,75 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <mk@cm4all.com>
+
+#include "pipe.hxx"
+
+#include <algorithm>
+#include <mutex>
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+std::size_t
+ReadPipeMaxSize() noexcept
+{
+    /* the kernel default for fs.pipe-max-size */
+    constexpr std::size_t default_max_size = 1024 * 1024;
+
+    int fd = open("/proc/sys/fs/pipe-max-size", O_RDONLY|O_CLOEXEC);
+    if (fd < 0)
+        return default_max_size;
+
+    char buffer[32];
+    ssize_t nbytes = read(fd, buffer, sizeof(buffer) - 1);
+    close(fd);
+    if (nbytes <= 0)
+        return default_max_size;
+
+    buffer[nbytes] = 0;
+
+    char *endptr;
+    unsigned long value = strtoul(buffer, &endptr, 10);
+    if (endptr == buffer || value == 0)
+        return default_max_size;
+
+    return value;
+}
+
+/* not a function-local static: the project is built with
+   -fno-threadsafe-statics, and this is called from worker threads */
+static std::once_flag pipe_max_size_once;
+static std::size_t pipe_max_size;
+
+std::size_t
+GetPipeMaxSize() noexcept
+{
+    std::call_once(pipe_max_size_once, []{
+        pipe_max_size = ReadPipeMaxSize();
+    });
+
+    return pipe_max_size;
+}
+
+std::size_t
+SetPipeSize(int fd, std::size_t size, std::size_t max_size) noexcept
+{
+    size = std::min(size, max_size);
+
+    int result = fcntl(fd, F_SETPIPE_SZ, (int)size);
+    if (result < 0)
+        return 0;
+
+    return result;
+}
+
+std::size_t
+GetPipeSize(int fd) noexcept
+{
+    int result = fcntl(fd, F_GETPIPE_SZ);
+    if (result < 0)
+        return 0;
+
+    return result;
+}
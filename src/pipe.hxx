@@ -0,0 +1,43 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <mk@cm4all.com>
+
+#pragma once
+
+#include <cstddef>
+
+/**
+ * Determine the maximum pipe capacity an unprivileged process may
+ * configure (from /proc/sys/fs/pipe-max-size).
+ *
+ * @return the limit in bytes (the kernel default if the file cannot
+ * be read)
+ */
+std::size_t
+ReadPipeMaxSize() noexcept;
+
+/**
+ * Like ReadPipeMaxSize(), but the file is read only once per
+ * process.
+ */
+std::size_t
+GetPipeMaxSize() noexcept;
+
+/**
+ * Change the capacity of a pipe with F_SETPIPE_SZ.
+ *
+ * @param size the desired capacity; the kernel rounds it up to a
+ * power of two number of pages
+ * @param max_size the upper limit (see ReadPipeMaxSize())
+ * @return the new capacity or 0 on error
+ */
+std::size_t
+SetPipeSize(int fd, std::size_t size, std::size_t max_size) noexcept;
+
+/**
+ * Obtain the capacity of a pipe with F_GETPIPE_SZ.
+ *
+ * @return the capacity or 0 on error
+ */
+std::size_t
+GetPipeSize(int fd) noexcept;
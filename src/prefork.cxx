@@ -0,0 +1,508 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <mk@cm4all.com>
+
+#include "multi.hxx"
+
+#include <was/multi.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <new>
+
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/**
+ * A child which lived shorter than this is considered to have
+ * crashed on startup; respawning it is delayed exponentially.
+ */
+static constexpr int64_t MIN_UPTIME_NS = 1000000000;
+
+static constexpr int64_t INITIAL_BACKOFF_NS = 100000000;
+static constexpr int64_t MAX_BACKOFF_NS = 10000000000;
+
+static int64_t
+Now() noexcept
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return int64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+static void
+Sleep(int64_t ns) noexcept
+{
+    struct timespec ts;
+    ts.tv_sec = time_t(ns / 1000000000);
+    ts.tv_nsec = long(ns % 1000000000);
+    nanosleep(&ts, nullptr);
+}
+
+/**
+ * Parse a Linux CPU list ("0-3,8-11") and add all CPUs to the set.
+ */
+static bool
+ParseCpuList(const char *p, cpu_set_t &set) noexcept
+{
+    while (*p != 0 && *p != '\n') {
+        char *endptr;
+        const unsigned long first = strtoul(p, &endptr, 10);
+        if (endptr == p)
+            return false;
+
+        unsigned long last = first;
+        p = endptr;
+        if (*p == '-') {
+            ++p;
+            last = strtoul(p, &endptr, 10);
+            if (endptr == p || last < first)
+                return false;
+            p = endptr;
+        }
+
+        for (unsigned long i = first; i <= last && i < CPU_SETSIZE; ++i)
+            CPU_SET(i, &set);
+
+        if (*p == ',')
+            ++p;
+    }
+
+    return true;
+}
+
+static bool
+ReadCpuList(const char *path, cpu_set_t &set) noexcept
+{
+    int fd = open(path, O_RDONLY|O_CLOEXEC);
+    if (fd < 0)
+        return false;
+
+    char buffer[4096];
+    ssize_t nbytes = read(fd, buffer, sizeof(buffer) - 1);
+    close(fd);
+    if (nbytes <= 0)
+        return false;
+
+    buffer[nbytes] = 0;
+    return ParseCpuList(buffer, set);
+}
+
+/**
+ * Determine the CPUs of the (i % n)-th online NUMA node, restricted
+ * to the CPUs this process may run on.
+ */
+static bool
+GetNodeCpus(unsigned i, const cpu_set_t &allowed, cpu_set_t &set) noexcept
+{
+    cpu_set_t nodes;
+    CPU_ZERO(&nodes);
+    if (!ReadCpuList("/sys/devices/system/node/online", nodes))
+        return false;
+
+    const unsigned n_nodes = CPU_COUNT(&nodes);
+    if (n_nodes == 0)
+        return false;
+
+    i %= n_nodes;
+
+    for (unsigned node = 0; node < CPU_SETSIZE; ++node) {
+        if (!CPU_ISSET(node, &nodes) || i-- > 0)
+            continue;
+
+        char path[64];
+        snprintf(path, sizeof(path),
+                 "/sys/devices/system/node/node%u/cpulist", node);
+
+        cpu_set_t node_cpus;
+        CPU_ZERO(&node_cpus);
+        if (!ReadCpuList(path, node_cpus))
+            return false;
+
+        CPU_AND(&set, &node_cpus, &allowed);
+        return CPU_COUNT(&set) > 0;
+    }
+
+    return false;
+}
+
+/**
+ * Pin the calling process according to the
+ * #WAS_MULTI_PREFORK_PIN_CPU / #WAS_MULTI_PREFORK_PIN_NODE flags.
+ * Errors are ignored; pinning is only an optimization.
+ */
+static void
+PinChild(unsigned i, unsigned flags) noexcept
+{
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+        return;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+
+    if (flags & WAS_MULTI_PREFORK_PIN_CPU) {
+        const unsigned n_cpus = CPU_COUNT(&allowed);
+        if (n_cpus == 0)
+            return;
+
+        unsigned nth = i % n_cpus;
+        for (unsigned cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (CPU_ISSET(cpu, &allowed) && nth-- == 0) {
+                CPU_SET(cpu, &set);
+                break;
+            }
+        }
+    } else if (!GetNodeCpus(i, allowed, set))
+        return;
+
+    sched_setaffinity(0, sizeof(set), &set);
+}
+
+namespace {
+
+struct PreforkChild {
+    pid_t pid = -1;
+
+    /**
+     * The number of consecutive early crashes.
+     */
+    unsigned failures = 0;
+
+    int64_t start_time;
+
+    /**
+     * If pid==-1: when shall this child be respawned?
+     */
+    int64_t respawn_time = 0;
+};
+
+/**
+ * The children of the running supervisor, for OnTerminate().
+ */
+static PreforkChild *volatile prefork_children;
+static volatile unsigned prefork_n;
+
+/**
+ * Set by OnTerminate().
+ */
+static volatile sig_atomic_t prefork_terminated;
+
+/**
+ * The SIGTERM handler of the supervisor: forward the signal to all
+ * children.
+ */
+static void
+OnTerminate(int) noexcept
+{
+    prefork_terminated = 1;
+
+    PreforkChild *const children = prefork_children;
+    const unsigned n = prefork_n;
+    for (unsigned i = 0; i < n; ++i)
+        if (children[i].pid > 0)
+            kill(children[i].pid, SIGTERM);
+}
+
+class PreforkSupervisor {
+    PreforkChild *const children;
+    const unsigned n;
+    const unsigned flags;
+
+    unsigned n_running = 0;
+
+    /**
+     * Set after a child has exited successfully, i.e. the Multi-WAS
+     * socket has been closed, or after SIGTERM; no more children are
+     * spawned.
+     */
+    bool shutting_down = false;
+
+    /**
+     * The SIGTERM handler which was installed before
+     * InstallSignalHandler().
+     */
+    struct sigaction old_sigterm;
+
+public:
+    PreforkSupervisor(PreforkChild *_children, unsigned _n,
+                      unsigned _flags) noexcept
+        :children(_children), n(_n), flags(_flags) {}
+
+    void InstallSignalHandler() noexcept;
+    void RestoreSignalHandler() noexcept;
+
+    /**
+     * @return the child index (in the child process), -1 when the
+     * supervisor is finished or -2 on error
+     */
+    int Run() noexcept;
+
+private:
+    /**
+     * @return the child index (in the child process), -1 in the
+     * parent or -2 on error
+     */
+    int Spawn(unsigned i) noexcept;
+
+    void OnExit(pid_t pid, int status) noexcept;
+
+    /**
+     * @return the earliest pending respawn time or -1 if there is
+     * none
+     */
+    int64_t NextRespawn() const noexcept;
+};
+
+void
+PreforkSupervisor::InstallSignalHandler() noexcept
+{
+    prefork_children = children;
+    prefork_n = n;
+    prefork_terminated = 0;
+
+    struct sigaction sa{};
+    sa.sa_handler = OnTerminate;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGTERM, &sa, &old_sigterm);
+}
+
+void
+PreforkSupervisor::RestoreSignalHandler() noexcept
+{
+    sigaction(SIGTERM, &old_sigterm, nullptr);
+    prefork_n = 0;
+    prefork_children = nullptr;
+}
+
+int
+PreforkSupervisor::Spawn(unsigned i) noexcept
+{
+    /* block SIGTERM until the new pid has been recorded, or
+       OnTerminate() could miss this child */
+    sigset_t mask, old_mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGTERM);
+    sigprocmask(SIG_BLOCK, &mask, &old_mask);
+
+    const pid_t pid = fork();
+    if (pid < 0) {
+        sigprocmask(SIG_SETMASK, &old_mask, nullptr);
+        return -2;
+    }
+
+    if (pid == 0) {
+        RestoreSignalHandler();
+        sigprocmask(SIG_SETMASK, &old_mask, nullptr);
+
+        if (flags & (WAS_MULTI_PREFORK_PIN_CPU|WAS_MULTI_PREFORK_PIN_NODE))
+            PinChild(i, flags);
+        return int(i);
+    }
+
+    auto &child = children[i];
+    child.pid = pid;
+    child.start_time = Now();
+    ++n_running;
+
+    sigprocmask(SIG_SETMASK, &old_mask, nullptr);
+    return -1;
+}
+
+void
+PreforkSupervisor::OnExit(pid_t pid, int status) noexcept
+{
+    for (unsigned i = 0; i < n; ++i) {
+        auto &child = children[i];
+        if (child.pid != pid)
+            continue;
+
+        child.pid = -1;
+        --n_running;
+
+        if (WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS) {
+            /* was_multi_accept_simple() has returned NULL: the
+               Multi-WAS socket is gone */
+            shutting_down = true;
+            return;
+        }
+
+        /* crashed: respawn, but back off if it keeps crashing
+           right after startup */
+        const int64_t now = Now();
+        if (now - child.start_time < MIN_UPTIME_NS) {
+            int64_t backoff = INITIAL_BACKOFF_NS;
+            for (unsigned j = 0; j < child.failures && backoff < MAX_BACKOFF_NS; ++j)
+                backoff *= 2;
+            if (backoff > MAX_BACKOFF_NS)
+                backoff = MAX_BACKOFF_NS;
+
+            ++child.failures;
+            child.respawn_time = now + backoff;
+        } else {
+            child.failures = 0;
+            child.respawn_time = now;
+        }
+
+        return;
+    }
+}
+
+int64_t
+PreforkSupervisor::NextRespawn() const noexcept
+{
+    int64_t result = -1;
+    for (unsigned i = 0; i < n; ++i) {
+        const auto &child = children[i];
+        if (child.pid < 0 && (result < 0 || child.respawn_time < result))
+            result = child.respawn_time;
+    }
+
+    return result;
+}
+
+int
+PreforkSupervisor::Run() noexcept
+{
+    while (true) {
+        if (prefork_terminated)
+            shutting_down = true;
+
+        if (!shutting_down) {
+            const int64_t now = Now();
+            for (unsigned i = 0; i < n; ++i) {
+                if (children[i].pid >= 0 || children[i].respawn_time > now)
+                    continue;
+
+                const int result = Spawn(i);
+                if (result >= 0)
+                    return result;
+
+                if (result == -2) {
+                    /* try again later */
+                    children[i].respawn_time = now + INITIAL_BACKOFF_NS;
+                }
+            }
+        }
+
+        if (n_running == 0 && (shutting_down || NextRespawn() < 0))
+            return -1;
+
+        const int64_t next = shutting_down ? -1 : NextRespawn();
+
+        int status;
+        pid_t pid;
+        if (next < 0) {
+            pid = waitpid(-1, &status, 0);
+            if (pid < 0) {
+                if (errno == EINTR)
+                    continue;
+                return -2;
+            }
+        } else {
+            pid = waitpid(-1, &status, WNOHANG);
+            if (pid < 0 && errno != EINTR && errno != ECHILD)
+                return -2;
+
+            if (pid <= 0) {
+                const int64_t delay = next - Now();
+                if (delay > 0)
+                    /* poll for child exits at least every 100 ms
+                       while waiting for the respawn */
+                    Sleep(delay < INITIAL_BACKOFF_NS ? delay : INITIAL_BACKOFF_NS);
+                continue;
+            }
+        }
+
+        OnExit(pid, status);
+    }
+}
+
+} // anonymous namespace
+
+static pthread_mutex_t *
+CreateAcceptLock() noexcept
+{
+    void *p = mmap(nullptr, sizeof(pthread_mutex_t), PROT_READ|PROT_WRITE,
+                   MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return nullptr;
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+
+    auto *mutex = static_cast<pthread_mutex_t *>(p);
+    const int error = pthread_mutex_init(mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    if (error != 0) {
+        munmap(p, sizeof(pthread_mutex_t));
+        errno = error;
+        return nullptr;
+    }
+
+    return mutex;
+}
+
+int
+was_multi_prefork(struct was_multi *m, unsigned n, unsigned flags)
+{
+    if (n == 0 || m->accept_lock != nullptr) {
+        errno = EINVAL;
+        return -2;
+    }
+
+    auto *children = new(std::nothrow) PreforkChild[n];
+    if (children == nullptr) {
+        errno = ENOMEM;
+        return -2;
+    }
+
+    m->accept_lock = CreateAcceptLock();
+    if (m->accept_lock == nullptr) {
+        delete[] children;
+        return -2;
+    }
+
+    PreforkSupervisor supervisor(children, n, flags);
+    supervisor.InstallSignalHandler();
+    const int result = supervisor.Run();
+
+    if (result >= 0) {
+        /* child process */
+        delete[] children;
+        return result;
+    }
+
+    const int saved_errno = errno;
+
+    supervisor.RestoreSignalHandler();
+
+    if (result == -2) {
+        /* don't leave orphans behind */
+        for (unsigned i = 0; i < n; ++i)
+            if (children[i].pid >= 0)
+                kill(children[i].pid, SIGTERM);
+        for (unsigned i = 0; i < n; ++i)
+            if (children[i].pid >= 0)
+                waitpid(children[i].pid, nullptr, 0);
+    }
+
+    delete[] children;
+
+    munmap(m->accept_lock, sizeof(*m->accept_lock));
+    m->accept_lock = nullptr;
+
+    errno = saved_errno;
+    return result;
+}
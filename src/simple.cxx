@@ -10,16 +10,33 @@
 #include <was/simple.h>
 #include <was/protocol.h>
 
+#include "simple.hxx"
+#include "arena.hxx"
+#include "cache.hxx"
+#include "compress.hxx"
+#include "flat_map.hxx"
+#include "header_block.hxx"
+#include "header_token.hxx"
 #include "iterator.hxx"
+#include "pipe.hxx"
+#include "slab.hxx"
+#include "stats.hxx"
+#include "trace.hxx"
+#ifdef HAVE_IO_URING
+#include "control_ring.hxx"
+#endif
 #include "util/Unaligned.hxx"
 
 #include <http/header.h>
 
+#include <algorithm>
 #include <cassert>
 #include <cerrno>
+#include <chrono>
 #include <climits>
 #include <cstring>
-#include <map>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <string_view>
 
@@ -28,7 +45,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <fcntl.h>
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof(x[0]))
@@ -57,29 +76,78 @@ struct was_simple {
      * The control channel.
      */
     struct Control {
-        union {
-            char raw[8192];
-            struct was_header header;
-        } input_buffer;
+        static constexpr size_t INPUT_BUFFER_SIZE = 8192;
+        static constexpr size_t OUTPUT_BUFFER_SIZE = 4096;
+
+        /**
+         * The #input_buffer and #output_buffer share one allocation
+         * from this slab.  They are allocated when the connection
+         * becomes active, and returned while the connection is idle
+         * (see ReleaseIdleBuffers()).
+         */
+        static Slab slab;
+
+        struct {
+            /**
+             * nullptr if the buffers are not allocated.
+             */
+            char *raw = nullptr;
 
-        size_t input_position = 0;
+            /**
+             * The start of the current packet.  Consumed packets
+             * are not removed by moving the rest of the buffer;
+             * this offset is incremented instead.
+             */
+            size_t start = 0;
+
+            /**
+             * The end of the received data.
+             */
+            size_t end = 0;
+        } input_buffer;
 
         /**
          * The number of bytes to ignore from the input pipe.  This is
          * used to recover from packets that are too large.  If this
-         * is non-zero, then #input_position must be zero, and the
-         * #input_buffer will be used to discard data.
+         * is non-zero, then the #input_buffer must be empty, and it
+         * will be used to discard data.
          */
         size_t discard_input = 0;
 
         struct {
+            /**
+             * The start of the data that has not yet been sent.  A
+             * partial send increments this offset.
+             */
+            unsigned start = 0;
+
+            /**
+             * The end of the data.
+             */
             unsigned position = 0;
-            char data[4096];
+
+            /**
+             * Points into the same allocation as
+             * input_buffer.raw.
+             */
+            char *data = nullptr;
         } output_buffer;
 
         struct was_control_packet packet;
 
-        const int fd;
+        /**
+         * The socket; -1 while the #was_simple object is in the
+         * pool (see was_simple::Release()).
+         */
+        int fd;
+
+#ifdef HAVE_IO_URING
+        /**
+         * The io_uring backend; nullptr if it is disabled (the
+         * default).  See was_simple_enable_io_uring().
+         */
+        ControlRing *ring = nullptr;
+#endif
 
         explicit Control(int _fd) noexcept
             :fd(_fd)
@@ -88,21 +156,202 @@ struct was_simple {
         }
 
         ~Control() noexcept {
+            ReleaseBuffers();
+            DisableRing();
+
+            if (fd >= 0)
+                close(fd);
+        }
+
+        void Close() noexcept {
+            ReleaseBuffers();
+            DisableRing();
+
             close(fd);
+            fd = -1;
+        }
+
+        bool HasRing() const noexcept {
+#ifdef HAVE_IO_URING
+            return ring != nullptr;
+#else
+            return false;
+#endif
+        }
+
+        /**
+         * @return false on error (with errno set; ENOSYS if io_uring
+         * support is not available)
+         */
+        bool EnableRing() noexcept;
+
+        void DisableRing() noexcept {
+#ifdef HAVE_IO_URING
+            delete ring;
+            ring = nullptr;
+#endif
+        }
+
+        /**
+         * The file descriptor to be polled for incoming control
+         * packets.
+         */
+        int GetPollFd() const noexcept {
+#ifdef HAVE_IO_URING
+            if (ring != nullptr)
+                return ring->GetPollFd();
+#endif
+            return fd;
+        }
+
+        /**
+         * Has control data been received already (by io_uring)
+         * which polling the #GetPollFd() would not report?
+         */
+        bool HasQueuedInput() const noexcept {
+#ifdef HAVE_IO_URING
+            return ring != nullptr && ring->HasQueuedInput();
+#else
+            return false;
+#endif
+        }
+
+        /**
+         * Remove the given number of bytes which have been sent
+         * from the #output_buffer.
+         */
+        void ConsumeOutput(size_t nbytes) noexcept {
+            assert(nbytes <= GetOutputSize());
+
+            output_buffer.start += nbytes;
+            if (output_buffer.start == output_buffer.position)
+                output_buffer.start = output_buffer.position = 0;
+        }
+
+        bool HasBuffers() const noexcept {
+            return input_buffer.raw != nullptr;
+        }
+
+        /**
+         * Make sure the buffers are allocated.
+         *
+         * @return false if out of memory (errno=ENOMEM)
+         */
+        bool AllocateBuffers() noexcept {
+            if (HasBuffers())
+                return true;
+
+            auto *p = static_cast<char *>(slab.Allocate());
+            if (p == nullptr) {
+                errno = ENOMEM;
+                return false;
+            }
+
+            input_buffer.raw = p;
+            output_buffer.data = p + INPUT_BUFFER_SIZE;
+            return true;
+        }
+
+        void ReleaseBuffers() noexcept {
+            if (!HasBuffers())
+                return;
+
+            slab.Free(input_buffer.raw);
+            input_buffer.raw = output_buffer.data = nullptr;
+        }
+
+        /**
+         * Return the buffers to the #slab if they do not contain any
+         * data.
+         */
+        void ReleaseIdleBuffers() noexcept {
+            if (GetInputSize() == 0 && discard_input == 0 &&
+                packet.payload == nullptr && GetOutputSize() == 0)
+                ReleaseBuffers();
+        }
+
+        /**
+         * Reinitialize a closed object with a new socket.
+         */
+        void Reopen(int _fd) noexcept {
+            assert(fd < 0);
+
+            fd = _fd;
+            input_buffer.start = input_buffer.end = 0;
+            discard_input = 0;
+            output_buffer.start = output_buffer.position = 0;
+            packet.payload = nullptr;
         }
 
         ssize_t DirectSend(const void *p, size_t length) {
+            CountStat(Stat::CONTROL_SENDS);
             return send(fd, p, length, MSG_NOSIGNAL);
         }
 
-        bool IsInputBufferFull() const {
-            return input_position >= sizeof(input_buffer);
+        ssize_t DirectReceive(void *p, size_t size, bool dontwait) noexcept {
+#ifdef HAVE_IO_URING
+            if (ring != nullptr)
+                return ring->Receive(p, size, dontwait);
+#endif
+
+            CountStat(Stat::CONTROL_RECEIVES);
+            return recv(fd, p, size, dontwait * MSG_DONTWAIT);
+        }
+
+        size_t GetInputSize() const noexcept {
+            return input_buffer.end - input_buffer.start;
+        }
+
+        bool IsHeaderComplete() const noexcept {
+            return GetInputSize() >= sizeof(struct was_header);
+        }
+
+        /**
+         * Load the header of the current packet.  The caller must
+         * check IsHeaderComplete() first.
+         */
+        struct was_header GetHeader() const noexcept {
+            assert(IsHeaderComplete());
+
+            return LoadUnaligned<struct was_header>(input_buffer.raw +
+                                                    input_buffer.start);
+        }
+
+        /**
+         * The number of bytes of the current packet (header and
+         * payload) that need to be in the #input_buffer, as far as
+         * known.
+         */
+        size_t GetPacketSize() const noexcept {
+            return IsHeaderComplete()
+                ? sizeof(struct was_header) + GetHeader().length
+                : sizeof(struct was_header);
         }
 
         bool IsPacketComplete() const {
-            return input_position >= sizeof(input_buffer.header) &&
-                input_position >= sizeof(input_buffer.header) +
-                input_buffer.header.length;
+            return GetInputSize() >= GetPacketSize();
+        }
+
+        /**
+         * Is the current packet too large for the #input_buffer?
+         */
+        bool IsPacketTooLarge() const noexcept {
+            return GetPacketSize() > INPUT_BUFFER_SIZE;
+        }
+
+        /**
+         * Move the current (incomplete) packet to the beginning of
+         * the #input_buffer, but only if the rest of it wouldn't fit
+         * after it.
+         */
+        void CompactInput() noexcept;
+
+        size_t GetOutputSize() const noexcept {
+            return output_buffer.position - output_buffer.start;
+        }
+
+        size_t GetOutputFree() const noexcept {
+            return OUTPUT_BUFFER_SIZE - GetOutputSize();
         }
 
         /**
@@ -129,7 +378,8 @@ struct was_simple {
          * with errno=E2BIG.
          */
         enum was_command PeekCommand() const noexcept {
-            return (enum was_command)input_buffer.header.command;
+            return (enum was_command)LoadUnaligned<struct was_header>(input_buffer.raw +
+                                                                      input_buffer.start).command;
         }
 
         /**
@@ -170,13 +420,28 @@ struct was_simple {
         void Append(const void *p, size_t length);
 
         /**
-         * Append data to the #output_buffer if there is enough room,
-         * possibly flushing it and possibly sending the data directly
-         * to the socket.
+         * Append data to the #output_buffer if there is enough room.
+         * If not, then the #output_buffer and the new data are sent
+         * to the socket with a single sendmsg() call, without copying
+         * the new data to the #output_buffer first.
+         *
+         * @param n the number of elements in the #iovec array; must
+         * not be larger than #MAX_SEND_VECTOR
+         * @return true on success, false on I/O error
+         */
+        bool SendV(const struct iovec *v, size_t n);
+
+        static constexpr size_t MAX_SEND_VECTOR = 4;
+
+        /**
+         * Like SendV(), but with only one buffer.
          *
          * @return true on success, false on I/O error
          */
-        bool Send(const void *data, size_t length);
+        bool Send(const void *data, size_t length) {
+            const struct iovec v{const_cast<void *>(data), length};
+            return SendV(&v, 1);
+        }
 
         /**
          * Assemble a WAS control header and send it.
@@ -185,6 +450,17 @@ struct was_simple {
          */
         bool SendHeader(enum was_command command, size_t length);
 
+        /**
+         * Send a WAS control packet whose payload consists of the
+         * given buffers.
+         *
+         * @param n the number of payload buffers; must be smaller
+         * than #MAX_SEND_VECTOR
+         * @return true on success, false on I/O error
+         */
+        bool SendPacketV(enum was_command command,
+                         const struct iovec *payload, size_t n);
+
         /**
          * Send a WAS control packet without a payload.
          *
@@ -201,7 +477,8 @@ struct was_simple {
          */
         bool SendPacket(enum was_command command,
                         const void *payload, size_t length) {
-            return SendHeader(command, length) && Send(payload, length);
+            const struct iovec v{const_cast<void *>(payload), length};
+            return SendPacketV(command, &v, 1);
         }
 
         /**
@@ -229,7 +506,7 @@ struct was_simple {
          */
         uint64_t announced;
 
-        const int fd;
+        int fd;
 
         /**
          * Is #announced valid?
@@ -258,15 +535,100 @@ struct was_simple {
          */
         bool no_body;
 
+        /**
+         * The capacity of the pipe (0 if unknown).
+         */
+        size_t pipe_size;
+
+        /**
+         * An optional read-ahead buffer.  It is disabled (nullptr)
+         * by default and configured with
+         * was_simple_set_input_buffer() (or implicitly by
+         * was_simple_input_peek() and was_simple_read_line()).  Data
+         * in this buffer has already been accounted in #received.
+         */
+        struct {
+            char *data = nullptr;
+
+            size_t capacity = 0, start = 0, end = 0;
+        } buffer;
+
+        /**
+         * The #buffer capacity if it is enabled implicitly.
+         */
+        static constexpr size_t DEFAULT_BUFFER_SIZE = 16384;
+
+        /**
+         * The request body obtained by was_simple_input_map().  It
+         * is freed when the request is finished.
+         */
+        struct {
+            void *data = nullptr;
+
+            size_t size = 0;
+
+            /**
+             * Was #data obtained with mmap() (or else with
+             * malloc())?
+             */
+            bool mapped = false;
+        } map;
+
+        /**
+         * Bodies larger than this are spliced into a memfd and then
+         * mapped by was_simple_input_map() instead of being read into
+         * a heap buffer.
+         */
+        static constexpr size_t MAP_THRESHOLD = 64 * 1024;
+
         explicit Input(int _fd) noexcept
-            :fd(_fd)
+            :fd(_fd), pipe_size(GetPipeSize(fd))
         {
             fd_set_nonblock(fd);
         }
 
         ~Input() noexcept {
+            FreeMap();
+            free(buffer.data);
+
+            if (fd >= 0 && fd != STDIN_FILENO)
+                close(fd);
+        }
+
+        /**
+         * Close the pipe and disable the #buffer.
+         */
+        void Close() noexcept {
+            FreeMap();
+
             if (fd != STDIN_FILENO)
                 close(fd);
+            fd = -1;
+
+            free(buffer.data);
+            buffer.data = nullptr;
+            buffer.capacity = buffer.start = buffer.end = 0;
+        }
+
+        void Reopen(int _fd) noexcept {
+            assert(fd < 0);
+
+            fd = _fd;
+            pipe_size = GetPipeSize(fd);
+            fd_set_nonblock(fd);
+        }
+
+        void FreeMap() noexcept {
+            if (map.data == nullptr)
+                return;
+
+            if (map.mapped)
+                munmap(map.data, map.size);
+            else
+                free(map.data);
+
+            map.data = nullptr;
+            map.size = 0;
         }
 
         bool HasBody() const {
@@ -277,11 +639,35 @@ struct was_simple {
             return known_length && received >= announced;
         }
 
+        /**
+         * The number of bytes in the read-ahead #buffer.
+         */
+        size_t GetBuffered() const noexcept {
+            return buffer.end - buffer.start;
+        }
+
+        void Consume(size_t nbytes) noexcept {
+            assert(nbytes <= GetBuffered());
+
+            buffer.start += nbytes;
+            if (buffer.start == buffer.end)
+                buffer.start = buffer.end = 0;
+        }
+
+        void DiscardBuffered() noexcept {
+            buffer.start = buffer.end = 0;
+        }
+
+        /**
+         * The number of bytes which have not been consumed by the
+         * application yet (including the read-ahead #buffer), or -1
+         * if unknown.
+         */
         int64_t GetRemaining() const {
             assert(!stopped || ignore_premature);
 
             return known_length
-                ? int64_t(announced - received)
+                ? int64_t(announced - received + GetBuffered())
                 : -1;
         }
 
@@ -316,7 +702,7 @@ struct was_simple {
          */
         uint64_t announced;
 
-        const int fd;
+        int fd;
 
         /**
          * Is #announced valid?
@@ -329,15 +715,95 @@ struct was_simple {
          */
         bool no_body;
 
+        /**
+         * An optional buffer which collects small writes until it is
+         * full or flushed.  It is disabled (nullptr) by default and
+         * configured with was_simple_set_output_buffer().  Data in
+         * this buffer has not yet been accounted in #sent.
+         */
+        struct {
+            char *data = nullptr;
+
+            size_t capacity = 0, size = 0;
+        } buffer;
+
+        /**
+         * Data which has been accepted from the application but could
+         * not be written to the pipe yet because it was full.  This
+         * is only used in non-blocking mode (see
+         * was_simple_set_non_block()).  It is always written before
+         * the #buffer.  Data in this buffer has not yet been
+         * accounted in #sent.
+         */
+        struct {
+            char *data = nullptr;
+
+            size_t start = 0, size = 0, capacity = 0;
+        } pending;
+
+        /**
+         * The capacity of the pipe (0 if unknown).
+         */
+        size_t pipe_size;
+
         explicit Output(int _fd) noexcept
-            :fd(_fd)
+            :fd(_fd), pipe_size(GetPipeSize(fd))
         {
             fd_set_nonblock(fd);
         }
 
         ~Output() noexcept {
+            free(buffer.data);
+            free(pending.data);
+
+            if (fd >= 0 && fd != STDOUT_FILENO)
+                close(fd);
+        }
+
+        /**
+         * Close the pipe and disable the #buffer.  The #pending
+         * allocation is kept for the next connection.
+         */
+        void Close() noexcept {
             if (fd != STDOUT_FILENO)
                 close(fd);
+            fd = -1;
+
+            free(buffer.data);
+            buffer.data = nullptr;
+            buffer.capacity = buffer.size = 0;
+
+            pending.start = pending.size = 0;
+        }
+
+        void Reopen(int _fd) noexcept {
+            assert(fd < 0);
+
+            fd = _fd;
+            pipe_size = GetPipeSize(fd);
+            fd_set_nonblock(fd);
+        }
+
+        size_t GetBufferFree() const noexcept {
+            return buffer.capacity - buffer.size;
+        }
+
+        /**
+         * The number of bytes which have been submitted by the
+         * application, including those still in the #buffer and in
+         * #pending.
+         */
+        uint64_t GetPosition() const noexcept {
+            return sent + pending.size + buffer.size;
+        }
+
+        /**
+         * Discard all data which has not yet been written to the
+         * pipe.
+         */
+        void DiscardUnsent() noexcept {
+            buffer.size = 0;
+            pending.start = pending.size = 0;
         }
 
         /**
@@ -351,7 +817,8 @@ struct was_simple {
          * Can this much data be sent?
          */
         bool CanSend(size_t nbytes) const {
-            return !no_body && (!known_length || sent + nbytes <= announced);
+            return !no_body &&
+                (!known_length || GetPosition() + nbytes <= announced);
         }
 
         void Sent(size_t nbytes) {
@@ -367,12 +834,25 @@ struct was_simple {
      * Request metadata received from the control channel.
      */
     struct Request {
+        /**
+         * All strings below are allocated here.  It is reset when
+         * the request is finished, which keeps its memory for the
+         * next request.
+         */
+        Arena arena;
+
         http_method_t method;
-        char *uri, *script_name, *path_info, *query_string;
+        const char *uri, *script_name, *path_info, *query_string;
 
-        char *remote_host;
+        const char *remote_host;
 
-        std::multimap<std::string, std::string, std::less<>> headers, parameters;
+        FlatMultiMap headers, parameters;
+
+        /**
+         * The values of well-known headers (the first one of each
+         * name), indexed by #was_simple_header.
+         */
+        const char *header_tokens[WAS_SIMPLE_HEADER_COUNT];
 
         /**
          * True if #WAS_COMMAND_METRIC has been received.
@@ -394,20 +874,27 @@ struct was_simple {
 
             remote_host = nullptr;
 
+            std::fill_n(header_tokens, WAS_SIMPLE_HEADER_COUNT, nullptr);
+
             want_metrics = false;
             finished = false;
         }
 
-        void Deinit() {
-            free(uri);
-            free(script_name);
-            free(path_info);
-            free(query_string);
-
-            free(remote_host);
+        /**
+         * Remember the value of a well-known header.
+         */
+        void ApplyHeaderToken(const FlatMultiMap::Item &header) noexcept {
+            const auto token = LookupHeaderToken(header.name);
+            if (token != WAS_SIMPLE_HEADER_COUNT &&
+                header_tokens[token] == nullptr)
+                header_tokens[token] = header.value.data();
+        }
 
+        void Deinit() {
             headers.clear();
             parameters.clear();
+
+            arena.Reset();
         }
     } request;
 
@@ -486,37 +973,354 @@ struct was_simple {
      */
     int dev_null = -2;
 
-    was_simple(int control_fd, int input_fd, int output_fd) noexcept
-        :control(control_fd), input(input_fd), output(output_fd)
-    {
-    }
+    /**
+     * If non-zero, then the pipes are grown automatically (up to this
+     * size) when a large request or response body is announced.  See
+     * was_simple_set_pipe_auto().
+     */
+    size_t auto_pipe_size = 0;
 
-    ~was_simple() {
-        if (dev_null >= 0)
-            close(dev_null);
+    /**
+     * Non-blocking mode, see was_simple_set_non_block().
+     */
+    bool non_block = false;
 
-        if (response.state != Response::State::NONE)
-            request.Deinit();
-    }
+    /**
+     * The events the last operation which failed with EAGAIN (in
+     * non-blocking mode) is waiting for, in addition to POLLIN on
+     * the control socket.  See was_simple_get_poll().
+     */
+    struct {
+        short input = 0, output = 0;
+    } wait;
 
-    bool HasRequestBody() const {
-        assert(response.state != Response::State::NONE);
+    /**
+     * Did the current operation fail because it would block (in
+     * non-blocking mode)?  Set by WouldBlock() and reset by
+     * BeginOperation().  Unlike errno, this cannot be a stale value
+     * left over by an earlier system call.
+     */
+    bool blocked = false;
 
-        return input.HasBody();
-    }
+    /**
+     * Automatic per-request metrics, see
+     * was_simple_set_auto_metrics().
+     */
+    struct Metrics {
+        using Clock = std::chrono::steady_clock;
 
-    void DeinitRequest() {
-        assert(response.state != Response::State::NONE);
+        /**
+         * When Accept() returned the request and when the response
+         * body began.
+         */
+        Clock::time_point accept_time, body_time;
 
-        request.Deinit();
-    }
+        /**
+         * Response body bytes which were not copied through
+         * userspace (splice(), vmsplice()).
+         */
+        uint64_t spliced;
 
-    void ClearRequest() {
-        assert(response.state != Response::State::NONE);
+        /**
+         * The number of times an operation had to wait for a pipe
+         * or the control channel (blocking poll() or EAGAIN in
+         * non-blocking mode).  This is mutable because Poll() is
+         * const.
+         */
+        mutable unsigned waits;
 
-        request.Deinit();
-        response.state = Response::State::NONE;
-        partial_read_state = PartialReadState::INITIAL;
+        /**
+         * Configured by was_simple_set_auto_metrics().
+         */
+        bool enabled = false;
+
+        /**
+         * Shall metrics be collected and sent for the current
+         * request?  Only if #enabled and the peer has requested
+         * them.
+         */
+        bool active = false;
+
+        void Start() noexcept {
+            accept_time = Clock::now();
+            body_time = {};
+            spliced = 0;
+            waits = 0;
+        }
+
+        void BeginBody() noexcept {
+            if (active && body_time == Clock::time_point{})
+                body_time = Clock::now();
+        }
+    } metrics;
+
+    /**
+     * Response body compression, see was_simple_compress().  The
+     * compressor and the buffer are kept for the next response.
+     */
+    struct Compression {
+        static constexpr size_t BUFFER_SIZE = 16384;
+
+        Compressor compressor;
+
+        /**
+         * Compressed data is collected here before it is passed to
+         * WriteRawV().  Allocated on first use.
+         */
+        char *buffer = nullptr;
+
+        /**
+         * The number of uncompressed bytes submitted by the
+         * application.
+         */
+        uint64_t position;
+
+        /**
+         * The uncompressed length declared by the application with
+         * SetLength().  Only valid if #known_length is true.
+         */
+        uint64_t announced;
+
+        bool known_length;
+
+        ~Compression() noexcept {
+            free(buffer);
+        }
+
+        void Reset() noexcept {
+            compressor.Stop();
+            position = 0;
+            known_length = false;
+        }
+    } compression;
+
+    /**
+     * The response cache, see was_simple_set_cache().
+     */
+    struct Caching {
+        struct was_simple_cache *cache = nullptr;
+
+        /**
+         * The key of the current request; the buffer is kept for the
+         * next request.
+         */
+        std::string key;
+
+        /**
+         * The response which is being recorded, see
+         * was_simple_cache_response().
+         */
+        std::unique_ptr<CachedResponse> record;
+
+        /**
+         * The time to live of #record.
+         */
+        std::chrono::milliseconds ttl;
+
+        bool IsRecording() const noexcept {
+            return record != nullptr;
+        }
+
+        void Cancel() noexcept {
+            record.reset();
+        }
+    } caching;
+
+    /**
+     * Was this object obtained from the pool by
+     * was_simple_new_pooled()?  Then was_simple_free() returns it to
+     * the pool instead of deleting it.
+     */
+    bool pooled = false;
+
+    was_simple(int control_fd, int input_fd, int output_fd) noexcept
+        :control(control_fd), input(input_fd), output(output_fd)
+    {
+        ApplyPipeSizeEnv();
+    }
+
+    ~was_simple() {
+        if (dev_null >= 0)
+            close(dev_null);
+
+        if (response.state != Response::State::NONE)
+            request.Deinit();
+    }
+
+    /**
+     * Close the connection, but keep the object (and its
+     * allocations) for Reopen().  This is used by the pool.
+     */
+    void Release() noexcept {
+        caching.Cancel();
+
+        if (response.state != Response::State::NONE) {
+            request.Deinit();
+            response.state = Response::State::NONE;
+        }
+
+        control.Close();
+        input.Close();
+        output.Close();
+    }
+
+    /**
+     * Reinitialize an object after Release() with a new connection,
+     * as if it had just been constructed.  The /dev/null handle is
+     * kept.
+     */
+    void Reopen(int control_fd, int input_fd, int output_fd) noexcept {
+        control.Reopen(control_fd);
+        input.Reopen(input_fd);
+        output.Reopen(output_fd);
+
+        partial_read_state = PartialReadState::INITIAL;
+        auto_pipe_size = 0;
+        non_block = false;
+        wait = {};
+        metrics.enabled = metrics.active = false;
+        caching.cache = nullptr;
+
+        ApplyPipeSizeEnv();
+    }
+
+    /**
+     * The number of bytes occupied by this object, including its
+     * heap allocations.
+     */
+    [[gnu::pure]]
+    size_t GetMemoryUsage() const noexcept {
+        return sizeof(*this) +
+            (control.HasBuffers() ? Control::slab.GetSize() : 0) +
+            input.buffer.capacity +
+            output.buffer.capacity + output.pending.capacity +
+            request.arena.GetMemoryUsage() +
+            request.headers.GetMemoryUsage() +
+            request.parameters.GetMemoryUsage();
+    }
+
+    /**
+     * Evaluate the environment variable "WAS_PIPE_SIZE": "auto"
+     * enables was_simple_set_pipe_auto() up to the system limit, and
+     * a number is passed to was_simple_set_pipe_size().
+     */
+    void ApplyPipeSizeEnv() noexcept;
+
+    bool SetPipeSize(size_t size) noexcept;
+
+    void SetPipeAuto(size_t max_size) noexcept {
+        auto_pipe_size = max_size > 0
+            ? std::min(max_size, GetPipeMaxSize())
+            : 0;
+    }
+
+    /**
+     * Grow the given pipe if auto mode is enabled and the given
+     * number of pending bytes does not fit.
+     */
+    void AutoGrowPipe(int fd, size_t &pipe_size, uint64_t pending) noexcept {
+        if (auto_pipe_size > pipe_size && pending > pipe_size) {
+            const size_t size = pending < auto_pipe_size
+                ? size_t(pending)
+                : auto_pipe_size;
+            const size_t new_size = ::SetPipeSize(fd, size, auto_pipe_size);
+            if (new_size > 0)
+                pipe_size = new_size;
+            else
+                /* don't try again */
+                auto_pipe_size = pipe_size;
+        }
+    }
+
+    /**
+     * Did the last operation fail because it would block in
+     * non-blocking mode?
+     */
+    bool IsWouldBlock() const noexcept {
+        return blocked;
+    }
+
+    /**
+     * Called by all public functions which may fail with EAGAIN in
+     * non-blocking mode before they do anything else.
+     */
+    void BeginOperation() noexcept {
+        blocked = false;
+    }
+
+    /**
+     * Called by those public functions before they return a result:
+     * if they fail for another reason, errno must not contain a stale
+     * EAGAIN which the caller would mistake for "would block".
+     */
+    template<typename T>
+    T EndOperation(T result, T failure) noexcept {
+        if (result == failure && errno == EAGAIN && !blocked)
+            errno = EIO;
+        return result;
+    }
+
+    /**
+     * In non-blocking mode, apply the control packets which have
+     * already arrived, without waiting for more.  This must be done
+     * before reporting that the output pipe would block, or else a
+     * STOP would not be noticed while the pipe is full (and a
+     * level-triggered poller would spin on the readable control
+     * socket).
+     *
+     * @return false on error (the #ERROR state has been set)
+     */
+    bool ApplyControlNonBlock() noexcept {
+        assert(non_block);
+
+        /* EAGAIN means nothing has arrived */
+        if ((!control.Fill(true) && errno != EAGAIN) ||
+            !ApplyPendingControl()) {
+            response.state = Response::State::ERROR;
+            return false;
+        }
+
+        return true;
+    }
+
+    /**
+     * Record what the current operation needs to wait for and fail
+     * with EAGAIN.
+     *
+     * @return false
+     */
+    bool WouldBlock(short input_events, short output_events) noexcept {
+        assert(non_block);
+
+        ++metrics.waits;
+
+        wait.input = input_events;
+        wait.output = output_events;
+        blocked = true;
+        errno = EAGAIN;
+        return false;
+    }
+
+    unsigned GetPoll(struct pollfd *fds) const noexcept;
+
+    bool HasRequestBody() const {
+        assert(response.state != Response::State::NONE);
+
+        return input.HasBody();
+    }
+
+    void DeinitRequest() {
+        assert(response.state != Response::State::NONE);
+
+        request.Deinit();
+    }
+
+    void ClearRequest() {
+        assert(response.state != Response::State::NONE);
+
+        request.Deinit();
+        response.state = Response::State::NONE;
+        partial_read_state = PartialReadState::INITIAL;
     }
 
     /**
@@ -535,14 +1339,117 @@ struct was_simple {
 
     bool ApplyRequestPacket(const struct was_control_packet &packet);
     bool ApplyPendingControl();
-    bool ReadAndApplyControl();
+
+    /**
+     * @param dontwait if true, then fail with EAGAIN instead of
+     * blocking (and don't set the #ERROR state)
+     */
+    bool ReadAndApplyControl(bool dontwait=false);
+
+    /**
+     * Is a request being received?  This can only be the case in
+     * non-blocking mode, after Accept() has returned early.
+     */
+    bool IsReceivingRequest() const noexcept {
+        return response.state == Response::State::STATUS &&
+            !request.finished;
+    }
 
     const char *Accept(const char *would_block=nullptr);
+
+    /**
+     * The first part of Accept(): finish the previous request and
+     * receive the next one.
+     */
+    const char *ReceiveNextRequest(const char *would_block);
+
+    /**
+     * The second part of ReceiveNextRequest(): receive the control
+     * packets of a request until #WAS_COMMAND_DATA or
+     * #WAS_COMMAND_NO_DATA.
+     */
+    const char *ReceiveRequest(const char *would_block);
+
+    /**
+     * Look up the current request in the response cache and send
+     * the cached response.
+     *
+     * @return true if the request has been handled (successfully or
+     * not), false if it shall be returned to the application
+     */
+    bool ServeFromCache() noexcept;
+
+    /**
+     * Send a cached response: all control packets with one send()
+     * and the body with tee() from the cached pipe.
+     */
+    bool ServeCached(const CachedResponse &r) noexcept;
+
+    /**
+     * Implementation of was_simple_cache_response().
+     */
+    bool CacheResponse(unsigned ttl_ms) noexcept;
+
+    /**
+     * Append response body data to the response being recorded.
+     * Too much data cancels the recording.
+     */
+    void RecordBody(const struct iovec *v, size_t n, size_t length) noexcept;
+
+    /**
+     * Called by End() after the response has been finished: add the
+     * recorded response to the cache if it is complete.
+     *
+     * @param no_data true if #WAS_COMMAND_NO_DATA has been sent
+     */
+    void StoreRecordedResponse(bool no_data) noexcept;
+
+    /**
+     * Like poll(), but report the control channel (which must be
+     * the first element) as readable if io_uring has already
+     * received data.
+     */
+    int Poll(struct pollfd *fds, unsigned n, int timeout_ms) const noexcept;
+
     enum was_simple_poll_result PollInput(int timeout_ms);
 
+    /**
+     * Wait for request body data.  In non-blocking mode, this
+     * doesn't wait, but returns #WAS_SIMPLE_POLL_TIMEOUT with
+     * errno=EAGAIN instead.
+     */
+    enum was_simple_poll_result WaitInput() noexcept {
+        if (!non_block)
+            return PollInput(-1);
+
+        auto result = PollInput(0);
+        if (result == WAS_SIMPLE_POLL_TIMEOUT)
+            WouldBlock(POLLIN, 0);
+        return result;
+    }
+
     bool Received(size_t nbytes);
+
+    /**
+     * Read from the pipe, bypassing the read-ahead buffer.
+     */
+    ssize_t ReadPipe(void *buffer, size_t length);
+
     ssize_t Read(void *buffer, size_t length);
 
+    bool SetInputBuffer(size_t capacity) noexcept;
+
+    /**
+     * Read more data from the pipe into the read-ahead buffer.
+     *
+     * @return the number of bytes read (0 if the buffer is full or
+     * at the end of the request body) or -1/-2 like Read()
+     */
+    ssize_t FillInputBuffer() noexcept;
+
+    ssize_t PeekInput(const void **data_r) noexcept;
+    ssize_t ReadLine(char *buffer, size_t size) noexcept;
+
     int64_t GetInputRemaining() const {
         if (input.premature)
             return -1;
@@ -550,968 +1457,2904 @@ struct was_simple {
         return input.GetRemaining();
     }
 
-    bool CloseInput();
-    bool SetStatus(http_status_t status);
-    bool SetHeader(std::string_view name, std::string_view value) noexcept;
-    bool SetLength(uint64_t length);
+    bool CloseInput();
+    bool SetStatus(http_status_t status);
+    bool SetHeader(std::string_view name, std::string_view value) noexcept;
+    bool SendHeaderBlock(const was_simple_header_block &b) noexcept;
+    bool SetLength(uint64_t length);
+
+    bool IsCompressing() const noexcept {
+        return compression.compressor.IsActive();
+    }
+
+    const char *EnableCompression() noexcept;
+
+    /**
+     * Pass data through the compressor and write the result with
+     * WriteRawV().
+     */
+    bool Compress(std::string_view src, Compressor::Operation op) noexcept;
+
+    /**
+     * The WriteV() implementation for compressed responses.
+     */
+    bool CompressV(const struct iovec *v, size_t n, size_t length) noexcept;
+
+    /**
+     * Finish the compressed stream and disable the compressor.
+     */
+    bool FinishCompression() noexcept;
+
+    /**
+     * The compressed body has reached the length declared with
+     * SetLength(): finish the stream and announce the compressed
+     * length.
+     */
+    bool EndCompressedBody() noexcept;
+
+    /**
+     * The SendFile() implementation for compressed responses.
+     */
+    bool CompressFile(int fd, uint64_t offset, uint64_t length) noexcept;
+
+    enum was_simple_poll_result PollOutput(int timeout_ms);
+
+    bool SetOutputBuffer(size_t capacity) noexcept;
+
+    /**
+     * Write the contents of the output buffer to the pipe.
+     */
+    bool FlushOutputBuffer() noexcept;
+
+    /**
+     * Send the control output buffer and write the output buffer to
+     * the pipe with one io_uring submission.  Whatever could not be
+     * written immediately is written with FlushOutputBuffer()'s
+     * blocking code path.
+     */
+    bool FlushRing() noexcept;
+
+    /**
+     * The specified number of bytes have been written to the end of
+     * the output buffer; account for them as if they had been passed
+     * to Write().
+     */
+    bool CommitOutputBuffer(size_t length) noexcept;
+
+    /**
+     * Write data to the pipe, bypassing the output buffer (which
+     * must be empty).
+     *
+     * @param gift if true, then the pages are mapped into the pipe
+     * with vmsplice() instead of being copied
+     */
+    bool WriteDirectV(const struct iovec *v, size_t n, size_t length,
+                      bool gift=false);
+
+    /**
+     * The non-blocking version of WriteDirectV(): whatever does not
+     * fit into the pipe is copied to Output::pending.
+     *
+     * @return false on error or if there is already too much pending
+     * data (errno=EAGAIN); in that case, nothing has been consumed
+     */
+    bool WriteDirectVNonBlock(const struct iovec *v, size_t n, size_t length,
+                              bool gift) noexcept;
+
+    /**
+     * Copy the rest of an #iovec array (starting at the given
+     * position) to Output::pending.
+     */
+    bool QueuePendingV(const struct iovec *v, size_t n,
+                       size_t i, size_t offset) noexcept;
+
+    bool QueuePending(const void *data, size_t length) noexcept {
+        const struct iovec v{const_cast<void *>(data), length};
+        return QueuePendingV(&v, 1, 0, 0);
+    }
+
+    /**
+     * Write Output::pending to the pipe (non-blocking mode).
+     *
+     * @return true if it is empty now, false on error or if the pipe
+     * is full (errno=EAGAIN)
+     */
+    bool FlushPending() noexcept;
+
+    /**
+     * Write Output::pending and Output::buffer, waiting with
+     * PollOutput() until the pipe accepts them.  This is used by
+     * operations which always block after they have left
+     * non-blocking mode temporarily.
+     */
+    bool FlushPendingBlocking() noexcept;
+
+    bool WriteDirect(const void *data, size_t length) {
+        const struct iovec v{const_cast<void *>(data), length};
+        return WriteDirectV(&v, 1, length);
+    }
+
+    /**
+     * Like WriteDirectV(), but write the contents of the output
+     * buffer first, in the same system call.
+     */
+    bool FlushOutputBufferV(const struct iovec *v, size_t n, size_t length);
+
+    bool Write(const void *data, size_t length) {
+        const struct iovec v{const_cast<void *>(data), length};
+        return WriteV(&v, 1, length);
+    }
+
+    bool WriteV(const struct iovec *v, size_t n, size_t length);
+
+    /**
+     * Like WriteV(), but bypass the compressor.
+     */
+    bool WriteRawV(const struct iovec *v, size_t n, size_t length);
+
+    bool WriteRaw(const void *data, size_t length) {
+        const struct iovec v{const_cast<void *>(data), length};
+        return WriteRawV(&v, 1, length);
+    }
+
+    bool WriteGift(const void *data, size_t length) noexcept;
+    was_gcc_printf(2, 0)
+    bool VPrintf(const char *fmt, va_list va) noexcept;
+
+    bool Flush() noexcept {
+        if (IsCompressing() && response.state == Response::State::BODY &&
+            !Compress({}, Compressor::Operation::FLUSH))
+            return false;
+
+        if (!FlushOutputBuffer())
+            return false;
+
+        if (!control.Flush()) {
+            response.state = Response::State::ERROR;
+            return false;
+        }
+
+        return true;
+    }
+
+    ssize_t Splice(size_t max_length) noexcept;
+    bool SpliceAll(bool end) noexcept;
+
+    bool SendFile(int fd, uint64_t offset, uint64_t length) noexcept;
+
+    http_status_t GetRange(uint64_t size,
+                           uint64_t &offset_r, uint64_t &length_r) const noexcept;
+
+    bool SendFileRange(int fd, uint64_t size) noexcept;
+
+    ssize_t SpliceFrom(int fd, size_t max_length) noexcept;
+
+    bool SpliceTo(int out_fd) noexcept;
+
+    /**
+     * Like SpliceTo(), but write the read-ahead buffer first.
+     */
+    bool SpliceInputTo(int out_fd) noexcept;
+
+    /**
+     * Implementation of was_simple_input_map().
+     */
+    const void *MapInput(size_t *length_r) noexcept;
+
+    /**
+     * Read the rest of the request body into a heap buffer.
+     */
+    void *ReadInputToBuffer(size_t length) noexcept;
+
+    /**
+     * Splice the rest of the request body into a new memfd.
+     *
+     * @param length the length of the rest of the request body for
+     * allocating the file, or 0 if it is not yet known
+     * @return the memfd (its file position is the length of the
+     * data) or -1 on error
+     */
+    int SpliceInputToMemfd(size_t length) noexcept;
+
+    /**
+     * Splice the rest of the request body into a memfd and map it.
+     */
+    void *ReadInputToMemfd(size_t length) noexcept;
+
+    /**
+     * Like ReadInputToMemfd(), but for a request body whose length
+     * has not been announced yet.  This keeps draining the pipe
+     * until LENGTH or PREMATURE arrives, because the peer may send
+     * LENGTH only after the whole body.
+     */
+    const void *ReadUnknownInputToMemfd(size_t *length_r) noexcept;
+
+    bool SetResponseStateBody();
+
+    bool DiscardAllInput();
+
+    bool CloseDiscardInput() noexcept {
+        if (response.state == Response::State::ERROR)
+            return false;
+
+        if (input.no_body || input.IsEOF()) {
+            /* nothing to stop: don't flush the control channel
+               here, so End() can send the remaining control packets
+               together with LENGTH or NO_DATA */
+            input.DiscardBuffered();
+            return true;
+        }
+
+        return (input.stopped || (CloseInput() && control.Flush())) &&
+            DiscardAllInput();
+    }
+
+    bool WantMetrics() const noexcept {
+        assert(response.state != Response::State::NONE);
+
+        return request.want_metrics;
+    }
+
+    bool SendMetric(std::string_view name, float value) noexcept;
+
+    /**
+     * Send the automatic metrics of the current request (if
+     * enabled); they are appended to the control output buffer and
+     * flushed together with the end of the response.
+     */
+    bool SendAutoMetrics() noexcept;
+
+    bool End();
+    bool Abort();
+};
+
+Slab was_simple::Control::slab{INPUT_BUFFER_SIZE + OUTPUT_BUFFER_SIZE, 256};
+
+void
+was_simple::Control::CompactInput() noexcept
+{
+    if (input_buffer.start == 0 ||
+        input_buffer.start + GetPacketSize() <= INPUT_BUFFER_SIZE)
+        /* no need to move anything */
+        return;
+
+    const size_t size = GetInputSize();
+    CountStat(Stat::CONTROL_MOVED_BYTES, size);
+    memmove(input_buffer.raw, input_buffer.raw + input_buffer.start, size);
+    input_buffer.start = 0;
+    input_buffer.end = size;
+}
+
+bool
+was_simple::Control::Fill(bool dontwait)
+{
+    if (!AllocateBuffers())
+        return false;
+
+    if (discard_input > 0)
+        /* the input buffer is empty; PeekCommand() is not needed
+           anymore, so use the whole buffer for discarding */
+        input_buffer.start = input_buffer.end = 0;
+
+    CompactInput();
+
+    assert(input_buffer.end < INPUT_BUFFER_SIZE);
+
+    size_t max_read = INPUT_BUFFER_SIZE - input_buffer.end;
+    if (discard_input > 0 && discard_input < max_read)
+        max_read = discard_input;
+
+    ssize_t nbytes = DirectReceive(input_buffer.raw + input_buffer.end,
+                                   max_read, dontwait);
+    if (nbytes <= 0) {
+        if (nbytes == 0)
+            /* the WAS client closed the control socket; recv()==0
+               doesn't set errno, but our caller checks errno if we
+               return false; to avoid leaving a random errno value,
+               set one that fits best */
+            errno = ECONNRESET;
+        return false;
+    }
+
+    if (discard_input > 0)
+        discard_input -= nbytes;
+    else
+        input_buffer.end += nbytes;
+    return true;
+}
+
+bool
+was_simple::Control::EnableRing() noexcept
+{
+#ifdef HAVE_IO_URING
+    if (ring != nullptr)
+        return true;
+
+    auto *r = new ControlRing(fd);
+    if (!r->Open()) {
+        const int e = errno;
+        delete r;
+        errno = e;
+        return false;
+    }
+
+    ring = r;
+    return true;
+#else
+    errno = ENOSYS;
+    return false;
+#endif
+}
+
+void
+was_simple::Control::Shift()
+{
+    assert(IsPacketComplete());
+
+    input_buffer.start += GetPacketSize();
+
+    if (input_buffer.start == input_buffer.end)
+        /* the buffer is empty: start over at the beginning */
+        input_buffer.start = input_buffer.end = 0;
+
+    packet.payload = nullptr;
+}
+
+const struct was_control_packet *
+was_simple::Control::Get()
+{
+    if (!IsPacketComplete())
+        return nullptr;
+
+    const auto header = GetHeader();
+    packet.command = (enum was_command)header.command;
+    packet.length = header.length;
+
+    if (packet.length > 0) {
+        packet.payload = input_buffer.raw + input_buffer.start +
+            sizeof(header);
+    } else {
+        packet.payload = nullptr;
+        Shift();
+    }
+
+    return &packet;
+}
+
+inline const struct was_control_packet *
+was_simple::Control::Next()
+{
+    /* clean up the previous packet */
+    if (packet.payload != nullptr)
+        Shift();
+
+    return Get();
+}
+
+const struct was_control_packet *
+was_simple::Control::Read(bool dontwait)
+{
+    /* clean up the previous packet */
+    if (packet.payload != nullptr)
+        Shift();
+
+    while (true) {
+        const auto *p = Get();
+        if (p != nullptr)
+            return p;
+
+        if (IsPacketTooLarge() && input_buffer.end == INPUT_BUFFER_SIZE) {
+            /* input buffer is full: discard the packet and return an
+               error to the caller */
+
+            /* leave the header where it is, so PeekCommand() can
+               still read it; the packet may start anywhere in the
+               buffer if one recv() has filled all of it */
+            discard_input = GetPacketSize() - GetInputSize();
+            input_buffer.end = input_buffer.start;
+
+            CountStat(Stat::PACKETS_TOO_LARGE);
+            errno = E2BIG;
+            return nullptr;
+        }
+
+        if (!Fill(dontwait))
+            return nullptr;
+    }
+}
+
+bool
+was_simple::Control::Flush()
+{
+    assert(output_buffer.start <= output_buffer.position);
+    assert(output_buffer.position <= OUTPUT_BUFFER_SIZE);
+
+    if (output_buffer.start == output_buffer.position)
+        /* buffer is empty */
+        return true;
+
+    ssize_t nbytes = DirectSend(output_buffer.data + output_buffer.start,
+                                GetOutputSize());
+    if (nbytes <= 0)
+        return false;
+
+    output_buffer.start += nbytes;
+
+    if (output_buffer.start == output_buffer.position)
+        output_buffer.start = output_buffer.position = 0;
+
+    return true;
+}
+
+inline void
+was_simple::Control::Append(const void *p, size_t length)
+{
+    assert(HasBuffers());
+    assert(output_buffer.position <= OUTPUT_BUFFER_SIZE);
+    assert(length <= GetOutputFree());
+
+    if (output_buffer.position + length > OUTPUT_BUFFER_SIZE) {
+        /* move the rest of a partially sent buffer to the
+           beginning to make room */
+        const size_t size = GetOutputSize();
+        CountStat(Stat::CONTROL_MOVED_BYTES, size);
+        memmove(output_buffer.data,
+                output_buffer.data + output_buffer.start,
+                size);
+        output_buffer.start = 0;
+        output_buffer.position = size;
+    }
+
+    memcpy(output_buffer.data + output_buffer.position, p, length);
+    output_buffer.position += length;
+}
+
+bool
+was_simple::Control::SendV(const struct iovec *src, size_t n)
+{
+    assert(n <= MAX_SEND_VECTOR);
+
+    size_t total = 0;
+    for (size_t i = 0; i < n; ++i)
+        total += src[i].iov_len;
+
+    if (total <= GetOutputFree()) {
+        if (!AllocateBuffers())
+            return false;
+
+        for (size_t i = 0; i < n; ++i)
+            Append(src[i].iov_base, src[i].iov_len);
+        return true;
+    }
+
+    /* too large for the buffer: send the buffer and the new data in
+       one system call */
+
+    struct iovec v[1 + MAX_SEND_VECTOR];
+    size_t n_v = 0;
+
+    if (GetOutputSize() > 0) {
+        v[n_v].iov_base = output_buffer.data + output_buffer.start;
+        v[n_v].iov_len = GetOutputSize();
+        ++n_v;
+    }
+
+    for (size_t i = 0; i < n; ++i)
+        if (src[i].iov_len > 0)
+            v[n_v++] = src[i];
+
+    struct iovec *i = v;
+
+    while (true) {
+        struct msghdr msg{};
+        msg.msg_iov = i;
+        msg.msg_iovlen = n_v;
+
+        CountStat(Stat::CONTROL_SENDS);
+        ssize_t nbytes = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (nbytes <= 0)
+            return false;
+
+        /* consume the #output_buffer first */
+        if (GetOutputSize() > 0) {
+            assert(i->iov_base == output_buffer.data + output_buffer.start);
+
+            const size_t consumed = std::min<size_t>(nbytes, GetOutputSize());
+            output_buffer.start += consumed;
+            nbytes -= consumed;
+
+            if (output_buffer.start == output_buffer.position) {
+                output_buffer.start = output_buffer.position = 0;
+                ++i;
+                --n_v;
+            } else {
+                i->iov_base = output_buffer.data + output_buffer.start;
+                i->iov_len = GetOutputSize();
+            }
+        }
+
+        /* skip the new data that was sent */
+        while (n_v > 0 && size_t(nbytes) >= i->iov_len) {
+            nbytes -= i->iov_len;
+            total -= i->iov_len;
+            ++i;
+            --n_v;
+        }
+
+        if (n_v == 0)
+            return true;
+
+        i->iov_base = (char *)i->iov_base + nbytes;
+        i->iov_len -= nbytes;
+        total -= nbytes;
+
+        if (GetOutputSize() == 0 && total <= GetOutputFree() &&
+            AllocateBuffers()) {
+            /* the rest fits into the (now empty) buffer */
+            for (; n_v > 0; ++i, --n_v)
+                Append(i->iov_base, i->iov_len);
+            return true;
+        }
+    }
+}
+
+static constexpr struct was_header
+MakeHeader(enum was_command command, size_t length) noexcept
+{
+    struct was_header h{};
+    h.length = uint16_t(length);
+    h.command = uint16_t(command);
+    return h;
+}
+
+bool
+was_simple::Control::SendHeader(enum was_command command, size_t length)
+{
+    const auto header = MakeHeader(command, length);
+    return Send(&header, sizeof(header));
+}
+
+bool
+was_simple::Control::SendPacketV(enum was_command command,
+                                 const struct iovec *payload, size_t n)
+{
+    assert(n < MAX_SEND_VECTOR);
+
+    size_t length = 0;
+    for (size_t i = 0; i < n; ++i)
+        length += payload[i].iov_len;
+
+    const auto header = MakeHeader(command, length);
+
+    struct iovec v[MAX_SEND_VECTOR];
+    v[0].iov_base = const_cast<struct was_header *>(&header);
+    v[0].iov_len = sizeof(header);
+    std::copy_n(payload, n, v + 1);
+
+    return SendV(v, n + 1);
+}
+
+inline bool
+was_simple::FinishRequest()
+{
+    assert(response.state != Response::State::NONE);
+
+    if (response.state == Response::State::ERROR)
+        /* cannot reuse this WAS connection */
+        return false;
+
+    // TODO??
+    bool result = End();
+    if (!result && IsWouldBlock())
+        /* try again in the next call */
+        return false;
+
+    ClearRequest();
+    return result;
+}
+
+static bool
+was_simple_apply_string(Arena &arena, const char **value_r,
+                        std::string_view payload)
+{
+    if (*value_r != nullptr)
+        return false;
+
+    *value_r = arena.DupZ(payload);
+    return *value_r != nullptr;
+}
+
+/**
+ * @return the new item or nullptr on error
+ */
+static const FlatMultiMap::Item *
+was_simple_apply_map(Arena &arena, FlatMultiMap &map,
+                     std::string_view payload)
+{
+    const auto eq = payload.find('=');
+    if (eq == 0 || eq == payload.npos)
+        return nullptr;
+
+    /* copy name and value with one allocation, replacing the '='
+       with a null terminator */
+    char *p = arena.Allocate(payload.size() + 1);
+    if (p == nullptr)
+        return nullptr;
+
+    memcpy(p, payload.data(), payload.size());
+    p[eq] = 0;
+    p[payload.size()] = 0;
+
+    return &map.insert({p, eq}, {p + eq + 1, payload.size() - eq - 1});
+}
+
+bool
+was_simple::ApplyRequestPacket(const struct was_control_packet &packet)
+{
+    assert(response.state != Response::State::NONE);
+
+    WAS_TRACE2(packet, packet.command, packet.length);
+
+    http_method_t method;
+    uint64_t length;
+
+    switch (packet.command) {
+    case WAS_COMMAND_NOP:
+        break;
+
+    case WAS_COMMAND_REQUEST:
+        return false;
+
+    case WAS_COMMAND_METHOD:
+        if (request.finished)
+            return false;
+
+        if (packet.length != sizeof(uint32_t))
+            return false;
+
+        method = static_cast<http_method_t>(LoadUnaligned<uint32_t>(packet.payload));
+        if (request.method != HTTP_METHOD_GET &&
+            method != request.method)
+            /* sending that packet twice is illegal */
+            return false;
+
+        if (!http_method_is_valid(method))
+            return false;
+
+        request.method = method;
+        break;
+
+    case WAS_COMMAND_URI:
+        if (request.finished)
+            return false;
+
+        return was_simple_apply_string(request.arena, &request.uri,
+                                       packet.GetPayloadString());
+
+    case WAS_COMMAND_SCRIPT_NAME:
+        if (request.finished)
+            return false;
+
+        return was_simple_apply_string(request.arena, &request.script_name,
+                                       packet.GetPayloadString());
+
+    case WAS_COMMAND_PATH_INFO:
+        if (request.finished)
+            return false;
+
+        return was_simple_apply_string(request.arena, &request.path_info,
+                                       packet.GetPayloadString());
+
+    case WAS_COMMAND_QUERY_STRING:
+        if (request.finished)
+            return false;
+
+        return was_simple_apply_string(request.arena, &request.query_string,
+                                       packet.GetPayloadString());
+
+    case WAS_COMMAND_HEADER:
+        if (request.finished)
+            return false;
+
+        if (const auto *header =
+            was_simple_apply_map(request.arena, request.headers,
+                                 packet.GetPayloadString()))
+            request.ApplyHeaderToken(*header);
+        break;
+
+    case WAS_COMMAND_PARAMETER:
+        if (request.finished)
+            return false;
+
+        was_simple_apply_map(request.arena, request.parameters,
+                             packet.GetPayloadString());
+        break;
+
+    case WAS_COMMAND_STATUS:
+        return false;
+
+    case WAS_COMMAND_NO_DATA:
+        if (request.finished)
+            return false;
+
+        input.announced = 0;
+        input.known_length = true;
+        input.no_body = true;
+        request.finished = true;
+        break;
+
+    case WAS_COMMAND_DATA:
+        if (request.finished)
+            return false;
+
+        /* TODO: body? */
+        input.no_body = false;
+        request.finished = true;
+        break;
+
+    case WAS_COMMAND_LENGTH:
+        if (!request.finished || input.no_body || input.premature)
+            return false;
+
+        if (packet.length != sizeof(length))
+            return false;
+
+        length = LoadUnaligned<uint64_t>(packet.payload);
+        if (length < input.received ||
+            (input.known_length && length != input.announced))
+            return false;
+
+        input.announced = length;
+        input.known_length = true;
+
+        AutoGrowPipe(input.fd, input.pipe_size, length - input.received);
+        break;
+
+    case WAS_COMMAND_STOP:
+        if (!request.finished)
+            return false;
+
+        CountStat(Stat::STOPS);
+
+        if (response.state == Response::State::STOP) {
+            /* if we're already at this state, then probably because
+               was_simple_abort() was called - and
+               WAS_COMMAND_PREMATURE has already been sent, so we can
+               silently ignore this control packet */
+            assert(output.no_body);
+            return true;
+        }
+
+        output.no_body = true;
+        output.DiscardUnsent();
+
+        if (!control.SendUint64(WAS_COMMAND_PREMATURE, output.sent) ||
+            !control.Flush())
+            return false;
+
+        response.state = Response::State::STOP;
+        break;
+
+    case WAS_COMMAND_PREMATURE:
+        if (!request.finished)
+            return false;
+
+        CountStat(Stat::PREMATURES);
+
+        if (packet.length != sizeof(length))
+            return false;
+
+        length = LoadUnaligned<uint64_t>(packet.payload);
+        if (length < input.received ||
+            (input.known_length && length > input.announced))
+            return false;
+
+        input.announced = length;
+        input.known_length = true;
+        input.premature = true;
+        return true;
+
+    case WAS_COMMAND_REMOTE_HOST:
+        if (request.finished)
+            return false;
+
+        return was_simple_apply_string(request.arena, &request.remote_host,
+                                       packet.GetPayloadString());
+
+    case WAS_COMMAND_METRIC:
+        request.want_metrics = true;
+        return true;
+    }
+
+    return true;
+}
+
+bool
+was_simple::ApplyPendingControl()
+{
+    const struct was_control_packet *packet;
+    while ((packet = control.Next()) != nullptr)
+        if (!ApplyRequestPacket(*packet))
+            return false;
+
+    return true;
+}
+
+bool
+was_simple::ReadAndApplyControl(bool dontwait)
+{
+    const auto *packet = control.Read(dontwait);
+    if (packet == nullptr) {
+        if (dontwait && errno == EAGAIN)
+            return WouldBlock(0, 0);
+
+        if (errno == E2BIG) {
+            /* the payload is too large for our control input buffer;
+               check the command to see whether to fail the request
+               with a HTTP error status or abort the WAS connection */
+            switch (control.PeekCommand()) {
+            case WAS_COMMAND_URI:
+            case WAS_COMMAND_SCRIPT_NAME:
+            case WAS_COMMAND_PATH_INFO:
+            case WAS_COMMAND_QUERY_STRING:
+                error_status = HTTP_STATUS_REQUEST_URI_TOO_LONG;
+                return true;
+
+            case WAS_COMMAND_HEADER:
+            case WAS_COMMAND_PARAMETER:
+                if (error_status == http_status_t{})
+                    error_status = HTTP_STATUS_REQUEST_HEADER_FIELDS_TOO_LARGE;
+                return true;
+
+            default:
+                /* there's no good way to handle this gracefully;
+                   abort the WAS connection */
+                break;
+            }
+        }
+
+        response.state = Response::State::ERROR;
+        return false;
+    }
+
+    return ApplyRequestPacket(*packet);
+}
+
+const char *
+was_simple::Accept(const char *would_block)
+{
+    while (true) {
+        const char *uri = ReceiveNextRequest(would_block);
+        if (uri == nullptr || uri == would_block)
+            return uri;
+
+        /* a cache hit is answered right here; loop instead of
+           recursing, there may be many of them in a row */
+        if (!ServeFromCache()) {
+            CountStat(Stat::REQUESTS);
+
+            metrics.active = metrics.enabled && request.want_metrics;
+            if (metrics.active)
+                metrics.Start();
+
+            return uri;
+        }
+    }
+}
+
+const char *
+was_simple::ReceiveNextRequest(const char *would_block)
+{
+    if (IsReceivingRequest())
+        /* continue where the last non-blocking call left off */
+        return ReceiveRequest(would_block);
+
+    if (response.state != Response::State::NONE &&
+        !FinishRequest())
+        return IsWouldBlock() ? would_block : nullptr;
+
+    assert(response.state == Response::State::NONE);
+
+    while (true) {
+        const auto *packet = control.Read(would_block != nullptr ||
+                                          non_block);
+        if (packet == nullptr) {
+            if (errno != EAGAIN)
+                return nullptr;
+
+            /* this connection is idle: don't occupy the control
+               buffers until the next request arrives */
+            control.ReleaseIdleBuffers();
+
+            wait.input = wait.output = 0;
+            blocked = true;
+            return would_block;
+        }
+
+        if (packet->command == WAS_COMMAND_REQUEST)
+            /* we got another request: break out of this "while" loop
+               and handle it */
+            break;
+        else if (packet->command == WAS_COMMAND_STOP) {
+            /* this is late, we're already finished sending the
+               response body, but we're doing our best to handle it
+               gracefully */
+            if (!control.SendUint64(WAS_COMMAND_PREMATURE, output.sent) ||
+                !control.Flush()) {
+                response.state = Response::State::ERROR;
+                return nullptr;
+            }
+        } else if (packet->command != WAS_COMMAND_NOP)
+            /* unexpected packet */
+            return nullptr;
+    }
+
+    assert(response.state == Response::State::NONE);
+
+    error_status = http_status_t{};
+
+    input.received = 0;
+    input.DiscardBuffered();
+    input.known_length = false;
+    input.stopped = false;
+    input.premature = false;
+    input.ignore_premature = false;
+    input.FreeMap();
+
+    output.sent = 0;
+    output.known_length = false;
+    output.DiscardUnsent();
+
+    compression.Reset();
+    caching.Cancel();
+
+    response.state = Response::State::STATUS;
+
+    request.Init();
+
+    return ReceiveRequest(would_block);
+}
+
+const char *
+was_simple::ReceiveRequest(const char *would_block)
+{
+    assert(response.state == Response::State::STATUS);
+
+    do {
+        if (!ReadAndApplyControl(non_block)) {
+            if (IsWouldBlock())
+                return would_block;
+
+            response.state = Response::State::ERROR;
+            return nullptr;
+        }
+    } while (!request.finished);
+
+    /* after we have received DATA or NO_DATA which allows us to start
+       handling the request, consume all other control packets that
+       may have been received already, just in case it contains
+       helpful data such as LENGTH */
+    if (!ApplyPendingControl()) {
+        response.state = Response::State::ERROR;
+        return nullptr;
+    }
+
+    if (error_status != http_status_t{}) {
+        /* a recoverable error has occurred - generate an empty
+           response without returning this request to the caller */
+        SetStatus(error_status);
+
+        /* TODO let's hope the compiler optimizes this to a JMP or
+           else we risk stack overflow; but I don't want to use "goto"
+           here, and wrapping the whole method in a loop is ugly,
+           too */
+        return ReceiveNextRequest(would_block);
+    }
+
+    return request.uri;
+}
+
+inline bool
+was_simple::ServeFromCache() noexcept
+{
+    if (caching.cache == nullptr || non_block ||
+        request.method != HTTP_METHOD_GET || !input.no_body)
+        return false;
+
+    caching.cache->MakeKey(caching.key, request.method,
+                           request.uri, request.query_string,
+                           request.headers);
+
+    const auto r = caching.cache->Get(caching.key);
+    if (!r)
+        return false;
+
+    metrics.active = false;
+
+    /* on error, the #ERROR state makes the next FinishRequest()
+       call fail */
+    ServeCached(*r);
+    return true;
+}
+
+bool
+was_simple::ServeCached(const CachedResponse &r) noexcept
+{
+    assert(response.state == Response::State::STATUS);
+    assert(!non_block);
+
+    if (!control.Send(r.control.data(), r.control.size()) ||
+        !control.Flush()) {
+        response.state = Response::State::ERROR;
+        return false;
+    }
+
+    output.no_body = http_status_is_empty(r.status);
+
+    const size_t size = r.body.size();
+    if (size == 0) {
+        response.state = Response::State::END;
+        return true;
+    }
+
+    response.state = Response::State::BODY;
+    output.announced = size;
+    output.known_length = true;
+
+    /* tee() always duplicates from the start of the cached pipe, so
+       only the first call can be used; the rest (if any) is copied
+       from memory */
+    size_t teed = 0;
+    while (r.pipe >= 0) {
+        CountStat(Stat::PIPE_SPLICES);
+        const ssize_t nbytes = tee(r.pipe, output.fd, size,
+                                   SPLICE_F_NONBLOCK);
+        if (nbytes < 0 && errno == EAGAIN) {
+            if (PollOutput(-1) != WAS_SIMPLE_POLL_SUCCESS)
+                return false;
+
+            continue;
+        }
+
+        /* other errors (e.g. EINVAL if the response body is not a
+           pipe) fall back to copying */
+        if (nbytes > 0) {
+            output.Sent(nbytes);
+            metrics.spliced += nbytes;
+            teed = nbytes;
+        }
+
+        break;
+    }
+
+    if (teed < size)
+        return WriteDirect(r.body.data() + teed, size - teed);
+
+    response.state = Response::State::END;
+    return true;
+}
+
+inline bool
+was_simple::CacheResponse(unsigned ttl_ms) noexcept
+{
+    assert(response.state != Response::State::NONE);
+
+    if (caching.cache == nullptr || non_block ||
+        request.method != HTTP_METHOD_GET || !input.no_body ||
+        response.state != Response::State::STATUS)
+        return false;
+
+    if (!caching.IsRecording()) {
+        caching.record = std::make_unique<CachedResponse>();
+        caching.cache->MakeKey(caching.record->key, request.method,
+                               request.uri, request.query_string,
+                               request.headers);
+    }
+
+    caching.ttl = std::chrono::milliseconds{ttl_ms};
+    return true;
+}
+
+void
+was_simple::RecordBody(const struct iovec *v, size_t n,
+                       size_t length) noexcept
+{
+    assert(caching.IsRecording());
+
+    auto &body = caching.record->body;
+    if (body.size() + length > caching.cache->max_entry_size) {
+        caching.Cancel();
+        return;
+    }
+
+    for (size_t i = 0; i < n; ++i) {
+        const char *p = (const char *)v[i].iov_base;
+        body.insert(body.end(), p, p + v[i].iov_len);
+    }
+}
+
+void
+was_simple::StoreRecordedResponse(bool no_data) noexcept
+{
+    assert(caching.IsRecording());
+
+    auto record = std::move(caching.record);
+
+    if (response.state != Response::State::END)
+        return;
+
+    if (no_data) {
+        record->body.clear();
+        record->AppendEmpty(WAS_COMMAND_NO_DATA);
+    } else {
+        /* only a complete body may be cached */
+        if (!output.IsFull() || output.sent != record->body.size())
+            return;
+
+        const uint64_t length = output.sent;
+        record->AppendEmpty(WAS_COMMAND_DATA);
+        record->AppendPacket(WAS_COMMAND_LENGTH, &length, sizeof(length));
+    }
+
+    record->expires = CachedResponse::Clock::now() + caching.ttl;
+    caching.cache->Put(std::move(record));
+}
+
+static constexpr struct pollfd
+MakePollfd(int fd, short events) noexcept
+{
+    struct pollfd pfd{};
+    pfd.fd = fd;
+    pfd.events = events;
+    return pfd;
+}
+
+int
+was_simple::Poll(struct pollfd *fds, unsigned n, int timeout_ms) const noexcept
+{
+    assert(n > 0);
+    assert(fds[0].fd == control.GetPollFd());
+
+    if (timeout_ms != 0)
+        ++metrics.waits;
+
+    if (control.HasQueuedInput()) {
+        /* io_uring has already received control data; polling
+           would not report it */
+        fds[0].revents = POLLIN;
+        for (unsigned i = 1; i < n; ++i)
+            fds[i].revents = 0;
+        return 1;
+    }
+
+    CountStat(Stat::POLLS);
+    const int result = poll(fds, n, timeout_ms);
+    if (result == 0)
+        CountStat(Stat::POLL_TIMEOUTS);
+    return result;
+}
+
+enum was_simple_poll_result
+was_simple::PollInput(int timeout_ms)
+{
+    assert(response.state != Response::State::NONE);
+
+    if (input.premature && !input.ignore_premature)
+        return WAS_SIMPLE_POLL_CLOSED;
+
+    if (input.no_body || input.IsEOF())
+        return WAS_SIMPLE_POLL_END;
+
+    if (!control.Flush() || !ApplyPendingControl() ||
+        !control.Flush()) {
+        response.state = Response::State::ERROR;
+        return WAS_SIMPLE_POLL_ERROR;
+    }
+
+    if (response.state == Response::State::STOP)
+        /* this may have been caused by STOP */
+        return WAS_SIMPLE_POLL_ERROR;
+
+    /* check "eof" again, as it may have changed after control packets
+       have been handled */
+    if (input.IsEOF())
+        return WAS_SIMPLE_POLL_END;
+
+    struct pollfd fds[] = {
+        MakePollfd(control.GetPollFd(), POLLIN),
+        MakePollfd(input.fd, POLLIN),
+    };
+
+    while (true) {
+        WAS_TRACE1(poll_input_start, timeout_ms);
+        int ret = Poll(fds, ARRAY_SIZE(fds), timeout_ms);
+        WAS_TRACE1(poll_input_end, ret);
+        if (ret < 0) {
+            response.state = Response::State::ERROR;
+            return WAS_SIMPLE_POLL_ERROR;
+        }
+
+        if (ret == 0)
+            return WAS_SIMPLE_POLL_TIMEOUT;
+
+        if (fds[0].revents & POLLIN) {
+            /* EAGAIN is a spurious wakeup */
+            if ((!control.Fill(true) && errno != EAGAIN) ||
+                !ApplyPendingControl()) {
+                response.state = Response::State::ERROR;
+                return WAS_SIMPLE_POLL_ERROR;
+            }
+
+            if (input.premature && !input.ignore_premature)
+                return WAS_SIMPLE_POLL_CLOSED;
+
+            if (response.state == Response::State::STOP)
+                /* this may have been caused by STOP */
+                return WAS_SIMPLE_POLL_ERROR;
+
+            if (input.IsEOF())
+                return WAS_SIMPLE_POLL_END;
+        }
+
+        if (fds[1].revents & POLLIN)
+            return WAS_SIMPLE_POLL_SUCCESS;
+    }
+}
+
+bool
+was_simple::Received(size_t nbytes)
+{
+    assert(response.state != Response::State::NONE);
+
+    if (input.premature && !input.ignore_premature)
+        return false;
+
+    input.received += nbytes;
+
+    if (input.known_length && input.received > input.announced) {
+        response.state = Response::State::ERROR;
+        return false;
+    }
+
+    /* TODO??? */
+    return true;
+}
+
+ssize_t
+was_simple::ReadPipe(void *buffer, size_t length)
+{
+    assert(response.state != Response::State::NONE);
+
+    if (response.state == Response::State::ERROR)
+        return -2;
+
+    if (input.premature && !input.ignore_premature)
+        return -2;
+
+    if (input.no_body || input.IsEOF())
+        return 0;
+
+    length = input.ClampRemaining(length);
+    if (length == 0)
+        return 0;
+
+    if (partial_read_state == PartialReadState::PARTIAL) {
+        partial_read_state = PartialReadState::FINISHED;
+
+        switch (WaitInput()) {
+        case WAS_SIMPLE_POLL_SUCCESS:
+            break;
+
+        case WAS_SIMPLE_POLL_TIMEOUT:
+            /* non-blocking mode: EAGAIN */
+            return -1;
+
+        case WAS_SIMPLE_POLL_ERROR:
+        case WAS_SIMPLE_POLL_CLOSED:
+            return -2;
+
+        case WAS_SIMPLE_POLL_END:
+            return 0;
+        }
+    }
+
+    CountStat(Stat::PIPE_READS);
+    ssize_t nbytes = read(input.fd, buffer, length);
+    if (nbytes < 0 && errno == EAGAIN) {
+        /* reading blocks: poll for data (or for control commands and
+           handle them) */
+        switch (WaitInput()) {
+        case WAS_SIMPLE_POLL_SUCCESS:
+            /* time to try again */
+
+            length = input.ClampRemaining(length);
+            assert(length > 0);
+
+            CountStat(Stat::PIPE_READS);
+            nbytes = read(input.fd, buffer, length);
+            if (nbytes < 0 && errno == EAGAIN && non_block) {
+                WouldBlock(POLLIN, 0);
+                return -1;
+            }
+
+            break;
+
+        case WAS_SIMPLE_POLL_TIMEOUT:
+            /* non-blocking mode: EAGAIN */
+            return -1;
+
+        case WAS_SIMPLE_POLL_ERROR:
+        case WAS_SIMPLE_POLL_CLOSED:
+            return -2;
+
+        case WAS_SIMPLE_POLL_END:
+            return 0;
+        }
+    }
+
+    if (nbytes <= 0) {
+        response.state = Response::State::ERROR;
+        return nbytes < 0 ? -1 : -2;
+    }
+
+    if (!Received(nbytes))
+        return -2;
+
+    if (size_t(nbytes) < length &&
+        partial_read_state == PartialReadState::INITIAL)
+        partial_read_state = PartialReadState::PARTIAL;
+
+    return nbytes;
+}
+
+bool
+was_simple::SetInputBuffer(size_t capacity) noexcept
+{
+    const size_t buffered = input.GetBuffered();
+    if (capacity < buffered) {
+        errno = EBUSY;
+        return false;
+    }
+
+    if (capacity == 0) {
+        free(input.buffer.data);
+        input.buffer.data = nullptr;
+        input.buffer.capacity = 0;
+        return true;
+    }
+
+    if (input.buffer.start > 0) {
+        memmove(input.buffer.data, input.buffer.data + input.buffer.start,
+                buffered);
+        input.buffer.start = 0;
+        input.buffer.end = buffered;
+    }
+
+    auto *data = (char *)realloc(input.buffer.data, capacity);
+    if (data == nullptr)
+        return false;
+
+    input.buffer.data = data;
+    input.buffer.capacity = capacity;
+    return true;
+}
+
+ssize_t
+was_simple::FillInputBuffer() noexcept
+{
+    assert(input.buffer.data != nullptr);
+
+    const size_t buffered = input.GetBuffered();
+    if (input.buffer.start > 0) {
+        memmove(input.buffer.data, input.buffer.data + input.buffer.start,
+                buffered);
+        input.buffer.start = 0;
+        input.buffer.end = buffered;
+    }
+
+    if (input.buffer.end == input.buffer.capacity)
+        return 0;
+
+    const ssize_t nbytes = ReadPipe(input.buffer.data + input.buffer.end,
+                                    input.buffer.capacity - input.buffer.end);
+    if (nbytes > 0)
+        input.buffer.end += nbytes;
+
+    return nbytes;
+}
+
+ssize_t
+was_simple::PeekInput(const void **data_r) noexcept
+{
+    assert(response.state != Response::State::NONE);
+
+    if (response.state == Response::State::ERROR)
+        return -2;
+
+    if (input.premature && !input.ignore_premature)
+        return -2;
+
+    if (input.buffer.data == nullptr &&
+        !SetInputBuffer(Input::DEFAULT_BUFFER_SIZE))
+        return -2;
+
+    if (input.GetBuffered() == 0) {
+        const ssize_t nbytes = FillInputBuffer();
+        if (nbytes <= 0)
+            return nbytes;
+    }
+
+    *data_r = input.buffer.data + input.buffer.start;
+    return input.GetBuffered();
+}
+
+ssize_t
+was_simple::Read(void *buffer, size_t length)
+{
+    if (input.buffer.data == nullptr ||
+        /* large reads bypass the empty buffer */
+        (input.GetBuffered() == 0 && length >= input.buffer.capacity))
+        return ReadPipe(buffer, length);
+
+    const void *data;
+    ssize_t nbytes = PeekInput(&data);
+    if (nbytes <= 0)
+        return nbytes;
+
+    nbytes = std::min(size_t(nbytes), length);
+    memcpy(buffer, data, nbytes);
+    input.Consume(nbytes);
+    return nbytes;
+}
+
+ssize_t
+was_simple::ReadLine(char *dest, size_t size) noexcept
+{
+    if (size < 2) {
+        /* no room for any data: the result would be
+           indistinguishable from the end of the request body */
+        if (size > 0)
+            *dest = 0;
+        errno = EINVAL;
+        return -1;
+    }
+
+    const void *data;
+    ssize_t nbytes = PeekInput(&data);
+    if (nbytes <= 0) {
+        *dest = 0;
+        return nbytes;
+    }
+
+    while (true) {
+        const char *p = input.buffer.data + input.buffer.start;
+        const size_t buffered = input.GetBuffered();
+        const size_t max_length = std::min(buffered, size - 1);
+
+        size_t length;
+        if (const auto *newline = (const char *)memchr(p, '\n', max_length))
+            length = newline + 1 - p;
+        else if (buffered >= size - 1 || buffered == input.buffer.capacity)
+            /* the line is too long: return a part of it */
+            length = max_length;
+        else {
+            nbytes = FillInputBuffer();
+            if (nbytes < 0) {
+                /* the partial line remains in the buffer */
+                *dest = 0;
+                return nbytes;
+            }
+
+            if (nbytes > 0)
+                continue;
+
+            /* end of the request body: return the last
+               (unterminated) line */
+            length = max_length;
+        }
+
+        memcpy(dest, p, length);
+        dest[length] = 0;
+        input.Consume(length);
+        return length;
+    }
+}
+
+bool
+was_simple::CloseInput()
+{
+    assert(response.state != Response::State::NONE);
+
+    if (response.state == Response::State::ERROR)
+        return false;
+
+    /* the application is not interested in buffered data anymore */
+    input.DiscardBuffered();
+
+    /* kludge: send STOP for request body only if another control
+       packet will be sent in this function, because otherwise
+       beng-proxy's was_stock may be confused by a control packet on
+       an idle WAS control connection */
+    if (IsControlFinished())
+        return true;
+
+    if (input.no_body || input.stopped || input.premature ||
+        input.IsEOF())
+        return true;
+
+    if (!control.SendEmpty(WAS_COMMAND_STOP)) {
+        response.state = Response::State::ERROR;
+        return false;
+    }
+
+    input.stopped = true;
+    return true;
+}
+
+bool
+was_simple::SetStatus(http_status_t status)
+{
+    assert(response.state != Response::State::NONE);
+
+    if (response.state != Response::State::STATUS)
+        /* too late for sending the status */
+        return false;
+
+    if (!control.SendPacket(WAS_COMMAND_STATUS, &status, sizeof(status))) {
+        response.state = Response::State::ERROR;
+        return false;
+    }
+
+    if (caching.IsRecording()) {
+        caching.record->status = status;
+        caching.record->AppendPacket(WAS_COMMAND_STATUS,
+                                     &status, sizeof(status));
+    }
+
+    response.state = Response::State::HEADERS;
+    output.no_body = http_status_is_empty(status);
+    return true;
+}
+
+inline bool
+was_simple::SetHeader(std::string_view name,
+                      std::string_view value) noexcept
+{
+    assert(response.state != Response::State::NONE);
+
+    if (response.state == Response::State::STATUS &&
+        !SetStatus(HTTP_STATUS_OK))
+        return false;
+
+    if (response.state != Response::State::HEADERS)
+        /* too late for sending headers */
+        return false;
+
+    const struct iovec payload[] = {
+        {const_cast<char *>(name.data()), name.size()},
+        {const_cast<char *>("="), 1},
+        {const_cast<char *>(value.data()), value.size()},
+    };
+
+    bool success = control.SendPacketV(WAS_COMMAND_HEADER,
+                                       payload, ARRAY_SIZE(payload));
+
+    if (!success)
+        response.state = Response::State::ERROR;
+    else if (caching.IsRecording())
+        caching.record->AppendPacket(WAS_COMMAND_HEADER,
+                                     payload, ARRAY_SIZE(payload));
+
+    return success;
+}
+
+inline bool
+was_simple::SendHeaderBlock(const was_simple_header_block &b) noexcept
+{
+    assert(response.state != Response::State::NONE);
+
+    if (response.state == Response::State::STATUS &&
+        !SetStatus(HTTP_STATUS_OK))
+        return false;
+
+    if (response.state != Response::State::HEADERS)
+        /* too late for sending headers */
+        return false;
+
+    if (b.data.empty())
+        return true;
+
+    bool success = control.Send(b.data.data(), b.data.size());
+
+    if (!success)
+        response.state = Response::State::ERROR;
+    else if (caching.IsRecording())
+        caching.record->control.insert(caching.record->control.end(),
+                                       b.data.begin(), b.data.end());
+
+    return success;
+}
+
+bool
+was_simple::SetLength(uint64_t length)
+{
+    assert(response.state != Response::State::NONE);
+
+    if (output.no_body)
+        return false;
+
+    if (IsCompressing()) {
+        /* the length refers to the uncompressed body; the
+           compressed length will be announced when the compressed
+           stream is finished */
+        if (compression.known_length) {
+            assert(length == compression.announced);
+            return true;
+        }
+
+        assert(length >= compression.position);
+
+        if (!SetResponseStateBody())
+            return false;
+
+        compression.announced = length;
+        compression.known_length = true;
+
+        if (length == compression.position)
+            return EndCompressedBody();
+
+        return true;
+    }
+
+    assert(length >= output.GetPosition());
+
+    if (output.known_length) {
+        assert(length == output.announced);
+        return true;
+    }
+
+    if (response.state == Response::State::STATUS &&
+        !SetStatus(HTTP_STATUS_OK))
+        return false;
+
+    if (response.state == Response::State::HEADERS) {
+        if (!control.SendEmpty(WAS_COMMAND_DATA)) {
+            response.state = Response::State::ERROR;
+            return false;
+        }
+
+        response.state = Response::State::BODY;
+    }
+
+    assert(response.state == Response::State::BODY);
+
+    /* before finishing the response, the whole request body must be
+       discarded, or else we may mix up with the next request body if
+       we miss a PREMATURE packet */
+    if (length == output.GetPosition() && !CloseDiscardInput()) {
+        response.state = Response::State::ERROR;
+        return false;
+    }
+
+    if (!control.SendUint64(WAS_COMMAND_LENGTH, length) ||
+        !control.Flush()) {
+        response.state = Response::State::ERROR;
+        return false;
+    }
+
+    output.announced = length;
+    output.known_length = true;
 
-    enum was_simple_poll_result PollOutput(int timeout_ms);
-    bool Write(const void *data, size_t length);
+    AutoGrowPipe(output.fd, output.pipe_size, length - output.sent);
 
-    ssize_t Splice(size_t max_length) noexcept;
-    bool SpliceAll(bool end) noexcept;
+    if (output.IsFull())
+        response.state = Response::State::END;
 
-    bool SpliceTo(int out_fd) noexcept;
+    return true;
+}
 
-    bool SetResponseStateBody();
+/**
+ * The parsed value of the environment variable "WAS_PIPE_SIZE".
+ */
+struct PipeSizeEnv {
+    /**
+     * The pipe size to be configured; 0 if none was specified.
+     */
+    size_t size = 0;
 
-    bool DiscardAllInput();
+    /**
+     * Was "auto" specified?
+     */
+    bool automatic = false;
+};
 
-    bool CloseDiscardInput() noexcept {
-        return (input.stopped || (CloseInput() && control.Flush())) &&
-            DiscardAllInput();
-    }
+static PipeSizeEnv
+ParsePipeSizeEnv() noexcept
+{
+    PipeSizeEnv env;
 
-    bool WantMetrics() const noexcept {
-        assert(response.state != Response::State::NONE);
+    const char *value = getenv("WAS_PIPE_SIZE");
+    if (value == nullptr || *value == 0)
+        return env;
 
-        return request.want_metrics;
+    if (strcmp(value, "auto") == 0) {
+        env.automatic = true;
+        return env;
     }
 
-    bool SendMetric(std::string_view name, float value) noexcept;
+    char *endptr;
+    const unsigned long size = strtoul(value, &endptr, 10);
+    if (*endptr == 0)
+        env.size = size;
 
-    bool End();
-    bool Abort();
-};
+    return env;
+}
+
+/* not a function-local static: the project is built with
+   -fno-threadsafe-statics, and connections may be created by several
+   threads */
+static std::once_flag pipe_size_env_once;
+static PipeSizeEnv pipe_size_env;
+
+void
+was_simple::ApplyPipeSizeEnv() noexcept
+{
+    /* parsed only once per process, because this is called for
+       each new connection */
+    std::call_once(pipe_size_env_once, []{
+        pipe_size_env = ParsePipeSizeEnv();
+    });
+
+    if (pipe_size_env.automatic)
+        SetPipeAuto(SIZE_MAX);
+    else if (pipe_size_env.size > 0)
+        SetPipeSize(pipe_size_env.size);
+}
 
 bool
-was_simple::Control::Fill(bool dontwait)
+was_simple::SetPipeSize(size_t size) noexcept
 {
-    assert(input_position < sizeof(input_buffer));
+    const size_t max_size = GetPipeMaxSize();
 
-    size_t max_read = sizeof(input_buffer) - input_position;
-    if (discard_input > 0 && discard_input < max_read)
-        max_read = discard_input;
+    const size_t new_input_size = ::SetPipeSize(input.fd, size, max_size);
+    if (new_input_size > 0)
+        input.pipe_size = new_input_size;
 
-    ssize_t nbytes = recv(fd,
-                          input_buffer.raw + input_position,
-                          max_read,
-                          dontwait * MSG_DONTWAIT);
-    if (nbytes <= 0) {
-        if (nbytes == 0)
-            /* the WAS client closed the control socket; recv()==0
-               doesn't set errno, but our caller checks errno if we
-               return false; to avoid leaving a random errno value,
-               set one that fits best */
-            errno = ECONNRESET;
-        return false;
-    }
+    const size_t new_output_size = ::SetPipeSize(output.fd, size, max_size);
+    if (new_output_size > 0)
+        output.pipe_size = new_output_size;
 
-    if (discard_input > 0)
-        discard_input -= nbytes;
-    else
-        input_position += nbytes;
-    return true;
+    return new_input_size > 0 && new_output_size > 0;
 }
 
-void
-was_simple::Control::Shift()
+bool
+was_simple::SetResponseStateBody()
 {
-    assert(IsPacketComplete());
+    assert(response.state != Response::State::NONE);
 
-    unsigned full_length = sizeof(input_buffer.header) +
-        input_buffer.header.length;
+    if (response.state == Response::State::ERROR)
+        return false;
 
-    input_position -= full_length;
-    memmove(input_buffer.raw, input_buffer.raw + full_length, input_position);
+    if (response.state == Response::State::STATUS &&
+        !SetStatus(HTTP_STATUS_OK))
+        return false;
 
-    packet.payload = nullptr;
-}
+    if (response.state == Response::State::HEADERS) {
+        if (output.no_body) {
+            response.state = Response::State::END;
+            if (!control.SendEmpty(WAS_COMMAND_NO_DATA))
+                response.state = Response::State::ERROR;
+            return false;
+        }
 
-const struct was_control_packet *
-was_simple::Control::Get()
-{
-    if (!IsPacketComplete())
-        return nullptr;
+        if (!control.SendEmpty(WAS_COMMAND_DATA)) {
+            response.state = Response::State::ERROR;
+            return false;
+        }
 
-    packet.command = (enum was_command)input_buffer.header.command;
-    packet.length = input_buffer.header.length;
+        metrics.BeginBody();
 
-    if (packet.length > 0) {
-        packet.payload = input_buffer.raw +
-            sizeof(input_buffer.header);
-    } else {
-        packet.payload = nullptr;
-        Shift();
+        if (output.IsFull()) {
+            response.state = Response::State::END;
+            return false;
+        }
+
+        response.state = Response::State::BODY;
     }
 
-    return &packet;
+    return response.state == Response::State::BODY;
 }
 
-inline const struct was_control_packet *
-was_simple::Control::Next()
+enum was_simple_poll_result
+was_simple::PollOutput(int timeout_ms)
 {
-    /* clean up the previous packet */
-    if (packet.payload != nullptr)
-        Shift();
+    assert(response.state != Response::State::NONE);
 
-    return Get();
-}
+    if (response.state == Response::State::STOP)
+        return WAS_SIMPLE_POLL_ERROR;
 
-const struct was_control_packet *
-was_simple::Control::Read(bool dontwait)
-{
-    /* clean up the previous packet */
-    if (packet.payload != nullptr)
-        Shift();
+    if (output.IsFull())
+        return WAS_SIMPLE_POLL_END;
+
+    if (!FlushOutputBuffer())
+        return WAS_SIMPLE_POLL_ERROR;
+
+    if (output.IsFull())
+        return WAS_SIMPLE_POLL_END;
+
+    if (!control.Flush() || !ApplyPendingControl() ||
+        !control.Flush()) {
+        response.state = Response::State::ERROR;
+        return WAS_SIMPLE_POLL_ERROR;
+    }
+
+    if (response.state > Response::State::BODY)
+        /* throw WAS_SIMPLE_POLL_ERROR even if state==END, which may
+           have been caused by STOP; in that case, the current request
+           must be aborted by the application, but this object may be
+           reused, so don't set state=ERROR */
+        return WAS_SIMPLE_POLL_ERROR;
+
+    struct pollfd fds[] = {
+        MakePollfd(control.GetPollFd(), POLLIN),
+        MakePollfd(output.fd, POLLOUT),
+    };
 
     while (true) {
-        const auto *p = Get();
-        if (p != nullptr)
-            return p;
+        WAS_TRACE1(poll_output_start, timeout_ms);
+        int ret = Poll(fds, ARRAY_SIZE(fds), timeout_ms);
+        WAS_TRACE1(poll_output_end, ret);
+        if (ret < 0) {
+            response.state = Response::State::ERROR;
+            return WAS_SIMPLE_POLL_ERROR;
+        }
 
-        if (IsInputBufferFull()) {
-            /* input buffer is full: discard the packet and return an
-               error to the caller */
+        if (ret == 0)
+            return WAS_SIMPLE_POLL_TIMEOUT;
 
-            const size_t total_size = sizeof(input_buffer.header) +
-                input_buffer.header.length;
-            discard_input = total_size - input_position;
-            input_position = 0;
+        if (fds[0].revents & POLLIN) {
+            /* EAGAIN is a spurious wakeup */
+            if ((!control.Fill(true) && errno != EAGAIN) ||
+                !ApplyPendingControl()) {
+                response.state = Response::State::ERROR;
+                return WAS_SIMPLE_POLL_ERROR;
+            }
 
-            errno = E2BIG;
-            return nullptr;
+            if (response.state > Response::State::BODY)
+                /* throw WAS_SIMPLE_POLL_ERROR even if state==END,
+                   which may have been caused by STOP; in that case,
+                   the current request must be aborted by the
+                   application, but this object may be reused, so
+                   don't set state=ERROR */
+                return WAS_SIMPLE_POLL_ERROR;
         }
 
-        if (!Fill(dontwait))
-            return nullptr;
+        if (fds[1].revents & POLLOUT)
+            return WAS_SIMPLE_POLL_SUCCESS;
     }
 }
 
-bool
-was_simple::Control::Flush()
+inline const char *
+was_simple::EnableCompression() noexcept
 {
-    assert(output_buffer.position <= sizeof(output_buffer.data));
+    assert(response.state != Response::State::NONE);
 
-    if (output_buffer.position == 0)
-        /* buffer is empty */
-        return true;
+    if (IsCompressing())
+        return GetContentEncodingName(compression.compressor.GetEncoding());
 
-    ssize_t nbytes = DirectSend(output_buffer.data, output_buffer.position);
-    if (nbytes <= 0)
-        return false;
+    if (response.state == Response::State::STATUS &&
+        !SetStatus(HTTP_STATUS_OK))
+        return nullptr;
 
-    output_buffer.position -= nbytes;
-    memmove(output_buffer.data + nbytes,
-            output_buffer.data,
-            output_buffer.position);
-    return true;
-}
+    if (response.state != Response::State::HEADERS ||
+        output.no_body || output.known_length || non_block)
+        return nullptr;
 
-inline void
-was_simple::Control::Append(const void *p, size_t length)
-{
-    assert(output_buffer.position <= sizeof(output_buffer.data));
-    assert(output_buffer.position + length <= sizeof(output_buffer.data));
+    const char *accept_encoding =
+        request.header_tokens[WAS_SIMPLE_HEADER_ACCEPT_ENCODING];
+    if (accept_encoding == nullptr)
+        return nullptr;
 
-    memcpy(output_buffer.data + output_buffer.position, p, length);
-    output_buffer.position += length;
+    const auto encoding = NegotiateContentEncoding(accept_encoding);
+    if (encoding == ContentEncoding::IDENTITY)
+        return nullptr;
+
+    if (compression.buffer == nullptr) {
+        compression.buffer = (char *)malloc(Compression::BUFFER_SIZE);
+        if (compression.buffer == nullptr)
+            return nullptr;
+    }
+
+    if (!compression.compressor.Start(encoding))
+        return nullptr;
+
+    const char *name = GetContentEncodingName(encoding);
+    if (!SetHeader("content-encoding", name) ||
+        !SetHeader("vary", "accept-encoding")) {
+        compression.compressor.Stop();
+        return nullptr;
+    }
+
+    return name;
 }
 
 bool
-was_simple::Control::Send(const void *data, size_t length)
+was_simple::Compress(std::string_view src, Compressor::Operation op) noexcept
 {
-    while (output_buffer.position + length > sizeof(output_buffer.data)) {
-        if (output_buffer.position == 0) {
-            /* too large for the buffer */
-            ssize_t nbytes = DirectSend(data, length);
-            return nbytes == (ssize_t)length;
-        }
+    assert(IsCompressing());
 
-        if (!Flush())
+    while (true) {
+        const ssize_t nbytes = compression.compressor.Process(src,
+                                                           compression.buffer,
+                                                           Compression::BUFFER_SIZE,
+                                                           op);
+        if (nbytes < 0)
             return false;
-    }
 
-    Append(data, length);
-    return true;
-}
+        if (nbytes > 0 && !WriteRaw(compression.buffer, nbytes))
+            return false;
 
-static constexpr struct was_header
-MakeHeader(enum was_command command, size_t length) noexcept
-{
-    struct was_header h{};
-    h.length = uint16_t(length);
-    h.command = uint16_t(command);
-    return h;
+        if (size_t(nbytes) < Compression::BUFFER_SIZE)
+            return true;
+    }
 }
 
 bool
-was_simple::Control::SendHeader(enum was_command command, size_t length)
-{
-    const auto header = MakeHeader(command, length);
-    return Send(&header, sizeof(header));
-}
-
-inline bool
-was_simple::FinishRequest()
+was_simple::CompressV(const struct iovec *v, size_t n, size_t length) noexcept
 {
     assert(response.state != Response::State::NONE);
 
-    if (response.state == Response::State::ERROR)
-        /* cannot reuse this WAS connection */
-        return false;
-
-    // TODO??
-    bool result = End();
-    ClearRequest();
-    return result;
-}
+    WAS_TRACE1(write, length);
 
-static bool
-was_simple_apply_string(char **value_r, std::string_view payload)
-{
-    if (*value_r != nullptr)
+    if (!SetResponseStateBody() ||
+        (compression.known_length &&
+         compression.position + length > compression.announced))
         return false;
 
-    *value_r = strndup(payload.data(), payload.size());
-    return true;
-}
+    for (size_t i = 0; i < n; ++i)
+        if (!Compress({(const char *)v[i].iov_base, v[i].iov_len},
+                      Compressor::Operation::PROCESS))
+            return false;
 
-static bool
-was_simple_apply_map(std::multimap<std::string, std::string, std::less<>> &map,
-                     std::string_view payload)
-{
-    const auto eq = payload.find('=');
-    if (eq == 0 || eq == payload.npos)
-        return false;
+    compression.position += length;
+
+    if (compression.known_length && compression.position >= compression.announced)
+        return EndCompressedBody();
 
-    map.emplace(payload.substr(0, eq), payload.substr(eq + 1));
     return true;
 }
 
 bool
-was_simple::ApplyRequestPacket(const struct was_control_packet &packet)
+was_simple::FinishCompression() noexcept
 {
-    assert(response.state != Response::State::NONE);
-
-    http_method_t method;
-    uint64_t length;
-
-    switch (packet.command) {
-    case WAS_COMMAND_NOP:
-        break;
+    const bool success = Compress({}, Compressor::Operation::FINISH);
+    compression.compressor.Stop();
+    return success;
+}
 
-    case WAS_COMMAND_REQUEST:
+bool
+was_simple::EndCompressedBody() noexcept
+{
+    /* SetLength() ends the response body (and discards the request
+       body); write the rest right away, like CommitOutputBuffer()
+       does for uncompressed responses */
+    return FinishCompression() &&
+        SetLength(output.GetPosition()) &&
+        FlushOutputBuffer();
+}
+
+bool
+was_simple::SetOutputBuffer(size_t capacity) noexcept
+{
+    if (capacity < output.buffer.size &&
+        response.state != Response::State::NONE &&
+        !FlushOutputBuffer())
         return false;
 
-    case WAS_COMMAND_METHOD:
-        if (request.finished)
-            return false;
+    if (capacity == 0) {
+        free(output.buffer.data);
+        output.buffer.data = nullptr;
+        output.buffer.capacity = output.buffer.size = 0;
+        return true;
+    }
 
-        if (packet.length != sizeof(uint32_t))
-            return false;
+    auto *data = (char *)realloc(output.buffer.data, capacity);
+    if (data == nullptr)
+        return false;
 
-        method = static_cast<http_method_t>(LoadUnaligned<uint32_t>(packet.payload));
-        if (request.method != HTTP_METHOD_GET &&
-            method != request.method)
-            /* sending that packet twice is illegal */
-            return false;
+    output.buffer.data = data;
+    output.buffer.capacity = capacity;
+    return true;
+}
 
-        if (!http_method_is_valid(method))
-            return false;
+bool
+was_simple::FlushOutputBuffer() noexcept
+{
+    if (non_block) {
+        /* move the buffer contents behind the pending data, so
+           nothing gets lost if the pipe is full */
+        if (output.buffer.size > 0) {
+            if (!QueuePending(output.buffer.data, output.buffer.size))
+                return false;
 
-        request.method = method;
-        break;
+            output.buffer.size = 0;
+        }
 
-    case WAS_COMMAND_URI:
-        if (request.finished)
-            return false;
+        return FlushPending();
+    }
 
-        return was_simple_apply_string(&request.uri,
-                                       packet.GetPayloadString());
+    if (output.buffer.size == 0)
+        return true;
 
-    case WAS_COMMAND_SCRIPT_NAME:
-        if (request.finished)
-            return false;
+    /* clear the buffer before writing, because WriteDirect() may
+       call PollOutput() which calls this method again */
+    const size_t size = output.buffer.size;
+    output.buffer.size = 0;
 
-        return was_simple_apply_string(&request.script_name,
-                                       packet.GetPayloadString());
+    return WriteDirect(output.buffer.data, size);
+}
 
-    case WAS_COMMAND_PATH_INFO:
-        if (request.finished)
-            return false;
+bool
+was_simple::FlushRing() noexcept
+{
+#ifdef HAVE_IO_URING
+    assert(control.ring != nullptr);
+    assert(!non_block);
+
+    const size_t size = output.buffer.size;
+    output.buffer.size = 0;
+
+    ssize_t sent, written;
+    if (!control.ring->SendWrite(control.output_buffer.data + control.output_buffer.start,
+                                 control.GetOutputSize(), sent,
+                                 output.fd, output.buffer.data, size,
+                                 written) ||
+        sent < 0) {
+        if (sent < 0)
+            errno = int(-sent);
+        response.state = Response::State::ERROR;
+        return false;
+    }
 
-        return was_simple_apply_string(&request.path_info,
-                                       packet.GetPayloadString());
+    control.ConsumeOutput(sent);
 
-    case WAS_COMMAND_QUERY_STRING:
-        if (request.finished)
+    if (written < 0) {
+        if (written != -EAGAIN && written != -ECANCELED) {
+            errno = int(-written);
+            response.state = Response::State::ERROR;
             return false;
+        }
 
-        return was_simple_apply_string(&request.query_string,
-                                       packet.GetPayloadString());
-
-    case WAS_COMMAND_HEADER:
-        if (request.finished)
-            return false;
+        written = 0;
+    }
 
-        was_simple_apply_map(request.headers, packet.GetPayloadString());
-        break;
+    output.Sent(written);
+    if (output.IsFull())
+        response.state = Response::State::END;
 
-    case WAS_COMMAND_PARAMETER:
-        if (request.finished)
-            return false;
+    /* write the rest (if any) the traditional way; this also sends
+       the rest of a partially sent control buffer */
+    return size_t(written) == size ||
+        WriteDirect(output.buffer.data + written, size - written);
+#else
+    return FlushOutputBuffer();
+#endif
+}
 
-        was_simple_apply_map(request.parameters, packet.GetPayloadString());
-        break;
+bool
+was_simple::CommitOutputBuffer(size_t length) noexcept
+{
+    assert(length <= output.GetBufferFree());
 
-    case WAS_COMMAND_STATUS:
+    if (!output.CanSend(length))
         return false;
 
-    case WAS_COMMAND_NO_DATA:
-        if (request.finished)
-            return false;
-
-        input.announced = 0;
-        input.known_length = true;
-        input.no_body = true;
-        request.finished = true;
-        break;
+    output.buffer.size += length;
 
-    case WAS_COMMAND_DATA:
-        if (request.finished)
-            return false;
+    if (output.known_length && output.GetPosition() >= output.announced)
+        /* this is the end of the response body; don't wait for the
+           application to flush it (in non-blocking mode, the data has
+           been consumed even if the pipe is full) */
+        return FlushOutputBuffer() || IsWouldBlock();
 
-        /* TODO: body? */
-        input.no_body = false;
-        request.finished = true;
-        break;
+    return true;
+}
 
-    case WAS_COMMAND_LENGTH:
-        if (!request.finished || input.no_body || input.premature)
-            return false;
+bool
+was_simple::FlushOutputBufferV(const struct iovec *v, size_t n,
+                               size_t length)
+{
+    if (output.buffer.size == 0)
+        return WriteDirectV(v, n, length);
 
-        if (packet.length != sizeof(length))
-            return false;
+    /* prepend the buffer to the given vector */
 
-        length = LoadUnaligned<uint64_t>(packet.payload);
-        if (length < input.received ||
-            (input.known_length && length != input.announced))
-            return false;
+    struct iovec buffer_v[16];
+    if (n >= ARRAY_SIZE(buffer_v) || non_block) {
+        /* too many elements (or non-blocking mode, where the buffer
+           must not be consumed before the new data is): use two
+           system calls */
+        return FlushOutputBuffer() && WriteDirectV(v, n, length);
+    }
 
-        input.announced = length;
-        input.known_length = true;
-        break;
+    buffer_v[0].iov_base = output.buffer.data;
+    buffer_v[0].iov_len = output.buffer.size;
+    std::copy_n(v, n, buffer_v + 1);
 
-    case WAS_COMMAND_STOP:
-        if (!request.finished)
-            return false;
+    const size_t total = output.buffer.size + length;
+    output.buffer.size = 0;
 
-        if (response.state == Response::State::STOP) {
-            /* if we're already at this state, then probably because
-               was_simple_abort() was called - and
-               WAS_COMMAND_PREMATURE has already been sent, so we can
-               silently ignore this control packet */
-            assert(output.no_body);
-            return true;
-        }
+    return WriteDirectV(buffer_v, n + 1, total);
+}
 
-        output.no_body = true;
+inline bool
+was_simple::WriteV(const struct iovec *v, size_t n, size_t length)
+{
+    if (IsCompressing())
+        return CompressV(v, n, length);
 
-        if (!control.SendUint64(WAS_COMMAND_PREMATURE, output.sent) ||
-            !control.Flush())
-            return false;
+    return WriteRawV(v, n, length);
+}
 
-        response.state = Response::State::STOP;
-        break;
+bool
+was_simple::WriteRawV(const struct iovec *v, size_t n, size_t length)
+{
+    assert(response.state != Response::State::NONE);
 
-    case WAS_COMMAND_PREMATURE:
-        if (!request.finished)
-            return false;
+    WAS_TRACE1(write, length);
 
-        if (packet.length != sizeof(length))
-            return false;
+    if (!SetResponseStateBody() ||
+        !output.CanSend(length))
+        return false;
 
-        length = LoadUnaligned<uint64_t>(packet.payload);
-        if (length < input.received ||
-            (input.known_length && length > input.announced))
-            return false;
+    if (caching.IsRecording())
+        RecordBody(v, n, length);
 
-        input.announced = length;
-        input.known_length = true;
-        input.premature = true;
-        return true;
+    if (output.buffer.capacity > 0) {
+        if (length >= output.buffer.capacity)
+            /* too large for the buffer: write it directly */
+            return FlushOutputBufferV(v, n, length);
 
-    case WAS_COMMAND_REMOTE_HOST:
-        if (request.finished)
+        if (length > output.GetBufferFree() && !FlushOutputBuffer())
             return false;
 
-        return was_simple_apply_string(&request.remote_host,
-                                       packet.GetPayloadString());
+        char *dest = output.buffer.data + output.buffer.size;
+        for (size_t i = 0; i < n; ++i)
+            dest = (char *)mempcpy(dest, v[i].iov_base, v[i].iov_len);
 
-    case WAS_COMMAND_METRIC:
-        request.want_metrics = true;
-        return true;
+        return CommitOutputBuffer(length);
     }
 
-    return true;
+    return WriteDirectV(v, n, length);
 }
 
-bool
-was_simple::ApplyPendingControl()
+/**
+ * Copy the next elements of an #iovec array, starting at the given
+ * position, to the given array.
+ *
+ * @return the number of elements copied
+ */
+static size_t
+CopyIovec(struct iovec *dest, size_t max_dest,
+          const struct iovec *src, size_t n, size_t i, size_t offset) noexcept
 {
-    const struct was_control_packet *packet;
-    while ((packet = control.Next()) != nullptr)
-        if (!ApplyRequestPacket(*packet))
-            return false;
+    size_t n_dest = 0;
 
-    return true;
+    for (; i < n && n_dest < max_dest; ++i, offset = 0) {
+        if (offset >= src[i].iov_len)
+            continue;
+
+        dest[n_dest].iov_base = (char *)src[i].iov_base + offset;
+        dest[n_dest].iov_len = src[i].iov_len - offset;
+        ++n_dest;
+    }
+
+    return n_dest;
 }
 
 bool
-was_simple::ReadAndApplyControl()
+was_simple::WriteDirectV(const struct iovec *v, size_t n, size_t length,
+                         bool gift)
 {
-    const auto *packet = control.Read(false);
-    if (packet == nullptr) {
-        if (errno == E2BIG) {
-            /* the payload is too large for our control input buffer;
-               check the command to see whether to fail the request
-               with a HTTP error status or abort the WAS connection */
-            switch (control.PeekCommand()) {
-            case WAS_COMMAND_URI:
-            case WAS_COMMAND_SCRIPT_NAME:
-            case WAS_COMMAND_PATH_INFO:
-            case WAS_COMMAND_QUERY_STRING:
-                error_status = HTTP_STATUS_REQUEST_URI_TOO_LONG;
-                return true;
+    assert(output.buffer.size == 0);
 
-            case WAS_COMMAND_HEADER:
-            case WAS_COMMAND_PARAMETER:
-                if (error_status == http_status_t{})
-                    error_status = HTTP_STATUS_REQUEST_HEADER_FIELDS_TOO_LARGE;
-                return true;
+    if (non_block)
+        return WriteDirectVNonBlock(v, n, length, gift);
 
-            default:
-                /* there's no good way to handle this gracefully;
-                   abort the WAS connection */
-                break;
-            }
-        }
+    if (response.state != Response::State::BODY ||
+        !output.CanSend(length))
+        return false;
+
+    /* before finishing the response, the whole request body must be
+       discarded, or else we may mix up with the next request body if
+       we miss a PREMATURE packet */
+    if (output.known_length && output.sent + length >= output.announced &&
+        !CloseDiscardInput()) {
+        response.state = Response::State::ERROR;
+        return false;
+    }
 
+    if (!control.Flush()) {
         response.state = Response::State::ERROR;
         return false;
     }
 
-    return ApplyRequestPacket(*packet);
-}
+    /* the current position within the #iovec array */
+    size_t i = 0, offset = 0;
 
-const char *
-was_simple::Accept(const char *would_block)
-{
-    if (response.state != Response::State::NONE &&
-        !FinishRequest())
-        return nullptr;
+    while (length > 0) {
+        struct iovec batch[64];
+        const size_t n_batch = CopyIovec(batch, ARRAY_SIZE(batch),
+                                         v, n, i, offset);
+        assert(n_batch > 0);
+
+        CountStat(Stat::PIPE_WRITES);
+        ssize_t nbytes = gift
+            ? vmsplice(output.fd, batch, n_batch, SPLICE_F_NONBLOCK)
+            : n_batch == 1
+            ? write(output.fd, batch[0].iov_base, batch[0].iov_len)
+            : writev(output.fd, batch, n_batch);
+        if (nbytes < 0 && gift && (errno == EINVAL || errno == ENOSYS)) {
+            /* vmsplice() is not supported; fall back to copying */
+            gift = false;
+            continue;
+        }
 
-    assert(response.state == Response::State::NONE);
+        if (nbytes < 0 && errno == EAGAIN) {
+            /* writing blocks: poll for the pipe to become writable
+               again (or for control commands and handle them) */
+            switch (PollOutput(-1)) {
+            case WAS_SIMPLE_POLL_SUCCESS:
+                /* time to try again */
+                continue;
 
-    while (true) {
-        const auto *packet = control.Read(would_block != nullptr);
-        if (packet == nullptr)
-            return errno == EAGAIN ? would_block : nullptr;
+            case WAS_SIMPLE_POLL_ERROR:
+            case WAS_SIMPLE_POLL_TIMEOUT:
+            case WAS_SIMPLE_POLL_CLOSED:
+            case WAS_SIMPLE_POLL_END:
+                return false;
+            }
+        }
 
-        if (packet->command == WAS_COMMAND_REQUEST)
-            /* we got another request: break out of this "while" loop
-               and handle it */
-            break;
-        else if (packet->command == WAS_COMMAND_STOP) {
-            /* this is late, we're already finished sending the
-               response body, but we're doing our best to handle it
-               gracefully */
-            if (!control.SendUint64(WAS_COMMAND_PREMATURE, output.sent) ||
-                !control.Flush()) {
-                response.state = Response::State::ERROR;
+        if (nbytes <= 0) {
+            response.state = Response::State::ERROR;
+            return false;
+        }
+
+        output.Sent(nbytes);
+        if (gift)
+            metrics.spliced += nbytes;
+        length -= nbytes;
+
+        /* advance the position */
+        for (size_t consumed = nbytes; consumed > 0;) {
+            assert(i < n);
+
+            const size_t rest = v[i].iov_len - offset;
+            if (consumed < rest) {
+                offset += consumed;
+                break;
+            }
+
+            consumed -= rest;
+            ++i;
+            offset = 0;
+        }
+
+        if (output.IsFull()) {
+            response.state = Response::State::END;
+            if (length > 0)
+                return false;
+        }
+    }
 
-                /* need to clear request's attributes or else our
-                   destructor will call Deinit() which will
-                   double-free obsolete string pointers */
-                request.Init();
+    return true;
+}
 
-                return nullptr;
-            }
-        } else if (packet->command != WAS_COMMAND_NOP)
-            /* unexpected packet */
-            return nullptr;
+bool
+was_simple::QueuePendingV(const struct iovec *v, size_t n,
+                          size_t i, size_t offset) noexcept
+{
+    auto &pending = output.pending;
+
+    size_t length = 0;
+    for (size_t j = i; j < n; ++j)
+        length += v[j].iov_len;
+    length -= offset;
+
+    if (pending.start + pending.size + length > pending.capacity) {
+        if (pending.start > 0) {
+            memmove(pending.data, pending.data + pending.start,
+                    pending.size);
+            pending.start = 0;
+        }
+
+        if (pending.size + length > pending.capacity) {
+            const size_t capacity = std::max<size_t>(pending.size + length,
+                                                     16384);
+            auto *data = (char *)realloc(pending.data, capacity);
+            if (data == nullptr)
+                return false;
+
+            pending.data = data;
+            pending.capacity = capacity;
+        }
     }
 
-    assert(response.state == Response::State::NONE);
+    char *dest = pending.data + pending.start + pending.size;
+    for (; i < n; ++i, offset = 0)
+        dest = (char *)mempcpy(dest, (const char *)v[i].iov_base + offset,
+                               v[i].iov_len - offset);
 
-    error_status = http_status_t{};
+    pending.size += length;
+    return true;
+}
 
-    input.received = 0;
-    input.known_length = false;
-    input.stopped = false;
-    input.premature = false;
-    input.ignore_premature = false;
+bool
+was_simple::FlushPending() noexcept
+{
+    auto &pending = output.pending;
+
+    while (pending.size > 0) {
+        /* before finishing the response, the whole request body
+           must be discarded, or else we may mix up with the next
+           request body if we miss a PREMATURE packet */
+        if (output.known_length &&
+            output.sent + pending.size >= output.announced &&
+            !CloseDiscardInput()) {
+            if (!IsWouldBlock())
+                response.state = Response::State::ERROR;
+            return false;
+        }
 
-    output.sent = 0;
-    output.known_length = false;
+        if (!control.Flush()) {
+            response.state = Response::State::ERROR;
+            return false;
+        }
 
-    response.state = Response::State::STATUS;
+        CountStat(Stat::PIPE_WRITES);
+        ssize_t nbytes = write(output.fd, pending.data + pending.start,
+                               pending.size);
+        if (nbytes < 0 && errno == EAGAIN) {
+            if (!ApplyControlNonBlock())
+                return false;
 
-    request.Init();
+            if (response.state != Response::State::BODY)
+                /* STOP has discarded the pending data */
+                return false;
 
-    do {
-        if (!ReadAndApplyControl()) {
+            return WouldBlock(0, POLLOUT);
+        }
+
+        if (nbytes <= 0) {
             response.state = Response::State::ERROR;
-            return nullptr;
+            return false;
         }
-    } while (!request.finished);
 
-    /* after we have received DATA or NO_DATA which allows us to start
-       handling the request, consume all other control packets that
-       may have been received already, just in case it contains
-       helpful data such as LENGTH */
-    if (!ApplyPendingControl()) {
-        response.state = Response::State::ERROR;
-        return nullptr;
+        output.Sent(nbytes);
+        pending.start += nbytes;
+        pending.size -= nbytes;
     }
 
-    if (error_status != http_status_t{}) {
-        /* a recoverable error has occurred - generate an empty
-           response without returning this request to the caller */
-        SetStatus(error_status);
+    pending.start = 0;
 
-        /* TODO let's hope the compiler optimizes this to a JMP or
-           else we risk stack overflow; but I don't want to use "goto"
-           here, and wrapping the whole method in a loop is ugly,
-           too */
-        return Accept(would_block);
-    }
+    if (output.IsFull() && response.state == Response::State::BODY)
+        response.state = Response::State::END;
 
-    return request.uri;
+    return true;
 }
 
-static constexpr struct pollfd
-MakePollfd(int fd, short events) noexcept
+bool
+was_simple::FlushPendingBlocking() noexcept
 {
-    struct pollfd pfd{};
-    pfd.fd = fd;
-    pfd.events = events;
-    return pfd;
+    assert(!non_block);
+
+    while (true) {
+        /* FlushPending() exists only in non-blocking mode; it moves
+           the buffer contents behind the pending data */
+        non_block = true;
+        const bool success = FlushOutputBuffer();
+        non_block = false;
+
+        if (success)
+            return true;
+
+        if (!IsWouldBlock())
+            return false;
+
+        blocked = false;
+
+        if (PollOutput(-1) != WAS_SIMPLE_POLL_SUCCESS)
+            return false;
+    }
 }
 
-enum was_simple_poll_result
-was_simple::PollInput(int timeout_ms)
+bool
+was_simple::WriteDirectVNonBlock(const struct iovec *v, size_t n,
+                                 size_t length, bool gift) noexcept
 {
-    assert(response.state != Response::State::NONE);
+    assert(non_block);
+    assert(output.buffer.size == 0);
 
-    if (input.premature && !input.ignore_premature)
-        return WAS_SIMPLE_POLL_CLOSED;
+    if (response.state != Response::State::BODY ||
+        !output.CanSend(length))
+        return false;
 
-    if (input.no_body || input.IsEOF())
-        return WAS_SIMPLE_POLL_END;
+    if (output.pending.size > 0 && !FlushPending()) {
+        /* new data must not overtake the pending data */
 
-    if (!control.Flush() || !ApplyPendingControl() ||
-        !control.Flush()) {
+        if (!IsWouldBlock())
+            return false;
+
+        /* limit the amount of memory we allocate for an application
+           which writes faster than the peer reads */
+        constexpr size_t max_pending = 256 * 1024;
+        if (output.pending.size + length > max_pending)
+            return false;
+
+        return QueuePendingV(v, n, 0, 0);
+    }
+
+    /* before finishing the response, the whole request body must be
+       discarded, or else we may mix up with the next request body if
+       we miss a PREMATURE packet */
+    if (output.known_length && output.sent + length >= output.announced &&
+        !CloseDiscardInput()) {
+        if (!IsWouldBlock()) {
+            response.state = Response::State::ERROR;
+            return false;
+        }
+
+        /* not yet: FlushPending() will try again later */
+        return QueuePendingV(v, n, 0, 0);
+    }
+
+    if (!control.Flush()) {
         response.state = Response::State::ERROR;
-        return WAS_SIMPLE_POLL_ERROR;
+        return false;
     }
 
-    if (response.state == Response::State::STOP)
-        /* this may have been caused by STOP */
-        return WAS_SIMPLE_POLL_ERROR;
+    /* the current position within the #iovec array */
+    size_t i = 0, offset = 0;
 
-    /* check "eof" again, as it may have changed after control packets
-       have been handled */
-    if (input.IsEOF())
-        return WAS_SIMPLE_POLL_END;
+    while (length > 0) {
+        struct iovec batch[64];
+        const size_t n_batch = CopyIovec(batch, ARRAY_SIZE(batch),
+                                         v, n, i, offset);
+        assert(n_batch > 0);
+
+        CountStat(Stat::PIPE_WRITES);
+        ssize_t nbytes = gift
+            ? vmsplice(output.fd, batch, n_batch, SPLICE_F_NONBLOCK)
+            : writev(output.fd, batch, n_batch);
+        if (nbytes < 0 && gift && (errno == EINVAL || errno == ENOSYS)) {
+            /* vmsplice() is not supported; fall back to copying */
+            gift = false;
+            continue;
+        }
 
-    struct pollfd fds[] = {
-        MakePollfd(control.fd, POLLIN),
-        MakePollfd(input.fd, POLLIN),
-    };
+        if (nbytes < 0 && errno == EAGAIN)
+            /* the pipe is full: copy the rest, it will be written
+               by FlushPending() */
+            return QueuePendingV(v, n, i, offset);
 
-    while (true) {
-        int ret = poll(fds, ARRAY_SIZE(fds), timeout_ms);
-        if (ret < 0) {
+        if (nbytes <= 0) {
             response.state = Response::State::ERROR;
-            return WAS_SIMPLE_POLL_ERROR;
+            return false;
         }
 
-        if (ret == 0)
-            return WAS_SIMPLE_POLL_TIMEOUT;
-
-        if (fds[0].revents & POLLIN) {
-            if (!control.Fill(true) ||
-                !ApplyPendingControl()) {
-                response.state = Response::State::ERROR;
-                return WAS_SIMPLE_POLL_ERROR;
-            }
+        output.Sent(nbytes);
+        if (gift)
+            metrics.spliced += nbytes;
+        length -= nbytes;
 
-            if (input.premature && !input.ignore_premature)
-                return WAS_SIMPLE_POLL_CLOSED;
+        /* advance the position */
+        for (size_t consumed = nbytes; consumed > 0;) {
+            assert(i < n);
 
-            if (response.state == Response::State::STOP)
-                /* this may have been caused by STOP */
-                return WAS_SIMPLE_POLL_ERROR;
+            const size_t rest = v[i].iov_len - offset;
+            if (consumed < rest) {
+                offset += consumed;
+                break;
+            }
 
-            if (input.IsEOF())
-                return WAS_SIMPLE_POLL_END;
+            consumed -= rest;
+            ++i;
+            offset = 0;
         }
-
-        if (fds[1].revents & POLLIN)
-            return WAS_SIMPLE_POLL_SUCCESS;
     }
+
+    if (output.IsFull())
+        response.state = Response::State::END;
+
+    return true;
 }
 
 bool
-was_simple::Received(size_t nbytes)
+was_simple::WriteGift(const void *data, size_t length) noexcept
 {
     assert(response.state != Response::State::NONE);
 
-    if (input.premature && !input.ignore_premature)
-        return false;
+    /* below this size, mapping pages is more expensive than copying
+       the data */
+    constexpr size_t min_gift_size = 16384;
 
-    input.received += nbytes;
+    if (length < min_gift_size || IsCompressing() || caching.IsRecording())
+        return Write(data, length);
 
-    if (input.known_length && input.received > input.announced) {
-        response.state = Response::State::ERROR;
+    if (!SetResponseStateBody() ||
+        !output.CanSend(length) ||
+        !FlushOutputBuffer())
         return false;
-    }
 
-    /* TODO??? */
-    return true;
+    const struct iovec v{const_cast<void *>(data), length};
+    return WriteDirectV(&v, 1, length, true);
 }
 
-ssize_t
-was_simple::Read(void *buffer, size_t length)
+bool
+was_simple::VPrintf(const char *fmt, va_list va) noexcept
 {
-    assert(response.state != Response::State::NONE);
+    if (!SetResponseStateBody())
+        return false;
 
-    if (response.state == Response::State::ERROR)
-        return -2;
+    char stack_buffer[4096];
+    char *dest = stack_buffer;
+    size_t max_size = sizeof(stack_buffer);
 
-    if (input.premature && !input.ignore_premature)
-        return -2;
+    /* formatting straight into the output buffer is not possible if
+       the data needs to be compressed or recorded */
+    const bool use_buffer = output.buffer.capacity > 0 && !IsCompressing() &&
+        !caching.IsRecording();
 
-    if (input.no_body || input.IsEOF())
-        return 0;
+    if (use_buffer) {
+        if (output.GetBufferFree() < 256 && !FlushOutputBuffer())
+            return false;
 
-    length = input.ClampRemaining(length);
-    if (length == 0)
-        return 0;
+        /* format straight into the output buffer */
+        dest = output.buffer.data + output.buffer.size;
+        max_size = output.GetBufferFree();
+    }
 
-    if (partial_read_state == PartialReadState::PARTIAL) {
-        partial_read_state = PartialReadState::FINISHED;
+    va_list va2;
+    va_copy(va2, va);
+    int length = vsnprintf(dest, max_size, fmt, va2);
+    va_end(va2);
 
-        switch (PollInput(-1)) {
-        case WAS_SIMPLE_POLL_SUCCESS:
-            break;
+    if (length < 0)
+        return false;
 
-        case WAS_SIMPLE_POLL_ERROR:
-        case WAS_SIMPLE_POLL_TIMEOUT:
-        case WAS_SIMPLE_POLL_CLOSED:
-            return -2;
+    if (size_t(length) < max_size) {
+        if (dest == stack_buffer)
+            return Write(stack_buffer, length);
 
-        case WAS_SIMPLE_POLL_END:
-            return 0;
-        }
+        return CommitOutputBuffer(length);
     }
 
-    ssize_t nbytes = read(input.fd, buffer, length);
-    if (nbytes < 0 && errno == EAGAIN) {
-        /* reading blocks: poll for data (or for control commands and
-           handle them) */
-        switch (PollInput(-1)) {
-        case WAS_SIMPLE_POLL_SUCCESS:
-            /* time to try again */
-
-            length = input.ClampRemaining(length);
-            assert(length > 0);
-
-            nbytes = read(input.fd, buffer, length);
-            break;
-
-        case WAS_SIMPLE_POLL_ERROR:
-        case WAS_SIMPLE_POLL_TIMEOUT:
-        case WAS_SIMPLE_POLL_CLOSED:
-            return -2;
+    /* the formatted string is too large; try again with a buffer
+       which is large enough */
 
-        case WAS_SIMPLE_POLL_END:
-            return 0;
-        }
-    }
+    if (use_buffer && size_t(length) < output.buffer.capacity) {
+        if (!FlushOutputBuffer())
+            return false;
 
-    if (nbytes <= 0) {
-        response.state = Response::State::ERROR;
-        return nbytes < 0 ? -1 : -2;
+        vsnprintf(output.buffer.data, output.buffer.capacity, fmt, va);
+        return CommitOutputBuffer(length);
     }
 
-    if (!Received(nbytes))
-        return -2;
-
-    if (size_t(nbytes) < length &&
-        partial_read_state == PartialReadState::INITIAL)
-        partial_read_state = PartialReadState::PARTIAL;
+    char *heap_buffer = (char *)malloc(length + 1);
+    if (heap_buffer == nullptr)
+        return false;
 
-    return nbytes;
+    vsnprintf(heap_buffer, length + 1, fmt, va);
+    bool success = Write(heap_buffer, length);
+    free(heap_buffer);
+    return success;
 }
 
-bool
-was_simple::CloseInput()
+inline ssize_t
+was_simple::Splice(size_t max_length) noexcept
 {
     assert(response.state != Response::State::NONE);
 
     if (response.state == Response::State::ERROR)
-        return false;
+        return -2;
 
-    /* kludge: send STOP for request body only if another control
-       packet will be sent in this function, because otherwise
-       beng-proxy's was_stock may be confused by a control packet on
-       an idle WAS control connection */
-    if (IsControlFinished())
-        return true;
+    if (input.premature && !input.ignore_premature)
+        return -2;
 
-    if (input.no_body || input.stopped || input.premature ||
-        input.IsEOF())
-        return true;
+    if (IsCompressing()) {
+        /* the data must pass through the compressor */
+        char buffer[16384];
+        const ssize_t nbytes = Read(buffer,
+                                    std::min(max_length, sizeof(buffer)));
+        if (nbytes > 0 && !Write(buffer, nbytes))
+            return -2;
 
-    if (!control.SendEmpty(WAS_COMMAND_STOP)) {
-        response.state = Response::State::ERROR;
-        return false;
+        return nbytes;
+    }
+
+    if (const size_t buffered = input.GetBuffered();
+        buffered > 0 && max_length > 0) {
+        /* copy data from the read-ahead buffer first */
+        const size_t length = std::min(buffered, max_length);
+        if (!Write(input.buffer.data + input.buffer.start, length))
+            return IsWouldBlock() ? -1 : -2;
+
+        input.Consume(length);
+        return length;
     }
 
-    input.stopped = true;
-    return true;
-}
+    if (input.no_body || input.IsEOF())
+        return 0;
 
-bool
-was_simple::SetStatus(http_status_t status)
-{
-    assert(response.state != Response::State::NONE);
+    max_length = input.ClampRemaining(max_length);
+    if (max_length == 0)
+        return 0;
 
-    if (response.state != Response::State::STATUS)
-        /* too late for sending the status */
-        return false;
+    if (!SetResponseStateBody() ||
+        !output.CanSend(max_length))
+        return -2;
 
-    if (!control.SendPacket(WAS_COMMAND_STATUS, &status, sizeof(status))) {
+    if (!FlushOutputBuffer())
+        return IsWouldBlock() ? -1 : -2;
+
+    if (!control.Flush()) {
         response.state = Response::State::ERROR;
-        return false;
+        return -2;
     }
 
-    response.state = Response::State::HEADERS;
-    output.no_body = http_status_is_empty(status);
-    return true;
-}
+    if (partial_read_state == PartialReadState::PARTIAL) {
+        partial_read_state = PartialReadState::FINISHED;
 
-inline bool
-was_simple::SetHeader(std::string_view name,
-                      std::string_view value) noexcept
-{
-    assert(response.state != Response::State::NONE);
+        switch (WaitInput()) {
+        case WAS_SIMPLE_POLL_SUCCESS:
+            break;
 
-    if (response.state == Response::State::STATUS &&
-        !SetStatus(HTTP_STATUS_OK))
-        return false;
+        case WAS_SIMPLE_POLL_TIMEOUT:
+            /* non-blocking mode: EAGAIN */
+            return -1;
 
-    if (response.state != Response::State::HEADERS)
-        /* too late for sending headers */
-        return false;
+        case WAS_SIMPLE_POLL_ERROR:
+        case WAS_SIMPLE_POLL_CLOSED:
+            return -2;
 
-    bool success = control.SendHeader(WAS_COMMAND_HEADER,
-                                      name.size() + 1 + value.size()) &&
-        control.Send(name.data(), name.size()) &&
-        control.Send("=", 1) &&
-        control.Send(value.data(), value.size());
+        case WAS_SIMPLE_POLL_END:
+            return 0;
+        }
+    }
 
-    if (!success)
-        response.state = Response::State::ERROR;
+    CountStat(Stat::PIPE_SPLICES);
+    ssize_t nbytes = splice(input.fd, nullptr,
+                            output.fd, nullptr, max_length,
+                            SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+    if (nbytes < 0 && errno == EAGAIN && non_block) {
+        /* find out which of the two pipes is blocking */
+        switch (PollInput(0)) {
+        case WAS_SIMPLE_POLL_SUCCESS:
+            WouldBlock(0, POLLOUT);
+            return -1;
 
-    return success;
-}
+        case WAS_SIMPLE_POLL_TIMEOUT:
+            WouldBlock(POLLIN, 0);
+            return -1;
 
-bool
-was_simple::SetLength(uint64_t length)
-{
-    assert(response.state != Response::State::NONE);
+        case WAS_SIMPLE_POLL_ERROR:
+        case WAS_SIMPLE_POLL_CLOSED:
+            return -2;
 
-    if (output.no_body)
-        return false;
+        case WAS_SIMPLE_POLL_END:
+            return 0;
+        }
+    }
 
-    assert(length >= output.sent);
+    if (nbytes < 0 && errno == EAGAIN) {
+        switch (PollInput(-1)) {
+        case WAS_SIMPLE_POLL_SUCCESS:
+            break;
 
-    if (output.known_length) {
-        assert(length == output.known_length);
-        return true;
-    }
+        case WAS_SIMPLE_POLL_ERROR:
+        case WAS_SIMPLE_POLL_TIMEOUT:
+        case WAS_SIMPLE_POLL_CLOSED:
+            return -2;
 
-    if (response.state == Response::State::STATUS &&
-        !SetStatus(HTTP_STATUS_OK))
-        return false;
+        case WAS_SIMPLE_POLL_END:
+            return 0;
+        }
 
-    if (response.state == Response::State::HEADERS) {
-        if (!control.SendEmpty(WAS_COMMAND_DATA)) {
-            response.state = Response::State::ERROR;
-            return false;
+        switch (PollOutput(-1)) {
+        case WAS_SIMPLE_POLL_SUCCESS:
+            break;
+
+        case WAS_SIMPLE_POLL_ERROR:
+        case WAS_SIMPLE_POLL_TIMEOUT:
+        case WAS_SIMPLE_POLL_CLOSED:
+        case WAS_SIMPLE_POLL_END:
+            return -2;
         }
 
-        response.state = Response::State::BODY;
+        CountStat(Stat::PIPE_SPLICES);
+        nbytes = splice(input.fd, nullptr,
+                        output.fd, nullptr, max_length,
+                        SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
     }
 
-    assert(response.state == Response::State::BODY);
+    if (nbytes < 0)
+        return -1;
 
-    /* before finishing the response, the whole request body must be
-       discarded, or else we may mix up with the next request body if
-       we miss a PREMATURE packet */
-    if (length == output.sent && !CloseDiscardInput()) {
-        response.state = Response::State::ERROR;
-        return false;
-    }
+    if (nbytes == 0)
+        /* the pipe was closed - this shouldn't happen */
+        return -2;
 
-    if (!control.SendUint64(WAS_COMMAND_LENGTH, length) ||
-        !control.Flush()) {
-        response.state = Response::State::ERROR;
-        return false;
-    }
+    WAS_TRACE1(splice, nbytes);
 
-    output.announced = length;
-    output.known_length = true;
+    if (!Received(nbytes))
+        return -2;
 
+    output.Sent(nbytes);
+    metrics.spliced += nbytes;
     if (output.IsFull())
         response.state = Response::State::END;
 
-    return true;
+    return nbytes;
 }
 
-bool
-was_simple::SetResponseStateBody()
+inline bool
+was_simple::SpliceAll(bool end) noexcept
 {
-    assert(response.state != Response::State::NONE);
+    while (true) {
+        if (end && !output.known_length && !IsCompressing() &&
+            input.known_length &&
+            !SetLength(input.GetRemaining() + output.GetPosition()))
+            return false;
 
-    if (response.state == Response::State::ERROR)
-        return false;
+        ssize_t nbytes = Splice(INT_MAX);
+        if (nbytes < 0)
+            return false;
 
-    if (response.state == Response::State::STATUS &&
-        !SetStatus(HTTP_STATUS_OK))
-        return false;
+        if (nbytes == 0)
+            return !end || End();
+    }
+}
 
-    if (response.state == Response::State::HEADERS) {
-        if (output.no_body) {
-            response.state = Response::State::END;
-            if (!control.SendEmpty(WAS_COMMAND_NO_DATA))
-                response.state = Response::State::ERROR;
+/**
+ * Read a chunk from a file with pread().  This is a fallback for
+ * files which do not support splice().
+ */
+static ssize_t
+ReadFileChunk(int fd, uint64_t offset, void *buffer, size_t size) noexcept
+{
+    ssize_t nbytes = pread(fd, buffer, size, offset);
+    if (nbytes == 0)
+        /* the file was truncated meanwhile */
+        errno = ENODATA;
+    return nbytes;
+}
+
+inline bool
+was_simple::CompressFile(int fd, uint64_t offset, uint64_t length) noexcept
+{
+    if (!compression.known_length) {
+        if (!SetLength(compression.position + length))
             return false;
-        }
+    } else if (compression.position + length > compression.announced)
+        return false;
 
-        if (!control.SendEmpty(WAS_COMMAND_DATA)) {
+    while (length > 0) {
+        char buffer[16384];
+        const ssize_t nbytes =
+            ReadFileChunk(fd, offset, buffer,
+                          std::min<uint64_t>(length, sizeof(buffer)));
+        if (nbytes <= 0) {
             response.state = Response::State::ERROR;
             return false;
         }
 
-        if (output.IsFull()) {
-            response.state = Response::State::END;
+        if (!Write(buffer, nbytes))
             return false;
-        }
 
-        response.state = Response::State::BODY;
+        offset += nbytes;
+        length -= nbytes;
     }
 
-    return response.state == Response::State::BODY;
+    return true;
 }
 
-enum was_simple_poll_result
-was_simple::PollOutput(int timeout_ms)
+bool
+was_simple::SendFile(int fd, uint64_t offset, uint64_t length) noexcept
 {
     assert(response.state != Response::State::NONE);
 
-    if (response.state == Response::State::STOP)
-        return WAS_SIMPLE_POLL_ERROR;
-
-    if (output.IsFull())
-        return WAS_SIMPLE_POLL_END;
-
-    if (!control.Flush() || !ApplyPendingControl() ||
-        !control.Flush()) {
-        response.state = Response::State::ERROR;
-        return WAS_SIMPLE_POLL_ERROR;
+    if (non_block) {
+        /* this function always blocks: leave non-blocking mode
+           temporarily, after writing the pending data */
+        BeginOperation();
+        non_block = false;
+        const bool result = FlushPendingBlocking() &&
+            SendFile(fd, offset, length);
+        non_block = true;
+        return EndOperation(result, false);
     }
 
-    if (response.state > Response::State::BODY)
-        /* throw WAS_SIMPLE_POLL_ERROR even if state==END, which may
-           have been caused by STOP; in that case, the current request
-           must be aborted by the application, but this object may be
-           reused, so don't set state=ERROR */
-        return WAS_SIMPLE_POLL_ERROR;
-
-    struct pollfd fds[] = {
-        MakePollfd(control.fd, POLLIN),
-        MakePollfd(output.fd, POLLOUT),
-    };
-
-    while (true) {
-        int ret = poll(fds, ARRAY_SIZE(fds), timeout_ms);
-        if (ret < 0) {
-            response.state = Response::State::ERROR;
-            return WAS_SIMPLE_POLL_ERROR;
-        }
-
-        if (ret == 0)
-            return WAS_SIMPLE_POLL_TIMEOUT;
-
-        if (fds[0].revents & POLLIN) {
-            if (!control.Fill(true) ||
-                !ApplyPendingControl()) {
-                response.state = Response::State::ERROR;
-                return WAS_SIMPLE_POLL_ERROR;
-            }
+    if (IsCompressing())
+        return CompressFile(fd, offset, length);
 
-            if (response.state > Response::State::BODY)
-                /* throw WAS_SIMPLE_POLL_ERROR even if state==END,
-                   which may have been caused by STOP; in that case,
-                   the current request must be aborted by the
-                   application, but this object may be reused, so
-                   don't set state=ERROR */
-                return WAS_SIMPLE_POLL_ERROR;
-        }
+    /* the file contents are not recorded */
+    caching.Cancel();
 
-        if (fds[1].revents & POLLOUT)
-            return WAS_SIMPLE_POLL_SUCCESS;
-    }
-}
+    if (!output.known_length) {
+        if (!SetLength(output.GetPosition() + length))
+            return false;
+    } else if (!output.CanSend(length))
+        return false;
 
-inline bool
-was_simple::Write(const void *data0, size_t length)
-{
-    assert(response.state != Response::State::NONE);
+    if (length == 0)
+        return true;
 
-    if (!SetResponseStateBody() ||
-        !output.CanSend(length))
+    if (!SetResponseStateBody() || !FlushOutputBuffer())
         return false;
 
     /* before finishing the response, the whole request body must be
        discarded, or else we may mix up with the next request body if
        we miss a PREMATURE packet */
-    if (output.known_length && output.sent + length >= output.announced &&
-        !CloseDiscardInput()) {
+    if (output.sent + length >= output.announced && !CloseDiscardInput()) {
+        response.state = Response::State::ERROR;
+        return false;
+    }
+
+    if (!control.Flush()) {
         response.state = Response::State::ERROR;
         return false;
     }
 
-    if (!control.Flush()) {
-        response.state = Response::State::ERROR;
-        return false;
-    }
+    loff_t position = offset;
+    bool use_splice = true;
+
+    while (length > 0) {
+        constexpr size_t max_splice = 1 << 30;
+        const size_t chunk = length < max_splice ? size_t(length) : max_splice;
+
+        ssize_t nbytes;
+        if (use_splice) {
+            CountStat(Stat::PIPE_SPLICES);
+            nbytes = splice(fd, &position, output.fd, nullptr, chunk,
+                            SPLICE_F_MOVE|SPLICE_F_NONBLOCK|SPLICE_F_MORE);
+            if (nbytes < 0 && errno == EINVAL) {
+                /* this file does not support splice() */
+                use_splice = false;
+                continue;
+            }
+
+            if (nbytes == 0) {
+                /* the file was truncated meanwhile */
+                response.state = Response::State::ERROR;
+                errno = ENODATA;
+                return false;
+            }
+        } else {
+            char buffer[16384];
+            nbytes = ReadFileChunk(fd, position, buffer,
+                                   std::min(chunk, sizeof(buffer)));
+            if (nbytes <= 0) {
+                response.state = Response::State::ERROR;
+                return false;
+            }
+
+            /* WriteDirect() does the accounting and handles
+               EAGAIN */
+            if (!WriteDirect(buffer, nbytes))
+                return false;
 
-    const char *data = (const char *)data0;
+            position += nbytes;
+            length -= nbytes;
+            continue;
+        }
 
-    while (length > 0) {
-        ssize_t nbytes = write(output.fd, data, length);
         if (nbytes < 0 && errno == EAGAIN) {
             /* writing blocks: poll for the pipe to become writable
-               again (or for control commands and handle them) */
+               again (or for control commands, e.g. STOP, and handle
+               them) */
             switch (PollOutput(-1)) {
             case WAS_SIMPLE_POLL_SUCCESS:
-                /* time to try again */
                 continue;
 
             case WAS_SIMPLE_POLL_ERROR:
@@ -1522,196 +4365,573 @@ was_simple::Write(const void *data0, size_t length)
             }
         }
 
-        if (nbytes <= 0) {
+        if (nbytes < 0) {
             response.state = Response::State::ERROR;
             return false;
         }
 
         output.Sent(nbytes);
-        data += nbytes;
+        metrics.spliced += nbytes;
         length -= nbytes;
-
-        if (output.IsFull()) {
-            response.state = Response::State::END;
-            if (length > 0)
-                return false;
-        }
     }
 
+    if (output.IsFull())
+        response.state = Response::State::END;
+
     return true;
 }
 
-inline ssize_t
-was_simple::Splice(size_t max_length) noexcept
+ssize_t
+was_simple::SpliceFrom(int fd, size_t max_length) noexcept
 {
     assert(response.state != Response::State::NONE);
 
+    if (non_block) {
+        /* this function always blocks, see SendFile() */
+        BeginOperation();
+        non_block = false;
+        const ssize_t result = FlushPendingBlocking()
+            ? SpliceFrom(fd, max_length)
+            : -2;
+        non_block = true;
+        return EndOperation(result, ssize_t(-2));
+    }
+
     if (response.state == Response::State::ERROR)
         return -2;
 
-    if (input.premature && !input.ignore_premature)
-        return -2;
+    if (IsCompressing()) {
+        /* the data must pass through the compressor */
+        if (compression.known_length) {
+            const uint64_t rest = compression.announced - compression.position;
+            if (rest < max_length)
+                max_length = rest;
+        }
 
-    if (input.no_body || input.IsEOF())
-        return 0;
+        if (max_length == 0)
+            return 0;
+
+        char buffer[16384];
+        while (true) {
+            const ssize_t nbytes = read(fd, buffer,
+                                        std::min(max_length, sizeof(buffer)));
+            if (nbytes < 0 && errno == EAGAIN) {
+                struct pollfd pfd = MakePollfd(fd, POLLIN);
+                ++metrics.waits;
+                CountStat(Stat::POLLS);
+                if (poll(&pfd, 1, -1) < 0)
+                    return -1;
+
+                continue;
+            }
+
+            if (nbytes <= 0)
+                return nbytes;
+
+            return Write(buffer, nbytes) ? nbytes : -2;
+        }
+    }
+
+    /* the spliced data is not recorded */
+    caching.Cancel();
+
+    if (output.known_length) {
+        const uint64_t rest = output.announced - output.GetPosition();
+        if (rest < max_length)
+            max_length = rest;
+    }
 
-    max_length = input.ClampRemaining(max_length);
     if (max_length == 0)
         return 0;
 
-    if (!SetResponseStateBody() ||
-        !output.CanSend(max_length))
+    if (!SetResponseStateBody() || !FlushOutputBuffer())
+        return -2;
+
+    /* see SendFile() */
+    if (output.known_length &&
+        output.sent + max_length >= output.announced &&
+        !CloseDiscardInput()) {
+        response.state = Response::State::ERROR;
         return -2;
+    }
 
     if (!control.Flush()) {
         response.state = Response::State::ERROR;
         return -2;
     }
 
-    if (partial_read_state == PartialReadState::PARTIAL) {
-        partial_read_state = PartialReadState::FINISHED;
+    while (true) {
+        CountStat(Stat::PIPE_SPLICES);
+        const ssize_t nbytes = splice(fd, nullptr, output.fd, nullptr,
+                                      max_length,
+                                      SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+        if (nbytes > 0) {
+            WAS_TRACE1(splice, nbytes);
 
-        switch (PollInput(-1)) {
-        case WAS_SIMPLE_POLL_SUCCESS:
-            break;
+            output.Sent(nbytes);
+            metrics.spliced += nbytes;
 
-        case WAS_SIMPLE_POLL_ERROR:
-        case WAS_SIMPLE_POLL_TIMEOUT:
-        case WAS_SIMPLE_POLL_CLOSED:
-            return -2;
+            if (output.IsFull())
+                response.state = Response::State::END;
 
-        case WAS_SIMPLE_POLL_END:
+            return nbytes;
+        }
+
+        if (nbytes == 0)
+            /* end of the source */
             return 0;
+
+        if (errno != EAGAIN)
+            return -1;
+
+        /* find out which side is blocking: if the source has data,
+           it's the response pipe */
+        struct pollfd pfd = MakePollfd(fd, POLLIN);
+
+        CountStat(Stat::POLLS);
+        const int result = poll(&pfd, 1, 0);
+        if (result < 0)
+            return -1;
+
+        if (result == 0) {
+            /* the source is empty; the whole response is waiting for
+               it */
+            ++metrics.waits;
+            CountStat(Stat::POLLS);
+            if (poll(&pfd, 1, -1) < 0)
+                return -1;
+
+            continue;
         }
-    }
 
-    ssize_t nbytes = splice(input.fd, nullptr,
-                            output.fd, nullptr, max_length,
-                            SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
-    if (nbytes < 0 && errno == EAGAIN) {
-        switch (PollInput(-1)) {
+        switch (PollOutput(-1)) {
         case WAS_SIMPLE_POLL_SUCCESS:
-            break;
+            continue;
 
         case WAS_SIMPLE_POLL_ERROR:
         case WAS_SIMPLE_POLL_TIMEOUT:
         case WAS_SIMPLE_POLL_CLOSED:
-            return -2;
-
         case WAS_SIMPLE_POLL_END:
-            return 0;
+            return -2;
         }
+    }
+}
 
-        switch (PollOutput(-1)) {
+/**
+ * Skip optional whitespace.
+ */
+static std::string_view
+StripLeft(std::string_view s) noexcept
+{
+    while (!s.empty() && (s.front() == ' ' || s.front() == '\t'))
+        s.remove_prefix(1);
+    return s;
+}
+
+/**
+ * Parse an unsigned decimal number.
+ *
+ * @return false if there is no number or on overflow
+ */
+static bool
+ParseUint64(std::string_view &s, uint64_t &value_r) noexcept
+{
+    if (s.empty() || s.front() < '0' || s.front() > '9')
+        return false;
+
+    uint64_t value = 0;
+    while (!s.empty() && s.front() >= '0' && s.front() <= '9') {
+        const unsigned digit = s.front() - '0';
+        if (value > (UINT64_MAX - digit) / 10)
+            return false;
+
+        value = value * 10 + digit;
+        s.remove_prefix(1);
+    }
+
+    value_r = value;
+    return true;
+}
+
+http_status_t
+was_simple::GetRange(uint64_t size,
+                     uint64_t &offset_r, uint64_t &length_r) const noexcept
+{
+    assert(response.state != Response::State::NONE);
+
+    offset_r = 0;
+    length_r = size;
+
+    if (request.method != HTTP_METHOD_GET)
+        return HTTP_STATUS_OK;
+
+    const char *range_header = request.header_tokens[WAS_SIMPLE_HEADER_RANGE];
+    if (range_header == nullptr ||
+        /* we can't verify the validator; send the whole file */
+        request.header_tokens[WAS_SIMPLE_HEADER_IF_RANGE] != nullptr)
+        return HTTP_STATUS_OK;
+
+    std::string_view s = range_header;
+    if (s.substr(0, 6) != "bytes=")
+        return HTTP_STATUS_OK;
+
+    s = StripLeft(s.substr(6));
+
+    uint64_t first, last;
+    if (!s.empty() && s.front() == '-') {
+        /* suffix range: the last N bytes */
+        s.remove_prefix(1);
+
+        uint64_t suffix;
+        if (!ParseUint64(s, suffix))
+            return HTTP_STATUS_OK;
+
+        if (!StripLeft(s).empty())
+            /* multiple ranges are not implemented; ignore the
+               header */
+            return HTTP_STATUS_OK;
+
+        if (suffix == 0 || size == 0)
+            return HTTP_STATUS_REQUESTED_RANGE_NOT_SATISFIABLE;
+
+        first = suffix < size ? size - suffix : 0;
+        last = size - 1;
+    } else {
+        if (!ParseUint64(s, first))
+            return HTTP_STATUS_OK;
+
+        s = StripLeft(s);
+        if (s.empty() || s.front() != '-')
+            return HTTP_STATUS_OK;
+
+        s = StripLeft(s.substr(1));
+
+        if (s.empty() || s.front() < '0' || s.front() > '9') {
+            /* open-ended range */
+            last = UINT64_MAX;
+        } else if (!ParseUint64(s, last) || last < first)
+            return HTTP_STATUS_OK;
+
+        if (!StripLeft(s).empty())
+            /* multiple ranges are not implemented; ignore the
+               header */
+            return HTTP_STATUS_OK;
+
+        if (first >= size)
+            return HTTP_STATUS_REQUESTED_RANGE_NOT_SATISFIABLE;
+
+        if (last >= size)
+            last = size - 1;
+    }
+
+    offset_r = first;
+    length_r = last - first + 1;
+    return HTTP_STATUS_PARTIAL_CONTENT;
+}
+
+bool
+was_simple::SendFileRange(int fd, uint64_t size) noexcept
+{
+    uint64_t offset, length;
+    const http_status_t status = GetRange(size, offset, length);
+
+    if (!SetStatus(status) ||
+        !SetHeader("accept-ranges", "bytes"))
+        return false;
+
+    char buffer[64];
+
+    switch (status) {
+    case HTTP_STATUS_PARTIAL_CONTENT:
+        snprintf(buffer, sizeof(buffer), "bytes %llu-%llu/%llu",
+                 (unsigned long long)offset,
+                 (unsigned long long)(offset + length - 1),
+                 (unsigned long long)size);
+        if (!SetHeader("content-range", buffer))
+            return false;
+        break;
+
+    case HTTP_STATUS_REQUESTED_RANGE_NOT_SATISFIABLE:
+        snprintf(buffer, sizeof(buffer), "bytes */%llu",
+                 (unsigned long long)size);
+        return SetHeader("content-range", buffer) && End();
+
+    default:
+        break;
+    }
+
+    return SendFile(fd, offset, length);
+}
+
+inline bool
+was_simple::SpliceTo(const int out_fd) noexcept
+{
+    constexpr std::size_t max_len = 1 << 30;
+
+    const int in_fd = was_simple_input_fd(this);
+    if (in_fd < 0)
+        return false;
+
+    while (true) {
+        switch (WaitInput()) {
         case WAS_SIMPLE_POLL_SUCCESS:
             break;
 
         case WAS_SIMPLE_POLL_ERROR:
         case WAS_SIMPLE_POLL_TIMEOUT:
-        case WAS_SIMPLE_POLL_CLOSED:
+            return false;
+
         case WAS_SIMPLE_POLL_END:
-            return -2;
+            return true;
+
+        case WAS_SIMPLE_POLL_CLOSED:
+            return false;
         }
 
-        nbytes = splice(input.fd, nullptr,
-                        output.fd, nullptr, max_length,
-                        SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
-    }
+        CountStat(Stat::PIPE_SPLICES);
+        auto nbytes = splice(in_fd, nullptr,
+                             out_fd, nullptr,
+                             input.ClampRemaining(max_len),
+                             SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+        if (nbytes < 0) {
+            if (errno != EAGAIN)
+                return false;
 
-    if (nbytes < 0)
-        return -1;
+            /* either the request body pipe is empty (that's what
+               WaitInput() is for) or out_fd is a full pipe; wait for
+               the latter here instead of spinning, but keep handling
+               control packets meanwhile */
+            struct pollfd fds[] = {
+                MakePollfd(control.GetPollFd(), POLLIN),
+                MakePollfd(out_fd, POLLOUT),
+            };
 
-    if (nbytes == 0)
-        /* the pipe was closed - this shouldn't happen */
-        return -2;
+            if (Poll(fds, ARRAY_SIZE(fds), -1) < 0)
+                return false;
 
-    if (!Received(nbytes))
-        return -2;
+            if (fds[0].revents & POLLIN) {
+                /* EAGAIN is a spurious wakeup */
+                if ((!control.Fill(true) && errno != EAGAIN) ||
+                    !ApplyPendingControl()) {
+                    response.state = Response::State::ERROR;
+                    return false;
+                }
 
-    output.Sent(nbytes);
-    if (output.IsFull())
-        response.state = Response::State::END;
+                /* PREMATURE and STOP are reported by WaitInput() */
+            }
 
-    return nbytes;
+            continue;
+        }
+
+        if (!Received(nbytes))
+            return false;
+    }
 }
 
 inline bool
-was_simple::SpliceAll(bool end) noexcept
+was_simple::DiscardAllInput()
 {
+    /* since we're discarding everything, receiving PREMATURE is okay,
+       just stop there and report success */
+    input.ignore_premature = true;
+
+    input.DiscardBuffered();
+
+    if (dev_null == -2)
+        dev_null = open("/dev/null", O_WRONLY|O_NOCTTY|O_CLOEXEC);
+
+    if (dev_null >= 0)
+        return SpliceTo(dev_null);
+
     while (true) {
-        if (end && !output.known_length && input.known_length &&
-            !SetLength(input.announced - input.received + output.sent))
-            return false;
+        char buffer[4096];
+        ssize_t nbytes = Read(buffer, sizeof(buffer));
+        if (nbytes <= 0)
+            return nbytes == 0;
+    }
+}
 
-        ssize_t nbytes = Splice(INT_MAX);
+inline bool
+was_simple::SpliceInputTo(int out_fd) noexcept
+{
+    if (response.state == Response::State::ERROR)
+        return false;
+
+    while (input.GetBuffered() > 0) {
+        CountStat(Stat::PIPE_WRITES);
+        const ssize_t nbytes = write(out_fd,
+                                     input.buffer.data + input.buffer.start,
+                                     input.GetBuffered());
         if (nbytes < 0)
             return false;
 
-        if (nbytes == 0)
-            return !end || End();
+        input.Consume(nbytes);
+    }
+
+    return SpliceTo(out_fd);
+}
+
+void *
+was_simple::ReadInputToBuffer(size_t length) noexcept
+{
+    char *data = (char *)malloc(length);
+    if (data == nullptr)
+        return nullptr;
+
+    for (size_t position = 0; position < length;) {
+        const ssize_t nbytes = Read(data + position, length - position);
+        if (nbytes <= 0) {
+            /* error or PREMATURE */
+            free(data);
+            return nullptr;
+        }
+
+        position += nbytes;
+    }
+
+    return data;
+}
+
+int
+was_simple::SpliceInputToMemfd(size_t length) noexcept
+{
+    const int fd = memfd_create("was-request-body", MFD_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    /* allocate all pages now so running out of memory is reported
+       here and not by SIGBUS while the mapping is being accessed */
+    if (length > 0 && fallocate(fd, 0, 0, length) < 0 &&
+        errno != EOPNOTSUPP) {
+        close(fd);
+        return -1;
+    }
+
+    if (!SpliceInputTo(fd)) {
+        /* error or PREMATURE */
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+void *
+was_simple::ReadInputToMemfd(size_t length) noexcept
+{
+    const int fd = SpliceInputToMemfd(length);
+    if (fd < 0)
+        return nullptr;
+
+    void *data = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    return data != MAP_FAILED ? data : nullptr;
+}
+
+const void *
+was_simple::ReadUnknownInputToMemfd(size_t *length_r) noexcept
+{
+    static constexpr char empty = 0;
+
+    const int fd = SpliceInputToMemfd(0);
+    if (fd < 0)
+        return nullptr;
+
+    /* the file position is where the body ends */
+    const off_t position = lseek(fd, 0, SEEK_CUR);
+    if (position < 0) {
+        close(fd);
+        return nullptr;
+    }
+
+    if (position == 0) {
+        close(fd);
+        *length_r = 0;
+        return &empty;
+    }
+
+    if (uint64_t(position) > SIZE_MAX) {
+        close(fd);
+        errno = EFBIG;
+        return nullptr;
     }
+
+    const size_t length = position;
+    void *data = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return nullptr;
+
+    input.map.data = data;
+    input.map.size = length;
+    input.map.mapped = true;
+
+    *length_r = length;
+    return data;
 }
 
-inline bool
-was_simple::SpliceTo(const int out_fd) noexcept
+inline const void *
+was_simple::MapInput(size_t *length_r) noexcept
 {
-    constexpr std::size_t max_len = 1 << 30;
-
-    const int in_fd = was_simple_input_fd(this);
-    if (in_fd < 0)
-        return false;
+    assert(response.state != Response::State::NONE);
 
-    while (true) {
-        switch (PollInput(-1)) {
-        case WAS_SIMPLE_POLL_SUCCESS:
-            break;
+    if (non_block) {
+        /* this function always blocks, see SendFile() */
+        BeginOperation();
+        non_block = false;
+        const void *result = FlushPendingBlocking()
+            ? MapInput(length_r)
+            : nullptr;
+        non_block = true;
+        return EndOperation(result, (const void *)nullptr);
+    }
 
-        case WAS_SIMPLE_POLL_ERROR:
-        case WAS_SIMPLE_POLL_TIMEOUT:
-            return false;
+    if (input.map.data != nullptr) {
+        /* already mapped */
+        *length_r = input.map.size;
+        return input.map.data;
+    }
 
-        case WAS_SIMPLE_POLL_END:
-            return true;
+    if (response.state == Response::State::ERROR || input.stopped ||
+        (input.premature && !input.ignore_premature))
+        return nullptr;
 
-        case WAS_SIMPLE_POLL_CLOSED:
-            return false;
-        }
+    static constexpr char empty = 0;
 
-        auto nbytes = splice(in_fd, nullptr,
-                             out_fd, nullptr,
-                             input.ClampRemaining(max_len),
-                             SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
-        if (nbytes < 0) {
-            if (errno == EAGAIN)
-                continue;
+    if (input.no_body) {
+        *length_r = 0;
+        return &empty;
+    }
 
-            return false;
-        }
+    if (!input.known_length)
+        /* LENGTH may still be on its way */
+        return ReadUnknownInputToMemfd(length_r);
 
-        if (!Received(nbytes))
-            return false;
+    const uint64_t remaining = input.GetRemaining();
+    if (remaining > SIZE_MAX) {
+        errno = EFBIG;
+        return nullptr;
     }
-}
 
-inline bool
-was_simple::DiscardAllInput()
-{
-    /* since we're discarding everything, receiving PREMATURE is okay,
-       just stop there and report success */
-    input.ignore_premature = true;
+    const size_t length = remaining;
+    if (length == 0) {
+        *length_r = 0;
+        return &empty;
+    }
 
-    if (dev_null == -2)
-        dev_null = open("/dev/null", O_WRONLY|O_NOCTTY|O_CLOEXEC);
+    const bool mapped = length > Input::MAP_THRESHOLD;
+    void *data = mapped
+        ? ReadInputToMemfd(length)
+        : ReadInputToBuffer(length);
+    if (data == nullptr)
+        return nullptr;
 
-    if (dev_null >= 0)
-        return SpliceTo(dev_null);
+    input.map.data = data;
+    input.map.size = length;
+    input.map.mapped = mapped;
 
-    while (true) {
-        char buffer[4096];
-        ssize_t nbytes = Read(buffer, sizeof(buffer));
-        if (nbytes <= 0)
-            return nbytes == 0;
-    }
+    *length_r = length;
+    return data;
 }
 
 bool
@@ -1725,13 +4945,34 @@ was_simple::End()
     if (!CloseDiscardInput())
         return false;
 
+    /* finish the compressed stream? */
+    bool compressed_premature = false;
+    if (IsCompressing()) {
+        if (compression.known_length && compression.position < compression.announced)
+            /* shorter than declared: abort the body just like an
+               uncompressed one (below) */
+            compressed_premature = true;
+        else if ((response.state == Response::State::BODY ||
+                  /* nothing has been written, but "content-encoding"
+                     has already been sent: send an empty stream */
+                  response.state == Response::State::HEADERS) &&
+                 !FinishCompression())
+            return false;
+
+        compression.compressor.Stop();
+    }
+
     /* generate a status code? */
     if (response.state == Response::State::STATUS &&
         !SetStatus(HTTP_STATUS_NO_CONTENT))
         return false;
 
+    if (!SendAutoMetrics())
+        return false;
+
     /* no response body? */
-    if (response.state == Response::State::HEADERS) {
+    const bool no_data = response.state == Response::State::HEADERS;
+    if (no_data) {
         if (!control.SendEmpty(WAS_COMMAND_NO_DATA)) {
             response.state = Response::State::ERROR;
             return false;
@@ -1744,18 +4985,46 @@ was_simple::End()
     if (response.state == Response::State::BODY) {
         assert(!output.no_body);
 
-        if (output.known_length) {
-            assert(output.sent < output.announced);
-
-            if (!control.SendUint64(WAS_COMMAND_PREMATURE, output.sent)) {
+        if (!non_block && !output.known_length && !compressed_premature &&
+            (control.HasRing() || output.buffer.size > 0)) {
+            /* announce the length first, so LENGTH is submitted
+               together with the rest of the body; without io_uring,
+               this is a fast path for buffered responses: the
+               headers, DATA and LENGTH are sent with one send(),
+               followed by one write() */
+            const uint64_t length = output.GetPosition();
+            if (!control.SendUint64(WAS_COMMAND_LENGTH, length)) {
                 response.state = Response::State::ERROR;
                 return false;
             }
 
-            response.state = Response::State::END;
-        } else {
-            if (!SetLength(output.sent))
+            output.announced = length;
+            output.known_length = true;
+
+            if (control.HasRing() ? !FlushRing() : !FlushOutputBuffer())
                 return false;
+        } else if (!FlushOutputBuffer() &&
+                   /* after STOP, finish the control channel below */
+                   response.state != Response::State::STOP)
+            return false;
+
+        /* flushing may have completed the announced body */
+        if (response.state == Response::State::BODY) {
+            if (output.known_length || compressed_premature) {
+                assert(!output.known_length ||
+                       output.sent < output.announced);
+
+                if (!control.SendUint64(WAS_COMMAND_PREMATURE,
+                                        output.sent)) {
+                    response.state = Response::State::ERROR;
+                    return false;
+                }
+
+                response.state = Response::State::END;
+            } else {
+                if (!SetLength(output.sent))
+                    return false;
+            }
         }
     }
 
@@ -1768,10 +5037,16 @@ was_simple::End()
     assert(response.state == Response::State::END ||
            response.state == Response::State::STOP);
 
+    if (caching.IsRecording())
+        StoreRecordedResponse(no_data);
+
     /* wait for PREMATURE? */
     if (input.stopped && !input.IsEOF()) {
         while (!input.premature) {
-            if (!ReadAndApplyControl()) {
+            if (!ReadAndApplyControl(non_block)) {
+                if (IsWouldBlock())
+                    return false;
+
                 response.state = Response::State::ERROR;
                 return false;
             }
@@ -1785,6 +5060,9 @@ was_simple::End()
 inline bool
 was_simple::Abort()
 {
+    compression.compressor.Stop();
+    caching.Cancel();
+
     switch (response.state) {
     case Response::State::NONE:
     case Response::State::STOP:
@@ -1801,6 +5079,7 @@ was_simple::Abort()
     case Response::State::BODY:
         if (!output.no_body && !output.IsFull()) {
             output.no_body = true;
+            output.DiscardUnsent();
 
             if (!control.SendUint64(WAS_COMMAND_PREMATURE, output.sent) ||
                 !control.Flush()) {
@@ -1829,10 +5108,13 @@ was_simple::SendMetric(std::string_view name, float value) noexcept
     if (!WantMetrics())
         return true;
 
-    bool success = control.SendHeader(WAS_COMMAND_METRIC,
-                                      sizeof(value) + name.size()) &&
-        control.Send(&value, sizeof(value)) &&
-        control.Send(name.data(), name.size());
+    const struct iovec payload[] = {
+        {&value, sizeof(value)},
+        {const_cast<char *>(name.data()), name.size()},
+    };
+
+    bool success = control.SendPacketV(WAS_COMMAND_METRIC,
+                                       payload, ARRAY_SIZE(payload));
 
     if (!success)
         response.state = Response::State::ERROR;
@@ -1840,6 +5122,53 @@ was_simple::SendMetric(std::string_view name, float value) noexcept
     return success;
 }
 
+bool
+was_simple::SendAutoMetrics() noexcept
+{
+    if (!metrics.active)
+        return true;
+
+    /* only once, even if End() is called again after EAGAIN */
+    metrics.active = false;
+
+    using Seconds = std::chrono::duration<float>;
+    const auto now = Metrics::Clock::now();
+
+    const uint64_t sent = output.GetPosition();
+
+    if (!SendMetric("was_handler_seconds",
+                    Seconds(now - metrics.accept_time).count()) ||
+        (metrics.body_time != Metrics::Clock::time_point{} &&
+         !SendMetric("was_first_byte_seconds",
+                     Seconds(metrics.body_time - metrics.accept_time).count())) ||
+        !SendMetric("was_request_body_bytes", float(input.received)) ||
+        !SendMetric("was_response_body_bytes", float(sent)) ||
+        !SendMetric("was_response_body_spliced_bytes", float(metrics.spliced)) ||
+        !SendMetric("was_response_body_copied_bytes",
+                    float(sent - std::min(sent, metrics.spliced))) ||
+        !SendMetric("was_waits", float(metrics.waits)))
+        return false;
+
+    return true;
+}
+
+unsigned
+was_simple::GetPoll(struct pollfd *fds) const noexcept
+{
+    unsigned n = 0;
+
+    /* the control channel is always relevant, because it may deliver
+       STOP, PREMATURE or a new request */
+    fds[n++] = MakePollfd(control.GetPollFd(), POLLIN);
+
+    if (wait.input != 0)
+        fds[n++] = MakePollfd(input.fd, wait.input);
+    else if (wait.output != 0)
+        fds[n++] = MakePollfd(output.fd, wait.output);
+
+    return n;
+}
+
 struct was_simple *
 was_simple_new(void)
 {
@@ -1852,28 +5181,126 @@ was_simple_new_fds(int control_fd, int input_fd, int output_fd)
     return new was_simple{control_fd, input_fd, output_fd};
 }
 
+/**
+ * A free list of #was_simple objects for Multi-WAS connections.  This
+ * saves the allocation (and page faults) of the large control
+ * buffers under connection churn.
+ */
+class SimplePool {
+    /**
+     * Never keep more than this number of idle objects.
+     */
+    static constexpr std::size_t MAX_IDLE = 64;
+
+    std::mutex mutex;
+
+    struct was_simple *idle[MAX_IDLE];
+    std::size_t n_idle = 0;
+
+public:
+    ~SimplePool() noexcept {
+        for (std::size_t i = 0; i < n_idle; ++i)
+            delete idle[i];
+    }
+
+    struct was_simple *Get() noexcept {
+        const std::lock_guard<std::mutex> lock(mutex);
+        return n_idle > 0 ? idle[--n_idle] : nullptr;
+    }
+
+    /**
+     * @return false if the pool is full
+     */
+    bool Put(struct was_simple *w) noexcept {
+        const std::lock_guard<std::mutex> lock(mutex);
+        if (n_idle >= MAX_IDLE)
+            return false;
+
+        idle[n_idle++] = w;
+        return true;
+    }
+};
+
+static SimplePool simple_pool;
+
+struct was_simple *
+was_simple_new_pooled(int control_fd, int input_fd, int output_fd) noexcept
+{
+    struct was_simple *w = simple_pool.Get();
+    if (w != nullptr)
+        w->Reopen(control_fd, input_fd, output_fd);
+    else {
+        w = new was_simple{control_fd, input_fd, output_fd};
+        w->pooled = true;
+    }
+
+    return w;
+}
+
 void
 was_simple_free(struct was_simple *w)
 {
+    if (w->pooled) {
+        w->Release();
+        if (simple_pool.Put(w))
+            return;
+    }
+
     delete w;
 }
 
 const char *
 was_simple_accept(struct was_simple *w)
 {
-    return w->Accept();
+    WAS_TRACE(accept_entry);
+    w->BeginOperation();
+    const char *uri = w->EndOperation(w->Accept(), (const char *)nullptr);
+    WAS_TRACE1(accept_return, uri);
+    return uri;
 }
 
 const char *
 was_simple_accept_non_block(struct was_simple *w, const char *would_block)
 {
-    return w->Accept(would_block);
+    WAS_TRACE(accept_entry);
+    w->BeginOperation();
+    const char *uri = w->EndOperation(w->Accept(would_block),
+                                      (const char *)nullptr);
+    if (uri != would_block || would_block == nullptr)
+        /* no accept_return if this call would block; the next
+           call will fire accept_entry again */
+        WAS_TRACE1(accept_return, uri);
+    return uri;
+}
+
+void
+was_simple_set_non_block(struct was_simple *w, bool non_block)
+{
+    w->non_block = non_block;
+}
+
+unsigned
+was_simple_get_poll(const struct was_simple *w, struct pollfd *fds)
+{
+    return w->GetPoll(fds);
+}
+
+bool
+was_simple_enable_io_uring(struct was_simple *w)
+{
+    return w->control.EnableRing();
+}
+
+size_t
+was_simple_get_memory_usage(const struct was_simple *w)
+{
+    return w->GetMemoryUsage();
 }
 
 int
 was_simple_control_fd(struct was_simple *w)
 {
-    return w->control.fd;
+    return w->control.GetPollFd();
 }
 
 http_method_t
@@ -1913,12 +5340,22 @@ was_simple_get_header(const struct was_simple *w, const char *name)
 {
     assert(w->response.state != was_simple::Response::State::NONE);
 
-    auto i = w->request.headers.find(name);
-    return i != w->request.headers.end()
-        ? i->second.c_str()
+    const auto *i = w->request.headers.find(name);
+    return i != nullptr
+        ? i->value.data()
         : nullptr;
 }
 
+const char *
+was_simple_get_header_token(const struct was_simple *w,
+                            enum was_simple_header token)
+{
+    assert(w->response.state != was_simple::Response::State::NONE);
+    assert(token < WAS_SIMPLE_HEADER_COUNT);
+
+    return w->request.header_tokens[token];
+}
+
 struct was_simple_iterator *
 was_simple_get_multi_header(const struct was_simple *w, const char *name)
 {
@@ -1926,6 +5363,19 @@ was_simple_get_multi_header(const struct was_simple *w, const char *name)
     return was_simple_iterator_new(x.first, x.second);
 }
 
+bool
+was_simple_foreach_multi_header(const struct was_simple *w, const char *name,
+                                bool (*callback)(const char *name,
+                                                 size_t name_length,
+                                                 const char *value,
+                                                 size_t value_length,
+                                                 void *ctx),
+                                void *ctx)
+{
+    auto x = w->request.headers.equal_range(name);
+    return was_simple_foreach(x.first, x.second, callback, ctx);
+}
+
 struct was_simple_iterator *
 was_simple_get_header_iterator(const struct was_simple *w)
 {
@@ -1933,6 +5383,20 @@ was_simple_get_header_iterator(const struct was_simple *w)
                                    w->request.headers.end());
 }
 
+bool
+was_simple_foreach_header(const struct was_simple *w,
+                          bool (*callback)(const char *name,
+                                           size_t name_length,
+                                           const char *value,
+                                           size_t value_length,
+                                           void *ctx),
+                          void *ctx)
+{
+    return was_simple_foreach(w->request.headers.begin(),
+                              w->request.headers.end(),
+                              callback, ctx);
+}
+
 const char *
 was_simple_get_remote_host(const struct was_simple *w)
 {
@@ -1946,9 +5410,9 @@ was_simple_get_parameter(const struct was_simple *w, const char *name)
 {
     assert(w->response.state != was_simple::Response::State::NONE);
 
-    auto i = w->request.parameters.find(name);
-    return i != w->request.parameters.end()
-        ? i->second.c_str()
+    const auto *i = w->request.parameters.find(name);
+    return i != nullptr
+        ? i->value.data()
         : nullptr;
 }
 
@@ -1959,6 +5423,20 @@ was_simple_get_parameter_iterator(const struct was_simple *w)
                                    w->request.parameters.end());
 }
 
+bool
+was_simple_foreach_parameter(const struct was_simple *w,
+                             bool (*callback)(const char *name,
+                                              size_t name_length,
+                                              const char *value,
+                                              size_t value_length,
+                                              void *ctx),
+                             void *ctx)
+{
+    return was_simple_foreach(w->request.parameters.begin(),
+                              w->request.parameters.end(),
+                              callback, ctx);
+}
+
 bool
 was_simple_has_body(const struct was_simple *w)
 {
@@ -1968,6 +5446,10 @@ was_simple_has_body(const struct was_simple *w)
 enum was_simple_poll_result
 was_simple_input_poll(struct was_simple *w, int timeout_ms)
 {
+    if (w->input.GetBuffered() > 0 &&
+        !(w->input.premature && !w->input.ignore_premature))
+        return WAS_SIMPLE_POLL_SUCCESS;
+
     return w->PollInput(timeout_ms);
 }
 
@@ -1988,13 +5470,55 @@ was_simple_input_fd(const struct was_simple *w)
 bool
 was_simple_received(struct was_simple *w, size_t nbytes)
 {
+    /* must not be mixed with the read-ahead buffer */
+    assert(w->input.GetBuffered() == 0);
+
     return w->Received(nbytes);
 }
 
 ssize_t
 was_simple_read(struct was_simple *w, void *buffer, size_t length)
 {
-    return w->Read(buffer, length);
+    w->BeginOperation();
+    return w->EndOperation(w->Read(buffer, length), ssize_t(-1));
+}
+
+bool
+was_simple_splice_to(struct was_simple *w, int fd)
+{
+    return w->SpliceInputTo(fd);
+}
+
+const void *
+was_simple_input_map(struct was_simple *w, size_t *length_r)
+{
+    return w->MapInput(length_r);
+}
+
+bool
+was_simple_set_input_buffer(struct was_simple *w, size_t size)
+{
+    return w->SetInputBuffer(size);
+}
+
+ssize_t
+was_simple_input_peek(struct was_simple *w, const void **data_r)
+{
+    w->BeginOperation();
+    return w->EndOperation(w->PeekInput(data_r), ssize_t(-1));
+}
+
+void
+was_simple_input_consume(struct was_simple *w, size_t nbytes)
+{
+    w->input.Consume(nbytes);
+}
+
+ssize_t
+was_simple_read_line(struct was_simple *w, char *buffer, size_t size)
+{
+    w->BeginOperation();
+    return w->EndOperation(w->ReadLine(buffer, size), ssize_t(-1));
 }
 
 int64_t
@@ -2030,26 +5554,59 @@ was_simple_set_header_n(struct was_simple *w,
     return w->SetHeader({name, name_length}, {value, value_length});
 }
 
+bool
+was_simple_send_header_block(struct was_simple *w,
+                             const struct was_simple_header_block *b)
+{
+    return w->SendHeaderBlock(*b);
+}
+
+static bool
+was_simple_copy_header(const char *name, size_t name_length,
+                       const char *value, size_t value_length,
+                       void *ctx) noexcept
+{
+    auto &w = *static_cast<struct was_simple *>(ctx);
+    return w.SetHeader({name, name_length}, {value, value_length});
+}
+
 bool
 was_simple_copy_all_headers(struct was_simple *w)
 {
-    for (const auto &i : w->request.headers)
-        if (!was_simple_set_header(w, i.first.c_str(), i.second.c_str()))
-            return false;
+    return was_simple_foreach_header(w, was_simple_copy_header, w);
+}
 
-    return true;
+const char *
+was_simple_compress(struct was_simple *w)
+{
+    return w->EnableCompression();
+}
+
+void
+was_simple_set_cache(struct was_simple *w, struct was_simple_cache *c)
+{
+    w->caching.Cancel();
+    w->caching.cache = c;
+}
+
+bool
+was_simple_cache_response(struct was_simple *w, unsigned ttl_ms)
+{
+    return w->CacheResponse(ttl_ms);
 }
 
 bool
 was_simple_set_length(struct was_simple *w, uint64_t length)
 {
-    return w->SetLength(length);
+    w->BeginOperation();
+    return w->EndOperation(w->SetLength(length), false);
 }
 
 bool
 was_simple_output_begin(struct was_simple *w)
 {
-    return w->SetResponseStateBody();
+    w->BeginOperation();
+    return w->EndOperation(w->SetResponseStateBody(), false);
 }
 
 enum was_simple_poll_result
@@ -2063,9 +5620,21 @@ was_simple_output_fd(struct was_simple *w)
 {
     assert(w->response.state != was_simple::Response::State::NONE);
 
+    if (w->IsCompressing())
+        /* the application must not bypass the compressor */
+        return -1;
+
     if (!w->SetResponseStateBody())
         return -1;
 
+    /* data written to the pipe directly cannot be recorded */
+    w->caching.Cancel();
+
+    /* the caller is going to write to the pipe directly, so
+       everything that was buffered must be written first */
+    if (!w->FlushOutputBuffer())
+        return -1;
+
     return w->output.fd;
 }
 
@@ -2074,7 +5643,8 @@ was_simple_sent(struct was_simple *w, size_t nbytes)
 {
     assert(w->response.state != was_simple::Response::State::NONE);
 
-    if (w->response.state > was_simple::Response::State::BODY)
+    if (w->response.state > was_simple::Response::State::BODY ||
+        w->IsCompressing())
         return false;
 
     if (!w->output.CanSend(nbytes)) {
@@ -2100,7 +5670,22 @@ was_simple_sent(struct was_simple *w, size_t nbytes)
 bool
 was_simple_write(struct was_simple *w, const void *data, size_t length)
 {
-    return w->Write(data, length);
+    w->BeginOperation();
+    return w->EndOperation(w->Write(data, length), false);
+}
+
+bool
+was_simple_writev(struct was_simple *w, const struct iovec *v, int n)
+{
+    if (n < 0)
+        return false;
+
+    size_t length = 0;
+    for (int i = 0; i < n; ++i)
+        length += v[i].iov_len;
+
+    w->BeginOperation();
+    return w->EndOperation(w->WriteV(v, n, length), false);
 }
 
 bool
@@ -2112,26 +5697,94 @@ was_simple_puts(struct was_simple *w, const char *s)
 bool
 was_simple_printf(struct was_simple *w, const char *fmt, ...)
 {
-    char buffer[4096];
+    w->BeginOperation();
 
     va_list va;
     va_start(va, fmt);
-    vsnprintf(buffer, sizeof(buffer), fmt, va);
+    bool success = w->VPrintf(fmt, va);
     va_end(va);
 
-    return was_simple_puts(w, buffer);
+    return w->EndOperation(success, false);
+}
+
+bool
+was_simple_set_output_buffer(struct was_simple *w, size_t size)
+{
+    return w->SetOutputBuffer(size);
+}
+
+bool
+was_simple_flush(struct was_simple *w)
+{
+    assert(w->response.state != was_simple::Response::State::NONE);
+
+    w->BeginOperation();
+    return w->EndOperation(w->Flush(), false);
 }
 
 ssize_t
 was_simple_splice(struct was_simple *w, size_t max_length)
 {
-    return w->Splice(max_length);
+    w->BeginOperation();
+    return w->EndOperation(w->Splice(max_length), ssize_t(-1));
 }
 
 bool
 was_simple_splice_all(struct was_simple *w, bool end)
 {
-    return w->SpliceAll(end);
+    w->BeginOperation();
+    return w->EndOperation(w->SpliceAll(end), false);
+}
+
+bool
+was_simple_set_pipe_size(struct was_simple *w, size_t size)
+{
+    return w->SetPipeSize(size);
+}
+
+void
+was_simple_set_pipe_auto(struct was_simple *w, size_t max_size)
+{
+    w->SetPipeAuto(max_size);
+}
+
+bool
+was_simple_write_gift(struct was_simple *w, const void *data, size_t length)
+{
+    w->BeginOperation();
+    return w->EndOperation(w->WriteGift(data, length), false);
+}
+
+bool
+was_simple_send_file(struct was_simple *w, int fd,
+                     uint64_t offset, uint64_t length)
+{
+    return w->SendFile(fd, offset, length);
+}
+
+http_status_t
+was_simple_get_range(const struct was_simple *w, uint64_t size,
+                     uint64_t *offset_r, uint64_t *length_r)
+{
+    return w->GetRange(size, *offset_r, *length_r);
+}
+
+bool
+was_simple_send_file_range(struct was_simple *w, int fd, uint64_t size)
+{
+    return w->SendFileRange(fd, size);
+}
+
+ssize_t
+was_simple_splice_from(struct was_simple *w, int fd, size_t max_length)
+{
+    return w->SpliceFrom(fd, max_length);
+}
+
+void
+was_simple_set_auto_metrics(struct was_simple *w, bool enable)
+{
+    w->metrics.enabled = enable;
 }
 
 bool
@@ -2149,11 +5802,14 @@ was_simple_metric(struct was_simple *w, const char *name, float value)
 bool
 was_simple_end(struct was_simple *w)
 {
-    return w->End();
+    WAS_TRACE1(end, w->output.sent);
+    w->BeginOperation();
+    return w->EndOperation(w->End(), false);
 }
 
 bool
 was_simple_abort(struct was_simple *w)
 {
+    WAS_TRACE1(abort, w->output.sent);
     return w->Abort();
 }
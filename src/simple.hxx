@@ -0,0 +1,19 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <mk@cm4all.com>
+
+/*
+ * Internal #was_simple functions for the Multi-WAS code.
+ */
+
+#pragma once
+
+struct was_simple;
+
+/**
+ * Like was_simple_new_fds(), but reuse an object from a
+ * process-wide pool.  was_simple_free() will reset the object and
+ * return it to the pool instead of deleting it.  This is thread-safe.
+ */
+struct was_simple *
+was_simple_new_pooled(int control_fd, int input_fd, int output_fd) noexcept;
@@ -0,0 +1,49 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <mk@cm4all.com>
+
+#include "slab.hxx"
+
+#include <cstdlib>
+
+Slab::~Slab() noexcept
+{
+    while (idle != nullptr) {
+        Item *next = idle->next;
+        free(idle);
+        idle = next;
+    }
+}
+
+void *
+Slab::Allocate() noexcept
+{
+    {
+        const std::lock_guard<std::mutex> lock(mutex);
+        if (idle != nullptr) {
+            Item *item = idle;
+            idle = item->next;
+            --n_idle;
+            return item;
+        }
+    }
+
+    return malloc(size);
+}
+
+void
+Slab::Free(void *p) noexcept
+{
+    {
+        const std::lock_guard<std::mutex> lock(mutex);
+        if (n_idle < max_idle) {
+            auto *item = static_cast<Item *>(p);
+            item->next = idle;
+            idle = item;
+            ++n_idle;
+            return;
+        }
+    }
+
+    free(p);
+}
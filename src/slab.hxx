@@ -0,0 +1,58 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <mk@cm4all.com>
+
+#pragma once
+
+#include <cstddef>
+#include <mutex>
+
+/**
+ * A thread-safe free list of fixed-size buffers.  Buffers which are
+ * freed are kept (up to a limit) for the next allocation, so
+ * connections can borrow their buffers only while they are active
+ * without going through malloc() each time.
+ */
+class Slab {
+    struct Item {
+        Item *next;
+    };
+
+    const std::size_t size;
+
+    /**
+     * Never keep more than this number of idle buffers.
+     */
+    const std::size_t max_idle;
+
+    std::mutex mutex;
+
+    Item *idle = nullptr;
+    std::size_t n_idle = 0;
+
+public:
+    Slab(std::size_t _size, std::size_t _max_idle) noexcept
+        :size(_size < sizeof(Item) ? sizeof(Item) : _size),
+         max_idle(_max_idle) {}
+
+    ~Slab() noexcept;
+
+    Slab(const Slab &) = delete;
+    Slab &operator=(const Slab &) = delete;
+
+    std::size_t GetSize() const noexcept {
+        return size;
+    }
+
+    /**
+     * Allocate an (uninitialized) buffer.
+     *
+     * @return nullptr if out of memory
+     */
+    void *Allocate() noexcept;
+
+    /**
+     * Return a buffer obtained by Allocate().
+     */
+    void Free(void *p) noexcept;
+};
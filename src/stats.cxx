@@ -0,0 +1,37 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <mk@cm4all.com>
+
+#include "stats.hxx"
+
+#include <was/simple.h>
+
+StatCounter was_stats[std::size_t(Stat::COUNT)];
+
+static uint64_t
+LoadStat(Stat stat) noexcept
+{
+    return was_stats[std::size_t(stat)].value.load(std::memory_order_relaxed);
+}
+
+void
+was_simple_get_stats(struct was_simple_stats *s)
+{
+    s->requests = LoadStat(Stat::REQUESTS);
+    s->control_receives = LoadStat(Stat::CONTROL_RECEIVES);
+    s->control_sends = LoadStat(Stat::CONTROL_SENDS);
+    s->control_moved_bytes = LoadStat(Stat::CONTROL_MOVED_BYTES);
+    s->pipe_reads = LoadStat(Stat::PIPE_READS);
+    s->pipe_writes = LoadStat(Stat::PIPE_WRITES);
+    s->pipe_splices = LoadStat(Stat::PIPE_SPLICES);
+    s->polls = LoadStat(Stat::POLLS);
+    s->poll_timeouts = LoadStat(Stat::POLL_TIMEOUTS);
+    s->packets_too_large = LoadStat(Stat::PACKETS_TOO_LARGE);
+    s->stops = LoadStat(Stat::STOPS);
+    s->prematures = LoadStat(Stat::PREMATURES);
+    s->multi_accepts = LoadStat(Stat::MULTI_ACCEPTS);
+    s->cache_hits = LoadStat(Stat::CACHE_HITS);
+    s->cache_misses = LoadStat(Stat::CACHE_MISSES);
+    s->cache_stores = LoadStat(Stat::CACHE_STORES);
+    s->cache_evictions = LoadStat(Stat::CACHE_EVICTIONS);
+}
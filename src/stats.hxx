@@ -0,0 +1,51 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <mk@cm4all.com>
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * Identifies one process-wide counter; see #was_simple_stats for
+ * their meanings.
+ */
+enum class Stat : unsigned {
+    REQUESTS,
+    CONTROL_RECEIVES,
+    CONTROL_SENDS,
+    CONTROL_MOVED_BYTES,
+    PIPE_READS,
+    PIPE_WRITES,
+    PIPE_SPLICES,
+    POLLS,
+    POLL_TIMEOUTS,
+    PACKETS_TOO_LARGE,
+    STOPS,
+    PREMATURES,
+    MULTI_ACCEPTS,
+    CACHE_HITS,
+    CACHE_MISSES,
+    CACHE_STORES,
+    CACHE_EVICTIONS,
+
+    COUNT
+};
+
+/**
+ * Each counter occupies its own cache line, so threads updating
+ * different counters do not slow each other down.
+ */
+struct alignas(64) StatCounter {
+    std::atomic<uint64_t> value{0};
+};
+
+extern StatCounter was_stats[std::size_t(Stat::COUNT)];
+
+static inline void
+CountStat(Stat stat, uint64_t n=1) noexcept
+{
+    was_stats[std::size_t(stat)].value.fetch_add(n, std::memory_order_relaxed);
+}
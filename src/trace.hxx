@@ -0,0 +1,46 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <mk@cm4all.com>
+
+#pragma once
+
+/*
+ * Static tracepoints (USDT) in the provider "libwas", for attaching
+ * bpftrace/eBPF to production workers, e.g.:
+ *
+ *   bpftrace -e 'usdt:/usr/lib/libcm4all-was-simple.so.1:libwas:accept_return { printf("%s\n", str(arg0)); }'
+ *
+ * Probes:
+ *
+ * - accept_entry()
+ * - accept_return(const char *uri) (nullptr on error/end); not fired
+ *   when was_simple_accept_non_block() returns its "would_block"
+ *   pointer, so a retried accept has one unmatched accept_entry per
+ *   attempt and exactly one accept_return
+ * - packet(unsigned command, size_t length) for each request packet
+ * - poll_input_start(int timeout_ms), poll_input_end(int result)
+ * - poll_output_start(int timeout_ms), poll_output_end(int result)
+ * - write(size_t length)
+ * - splice(size_t nbytes)
+ * - end(uint64_t sent), abort(uint64_t sent)
+ * - multi_accept(int control_fd)
+ *
+ * An unattached probe is a single "nop" instruction.  Without
+ * HAVE_USDT (meson option "usdt"), the macros expand to nothing.
+ */
+
+#ifdef HAVE_USDT
+
+#include <sys/sdt.h>
+
+#define WAS_TRACE(name) DTRACE_PROBE(libwas, name)
+#define WAS_TRACE1(name, a) DTRACE_PROBE1(libwas, name, a)
+#define WAS_TRACE2(name, a, b) DTRACE_PROBE2(libwas, name, a, b)
+
+#else
+
+#define WAS_TRACE(name) do {} while (false)
+#define WAS_TRACE1(name, a) do {} while (false)
+#define WAS_TRACE2(name, a, b) do {} while (false)
+
+#endif
@@ -0,0 +1,190 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <mk@cm4all.com>
+
+#include "uring.hxx"
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static int
+io_uring_setup(unsigned entries, struct io_uring_params *p) noexcept
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+               unsigned flags) noexcept
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                        flags, nullptr, _NSIG / 8);
+}
+
+static int
+io_uring_register(int fd, unsigned opcode, const void *arg,
+                  unsigned nr_args) noexcept
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+template<typename T>
+static T *
+RingPointer(void *ring, std::size_t offset) noexcept
+{
+    return reinterpret_cast<T *>(static_cast<char *>(ring) + offset);
+}
+
+void
+Uring::Close() noexcept
+{
+    if (sqes != nullptr) {
+        munmap(sqes, sqes_size);
+        sqes = nullptr;
+    }
+
+    if (cq_ring != nullptr && cq_ring != sq_ring)
+        munmap(cq_ring, cq_ring_size);
+    cq_ring = nullptr;
+
+    if (sq_ring != nullptr) {
+        munmap(sq_ring, sq_ring_size);
+        sq_ring = nullptr;
+    }
+
+    if (fd >= 0) {
+        close(fd);
+        fd = -1;
+    }
+}
+
+bool
+Uring::RegisterEventFd(int event_fd) noexcept
+{
+    return io_uring_register(fd, IORING_REGISTER_EVENTFD, &event_fd, 1) == 0;
+}
+
+bool
+Uring::Init(unsigned entries) noexcept
+{
+    struct io_uring_params p{};
+    fd = io_uring_setup(entries, &p);
+    if (fd < 0)
+        return false;
+
+    sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+    const bool single_mmap = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap && cq_ring_size > sq_ring_size)
+        sq_ring_size = cq_ring_size;
+
+    sq_ring = mmap(nullptr, sq_ring_size, PROT_READ|PROT_WRITE,
+                   MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (sq_ring == MAP_FAILED) {
+        sq_ring = nullptr;
+        return false;
+    }
+
+    if (single_mmap)
+        cq_ring = sq_ring;
+    else {
+        cq_ring = mmap(nullptr, cq_ring_size, PROT_READ|PROT_WRITE,
+                       MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (cq_ring == MAP_FAILED) {
+            cq_ring = nullptr;
+            return false;
+        }
+    }
+
+    sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    void *s = mmap(nullptr, sqes_size, PROT_READ|PROT_WRITE,
+                   MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (s == MAP_FAILED)
+        return false;
+
+    sqes = static_cast<struct io_uring_sqe *>(s);
+
+    sq_head = RingPointer<unsigned>(sq_ring, p.sq_off.head);
+    sq_tail = RingPointer<unsigned>(sq_ring, p.sq_off.tail);
+    sq_array = RingPointer<unsigned>(sq_ring, p.sq_off.array);
+    sq_mask = *RingPointer<unsigned>(sq_ring, p.sq_off.ring_mask);
+    sq_entries = p.sq_entries;
+
+    cq_head = RingPointer<unsigned>(cq_ring, p.cq_off.head);
+    cq_tail = RingPointer<unsigned>(cq_ring, p.cq_off.tail);
+    cq_mask = *RingPointer<unsigned>(cq_ring, p.cq_off.ring_mask);
+    cqes = RingPointer<struct io_uring_cqe>(cq_ring, p.cq_off.cqes);
+
+    local_sq_tail = *sq_tail;
+    return true;
+}
+
+struct io_uring_sqe *
+Uring::GetSqe() noexcept
+{
+    const unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    if (local_sq_tail - head >= sq_entries)
+        return nullptr;
+
+    const unsigned index = local_sq_tail & sq_mask;
+    ++local_sq_tail;
+
+    struct io_uring_sqe *sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sq_array[index] = index;
+    return sqe;
+}
+
+bool
+Uring::HasUnsubmitted() const noexcept
+{
+    return local_sq_tail != *sq_tail;
+}
+
+bool
+Uring::Enter(unsigned min_complete) noexcept
+{
+    const unsigned to_submit = local_sq_tail - *sq_tail;
+    __atomic_store_n(sq_tail, local_sq_tail, __ATOMIC_RELEASE);
+
+    if (to_submit == 0 && min_complete == 0)
+        return true;
+
+    const unsigned flags = min_complete > 0 ? IORING_ENTER_GETEVENTS : 0;
+
+    if (io_uring_enter(fd, to_submit, min_complete, flags) < 0) {
+        if (errno != EINTR)
+            return false;
+
+        /* the submission has completed before the wait was
+           interrupted; only wait again */
+        while (io_uring_enter(fd, 0, min_complete, flags) < 0)
+            if (errno != EINTR)
+                return false;
+    }
+
+    return true;
+}
+
+const struct io_uring_cqe *
+Uring::PeekCqe() const noexcept
+{
+    const unsigned head = *cq_head;
+    if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+        return nullptr;
+
+    return &cqes[head & cq_mask];
+}
+
+void
+Uring::SeenCqe() noexcept
+{
+    __atomic_store_n(cq_head, *cq_head + 1, __ATOMIC_RELEASE);
+}
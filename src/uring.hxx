@@ -0,0 +1,99 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <mk@cm4all.com>
+
+#pragma once
+
+#include <linux/io_uring.h>
+
+#include <cstddef>
+
+/**
+ * A minimal io_uring instance, talking to the kernel directly
+ * without liburing.
+ */
+class Uring {
+    int fd = -1;
+
+    void *sq_ring = nullptr, *cq_ring = nullptr;
+    std::size_t sq_ring_size = 0, cq_ring_size = 0;
+
+    struct io_uring_sqe *sqes = nullptr;
+    std::size_t sqes_size = 0;
+
+    unsigned *sq_head, *sq_tail, *sq_array;
+    unsigned sq_mask, sq_entries;
+
+    unsigned *cq_head, *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+
+    /**
+     * The SQ tail which will be published by the next Enter() call.
+     */
+    unsigned local_sq_tail = 0;
+
+public:
+    Uring() noexcept = default;
+
+    ~Uring() noexcept {
+        Close();
+    }
+
+    Uring(const Uring &) = delete;
+    Uring &operator=(const Uring &) = delete;
+
+    /**
+     * @return false on error (with errno set)
+     */
+    bool Init(unsigned entries) noexcept;
+
+    /**
+     * Destroy the ring: unmap it and close its file descriptor,
+     * which cancels all operations still in flight.  This may be
+     * called more than once.
+     */
+    void Close() noexcept;
+
+    /**
+     * The ring's file descriptor; it is readable (POLLIN) when
+     * completions are available.
+     */
+    int GetFd() const noexcept {
+        return fd;
+    }
+
+    /**
+     * Obtain a zeroed submission queue entry which will be
+     * submitted by the next Enter() call.
+     *
+     * @return nullptr if the submission queue is full
+     */
+    struct io_uring_sqe *GetSqe() noexcept;
+
+    bool HasUnsubmitted() const noexcept;
+
+    /**
+     * Let the kernel signal the given eventfd whenever a completion
+     * is posted.
+     *
+     * @return false on error (with errno set)
+     */
+    bool RegisterEventFd(int event_fd) noexcept;
+
+    /**
+     * Submit all queued entries and optionally wait for completions.
+     *
+     * @param min_complete the number of completions to wait for
+     * @return false on error (with errno set)
+     */
+    bool Enter(unsigned min_complete) noexcept;
+
+    /**
+     * @return the oldest completion or nullptr if there is none;
+     * call SeenCqe() after processing it
+     */
+    const struct io_uring_cqe *PeekCqe() const noexcept;
+
+    void SeenCqe() noexcept;
+};
@@ -0,0 +1,564 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <mk@cm4all.com>
+
+/*
+ * A benchmark for libcm4all-was.  The server runs in a thread; the
+ * main thread plays the container side over socketpair() and pipes
+ * and measures the latency of each request and the number of system
+ * calls the server needs for it (see was_simple_get_stats()).  The
+ * results are printed as one JSON object per line.  The program
+ * fails if a scenario exceeds its system call budget.
+ *
+ * Usage: BenchWas [ITERATIONS]
+ */
+
+#include <was/multi.h>
+#include <was/simple.h>
+#include <was/protocol.h>
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using Clock = std::chrono::steady_clock;
+
+static constexpr size_t LARGE_BODY = 1024 * 1024;
+static constexpr unsigned N_HEADERS = 50;
+
+static char chunk[65536];
+
+static bool
+CountHeader(const char *, size_t, const char *, size_t, void *ctx)
+{
+    ++*(unsigned *)ctx;
+    return true;
+}
+
+static bool
+HandleSimpleRequest(struct was_simple *w, const char *uri)
+{
+    if (strcmp(uri, "/write") == 0) {
+        if (!was_simple_set_length(w, LARGE_BODY))
+            return false;
+
+        for (size_t rest = LARGE_BODY; rest > 0;) {
+            const size_t n = std::min(rest, sizeof(chunk));
+            if (!was_simple_write(w, chunk, n))
+                return false;
+            rest -= n;
+        }
+    } else if (strcmp(uri, "/splice") == 0) {
+        if (!was_simple_splice_all(w, true))
+            return false;
+    } else if (strcmp(uri, "/length") == 0) {
+        if (!was_simple_set_length(w, 5) ||
+            !was_simple_write(w, "hello", 5))
+            return false;
+    } else if (strcmp(uri, "/no_content") == 0) {
+        /* was_simple_end() sends "204 No Content" */
+    } else if (strcmp(uri, "/stop") == 0) {
+        /* don't read the request body; was_simple_end() sends
+           STOP */
+    } else {
+        unsigned n = 0;
+        was_simple_foreach_header(w, CountHeader, &n);
+        was_simple_foreach_parameter(w, CountHeader, &n);
+        if (!was_simple_puts(w, "hello"))
+            return false;
+    }
+
+    return was_simple_end(w);
+}
+
+static void
+RunSimpleServer(int control_fd, int input_fd, int output_fd,
+                size_t output_buffer)
+{
+    auto *w = was_simple_new_fds(control_fd, input_fd, output_fd);
+    if (output_buffer > 0 && !was_simple_set_output_buffer(w, output_buffer))
+        abort();
+
+    const char *uri;
+    while ((uri = was_simple_accept(w)) != nullptr)
+        if (!HandleSimpleRequest(w, uri))
+            break;
+
+    was_simple_free(w);
+}
+
+/**
+ * @param connection_ctx non-NULL if the body of the current request
+ * has already been written by a previous call which returned
+ * #WAS_MULTI_RESULT_AGAIN
+ */
+static enum was_multi_result
+HandleMultiRequest(struct was_simple *w, const char *,
+                   void **connection_ctx, void *)
+{
+    if (*connection_ctx == nullptr) {
+        if (!was_simple_puts(w, "hello"))
+            return errno == EAGAIN
+                ? WAS_MULTI_RESULT_AGAIN
+                : WAS_MULTI_RESULT_CLOSE;
+
+        /* any non-NULL value will do */
+        *connection_ctx = w;
+    }
+
+    if (!was_simple_end(w))
+        return errno == EAGAIN
+            ? WAS_MULTI_RESULT_AGAIN
+            : WAS_MULTI_RESULT_CLOSE;
+
+    *connection_ctx = nullptr;
+    return WAS_MULTI_RESULT_DONE;
+}
+
+static void
+RunMultiServer()
+{
+    static constexpr struct was_multi_handler handler = {
+        HandleMultiRequest,
+        nullptr,
+    };
+
+    auto *m = was_multi_new();
+    if (was_multi_run(m, &handler, nullptr) != 0)
+        abort();
+    was_multi_free(m);
+}
+
+/**
+ * @return the number of system calls the library has made so far
+ */
+static uint64_t
+CountSyscalls() noexcept
+{
+    struct was_simple_stats s;
+    was_simple_get_stats(&s);
+    return s.control_receives + s.control_sends +
+        s.pipe_reads + s.pipe_writes + s.pipe_splices + s.polls;
+}
+
+/**
+ * The container side of one WAS connection.
+ */
+struct Peer {
+    int control_fd;
+
+    /**
+     * The request body pipe.
+     */
+    int output_fd;
+
+    /**
+     * The response body pipe.
+     */
+    int input_fd;
+
+    /**
+     * Control packets which have not been sent yet; like a real
+     * container, this sends all packets of a request at once.
+     */
+    char pending[8192];
+    size_t pending_size = 0;
+
+    void QueueControl(enum was_command cmd,
+                      const void *payload=nullptr, size_t length=0) {
+        struct was_header header;
+        if (sizeof(header) + length > sizeof(pending) - pending_size)
+            abort();
+
+        header.length = uint16_t(length);
+        header.command = uint16_t(cmd);
+        memcpy(pending + pending_size, &header, sizeof(header));
+        pending_size += sizeof(header);
+
+        if (length > 0)
+            memcpy(pending + pending_size, payload, length);
+        pending_size += length;
+    }
+
+    void QueueControl(enum was_command cmd, const char *payload) {
+        QueueControl(cmd, payload, strlen(payload));
+    }
+
+    void QueueControl(enum was_command cmd, uint64_t value) {
+        QueueControl(cmd, &value, sizeof(value));
+    }
+
+    void FlushControl() {
+        if (send(control_fd, pending, pending_size, 0) != ssize_t(pending_size))
+            abort();
+
+        pending_size = 0;
+    }
+
+    /**
+     * Receive one control packet.
+     *
+     * @return the command
+     */
+    unsigned ReceiveControl(uint64_t &value) {
+        struct was_header header;
+        if (recv(control_fd, &header, sizeof(header), MSG_WAITALL) != sizeof(header))
+            abort();
+
+        char buffer[256];
+        if (header.length > sizeof(buffer) ||
+            (header.length > 0 &&
+             recv(control_fd, buffer, header.length, MSG_WAITALL) != header.length))
+            abort();
+
+        if (header.length == sizeof(value))
+            memcpy(&value, buffer, sizeof(value));
+
+        return header.command;
+    }
+
+    /**
+     * Submit a request and wait for the complete response.
+     *
+     * @param body_size the size of the request body; 0 means no
+     * body
+     */
+    void Request(const char *uri, unsigned n_headers=0, size_t body_size=0);
+};
+
+void
+Peer::Request(const char *uri, unsigned n_headers, size_t body_size)
+{
+    QueueControl(WAS_COMMAND_REQUEST);
+    QueueControl(WAS_COMMAND_URI, uri);
+
+    for (unsigned i = 0; i < n_headers; ++i) {
+        char buffer[64];
+        snprintf(buffer, sizeof(buffer), "x-header-%u=value-%u", i, i);
+        QueueControl(WAS_COMMAND_HEADER, buffer);
+        snprintf(buffer, sizeof(buffer), "param%u=%u", i, i);
+        QueueControl(WAS_COMMAND_PARAMETER, buffer);
+    }
+
+    if (body_size > 0) {
+        QueueControl(WAS_COMMAND_DATA);
+        QueueControl(WAS_COMMAND_LENGTH, uint64_t(body_size));
+    } else
+        QueueControl(WAS_COMMAND_NO_DATA);
+
+    FlushControl();
+
+    size_t sent = 0;
+    bool stopped = false;
+
+    /* the response body length, once known */
+    uint64_t length = UINT64_MAX;
+    uint64_t received = 0;
+
+    /* finish when the response is complete, but not before the
+       request body was either sent completely or stopped */
+    while (received != length || (sent < body_size && !stopped)) {
+        struct pollfd pfds[3]{};
+        pfds[0].fd = control_fd;
+        pfds[0].events = POLLIN;
+        pfds[1].fd = input_fd;
+        pfds[1].events = POLLIN;
+        pfds[2].fd = output_fd;
+        pfds[2].events = sent < body_size && !stopped ? POLLOUT : 0;
+
+        if (poll(pfds, 3, -1) < 0)
+            abort();
+
+        if (pfds[0].revents) {
+            uint64_t value = 0;
+            switch (ReceiveControl(value)) {
+            case WAS_COMMAND_NO_DATA:
+                length = 0;
+                break;
+
+            case WAS_COMMAND_LENGTH:
+                length = value;
+                break;
+
+            case WAS_COMMAND_STOP:
+                stopped = true;
+                if (sent < body_size) {
+                    QueueControl(WAS_COMMAND_PREMATURE, uint64_t(sent));
+                    FlushControl();
+                }
+                break;
+
+            case WAS_COMMAND_PREMATURE:
+                abort();
+            }
+        }
+
+        if (pfds[1].revents) {
+            ssize_t nbytes = read(input_fd, chunk, sizeof(chunk));
+            if (nbytes <= 0)
+                abort();
+            received += nbytes;
+        }
+
+        /* no more request body data after PREMATURE */
+        if (pfds[2].revents && !stopped) {
+            ssize_t nbytes = write(output_fd, chunk,
+                                   std::min(body_size - sent, sizeof(chunk)));
+            if (nbytes < 0) {
+                if (errno != EAGAIN)
+                    abort();
+            } else
+                sent += nbytes;
+        }
+    }
+}
+
+static void
+Report(const char *name, std::vector<Clock::duration> &latencies,
+       Clock::duration total, uint64_t syscalls)
+{
+    std::sort(latencies.begin(), latencies.end());
+
+    const auto us = [](Clock::duration d){
+        return std::chrono::duration<double, std::micro>(d).count();
+    };
+
+    const size_t n = latencies.size();
+    printf("{\"name\":\"%s\",\"requests\":%zu,\"rps\":%.1f,"
+           "\"p50_us\":%.1f,\"p99_us\":%.1f,\"syscalls\":%.2f}\n",
+           name, n,
+           n / std::chrono::duration<double>(total).count(),
+           us(latencies[n / 2]), us(latencies[n * 99 / 100]),
+           double(syscalls) / n);
+    fflush(stdout);
+}
+
+static bool failed = false;
+
+/**
+ * @param max_syscalls the system call budget per request; 0 means
+ * unchecked
+ */
+template<typename F>
+static void
+Measure(const char *name, unsigned iterations, unsigned max_syscalls,
+        F &&f)
+{
+    std::vector<Clock::duration> latencies;
+    latencies.reserve(iterations);
+
+    const uint64_t start_syscalls = CountSyscalls();
+    const auto start = Clock::now();
+    for (unsigned i = 0; i < iterations; ++i) {
+        const auto t = Clock::now();
+        f();
+        latencies.push_back(Clock::now() - t);
+    }
+
+    const auto total = Clock::now() - start;
+
+    /* the server thread may already be blocked in the next
+       recv() */
+    const uint64_t syscalls = CountSyscalls() - start_syscalls;
+
+    Report(name, latencies, total, syscalls);
+
+    if (max_syscalls > 0 &&
+        syscalls > uint64_t(max_syscalls) * iterations + 1) {
+        fprintf(stderr, "%s: more than %u system calls per request\n",
+                name, max_syscalls);
+        failed = true;
+    }
+}
+
+/**
+ * Run a #was_simple server in a thread.
+ */
+class SimpleServer {
+    int control[2], request[2], response[2];
+    std::thread thread;
+
+public:
+    Peer peer;
+
+    explicit SimpleServer(size_t output_buffer) {
+        if (socketpair(AF_LOCAL, SOCK_STREAM|SOCK_CLOEXEC, 0, control) < 0 ||
+            pipe2(request, O_CLOEXEC) < 0 || pipe2(response, O_CLOEXEC) < 0)
+            abort();
+
+        fcntl(request[1], F_SETFL, O_NONBLOCK);
+
+        peer.control_fd = control[0];
+        peer.output_fd = request[1];
+        peer.input_fd = response[0];
+
+        thread = std::thread(RunSimpleServer,
+                             control[1], request[0], response[1],
+                             output_buffer);
+    }
+
+    ~SimpleServer() noexcept {
+        /* closing the control socket makes was_simple_accept()
+           return nullptr */
+        close(control[0]);
+        thread.join();
+
+        /* was_simple_free() has closed the server's side */
+        close(request[1]);
+        close(response[0]);
+    }
+};
+
+static void
+BenchSimple(unsigned iterations)
+{
+    SimpleServer server(0);
+    Peer &peer = server.peer;
+
+    /* small responses; these system call budgets are regression
+       tests for the keep-alive fast path */
+
+    Measure("hello", iterations, 4, [&]{
+        peer.Request("/hello");
+    });
+
+    Measure("hello_length", iterations, 3, [&]{
+        peer.Request("/length");
+    });
+
+    Measure("no_content", iterations, 2, [&]{
+        peer.Request("/no_content");
+    });
+
+    Measure("headers50", iterations, 4, [&]{
+        peer.Request("/headers", N_HEADERS);
+    });
+
+    /* large bodies */
+
+    Measure("write_1m", iterations, 0, [&]{
+        peer.Request("/write");
+    });
+
+    Measure("splice_all_1m", iterations, 0, [&]{
+        peer.Request("/splice", 0, LARGE_BODY);
+    });
+
+    Measure("stop_premature", iterations, 0, [&]{
+        peer.Request("/stop", 0, LARGE_BODY);
+    });
+}
+
+static void
+BenchSimpleBuffered(unsigned iterations)
+{
+    SimpleServer server(4096);
+    Peer &peer = server.peer;
+
+    Measure("hello_buffered", iterations, 3, [&]{
+        peer.Request("/hello");
+    });
+}
+
+/**
+ * Submit a new connection to the Multi-WAS socket.
+ */
+static Peer
+SendNew(int multi_fd)
+{
+    int control[2], request[2], response[2];
+    if (socketpair(AF_LOCAL, SOCK_STREAM|SOCK_CLOEXEC, 0, control) < 0 ||
+        pipe2(request, O_CLOEXEC) < 0 || pipe2(response, O_CLOEXEC) < 0)
+        abort();
+
+    const int fds[3] = {control[1], request[0], response[1]};
+
+    struct was_header h{};
+    h.command = MULTI_WAS_COMMAND_NEW;
+
+    struct iovec v = {&h, sizeof(h)};
+
+    union {
+        struct cmsghdr align;
+        char buffer[CMSG_SPACE(sizeof(fds))];
+    } cmsg;
+
+    struct msghdr msg{};
+    msg.msg_iov = &v;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cmsg.buffer;
+    msg.msg_controllen = sizeof(cmsg.buffer);
+
+    struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(c), fds, sizeof(fds));
+
+    if (sendmsg(multi_fd, &msg, 0) != sizeof(h))
+        abort();
+
+    close(control[1]);
+    close(request[0]);
+    close(response[1]);
+
+    Peer peer;
+    peer.control_fd = control[0];
+    peer.output_fd = request[1];
+    peer.input_fd = response[0];
+    return peer;
+}
+
+/**
+ * One new Multi-WAS connection per request.
+ */
+static void
+BenchMultiChurn(unsigned iterations)
+{
+    int multi[2];
+    if (socketpair(AF_LOCAL, SOCK_SEQPACKET|SOCK_CLOEXEC, 0, multi) < 0)
+        abort();
+
+    /* was_multi_new() uses file descriptor 0 */
+    if (dup2(multi[1], 0) < 0)
+        abort();
+    close(multi[1]);
+
+    std::thread thread(RunMultiServer);
+
+    Measure("multi_churn", iterations, 0, [&]{
+        Peer peer = SendNew(multi[0]);
+        peer.Request("/hello");
+        close(peer.control_fd);
+        close(peer.output_fd);
+        close(peer.input_fd);
+    });
+
+    close(multi[0]);
+    thread.join();
+}
+
+int
+main(int argc, char **argv)
+{
+    const unsigned iterations = argc > 1 ? strtoul(argv[1], nullptr, 10) : 1000;
+    if (iterations == 0) {
+        fprintf(stderr, "Usage: %s [ITERATIONS]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    BenchSimple(iterations);
+    BenchSimpleBuffered(iterations);
+    BenchMultiChurn(iterations);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,198 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <mk@cm4all.com>
+
+#include <was/coro.hxx>
+#include <was/protocol.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/**
+ * The client side of one WAS connection.
+ */
+struct FakeConnection {
+    int control_fd, request_fd, response_fd;
+
+    void SendControl(enum was_command cmd, const void *payload, size_t length) {
+        struct was_header header;
+        header.length = uint16_t(length);
+        header.command = uint16_t(cmd);
+
+        if (send(control_fd, &header, sizeof(header), 0) != sizeof(header) ||
+            (length > 0 && send(control_fd, payload, length, 0) != ssize_t(length)))
+            abort();
+    }
+
+    void SendControl(enum was_command cmd, const char *payload=nullptr) {
+        SendControl(cmd, payload, payload != nullptr ? strlen(payload) : 0);
+    }
+
+    void SendLength(uint64_t length) {
+        SendControl(WAS_COMMAND_LENGTH, &length, sizeof(length));
+    }
+
+    void SendBody(const char *data) {
+        const size_t length = strlen(data);
+        if (write(request_fd, data, length) != ssize_t(length))
+            abort();
+    }
+
+    void ExpectControl(enum was_command cmd, size_t length) {
+        struct was_header header;
+        if (recv(control_fd, &header, sizeof(header), MSG_WAITALL) != sizeof(header) ||
+            header.command != cmd || header.length != length)
+            abort();
+
+        char buffer[64];
+        if (length > sizeof(buffer) ||
+            recv(control_fd, buffer, length, MSG_WAITALL) != ssize_t(length))
+            abort();
+    }
+
+    void ExpectBody(const char *expected) {
+        const size_t length = strlen(expected);
+
+        char buffer[64];
+        if (read(response_fd, buffer, sizeof(buffer)) != ssize_t(length) ||
+            memcmp(buffer, expected, length) != 0)
+            abort();
+    }
+
+    void ExpectResponse(const char *body) {
+        ExpectControl(WAS_COMMAND_STATUS, sizeof(uint32_t));
+        ExpectControl(WAS_COMMAND_DATA, 0);
+        ExpectControl(WAS_COMMAND_LENGTH, sizeof(uint64_t));
+        ExpectBody(body);
+    }
+
+    void Close() {
+        close(control_fd);
+        close(request_fd);
+        close(response_fd);
+    }
+};
+
+/**
+ * Create a new WAS connection; the server side is returned as
+ * #was_simple object.
+ */
+static FakeConnection
+NewConnection(struct was_simple *&w)
+{
+    int control[2], request[2], response[2];
+    if (socketpair(AF_LOCAL, SOCK_STREAM|SOCK_CLOEXEC, 0, control) < 0 ||
+        pipe2(request, O_CLOEXEC) < 0 || pipe2(response, O_CLOEXEC) < 0)
+        abort();
+
+    w = was_simple_new_fds(control[1], request[0], response[1]);
+    if (w == nullptr)
+        abort();
+
+    return {control[0], request[1], response[0]};
+}
+
+/**
+ * Echo the URI and the request body; runs in a nested coroutine
+ * whose frame is recycled by the connection's #FramePool.
+ */
+static Was::Task
+Echo(Was::Connection &c, const char *uri)
+{
+    if (!co_await c.Write(uri, strlen(uri)))
+        co_return;
+
+    char buffer[64];
+    ssize_t nbytes;
+    while ((nbytes = co_await c.Read(buffer, sizeof(buffer))) > 0)
+        if (!co_await c.Write(buffer, nbytes))
+            co_return;
+}
+
+static Was::Task
+HandleConnection(Was::Connection &c, unsigned *n_requests)
+{
+    const char *uri;
+    while ((uri = co_await c.Accept()) != nullptr) {
+        co_await Echo(c, uri);
+
+        if (!co_await c.End())
+            break;
+
+        ++*n_requests;
+    }
+}
+
+static void
+TestCoro()
+{
+    struct was_simple *wa, *wb;
+    FakeConnection a = NewConnection(wa);
+    FakeConnection b = NewConnection(wb);
+
+    const pid_t pid = fork();
+    if (pid < 0)
+        abort();
+
+    if (pid == 0) {
+        a.Close();
+        b.Close();
+
+        unsigned n_requests = 0;
+
+        Was::Scheduler scheduler;
+        if (!scheduler.IsDefined() ||
+            !scheduler.Add(wa, HandleConnection, &n_requests) ||
+            !scheduler.Add(wb, HandleConnection, &n_requests) ||
+            !scheduler.Run())
+            _exit(EXIT_FAILURE);
+
+        _exit(n_requests == 3 ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    was_simple_free(wa);
+    was_simple_free(wb);
+
+    /* connection "a" waits for its request body, which must not
+       stall connection "b" */
+    a.SendControl(WAS_COMMAND_REQUEST);
+    a.SendControl(WAS_COMMAND_URI, "/a");
+    a.SendControl(WAS_COMMAND_DATA);
+    a.SendLength(5);
+
+    b.SendControl(WAS_COMMAND_REQUEST);
+    b.SendControl(WAS_COMMAND_URI, "/b");
+    b.SendControl(WAS_COMMAND_NO_DATA);
+    b.ExpectResponse("/b");
+
+    a.SendBody("hello");
+    a.ExpectResponse("/ahello");
+
+    /* keep-alive: a second request on the same connection */
+    b.SendControl(WAS_COMMAND_REQUEST);
+    b.SendControl(WAS_COMMAND_URI, "/b2");
+    b.SendControl(WAS_COMMAND_NO_DATA);
+    b.ExpectResponse("/b2");
+
+    /* shut down; the scheduler returns after both coroutines have
+       finished */
+    a.Close();
+    b.Close();
+
+    int status;
+    if (waitpid(pid, &status, 0) != pid ||
+        !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+        abort();
+}
+
+int
+main(int, char **)
+{
+    TestCoro();
+    return EXIT_SUCCESS;
+}
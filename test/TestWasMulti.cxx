@@ -0,0 +1,631 @@
+// SPDX-License-Identifier: BSD-2-Clause
+// Copyright CM4all GmbH
+// author: Max Kellermann <mk@cm4all.com>
+
+#include <was/multi.h>
+#include <was/simple.h>
+#include <was/protocol.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/**
+ * The client side of one WAS connection.
+ */
+struct FakeConnection {
+    int control_fd, input_fd;
+
+    void SendControl(enum was_command cmd, const char *payload=nullptr) {
+        const size_t length = payload != nullptr ? strlen(payload) : 0;
+
+        struct was_header header;
+        header.length = uint16_t(length);
+        header.command = uint16_t(cmd);
+
+        if (send(control_fd, &header, sizeof(header), 0) != sizeof(header) ||
+            (length > 0 && send(control_fd, payload, length, 0) != ssize_t(length)))
+            abort();
+    }
+
+    void ExpectControl(enum was_command cmd, size_t length) {
+        struct was_header header;
+        if (recv(control_fd, &header, sizeof(header), MSG_WAITALL) != sizeof(header) ||
+            header.command != cmd || header.length != length)
+            abort();
+
+        char buffer[64];
+        if (length > sizeof(buffer) ||
+            recv(control_fd, buffer, length, MSG_WAITALL) != ssize_t(length))
+            abort();
+    }
+
+    void ExpectBody(const char *expected) {
+        const size_t length = strlen(expected);
+
+        char buffer[64];
+        if (read(input_fd, buffer, sizeof(buffer)) != ssize_t(length) ||
+            memcmp(buffer, expected, length) != 0)
+            abort();
+    }
+
+    /**
+     * Expect nothing on the control socket within a short time.
+     */
+    void ExpectControlIdle() {
+        struct pollfd pfd{};
+        pfd.fd = control_fd;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, 100) != 0)
+            abort();
+    }
+};
+
+/**
+ * Create a new WAS connection and submit it to the Multi-WAS socket.
+ */
+static FakeConnection
+SendNew(int multi_fd)
+{
+    int control[2], request[2], response[2];
+    if (socketpair(AF_LOCAL, SOCK_STREAM|SOCK_CLOEXEC, 0, control) < 0 ||
+        pipe2(request, O_CLOEXEC) < 0 || pipe2(response, O_CLOEXEC) < 0)
+        abort();
+
+    const int fds[3] = {control[1], request[0], response[1]};
+
+    struct was_header h{};
+    h.command = MULTI_WAS_COMMAND_NEW;
+
+    struct iovec v = {&h, sizeof(h)};
+
+    union {
+        struct cmsghdr align;
+        char buffer[CMSG_SPACE(sizeof(fds))];
+    } cmsg;
+
+    struct msghdr msg{};
+    msg.msg_iov = &v;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cmsg.buffer;
+    msg.msg_controllen = sizeof(cmsg.buffer);
+
+    struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(c), fds, sizeof(fds));
+
+    if (sendmsg(multi_fd, &msg, 0) != sizeof(h))
+        abort();
+
+    close(control[1]);
+    close(request[0]);
+    close(response[1]);
+    close(request[1]);
+
+    return {control[0], response[0]};
+}
+
+/**
+ * Pipes for blocking a worker thread with the URI "/block" (see
+ * TestSteal()): the handler writes a byte to #block_notify_fd and
+ * then waits for a byte on #block_release_fd.
+ */
+static int block_notify_fd = -1, block_release_fd = -1;
+
+static enum was_multi_result
+HandleRequest(struct was_simple *w, const char *uri, void **, void *)
+{
+    if (strcmp(uri, "/block") == 0 && block_release_fd >= 0) {
+        char dummy = 0;
+        if (write(block_notify_fd, &dummy, sizeof(dummy)) != 1 ||
+            read(block_release_fd, &dummy, sizeof(dummy)) != 1)
+            abort();
+    }
+
+    if (!was_simple_puts(w, uri))
+        return errno == EAGAIN ? WAS_MULTI_RESULT_AGAIN : WAS_MULTI_RESULT_CLOSE;
+
+    if (!was_simple_end(w))
+        return errno == EAGAIN ? WAS_MULTI_RESULT_AGAIN : WAS_MULTI_RESULT_CLOSE;
+
+    return WAS_MULTI_RESULT_DONE;
+}
+
+/**
+ * @param n_threads the number of worker threads; 0 means
+ * was_multi_run() (single-threaded)
+ */
+static void
+RunServer(unsigned n_threads)
+{
+    static constexpr struct was_multi_handler handler = {
+        HandleRequest,
+        nullptr,
+    };
+
+    auto *m = was_multi_new();
+    const int result = n_threads > 0
+        ? was_multi_run_threads(m, n_threads, &handler, nullptr)
+        : was_multi_run(m, &handler, nullptr);
+    was_multi_free(m);
+
+    _exit(result == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+static void
+ExpectResponse(FakeConnection &c, const char *body)
+{
+    c.ExpectControl(WAS_COMMAND_STATUS, sizeof(uint32_t));
+    c.ExpectControl(WAS_COMMAND_DATA, 0);
+    c.ExpectControl(WAS_COMMAND_LENGTH, sizeof(uint64_t));
+    c.ExpectBody(body);
+}
+
+static void
+TestMulti(unsigned n_threads)
+{
+    int multi[2];
+    if (socketpair(AF_LOCAL, SOCK_SEQPACKET|SOCK_CLOEXEC, 0, multi) < 0)
+        abort();
+
+    const pid_t pid = fork();
+    if (pid < 0)
+        abort();
+
+    if (pid == 0) {
+        dup2(multi[1], 0);
+        close(multi[0]);
+        close(multi[1]);
+        RunServer(n_threads);
+    }
+
+    close(multi[1]);
+
+    FakeConnection a = SendNew(multi[0]);
+    FakeConnection b = SendNew(multi[0]);
+
+    /* an incomplete request on connection "a" must not stall
+       connection "b" */
+    a.SendControl(WAS_COMMAND_REQUEST);
+    a.SendControl(WAS_COMMAND_URI, "/a");
+
+    b.SendControl(WAS_COMMAND_REQUEST);
+    b.SendControl(WAS_COMMAND_URI, "/b");
+    b.SendControl(WAS_COMMAND_NO_DATA);
+    ExpectResponse(b, "/b");
+
+    a.ExpectControlIdle();
+    a.SendControl(WAS_COMMAND_NO_DATA);
+    ExpectResponse(a, "/a");
+
+    /* keep-alive: a second request on the same connection */
+    b.SendControl(WAS_COMMAND_REQUEST);
+    b.SendControl(WAS_COMMAND_URI, "/b2");
+    b.SendControl(WAS_COMMAND_NO_DATA);
+    ExpectResponse(b, "/b2");
+
+    /* shut down */
+    close(multi[0]);
+    close(a.control_fd);
+    close(b.control_fd);
+
+    int status;
+    if (waitpid(pid, &status, 0) != pid ||
+        !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+        abort();
+
+    close(a.input_fd);
+    close(b.input_fd);
+}
+
+/**
+ * Submit many connections at once (so the server receives them in
+ * batches), and then more after closing them (so it reuses pooled
+ * #was_simple objects).
+ */
+static void
+TestBatch(unsigned n_threads)
+{
+    int multi[2];
+    if (socketpair(AF_LOCAL, SOCK_SEQPACKET|SOCK_CLOEXEC, 0, multi) < 0)
+        abort();
+
+    const pid_t pid = fork();
+    if (pid < 0)
+        abort();
+
+    if (pid == 0) {
+        dup2(multi[1], 0);
+        close(multi[0]);
+        close(multi[1]);
+        RunServer(n_threads);
+    }
+
+    close(multi[1]);
+
+    static constexpr unsigned N = 40;
+
+    for (unsigned round = 0; round < 3; ++round) {
+        FakeConnection c[N];
+        for (auto &i : c)
+            i = SendNew(multi[0]);
+
+        for (unsigned i = 0; i < N; ++i) {
+            char uri[32];
+            snprintf(uri, sizeof(uri), "/%u/%u", round, i);
+
+            c[i].SendControl(WAS_COMMAND_REQUEST);
+            c[i].SendControl(WAS_COMMAND_URI, uri);
+            c[i].SendControl(WAS_COMMAND_NO_DATA);
+            ExpectResponse(c[i], uri);
+        }
+
+        for (auto &i : c) {
+            close(i.control_fd);
+            close(i.input_fd);
+        }
+    }
+
+    close(multi[0]);
+
+    int status;
+    if (waitpid(pid, &status, 0) != pid ||
+        !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+        abort();
+}
+
+/**
+ * Send a malformed packet to the Multi-WAS socket: a
+ * #MULTI_WAS_COMMAND_NEW packet with just one file descriptor.
+ */
+static void
+SendMalformed(int multi_fd)
+{
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) < 0)
+        abort();
+
+    struct was_header h{};
+    h.command = MULTI_WAS_COMMAND_NEW;
+
+    struct iovec v = {&h, sizeof(h)};
+
+    union {
+        struct cmsghdr align;
+        char buffer[CMSG_SPACE(sizeof(fds[0]))];
+    } cmsg;
+
+    struct msghdr msg{};
+    msg.msg_iov = &v;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cmsg.buffer;
+    msg.msg_controllen = sizeof(cmsg.buffer);
+
+    struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(fds[0]));
+    memcpy(CMSG_DATA(c), &fds[1], sizeof(fds[1]));
+
+    if (sendmsg(multi_fd, &msg, 0) != sizeof(h))
+        abort();
+
+    close(fds[1]);
+
+    /* the server must close the file descriptor it has received */
+    char dummy;
+    if (read(fds[0], &dummy, sizeof(dummy)) != 0)
+        abort();
+
+    close(fds[0]);
+
+    /* a packet which is too short */
+    if (send(multi_fd, &h, 1, 0) != 1)
+        abort();
+}
+
+/**
+ * Malformed packets on the Multi-WAS socket are dropped; they do
+ * not shut down the server.
+ */
+static void
+TestMalformed(unsigned n_threads)
+{
+    int multi[2];
+    if (socketpair(AF_LOCAL, SOCK_SEQPACKET|SOCK_CLOEXEC, 0, multi) < 0)
+        abort();
+
+    const pid_t pid = fork();
+    if (pid < 0)
+        abort();
+
+    if (pid == 0) {
+        dup2(multi[1], 0);
+        close(multi[0]);
+        close(multi[1]);
+        RunServer(n_threads);
+    }
+
+    close(multi[1]);
+
+    SendMalformed(multi[0]);
+
+    FakeConnection a = SendNew(multi[0]);
+    a.SendControl(WAS_COMMAND_REQUEST);
+    a.SendControl(WAS_COMMAND_URI, "/a");
+    a.SendControl(WAS_COMMAND_NO_DATA);
+    ExpectResponse(a, "/a");
+
+    close(multi[0]);
+    close(a.control_fd);
+
+    int status;
+    if (waitpid(pid, &status, 0) != pid ||
+        !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+        abort();
+
+    close(a.input_fd);
+}
+
+/**
+ * A connection queued for a worker which is stuck in a handler is
+ * taken over by an idle worker.
+ */
+static void
+TestSteal()
+{
+    int multi[2], notify[2], release[2];
+    if (socketpair(AF_LOCAL, SOCK_SEQPACKET|SOCK_CLOEXEC, 0, multi) < 0 ||
+        pipe2(notify, O_CLOEXEC) < 0 || pipe2(release, O_CLOEXEC) < 0)
+        abort();
+
+    const pid_t pid = fork();
+    if (pid < 0)
+        abort();
+
+    if (pid == 0) {
+        dup2(multi[1], 0);
+        close(multi[0]);
+        close(multi[1]);
+        block_notify_fd = notify[1];
+        block_release_fd = release[0];
+        RunServer(2);
+    }
+
+    close(multi[1]);
+    close(notify[1]);
+    close(release[0]);
+
+    /* the connections are dispatched round-robin: "a" and "c" are
+       queued for the first worker, "b" for the second one */
+    FakeConnection a = SendNew(multi[0]);
+    a.SendControl(WAS_COMMAND_REQUEST);
+    a.SendControl(WAS_COMMAND_URI, "/block");
+    a.SendControl(WAS_COMMAND_NO_DATA);
+
+    char dummy;
+    if (read(notify[0], &dummy, sizeof(dummy)) != 1)
+        abort();
+
+    FakeConnection b = SendNew(multi[0]);
+    b.SendControl(WAS_COMMAND_REQUEST);
+    b.SendControl(WAS_COMMAND_URI, "/b");
+    b.SendControl(WAS_COMMAND_NO_DATA);
+    ExpectResponse(b, "/b");
+
+    FakeConnection c = SendNew(multi[0]);
+    c.SendControl(WAS_COMMAND_REQUEST);
+    c.SendControl(WAS_COMMAND_URI, "/c");
+    c.SendControl(WAS_COMMAND_NO_DATA);
+
+    /* the first worker is still blocked */
+    struct pollfd pfd{};
+    pfd.fd = c.control_fd;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, 5000) != 1)
+        abort();
+
+    ExpectResponse(c, "/c");
+
+    if (write(release[1], &dummy, sizeof(dummy)) != 1)
+        abort();
+
+    ExpectResponse(a, "/block");
+
+    /* shut down */
+    close(multi[0]);
+    close(a.control_fd);
+    close(b.control_fd);
+    close(c.control_fd);
+
+    int status;
+    if (waitpid(pid, &status, 0) != pid ||
+        !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+        abort();
+
+    close(a.input_fd);
+    close(b.input_fd);
+    close(c.input_fd);
+    close(notify[0]);
+    close(release[1]);
+}
+
+/**
+ * A child of was_multi_prefork(): serve connections one at a time;
+ * the URI "/crash" makes it exit with a failure status.
+ */
+static void
+RunPreforkChild(struct was_multi *m)
+{
+    struct was_simple *w;
+    while ((w = was_multi_accept_simple(m)) != nullptr) {
+        const char *uri;
+        while ((uri = was_simple_accept(w)) != nullptr) {
+            if (strcmp(uri, "/crash") == 0)
+                _exit(2);
+
+            if (!was_simple_puts(w, uri) || !was_simple_end(w))
+                break;
+        }
+
+        was_simple_free(w);
+    }
+
+    _exit(EXIT_SUCCESS);
+}
+
+static void
+TestPrefork()
+{
+    int multi[2];
+    if (socketpair(AF_LOCAL, SOCK_SEQPACKET|SOCK_CLOEXEC, 0, multi) < 0)
+        abort();
+
+    const pid_t pid = fork();
+    if (pid < 0)
+        abort();
+
+    if (pid == 0) {
+        dup2(multi[1], 0);
+        close(multi[0]);
+        close(multi[1]);
+
+        auto *m = was_multi_new();
+        const int result = was_multi_prefork(m, 2, WAS_MULTI_PREFORK_PIN_CPU);
+        if (result >= 0)
+            RunPreforkChild(m);
+
+        was_multi_free(m);
+        _exit(result == -1 ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    close(multi[1]);
+
+    /* two connections are served by the two children
+       concurrently */
+    FakeConnection a = SendNew(multi[0]);
+    FakeConnection b = SendNew(multi[0]);
+
+    a.SendControl(WAS_COMMAND_REQUEST);
+    a.SendControl(WAS_COMMAND_URI, "/a");
+
+    b.SendControl(WAS_COMMAND_REQUEST);
+    b.SendControl(WAS_COMMAND_URI, "/b");
+    b.SendControl(WAS_COMMAND_NO_DATA);
+    ExpectResponse(b, "/b");
+
+    a.SendControl(WAS_COMMAND_NO_DATA);
+    ExpectResponse(a, "/a");
+
+    /* crash the child serving "b"; the supervisor respawns it */
+    b.SendControl(WAS_COMMAND_REQUEST);
+    b.SendControl(WAS_COMMAND_URI, "/crash");
+    b.SendControl(WAS_COMMAND_NO_DATA);
+
+    char dummy;
+    if (recv(b.control_fd, &dummy, sizeof(dummy), 0) != 0)
+        abort();
+
+    close(b.control_fd);
+    close(b.input_fd);
+
+    FakeConnection c = SendNew(multi[0]);
+    c.SendControl(WAS_COMMAND_REQUEST);
+    c.SendControl(WAS_COMMAND_URI, "/c");
+    c.SendControl(WAS_COMMAND_NO_DATA);
+    ExpectResponse(c, "/c");
+
+    /* shut down */
+    close(multi[0]);
+    close(a.control_fd);
+    close(c.control_fd);
+
+    int status;
+    if (waitpid(pid, &status, 0) != pid ||
+        !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+        abort();
+
+    close(a.input_fd);
+    close(c.input_fd);
+}
+
+/**
+ * SIGTERM sent to the supervisor reaches the children, even though
+ * the Multi-WAS socket is still open.
+ */
+static void
+TestPreforkTerminate()
+{
+    int multi[2];
+    if (socketpair(AF_LOCAL, SOCK_SEQPACKET|SOCK_CLOEXEC, 0, multi) < 0)
+        abort();
+
+    const pid_t pid = fork();
+    if (pid < 0)
+        abort();
+
+    if (pid == 0) {
+        dup2(multi[1], 0);
+        close(multi[0]);
+        close(multi[1]);
+
+        auto *m = was_multi_new();
+        const int result = was_multi_prefork(m, 2, 0);
+        if (result >= 0)
+            RunPreforkChild(m);
+
+        was_multi_free(m);
+        _exit(result == -1 ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    close(multi[1]);
+
+    /* wait until a child is running */
+    FakeConnection a = SendNew(multi[0]);
+    a.SendControl(WAS_COMMAND_REQUEST);
+    a.SendControl(WAS_COMMAND_URI, "/a");
+    a.SendControl(WAS_COMMAND_NO_DATA);
+    ExpectResponse(a, "/a");
+
+    if (kill(pid, SIGTERM) < 0)
+        abort();
+
+    /* the child serving "a" has been terminated */
+    char dummy;
+    if (recv(a.control_fd, &dummy, sizeof(dummy), 0) != 0)
+        abort();
+
+    int status;
+    if (waitpid(pid, &status, 0) != pid ||
+        !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+        abort();
+
+    close(multi[0]);
+    close(a.control_fd);
+    close(a.input_fd);
+}
+
+int
+main(int, char **)
+{
+    TestMulti(0);
+    TestMulti(1);
+    TestMulti(4);
+    TestBatch(0);
+    TestBatch(4);
+    TestMalformed(0);
+    TestMalformed(4);
+    TestSteal();
+    TestPrefork();
+    TestPreforkTerminate();
+    return EXIT_SUCCESS;
+}
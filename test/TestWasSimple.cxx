@@ -6,12 +6,29 @@
 #include <was/protocol.h>
 
 #include <algorithm>
+#include <iterator>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef HAVE_BROTLI
+#include <brotli/decode.h>
+#endif
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
 
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
 static void
@@ -126,6 +143,19 @@ public:
             abort();
     }
 
+    void ExpectHeader(const char *expected) {
+        const size_t length = strlen(expected);
+        ExpectControlHeader(WAS_COMMAND_HEADER, length);
+
+        char buffer[256];
+        if (length > sizeof(buffer))
+            abort();
+
+        ExpectControlRaw(buffer, length);
+        if (memcmp(buffer, expected, length) != 0)
+            abort();
+    }
+
     void ExpectStatus(http_status_t status) {
         ExpectControlT(WAS_COMMAND_STATUS, uint32_t(status));
     }
@@ -134,6 +164,27 @@ public:
         ExpectControlT(WAS_COMMAND_LENGTH, length);
     }
 
+    /**
+     * @return the value
+     */
+    float ExpectMetric(const char *name) {
+        const size_t length = strlen(name);
+        ExpectControlHeader(WAS_COMMAND_METRIC, sizeof(float) + length);
+
+        float value;
+        ReceiveControlT(value);
+
+        char buffer[64];
+        if (length > sizeof(buffer))
+            abort();
+
+        ExpectControlRaw(buffer, length);
+        if (memcmp(buffer, name, length) != 0)
+            abort();
+
+        return value;
+    }
+
     void ExpectPremature(uint64_t length) {
         ExpectControlT(WAS_COMMAND_PREMATURE, length);
     }
@@ -249,79 +300,178 @@ TestSimple(FakeWasClient &client, struct was_simple *s)
     client.DiscardAllInput(3);
 }
 
+/**
+ * Check that TestSimple() is reflected by the process-wide counters.
+ */
 static void
-TestDiscardedRequestBody(FakeWasClient &client, struct was_simple *s)
+TestStats(FakeWasClient &client, struct was_simple *s)
+{
+    struct was_simple_stats before, after;
+    was_simple_get_stats(&before);
+
+    TestSimple(client, s);
+
+    was_simple_get_stats(&after);
+
+    if (after.requests != before.requests + 1 ||
+        after.control_receives <= before.control_receives ||
+        after.control_sends <= before.control_sends ||
+        after.pipe_writes <= before.pipe_writes ||
+        after.pipe_splices != before.pipe_splices ||
+        after.stops != before.stops)
+        abort();
+}
+
+static void
+TestHeaders(FakeWasClient &client, struct was_simple *s)
 {
     client.SendControl(WAS_COMMAND_REQUEST);
     client.SendControl(WAS_COMMAND_URI, __func__);
-    client.SendControl(WAS_COMMAND_DATA);
+    client.SendControl(WAS_COMMAND_SCRIPT_NAME, "/script");
+    client.SendControl(WAS_COMMAND_HEADER, "x-foo=1");
+    client.SendControl(WAS_COMMAND_HEADER, "accept=text/html");
+    client.SendControl(WAS_COMMAND_HEADER, "x-foo=2");
+    client.SendControl(WAS_COMMAND_HEADER, "empty=");
+    client.SendControl(WAS_COMMAND_HEADER, "invalid");
+    client.SendControl(WAS_COMMAND_PARAMETER, "key=value");
+    client.SendControl(WAS_COMMAND_NO_DATA);
 
     const char *uri = was_simple_accept(s);
     if (uri == nullptr || strcmp(uri, __func__) != 0)
         abort();
 
-    if (!was_simple_has_body(s))
+    if (strcmp(was_simple_get_script_name(s), "/script") != 0)
         abort();
 
-    if (was_simple_input_fd(s) != 0)
+    if (was_simple_get_path_info(s) != nullptr ||
+        was_simple_get_query_string(s) != nullptr)
         abort();
 
-    if (was_simple_input_remaining(s) != -1)
+    const char *value = was_simple_get_header(s, "x-foo");
+    if (value == nullptr || strcmp(value, "1") != 0)
         abort();
 
-    if (was_simple_input_poll(s, 0) != WAS_SIMPLE_POLL_TIMEOUT)
+    value = was_simple_get_header(s, "empty");
+    if (value == nullptr || *value != 0)
         abort();
 
-    client.SendLength(5);
-    client.SendOutput("hello");
+    if (was_simple_get_header(s, "invalid") != nullptr ||
+        was_simple_get_header(s, "x-bar") != nullptr)
+        abort();
 
-    if (was_simple_input_poll(s, 0) != WAS_SIMPLE_POLL_SUCCESS)
+    auto *i = was_simple_get_multi_header(s, "x-foo");
+    const auto *pair = was_simple_iterator_next(i);
+    if (pair == nullptr || strcmp(pair->value, "1") != 0)
+        abort();
+    pair = was_simple_iterator_next(i);
+    if (pair == nullptr || strcmp(pair->value, "2") != 0)
+        abort();
+    if (was_simple_iterator_next(i) != nullptr)
         abort();
+    was_simple_iterator_free(i);
 
-    if (was_simple_input_remaining(s) != 5)
+    /* all headers, sorted by name */
+    static constexpr const char *expected_names[] = {
+        "accept", "empty", "x-foo", "x-foo",
+    };
+
+    i = was_simple_get_header_iterator(s);
+    for (const char *name : expected_names) {
+        pair = was_simple_iterator_next(i);
+        if (pair == nullptr || strcmp(pair->name, name) != 0)
+            abort();
+    }
+    if (was_simple_iterator_next(i) != nullptr)
+        abort();
+    was_simple_iterator_free(i);
+
+    /* the same without allocating an iterator */
+    struct Visitor {
+        const char *const *expected;
+        size_t n = 0;
+
+        static bool Callback(const char *name, size_t name_length,
+                             const char *_value, size_t value_length,
+                             void *ctx) noexcept {
+            auto &v = *static_cast<Visitor *>(ctx);
+            if (strlen(name) != name_length || strlen(_value) != value_length ||
+                strcmp(name, v.expected[v.n]) != 0)
+                abort();
+
+            ++v.n;
+            return true;
+        }
+    };
+
+    Visitor visitor{expected_names};
+    if (!was_simple_foreach_header(s, Visitor::Callback, &visitor) ||
+        visitor.n != std::size(expected_names))
+        abort();
+
+    visitor = {expected_names + 2};
+    if (!was_simple_foreach_multi_header(s, "x-foo", Visitor::Callback, &visitor) ||
+        visitor.n != 2)
+        abort();
+
+    static constexpr const char *expected_parameters[] = {"key"};
+    visitor = {expected_parameters};
+    if (!was_simple_foreach_parameter(s, Visitor::Callback, &visitor) ||
+        visitor.n != 1)
+        abort();
+
+    /* stopping early */
+    if (was_simple_foreach_header(s, [](const char *, size_t, const char *,
+                                        size_t, void *) noexcept {
+        return false;
+    }, nullptr))
+        abort();
+
+    value = was_simple_get_parameter(s, "key");
+    if (value == nullptr || strcmp(value, "value") != 0)
         abort();
 
     was_simple_end(s);
 
-    client.ExpectControl(WAS_COMMAND_STOP);
-    // TODO: do we need to send WAS_COMMAND_PREMATURE now?
     client.ExpectStatus(HTTP_STATUS_NO_CONTENT);
     client.ExpectControl(WAS_COMMAND_NO_DATA);
     client.ExpectControlEmpty();
 }
 
 static void
-TestPrematureDiscardedRequestBody(FakeWasClient &client, struct was_simple *s,
-                                  bool poll)
+TestHeaderTokens(FakeWasClient &client, struct was_simple *s)
 {
     client.SendControl(WAS_COMMAND_REQUEST);
     client.SendControl(WAS_COMMAND_URI, __func__);
-    client.SendControl(WAS_COMMAND_DATA);
+    client.SendControl(WAS_COMMAND_HEADER, "host=example.com");
+    client.SendControl(WAS_COMMAND_HEADER, "x-forwarded-for=1.2.3.4");
+    client.SendControl(WAS_COMMAND_HEADER, "x-forwarded-for=5.6.7.8");
+    client.SendControl(WAS_COMMAND_HEADER, "content-typo=x");
+    client.SendControl(WAS_COMMAND_NO_DATA);
 
     const char *uri = was_simple_accept(s);
     if (uri == nullptr || strcmp(uri, __func__) != 0)
         abort();
 
-    if (!was_simple_has_body(s))
+    const char *value = was_simple_get_header_token(s, WAS_SIMPLE_HEADER_HOST);
+    if (value == nullptr || strcmp(value, "example.com") != 0)
         abort();
 
-    client.SendLength(100);
-    client.SendOutput("hello");
-    client.SendPremature(5);
+    /* the first one of multiple headers */
+    value = was_simple_get_header_token(s, WAS_SIMPLE_HEADER_X_FORWARDED_FOR);
+    if (value == nullptr || strcmp(value, "1.2.3.4") != 0)
+        abort();
 
-    if (poll) {
-        auto poll_result = was_simple_input_poll(s, 0);
-        if (poll_result != WAS_SIMPLE_POLL_CLOSED)
-            abort();
-    }
+    /* the previous request's header must not be visible */
+    if (was_simple_get_header_token(s, WAS_SIMPLE_HEADER_ACCEPT) != nullptr ||
+        was_simple_get_header_token(s, WAS_SIMPLE_HEADER_CONTENT_TYPE) != nullptr)
+        abort();
 
-    was_simple_end(s);
+    /* unknown headers are still available */
+    value = was_simple_get_header(s, "content-typo");
+    if (value == nullptr || strcmp(value, "x") != 0)
+        abort();
 
-    if (!poll) {
-        /* the library sent WAS_COMMAND_STOP because it didn't yet
-           process the client's WAS_COMMAND_PREMATURE */
-        client.ExpectControl(WAS_COMMAND_STOP);
-    }
+    was_simple_end(s);
 
     client.ExpectStatus(HTTP_STATUS_NO_CONTENT);
     client.ExpectControl(WAS_COMMAND_NO_DATA);
@@ -329,213 +479,355 @@ TestPrematureDiscardedRequestBody(FakeWasClient &client, struct was_simple *s,
 }
 
 static void
-TestPrematureConsumedRequestBody(FakeWasClient &client, struct was_simple *s,
-                                 bool poll)
+TestHeaderBlock(FakeWasClient &client, struct was_simple *s,
+                const struct was_simple_header_block *b)
 {
     client.SendControl(WAS_COMMAND_REQUEST);
     client.SendControl(WAS_COMMAND_URI, __func__);
-    client.SendControl(WAS_COMMAND_DATA);
+    client.SendControl(WAS_COMMAND_NO_DATA);
 
     const char *uri = was_simple_accept(s);
     if (uri == nullptr || strcmp(uri, __func__) != 0)
         abort();
 
-    if (!was_simple_has_body(s))
+    if (!was_simple_status(s, HTTP_STATUS_OK) ||
+        !was_simple_send_header_block(s, b) ||
+        !was_simple_set_header(s, "x-request", "1"))
         abort();
 
-    client.SendLength(100);
-    client.SendOutput("hello");
+    was_simple_puts(s, "foo");
+    was_simple_end(s);
 
-    if (was_simple_input_fd(s) != 0)
-        abort();
+    client.ExpectStatus(HTTP_STATUS_OK);
+    client.ExpectHeader("content-type=text/plain");
+    client.ExpectHeader("cache-control=no-cache");
+    client.ExpectHeader("x-request=1");
+    client.ExpectControl(WAS_COMMAND_DATA);
+    client.ExpectLength(3);
+    client.ExpectControlEmpty();
+    client.DiscardAllInput(3);
+}
 
-    if (was_simple_input_remaining(s) != -1)
-        abort();
+/**
+ * Send more control packets than fit into the library's control input
+ * buffer at once.
+ */
+static void
+TestManyHeaders(FakeWasClient &client, struct was_simple *s)
+{
+    static constexpr unsigned n_headers = 100;
 
-    auto poll_result = was_simple_input_poll(s, 0);
-    if (poll_result != WAS_SIMPLE_POLL_SUCCESS)
-        abort();
+    client.SendControl(WAS_COMMAND_REQUEST);
+    client.SendControl(WAS_COMMAND_URI, __func__);
 
-    if (was_simple_input_remaining(s) != 100)
-        abort();
+    for (unsigned i = 0; i < n_headers; ++i) {
+        char buffer[256];
+        snprintf(buffer, sizeof(buffer), "x-header-%03u=%0*u", i, 120 + i % 7, i);
+        client.SendControl(WAS_COMMAND_HEADER, buffer);
+    }
 
-    char buffer[64];
-    ssize_t nbytes = was_simple_read(s, buffer, sizeof(buffer));
-    if (nbytes != 5 || memcmp(buffer, "hello", 5) != 0)
+    client.SendControl(WAS_COMMAND_NO_DATA);
+
+    const char *uri = was_simple_accept(s);
+    if (uri == nullptr || strcmp(uri, __func__) != 0)
         abort();
 
-    if (was_simple_input_remaining(s) != 95)
+    unsigned n = 0;
+    auto *i = was_simple_get_header_iterator(s);
+    while (const auto *pair = was_simple_iterator_next(i)) {
+        char name[32];
+        snprintf(name, sizeof(name), "x-header-%03u", n);
+        if (strcmp(pair->name, name) != 0 ||
+            strlen(pair->value) != 120 + n % 7 ||
+            unsigned(atoi(pair->value)) != n)
+            abort();
+
+        ++n;
+    }
+    was_simple_iterator_free(i);
+
+    if (n != n_headers)
         abort();
 
-    client.SendPremature(5);
+    was_simple_end(s);
 
-    if (poll) {
-        poll_result = was_simple_input_poll(s, 0);
-        if (poll_result != WAS_SIMPLE_POLL_CLOSED)
-            abort();
+    client.ExpectStatus(HTTP_STATUS_NO_CONTENT);
+    client.ExpectControl(WAS_COMMAND_NO_DATA);
+    client.ExpectControlEmpty();
+}
 
-        if (was_simple_input_fd(s) != -1)
-            abort();
+/**
+ * Send a header which is larger than the library's control input
+ * buffer, after so many small packets that it starts in the middle of
+ * a completely filled buffer.  The library must answer "431 Request
+ * Header Fields Too Large" and keep the connection.
+ */
+static void
+TestOversizedHeader(FakeWasClient &client, struct was_simple *s)
+{
+    static char buffer[32768];
+    size_t position = 0;
+
+    const auto append = [&](enum was_command cmd, const void *payload,
+                            size_t length){
+        struct was_header header;
+        header.length = uint16_t(length);
+        header.command = uint16_t(cmd);
+        memcpy(buffer + position, &header, sizeof(header));
+        position += sizeof(header);
+        if (length > 0)
+            memcpy(buffer + position, payload, length);
+        position += length;
+    };
+
+    append(WAS_COMMAND_REQUEST, nullptr, 0);
+    append(WAS_COMMAND_URI, __func__, strlen(__func__));
+
+    /* about 7.9 kB of small headers */
+    for (unsigned i = 0; i < 79; ++i) {
+        char header[96];
+        snprintf(header, sizeof(header), "x-header-%03u=%0*u", i, 82, i);
+        append(WAS_COMMAND_HEADER, header, strlen(header));
     }
 
-    nbytes = was_simple_read(s, buffer, sizeof(buffer));
-    if (nbytes != -2)
+    /* the oversized header starts in the middle of the first 8 kB */
+    if (position + sizeof(struct was_header) >= 8192)
         abort();
 
-    if (was_simple_input_fd(s) != -1)
+    static char large[9000];
+    memcpy(large, "x-large=", 8);
+    memset(large + 8, 'a', sizeof(large) - 8);
+    append(WAS_COMMAND_HEADER, large, sizeof(large));
+
+    append(WAS_COMMAND_NO_DATA, nullptr, 0);
+
+    /* send everything at once, so one recv() fills the library's
+       input buffer */
+    client.SendControlRaw(buffer, position);
+
+    /* non-blocking, so the rejected request is answered before the
+       next one is sent */
+    was_simple_set_non_block(s, true);
+
+    if (was_simple_accept(s) != nullptr || errno != EAGAIN)
         abort();
 
-    if (was_simple_input_remaining(s) != -1)
+    client.ExpectStatus(HTTP_STATUS_REQUEST_HEADER_FIELDS_TOO_LARGE);
+    client.ExpectControl(WAS_COMMAND_NO_DATA);
+    client.ExpectControlEmpty();
+
+    /* the connection is still usable */
+    client.SendControl(WAS_COMMAND_REQUEST);
+    client.SendControl(WAS_COMMAND_URI, __func__);
+    client.SendControl(WAS_COMMAND_NO_DATA);
+
+    const char *uri = was_simple_accept(s);
+    if (uri == nullptr || strcmp(uri, __func__) != 0)
         abort();
 
     was_simple_end(s);
+    was_simple_set_non_block(s, false);
 
     client.ExpectStatus(HTTP_STATUS_NO_CONTENT);
     client.ExpectControl(WAS_COMMAND_NO_DATA);
     client.ExpectControlEmpty();
 }
 
+/**
+ * Send a response header which is larger than the library's control
+ * output buffer.
+ */
 static void
-TestStopEarly(FakeWasClient &client, struct was_simple *s)
+TestLargeResponseHeader(FakeWasClient &client, struct was_simple *s)
 {
     client.SendControl(WAS_COMMAND_REQUEST);
     client.SendControl(WAS_COMMAND_URI, __func__);
     client.SendControl(WAS_COMMAND_NO_DATA);
-    client.SendControl(WAS_COMMAND_STOP);
 
     const char *uri = was_simple_accept(s);
     if (uri == nullptr || strcmp(uri, __func__) != 0)
         abort();
 
-    if (was_simple_has_body(s))
+    static char value[6000];
+    memset(value, 'a', sizeof(value) - 1);
+
+    if (!was_simple_set_header(s, "x-small", "foo") ||
+        !was_simple_set_header(s, "x-large", value) ||
+        !was_simple_set_header(s, "x-small", "bar"))
         abort();
 
     was_simple_end(s);
 
-    client.ExpectPremature(0);
+    client.ExpectStatus(HTTP_STATUS_OK);
+
+    char buffer[sizeof(value) + 16];
+    client.ExpectControlHeader(WAS_COMMAND_HEADER, 11);
+    client.ExpectControlRaw(buffer, 11);
+    if (memcmp(buffer, "x-small=foo", 11) != 0)
+        abort();
+
+    const size_t large_length = 8 + sizeof(value) - 1;
+    client.ExpectControlHeader(WAS_COMMAND_HEADER, large_length);
+    for (size_t position = 0; position < large_length;)
+        position += client.ReceiveControlRaw(buffer + position,
+                                             large_length - position);
+    if (memcmp(buffer, "x-large=", 8) != 0 ||
+        memcmp(buffer + 8, value, sizeof(value) - 1) != 0)
+        abort();
+
+    client.ExpectControlHeader(WAS_COMMAND_HEADER, 11);
+    client.ExpectControlRaw(buffer, 11);
+    if (memcmp(buffer, "x-small=bar", 11) != 0)
+        abort();
+
+    client.ExpectControl(WAS_COMMAND_NO_DATA);
     client.ExpectControlEmpty();
 }
 
 static void
-TestStopLate(FakeWasClient &client, struct was_simple *s, bool poll)
+ExpectInput(FakeWasClient &client, const char *expected)
+{
+    const size_t length = strlen(expected);
+    char buffer[4096];
+    if (length > sizeof(buffer) ||
+        read(client.input_fd, buffer, sizeof(buffer)) != ssize_t(length) ||
+        memcmp(buffer, expected, length) != 0)
+        abort();
+}
+
+static void
+TestOutputBuffer(FakeWasClient &client, struct was_simple *s)
 {
     client.SendControl(WAS_COMMAND_REQUEST);
     client.SendControl(WAS_COMMAND_URI, __func__);
-    client.SendControl(WAS_COMMAND_HEADER, "foo=bar");
     client.SendControl(WAS_COMMAND_NO_DATA);
 
+    if (!was_simple_set_output_buffer(s, 1024))
+        abort();
+
     const char *uri = was_simple_accept(s);
     if (uri == nullptr || strcmp(uri, __func__) != 0)
         abort();
 
-    if (was_simple_has_body(s))
+    if (!was_simple_puts(s, "foo") ||
+        !was_simple_printf(s, "%d%s", 42, "bar"))
         abort();
 
+    /* nothing has been sent yet, not even the status */
     client.ExpectControlEmpty();
+    client.DiscardAllInput(0);
 
-    bool success = was_simple_puts(s, "foo");
-    if (!success)
+    if (!was_simple_flush(s))
         abort();
 
     client.ExpectStatus(HTTP_STATUS_OK);
     client.ExpectControl(WAS_COMMAND_DATA);
     client.ExpectControlEmpty();
+    ExpectInput(client, "foo42bar");
 
-    client.SendControl(WAS_COMMAND_STOP);
+    /* larger than the buffer */
+    static char large[2000];
+    memset(large, 'x', sizeof(large) - 1);
 
-    if (poll) {
-        auto poll_result = was_simple_output_poll(s, 0);
-        if (poll_result != WAS_SIMPLE_POLL_ERROR)
-            abort();
-    } else {
-        char buffer[4096];
-        memset(buffer, '0', sizeof(buffer));
+    if (!was_simple_puts(s, "a") ||
+        !was_simple_printf(s, "%s", large) ||
+        !was_simple_puts(s, "b"))
+        abort();
 
-        success = was_simple_write(s, buffer, 4090);
-        if (!success)
-            abort();
+    was_simple_end(s);
 
-        success = was_simple_write(s, buffer, 8);
-        if (success)
-            abort();
-    }
+    client.ExpectLength(8 + 1 + sizeof(large) - 1 + 1);
+    client.ExpectControlEmpty();
 
-    /* after receiving STOP, all method calls for this request must fail */
+    char expected[sizeof(large) + 2];
+    snprintf(expected, sizeof(expected), "a%sb", large);
+    ExpectInput(client, expected);
 
-    if (was_simple_status(s, HTTP_STATUS_NOT_FOUND))
+    if (!was_simple_set_output_buffer(s, 0))
         abort();
+}
 
-    if (was_simple_set_header(s, "foo", "bar"))
-        abort();
+static void
+TestOutputBufferLength(FakeWasClient &client, struct was_simple *s)
+{
+    client.SendControl(WAS_COMMAND_REQUEST);
+    client.SendControl(WAS_COMMAND_URI, __func__);
+    client.SendControl(WAS_COMMAND_NO_DATA);
 
-    if (was_simple_copy_all_headers(s))
+    if (!was_simple_set_output_buffer(s, 1024))
         abort();
 
-    if (was_simple_set_length(s, 42))
+    const char *uri = was_simple_accept(s);
+    if (uri == nullptr || strcmp(uri, __func__) != 0)
         abort();
 
-    if (was_simple_output_begin(s))
+    if (!was_simple_set_length(s, 6))
         abort();
 
-    if (was_simple_output_poll(s, 0) != WAS_SIMPLE_POLL_ERROR)
-        abort();
+    client.ExpectStatus(HTTP_STATUS_OK);
+    client.ExpectControl(WAS_COMMAND_DATA);
+    client.ExpectLength(6);
 
-    if (was_simple_output_fd(s) != -1)
+    if (!was_simple_puts(s, "foo"))
         abort();
 
-    if (was_simple_set_length(s, 1))
+    client.DiscardAllInput(0);
+
+    /* the last chunk is flushed automatically */
+    if (!was_simple_puts(s, "bar"))
         abort();
 
-    if (was_simple_puts(s, "foo"))
+    ExpectInput(client, "foobar");
+
+    if (was_simple_puts(s, "x"))
         abort();
 
     was_simple_end(s);
-
-    client.ExpectPremature(poll ? 3 : 4093);
     client.ExpectControlEmpty();
-    client.DiscardAllInput(poll ? 3 : 4093);
+
+    if (!was_simple_set_output_buffer(s, 0))
+        abort();
 }
 
 static void
-TestAbort(FakeWasClient &client, struct was_simple *s, bool length)
+TestWriteV(FakeWasClient &client, struct was_simple *s, bool buffer)
 {
     client.SendControl(WAS_COMMAND_REQUEST);
     client.SendControl(WAS_COMMAND_URI, __func__);
     client.SendControl(WAS_COMMAND_NO_DATA);
 
-    const char *uri = was_simple_accept(s);
-    if (uri == nullptr || strcmp(uri, __func__) != 0)
+    if (!was_simple_set_output_buffer(s, buffer ? 16 : 0))
         abort();
 
-    if (was_simple_has_body(s))
+    const char *uri = was_simple_accept(s);
+    if (uri == nullptr || strcmp(uri, __func__) != 0)
         abort();
 
-    client.ExpectControlEmpty();
+    const struct iovec v[] = {
+        {const_cast<char *>("foo"), 3},
+        {const_cast<char *>(""), 0},
+        {const_cast<char *>("bar"), 3},
+    };
 
-    bool success = was_simple_puts(s, "foo");
-    if (!success)
+    if (!was_simple_writev(s, v, 3) ||
+        !was_simple_writev(s, v, 3) ||
+        !was_simple_writev(s, v, 3))
         abort();
 
-    if (length && !was_simple_set_length(s, 1024))
-        abort();
+    was_simple_end(s);
 
     client.ExpectStatus(HTTP_STATUS_OK);
     client.ExpectControl(WAS_COMMAND_DATA);
-
-    if (length)
-        client.ExpectLength(1024);
-
+    client.ExpectLength(18);
     client.ExpectControlEmpty();
+    ExpectInput(client, "foobarfoobarfoobar");
 
-    was_simple_abort(s);
-
-    client.ExpectPremature(3);
-    client.ExpectControlEmpty();
-    client.DiscardAllInput(3);
+    if (!was_simple_set_output_buffer(s, 0))
+        abort();
 }
 
 static void
-TestStopTooLate(FakeWasClient &client, struct was_simple *s)
+TestWriteGift(FakeWasClient &client, struct was_simple *s)
 {
     client.SendControl(WAS_COMMAND_REQUEST);
     client.SendControl(WAS_COMMAND_URI, __func__);
@@ -545,7 +837,1529 @@ TestStopTooLate(FakeWasClient &client, struct was_simple *s)
     if (uri == nullptr || strcmp(uri, __func__) != 0)
         abort();
 
-    if (was_simple_has_body(s))
+    /* make room for the whole body (the pages are not copied, so
+       each one occupies a pipe buffer) */
+    if (fcntl(1, F_SETPIPE_SZ, 65536) < 0)
+        abort();
+
+    static constexpr size_t size = 20000;
+    char *data = (char *)aligned_alloc(4096, 5 * 4096);
+    if (data == nullptr)
+        abort();
+
+    for (size_t i = 0; i < size; ++i)
+        data[i] = 'a' + i % 26;
+
+    if (!was_simple_write_gift(s, data, size))
+        abort();
+
+    was_simple_end(s);
+
+    client.ExpectStatus(HTTP_STATUS_OK);
+    client.ExpectControl(WAS_COMMAND_DATA);
+    client.ExpectLength(size);
+    client.ExpectControlEmpty();
+
+    static char buffer[size];
+    for (size_t position = 0; position < size;) {
+        ssize_t nbytes = read(client.input_fd, buffer + position,
+                              size - position);
+        if (nbytes <= 0)
+            abort();
+        position += nbytes;
+    }
+
+    if (memcmp(buffer, data, size) != 0)
+        abort();
+
+    free(data);
+    client.DiscardAllInput(0);
+
+    if (fcntl(1, F_SETPIPE_SZ, 4096) < 0)
+        abort();
+}
+
+static void
+TestPipeAuto(FakeWasClient &client, struct was_simple *s)
+{
+    client.SendControl(WAS_COMMAND_REQUEST);
+    client.SendControl(WAS_COMMAND_URI, __func__);
+    client.SendControl(WAS_COMMAND_NO_DATA);
+
+    was_simple_set_pipe_auto(s, 65536);
+
+    const char *uri = was_simple_accept(s);
+    if (uri == nullptr || strcmp(uri, __func__) != 0)
+        abort();
+
+    static constexpr size_t size = 20000;
+    if (!was_simple_set_length(s, size))
+        abort();
+
+    /* the pipe has been grown to hold the whole body */
+    if (fcntl(1, F_GETPIPE_SZ) < int(size))
+        abort();
+
+    static char data[size];
+    memset(data, 'x', sizeof(data));
+    if (!was_simple_write(s, data, sizeof(data)))
+        abort();
+
+    was_simple_end(s);
+
+    client.ExpectStatus(HTTP_STATUS_OK);
+    client.ExpectControl(WAS_COMMAND_DATA);
+    client.ExpectLength(size);
+    client.ExpectControlEmpty();
+    client.DiscardAllInput(size);
+
+    was_simple_set_pipe_auto(s, 0);
+    if (!was_simple_set_pipe_size(s, 4096))
+        abort();
+}
+
+/**
+ * Read everything which is currently available from the client's
+ * input pipe.
+ */
+static size_t
+ReadAvailable(FakeWasClient &client)
+{
+    size_t total = 0;
+
+    while (true) {
+        char buffer[4096];
+        ssize_t nbytes = read(client.input_fd, buffer, sizeof(buffer));
+        if (nbytes < 0) {
+            if (errno != EAGAIN)
+                abort();
+            return total;
+        }
+
+        total += nbytes;
+    }
+}
+
+static void
+TestNonBlock(FakeWasClient &client, struct was_simple *s)
+{
+    was_simple_set_non_block(s, true);
+
+    /* idle connection */
+    if (was_simple_accept(s) != nullptr || errno != EAGAIN)
+        abort();
+
+    const size_t idle_memory = was_simple_get_memory_usage(s);
+
+    /* incomplete request */
+    client.SendControl(WAS_COMMAND_REQUEST);
+    client.SendControl(WAS_COMMAND_URI, __func__);
+
+    if (was_simple_accept(s) != nullptr || errno != EAGAIN)
+        abort();
+
+    struct pollfd fds[2];
+    if (was_simple_get_poll(s, fds) != 1 ||
+        fds[0].fd != was_simple_control_fd(s) ||
+        fds[0].events != POLLIN)
+        abort();
+
+    client.SendControl(WAS_COMMAND_DATA);
+    client.SendLength(3);
+
+    const char *uri = was_simple_accept(s);
+    if (uri == nullptr || strcmp(uri, __func__) != 0)
+        abort();
+
+    /* the control buffers are allocated only while the connection
+       is active */
+    const size_t active_memory = was_simple_get_memory_usage(s);
+    if (active_memory < idle_memory + 8192 + 4096)
+        abort();
+
+    /* no request body data yet */
+    char buffer[16];
+    if (was_simple_read(s, buffer, sizeof(buffer)) != -1 || errno != EAGAIN)
+        abort();
+
+    if (was_simple_get_poll(s, fds) != 2 || fds[1].fd != 0 ||
+        fds[1].events != POLLIN)
+        abort();
+
+    client.SendOutput("abc");
+
+    if (was_simple_read(s, buffer, sizeof(buffer)) != 3 ||
+        memcmp(buffer, "abc", 3) != 0)
+        abort();
+
+    /* the response body does not fit into the pipe; the rest is
+       queued */
+    static char data[10000];
+    memset(data, 'x', sizeof(data));
+    if (!was_simple_write(s, data, sizeof(data)))
+        abort();
+
+    size_t received = 0;
+    while (!was_simple_end(s)) {
+        if (errno != EAGAIN)
+            abort();
+
+        if (was_simple_get_poll(s, fds) != 2 || fds[1].fd != 1 ||
+            fds[1].events != POLLOUT)
+            abort();
+
+        const size_t nbytes = ReadAvailable(client);
+        if (nbytes == 0)
+            abort();
+
+        received += nbytes;
+    }
+
+    received += ReadAvailable(client);
+    if (received != sizeof(data))
+        abort();
+
+    client.ExpectStatus(HTTP_STATUS_OK);
+    client.ExpectControl(WAS_COMMAND_DATA);
+    client.ExpectLength(sizeof(data));
+    client.ExpectControlEmpty();
+
+    /* idle again: the control buffers have been released */
+    const size_t end_memory = was_simple_get_memory_usage(s);
+    if (was_simple_accept(s) != nullptr || errno != EAGAIN)
+        abort();
+
+    if (was_simple_get_memory_usage(s) + 8192 + 4096 > end_memory)
+        abort();
+
+    was_simple_set_non_block(s, false);
+}
+
+/**
+ * In non-blocking mode, a STOP which arrives while the response body
+ * pipe is full must be handled by the next was_simple_end() call
+ * instead of failing with EAGAIN forever.
+ */
+static void
+TestNonBlockStop(FakeWasClient &client, struct was_simple *s)
+{
+    was_simple_set_non_block(s, true);
+
+    client.SendControl(WAS_COMMAND_REQUEST);
+    client.SendControl(WAS_COMMAND_URI, __func__);
+    client.SendControl(WAS_COMMAND_NO_DATA);
+
+    const char *uri = was_simple_accept(s);
+    if (uri == nullptr || strcmp(uri, __func__) != 0)
+        abort();
+
+    static char data[10000];
+    memset(data, 'x', sizeof(data));
+    if (!was_simple_write(s, data, sizeof(data)))
+        abort();
+
+    if (was_simple_end(s) || errno != EAGAIN)
+        abort();
+
+    client.SendControl(WAS_COMMAND_STOP);
+
+    if (!was_simple_end(s))
+        abort();
+
+    client.ExpectStatus(HTTP_STATUS_OK);
+    client.ExpectControl(WAS_COMMAND_DATA);
+    client.ExpectControlHeader(WAS_COMMAND_PREMATURE, sizeof(uint64_t));
+
+    uint64_t sent;
+    client.ReceiveControlT(sent);
+    if (sent == 0 || sent >= sizeof(data) || ReadAvailable(client) != sent)
+        abort();
+
+    client.ExpectControlEmpty();
+
+    was_simple_set_non_block(s, false);
+}
+
+/**
+ * Create an unlinked temporary file with the given contents.
+ */
+static int
+CreateTempFile(const char *contents)
+{
+    char path[] = "/tmp/TestWasSimple.XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0)
+        abort();
+
+    unlink(path);
+
+    const size_t length = strlen(contents);
+    if (write(fd, contents, length) != ssize_t(length))
+        abort();
+
+    return fd;
+}
+
+static void
+TestSendFile(FakeWasClient &client, struct was_simple *s)
+{
+    client.SendControl(WAS_COMMAND_REQUEST);
+    client.SendControl(WAS_COMMAND_URI, __func__);
+    client.SendControl(WAS_COMMAND_NO_DATA);
+
+    const char *uri = was_simple_accept(s);
+    if (uri == nullptr || strcmp(uri, __func__) != 0)
+        abort();
+
+    const int fd = CreateTempFile("0123456789");
+
+    if (!was_simple_puts(s, "<"))
+        abort();
+
+    /* the pipe has only one buffer; it must be drained before
+       splice() can move a page into it */
+    ExpectInput(client, "<");
+
+    if (!was_simple_send_file(s, fd, 3, 4))
+        abort();
+
+    was_simple_end(s);
+    close(fd);
+
+    client.ExpectStatus(HTTP_STATUS_OK);
+    client.ExpectControl(WAS_COMMAND_DATA);
+    client.ExpectLength(5);
+    client.ExpectControlEmpty();
+    ExpectInput(client, "3456");
+}
+
+/**
+ * Read the given number of bytes from the client's input pipe in a
+ * child process, and verify that they end with the given string.
+ */
+static pid_t
+ForkReadInput(FakeWasClient &client, size_t length, const char *tail)
+{
+    const pid_t pid = fork();
+    if (pid < 0)
+        abort();
+
+    if (pid > 0)
+        return pid;
+
+    /* let the parent find the pipe full */
+    poll(nullptr, 0, 100);
+
+    static char buffer[65536];
+    size_t position = 0;
+    while (position < length) {
+        struct pollfd pfd{};
+        pfd.fd = client.input_fd;
+        pfd.events = POLLIN;
+        poll(&pfd, 1, -1);
+
+        ssize_t nbytes = read(client.input_fd, buffer + position,
+                              std::min(length - position,
+                                       sizeof(buffer) - position));
+        if (nbytes < 0 && errno == EAGAIN)
+            continue;
+
+        if (nbytes <= 0)
+            _exit(EXIT_FAILURE);
+
+        position += nbytes;
+    }
+
+    const size_t tail_length = strlen(tail);
+    _exit(memcmp(buffer + length - tail_length, tail, tail_length) == 0
+          ? EXIT_SUCCESS
+          : EXIT_FAILURE);
+}
+
+/**
+ * was_simple_send_file() blocks even in non-blocking mode, after it
+ * has written the data which is still pending from an earlier
+ * was_simple_write().
+ */
+static void
+TestNonBlockSendFile(FakeWasClient &client, struct was_simple *s)
+{
+    was_simple_set_non_block(s, true);
+
+    client.SendControl(WAS_COMMAND_REQUEST);
+    client.SendControl(WAS_COMMAND_URI, __func__);
+    client.SendControl(WAS_COMMAND_NO_DATA);
+
+    const char *uri = was_simple_accept(s);
+    if (uri == nullptr || strcmp(uri, __func__) != 0)
+        abort();
+
+    /* this does not fit into the pipe; the rest is queued */
+    static char data[10000];
+    memset(data, 'x', sizeof(data));
+    if (!was_simple_write(s, data, sizeof(data)))
+        abort();
+
+    const pid_t pid = ForkReadInput(client, sizeof(data) + 4, "x3456");
+
+    const int fd = CreateTempFile("0123456789");
+    if (!was_simple_send_file(s, fd, 3, 4))
+        abort();
+
+    close(fd);
+
+    if (!was_simple_end(s))
+        abort();
+
+    int status;
+    if (waitpid(pid, &status, 0) != pid ||
+        !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+        abort();
+
+    client.ExpectStatus(HTTP_STATUS_OK);
+    client.ExpectControl(WAS_COMMAND_DATA);
+    client.ExpectLength(sizeof(data) + 4);
+    client.ExpectControlEmpty();
+
+    was_simple_set_non_block(s, false);
+}
+
+static void
+TestSendFileRange(FakeWasClient &client, struct was_simple *s,
+                  const char *range, http_status_t expected_status,
+                  const char *expected_content_range,
+                  const char *expected_body)
+{
+    client.SendControl(WAS_COMMAND_REQUEST);
+    client.SendControl(WAS_COMMAND_URI, __func__);
+    if (range != nullptr) {
+        char buffer[64];
+        snprintf(buffer, sizeof(buffer), "range=%s", range);
+        client.SendControl(WAS_COMMAND_HEADER, buffer);
+    }
+    client.SendControl(WAS_COMMAND_NO_DATA);
+
+    const char *uri = was_simple_accept(s);
+    if (uri == nullptr || strcmp(uri, __func__) != 0)
+        abort();
+
+    const int fd = CreateTempFile("0123456789");
+
+    if (!was_simple_send_file_range(s, fd, 10))
+        abort();
+
+    was_simple_end(s);
+    close(fd);
+
+    client.ExpectStatus(expected_status);
+    client.ExpectHeader("accept-ranges=bytes");
+    if (expected_content_range != nullptr) {
+        char buffer[64];
+        snprintf(buffer, sizeof(buffer), "content-range=%s",
+                 expected_content_range);
+        client.ExpectHeader(buffer);
+    }
+
+    if (*expected_body == 0) {
+        client.ExpectControl(WAS_COMMAND_NO_DATA);
+        client.ExpectControlEmpty();
+        client.DiscardAllInput(0);
+        return;
+    }
+
+    client.ExpectControl(WAS_COMMAND_DATA);
+    client.ExpectLength(strlen(expected_body));
+    client.ExpectControlEmpty();
+    ExpectInput(client, expected_body);
+}
+
+static void
+TestDiscardedRequestBody(FakeWasClient &client, struct was_simple *s)
+{
+    client.SendControl(WAS_COMMAND_REQUEST);
+    client.SendControl(WAS_COMMAND_URI, __func__);
+    client.SendControl(WAS_COMMAND_DATA);
+
+    const char *uri = was_simple_accept(s);
+    if (uri == nullptr || strcmp(uri, __func__) != 0)
+        abort();
+
+    if (!was_simple_has_body(s))
+        abort();
+
+    if (was_simple_input_fd(s) != 0)
+        abort();
+
+    if (was_simple_input_remaining(s) != -1)
+        abort();
+
+    if (was_simple_input_poll(s, 0) != WAS_SIMPLE_POLL_TIMEOUT)
+        abort();
+
+    client.SendLength(5);
+    client.SendOutput("hello");
+
+    if (was_simple_input_poll(s, 0) != WAS_SIMPLE_POLL_SUCCESS)
+        abort();
+
+    if (was_simple_input_remaining(s) != 5)
+        abort();
+
+    was_simple_end(s);
+
+    client.ExpectControl(WAS_COMMAND_STOP);
+    // TODO: do we need to send WAS_COMMAND_PREMATURE now?
+    client.ExpectStatus(HTTP_STATUS_NO_CONTENT);
+    client.ExpectControl(WAS_COMMAND_NO_DATA);
+    client.ExpectControlEmpty();
+}
+
+static void
+TestPrematureDiscardedRequestBody(FakeWasClient &client, struct was_simple *s,
+                                  bool poll)
+{
+    client.SendControl(WAS_COMMAND_REQUEST);
+    client.SendControl(WAS_COMMAND_URI, __func__);
+    client.SendControl(WAS_COMMAND_DATA);
+
+    const char *uri = was_simple_accept(s);
+    if (uri == nullptr || strcmp(uri, __func__) != 0)
+        abort();
+
+    if (!was_simple_has_body(s))
+        abort();
+
+    client.SendLength(100);
+    client.SendOutput("hello");
+    client.SendPremature(5);
+
+    if (poll) {
+        auto poll_result = was_simple_input_poll(s, 0);
+        if (poll_result != WAS_SIMPLE_POLL_CLOSED)
+            abort();
+    }
+
+    was_simple_end(s);
+
+    if (!poll) {
+        /* the library sent WAS_COMMAND_STOP because it didn't yet
+           process the client's WAS_COMMAND_PREMATURE */
+        client.ExpectControl(WAS_COMMAND_STOP);
+    }
+
+    client.ExpectStatus(HTTP_STATUS_NO_CONTENT);
+    client.ExpectControl(WAS_COMMAND_NO_DATA);
+    client.ExpectControlEmpty();
+}
+
+static void
+TestPrematureConsumedRequestBody(FakeWasClient &client, struct was_simple *s,
+                                 bool poll)
+{
+    client.SendControl(WAS_COMMAND_REQUEST);
+    client.SendControl(WAS_COMMAND_URI, __func__);
+    client.SendControl(WAS_COMMAND_DATA);
+
+    const char *uri = was_simple_accept(s);
+    if (uri == nullptr || strcmp(uri, __func__) != 0)
+        abort();
+
+    if (!was_simple_has_body(s))
+        abort();
+
+    client.SendLength(100);
+    client.SendOutput("hello");
+
+    if (was_simple_input_fd(s) != 0)
+        abort();
+
+    if (was_simple_input_remaining(s) != -1)
+        abort();
+
+    auto poll_result = was_simple_input_poll(s, 0);
+    if (poll_result != WAS_SIMPLE_POLL_SUCCESS)
+        abort();
+
+    if (was_simple_input_remaining(s) != 100)
+        abort();
+
+    char buffer[64];
+    ssize_t nbytes = was_simple_read(s, buffer, sizeof(buffer));
+    if (nbytes != 5 || memcmp(buffer, "hello", 5) != 0)
+        abort();
+
+    if (was_simple_input_remaining(s) != 95)
+        abort();
+
+    client.SendPremature(5);
+
+    if (poll) {
+        poll_result = was_simple_input_poll(s, 0);
+        if (poll_result != WAS_SIMPLE_POLL_CLOSED)
+            abort();
+
+        if (was_simple_input_fd(s) != -1)
+            abort();
+    }
+
+    nbytes = was_simple_read(s, buffer, sizeof(buffer));
+    if (nbytes != -2)
+        abort();
+
+    if (was_simple_input_fd(s) != -1)
+        abort();
+
+    if (was_simple_input_remaining(s) != -1)
+        abort();
+
+    was_simple_end(s);
+
+    client.ExpectStatus(HTTP_STATUS_NO_CONTENT);
+    client.ExpectControl(WAS_COMMAND_NO_DATA);
+    client.ExpectControlEmpty();
+}
+
+/**
+ * was_simple_input_map() with a body which is smaller (heap buffer)
+ * or larger (memfd) than the threshold.
+ */
+static void
+TestInputMap(FakeWasClient &client, struct was_simple *s, size_t size)
+{
+    client.SendControl(WAS_COMMAND_REQUEST);
+    client.SendControl(WAS_COMMAND_URI, __func__);
+    client.SendControl(WAS_COMMAND_DATA);
+    client.SendLength(size);
+
+    const char *uri = was_simple_accept(s);
+    if (uri == nullptr || strcmp(uri, __func__) != 0)
+        abort();
+
+    /* the whole body must fit into the request body pipe */
+    if (fcntl(client.output_fd, F_SETPIPE_SZ, int(size)) < 0)
+        abort();
+
+    static char body[128 * 1024];
+    if (size > sizeof(body))
+        abort();
+
+    for (size_t i = 0; i < size; ++i)
+        body[i] = 'a' + i % 26;
+
+    client.SendOutput(body, size);
+
+    size_t length;
+    const void *data = was_simple_input_map(s, &length);
+    if (data == nullptr || length != size || memcmp(data, body, size) != 0)
+        abort();
+
+    /* the same block again; the body has been consumed */
+    if (was_simple_input_map(s, &length) != data || length != size)
+        abort();
+
+    char buffer[16];
+    if (was_simple_read(s, buffer, sizeof(buffer)) != 0)
+        abort();
+
+    was_simple_end(s);
+
+    client.ExpectStatus(HTTP_STATUS_NO_CONTENT);
+    client.ExpectControl(WAS_COMMAND_NO_DATA);
+    client.ExpectControlEmpty();
+}
+
+static void
+TestInputMapUnknownLength(FakeWasClient &client, struct was_simple *s)
+{
+    static constexpr char body[] = "hello world";
+
+    client.SendControl(WAS_COMMAND_REQUEST);
+    client.SendControl(WAS_COMMAND_URI, __func__);
+    client.SendControl(WAS_COMMAND_DATA);
+
+    const char *uri = was_simple_accept(s);
+    if (uri == nullptr || strcmp(uri, __func__) != 0)
+        abort();
+
+    /* the body arrives before its length */
+    client.SendOutput(body);
+    client.SendLength(sizeof(body) - 1);
+
+    size_t length;
+    const void *data = was_simple_input_map(s, &length);
+    if (data == nullptr || length != sizeof(body) - 1 ||
+        memcmp(data, body, length) != 0)
+        abort();
+
+    was_simple_end(s);
+
+    client.ExpectStatus(HTTP_STATUS_NO_CONTENT);
+    client.ExpectControl(WAS_COMMAND_NO_DATA);
+    client.ExpectControlEmpty();
+}
+
+/**
+ * @param size the announced length of the request body; more than
+ * Input::MAP_THRESHOLD tests the memfd path
+ */
+static void
+TestInputMapPremature(FakeWasClient &client, struct was_simple *s,
+                      size_t size)
+{
+    client.SendControl(WAS_COMMAND_REQUEST);
+    client.SendControl(WAS_COMMAND_URI, __func__);
+    client.SendControl(WAS_COMMAND_DATA);
+    client.SendLength(size);
+
+    const char *uri = was_simple_accept(s);
+    if (uri == nullptr || strcmp(uri, __func__) != 0)
+        abort();
+
+    /* the partial body must fit into the request body pipe */
+    if (fcntl(client.output_fd, F_SETPIPE_SZ, int(size)) < 0)
+        abort();
+
+    static char body[128 * 1024];
+    const size_t sent = size / 2;
+    if (sent > sizeof(body))
+        abort();
+
+    memset(body, 'a', sent);
+    client.SendOutput(body, sent);
+    client.SendPremature(sent);
+
+    size_t length;
+    if (was_simple_input_map(s, &length) != nullptr)
+        abort();
+
+    was_simple_end(s);
+
+    client.ExpectStatus(HTTP_STATUS_NO_CONTENT);
+    client.ExpectControl(WAS_COMMAND_NO_DATA);
+    client.ExpectControlEmpty();
+}
+
+static void
+TestReadLine(FakeWasClient &client, struct was_simple *s)
+{
+    static constexpr char body[] = "one\nline number two\nlast";
+
+    client.SendControl(WAS_COMMAND_REQUEST);
+    client.SendControl(WAS_COMMAND_URI, __func__);
+    client.SendControl(WAS_COMMAND_DATA);
+    client.SendLength(sizeof(body) - 1);
+    client.SendOutput(body);
+
+    const char *uri = was_simple_accept(s);
+    if (uri == nullptr || strcmp(uri, __func__) != 0)
+        abort();
+
+    /* smaller than the second line */
+    if (!was_simple_set_input_buffer(s, 16))
+        abort();
+
+    char line[64];
+
+    /* no room for data besides the null terminator */
+    if (was_simple_read_line(s, line, 1) != -1 || errno != EINVAL)
+        abort();
+
+    ssize_t nbytes = was_simple_read_line(s, line, sizeof(line));
+    if (nbytes != 4 || strcmp(line, "one\n") != 0)
+        abort();
+
+    /* the read-ahead buffer is not accounted as consumed */
+    if (was_simple_input_remaining(s) != int64_t(sizeof(body) - 1 - 4))
+        abort();
+
+    /* the line does not fit into the buffer */
+    nbytes = was_simple_read_line(s, line, sizeof(line));
+    if (nbytes != 16 || strcmp(line, "line number two\n") != 0)
+        abort();
+
+    /* the line does not fit into the caller's buffer */
+    nbytes = was_simple_read_line(s, line, 3);
+    if (nbytes != 2 || strcmp(line, "la") != 0)
+        abort();
+
+    const void *data;
+    nbytes = was_simple_input_peek(s, &data);
+    if (nbytes != 2 || memcmp(data, "st", 2) != 0)
+        abort();
+
+    if (was_simple_input_poll(s, 0) != WAS_SIMPLE_POLL_SUCCESS)
+        abort();
+
+    was_simple_input_consume(s, 1);
+
+    char buffer[8];
+    nbytes = was_simple_read(s, buffer, sizeof(buffer));
+    if (nbytes != 1 || buffer[0] != 't')
+        abort();
+
+    if (was_simple_input_remaining(s) != 0 ||
+        was_simple_read_line(s, line, sizeof(line)) != 0 ||
+        was_simple_input_peek(s, &data) != 0)
+        abort();
+
+    if (!was_simple_set_input_buffer(s, 0))
+        abort();
+
+    was_simple_end(s);
+
+    client.ExpectStatus(HTTP_STATUS_NO_CONTENT);
+    client.ExpectControl(WAS_COMMAND_NO_DATA);
+    client.ExpectControlEmpty();
+}
+
+static void
+TestSpliceTo(FakeWasClient &client, struct was_simple *s)
+{
+    static constexpr char body[] = "first line\nthe rest of the body";
+
+    client.SendControl(WAS_COMMAND_REQUEST);
+    client.SendControl(WAS_COMMAND_URI, __func__);
+    client.SendControl(WAS_COMMAND_DATA);
+    client.SendLength(sizeof(body) - 1);
+    client.SendOutput(body, 14);
+
+    const char *uri = was_simple_accept(s);
+    if (uri == nullptr || strcmp(uri, __func__) != 0)
+        abort();
+
+    /* "the" remains in the read-ahead buffer, the rest is still in
+       the pipe */
+    char line[64];
+    if (was_simple_read_line(s, line, sizeof(line)) != 11)
+        abort();
+
+    client.SendOutput(body + 14);
+
+    const int fd = CreateTempFile("");
+    if (!was_simple_splice_to(s, fd) ||
+        was_simple_input_remaining(s) != 0)
+        abort();
+
+    char buffer[64];
+    const size_t length = sizeof(body) - 1 - 11;
+    if (pread(fd, buffer, sizeof(buffer), 0) != ssize_t(length) ||
+        memcmp(buffer, body + 11, length) != 0)
+        abort();
+
+    close(fd);
+
+    if (!was_simple_set_input_buffer(s, 0))
+        abort();
+
+    was_simple_end(s);
+
+    client.ExpectStatus(HTTP_STATUS_NO_CONTENT);
+    client.ExpectControl(WAS_COMMAND_NO_DATA);
+    client.ExpectControlEmpty();
+}
+
+static void
+TestSpliceFrom(FakeWasClient &client, struct was_simple *s)
+{
+    client.SendControl(WAS_COMMAND_REQUEST);
+    client.SendControl(WAS_COMMAND_URI, __func__);
+    client.SendControl(WAS_COMMAND_NO_DATA);
+
+    const char *uri = was_simple_accept(s);
+    if (uri == nullptr || strcmp(uri, __func__) != 0)
+        abort();
+
+    int p[2];
+    if (pipe2(p, O_CLOEXEC|O_NONBLOCK) < 0)
+        abort();
+
+    if (write(p[1], "0123456789", 10) != 10)
+        abort();
+
+    close(p[1]);
+
+    if (was_simple_splice_from(s, p[0], 4) != 4)
+        abort();
+
+    /* the pipe has only one buffer, see TestSendFile() */
+    ExpectInput(client, "0123");
+
+    if (was_simple_splice_from(s, p[0], 64) != 6)
+        abort();
+
+    ExpectInput(client, "456789");
+
+    if (was_simple_splice_from(s, p[0], 64) != 0)
+        abort();
+
+    close(p[0]);
+    was_simple_end(s);
+
+    client.ExpectStatus(HTTP_STATUS_OK);
+    client.ExpectControl(WAS_COMMAND_DATA);
+    client.ExpectLength(10);
+    client.ExpectControlEmpty();
+}
+
+#if defined(HAVE_ZLIB) || defined(HAVE_BROTLI) || defined(HAVE_ZSTD)
+
+static char compressed[4096];
+
+/**
+ * Receive the LENGTH packet and read that much compressed data from
+ * the response body pipe into #compressed.
+ *
+ * @param position the number of bytes which have already been read
+ * into #compressed
+ * @return the total length
+ */
+static size_t
+ReceiveCompressedInput(FakeWasClient &client, size_t position=0)
+{
+    client.ExpectControlHeader(WAS_COMMAND_LENGTH, sizeof(uint64_t));
+    uint64_t length;
+    client.ReceiveControlT(length);
+
+    if (length > sizeof(compressed) || length < position)
+        abort();
+
+    while (position < length) {
+        ssize_t nbytes = read(client.input_fd, compressed + position,
+                              length - position);
+        if (nbytes <= 0)
+            abort();
+        position += nbytes;
+    }
+
+    return length;
+}
+
+#endif
+
+#ifdef HAVE_ZLIB
+
+/**
+ * Receive the LENGTH packet, read that much gzip data from the
+ * response body pipe and compare the decompressed data.
+ */
+static void
+ExpectGzipInput(FakeWasClient &client, const char *expected,
+                size_t expected_length)
+{
+    const size_t length = ReceiveCompressedInput(client);
+
+    static char buffer[65536];
+    z_stream z{};
+    if (inflateInit2(&z, 15 + 16) != Z_OK)
+        abort();
+
+    z.next_in = (Bytef *)compressed;
+    z.avail_in = length;
+    z.next_out = (Bytef *)buffer;
+    z.avail_out = sizeof(buffer);
+
+    if (inflate(&z, Z_FINISH) != Z_STREAM_END ||
+        sizeof(buffer) - z.avail_out != expected_length ||
+        memcmp(buffer, expected, expected_length) != 0)
+        abort();
+
+    inflateEnd(&z);
+}
+
+static void
+TestCompress(FakeWasClient &client, struct was_simple *s)
+{
+    client.SendControl(WAS_COMMAND_REQUEST);
+    client.SendControl(WAS_COMMAND_URI, __func__);
+    client.SendControl(WAS_COMMAND_HEADER, "accept-encoding=br;q=0.5, gzip");
+    client.SendControl(WAS_COMMAND_NO_DATA);
+
+    const char *uri = was_simple_accept(s);
+    if (uri == nullptr || strcmp(uri, __func__) != 0)
+        abort();
+
+    const char *encoding = was_simple_compress(s);
+    if (encoding == nullptr || strcmp(encoding, "gzip") != 0)
+        abort();
+
+    if (!was_simple_puts(s, "hello ") ||
+        !was_simple_printf(s, "%s %d", "world", 42) ||
+        !was_simple_end(s))
+        abort();
+
+    client.ExpectStatus(HTTP_STATUS_OK);
+    client.ExpectHeader("content-encoding=gzip");
+    client.ExpectHeader("vary=accept-encoding");
+    client.ExpectControl(WAS_COMMAND_DATA);
+    ExpectGzipInput(client, "hello world 42", 14);
+    client.ExpectControlEmpty();
+}
+
+/**
+ * was_simple_set_length() declares the uncompressed length; the
+ * response ends when it has been reached.
+ */
+static void
+TestCompressLength(FakeWasClient &client, struct was_simple *s)
+{
+    client.SendControl(WAS_COMMAND_REQUEST);
+    client.SendControl(WAS_COMMAND_URI, __func__);
+    client.SendControl(WAS_COMMAND_HEADER, "accept-encoding=x-gzip");
+    client.SendControl(WAS_COMMAND_NO_DATA);
+
+    const char *uri = was_simple_accept(s);
+    if (uri == nullptr || strcmp(uri, __func__) != 0)
+        abort();
+
+    if (was_simple_compress(s) == nullptr)
+        abort();
+
+    static char body[40000];
+    for (size_t i = 0; i < sizeof(body); ++i)
+        body[i] = 'a' + i % 26;
+
+    if (!was_simple_set_length(s, sizeof(body)) ||
+        !was_simple_write(s, body, 30000) ||
+        !was_simple_write(s, body + 30000, sizeof(body) - 30000))
+        abort();
+
+    /* the body is complete */
+    if (was_simple_write(s, "x", 1))
+        abort();
+
+    was_simple_end(s);
+
+    client.ExpectStatus(HTTP_STATUS_OK);
+    client.ExpectHeader("content-encoding=gzip");
+    client.ExpectHeader("vary=accept-encoding");
+    client.ExpectControl(WAS_COMMAND_DATA);
+    ExpectGzipInput(client, body, sizeof(body));
+    client.ExpectControlEmpty();
+}
+
+/**
+ * "content-encoding" has already been sent when nothing is written;
+ * the response body is an empty gzip stream.
+ */
+static void
+TestCompressEmpty(FakeWasClient &client, struct was_simple *s)
+{
+    client.SendControl(WAS_COMMAND_REQUEST);
+    client.SendControl(WAS_COMMAND_URI, __func__);
+    client.SendControl(WAS_COMMAND_HEADER, "accept-encoding=gzip");
+    client.SendControl(WAS_COMMAND_NO_DATA);
+
+    const char *uri = was_simple_accept(s);
+    if (uri == nullptr || strcmp(uri, __func__) != 0)
+        abort();
+
+    if (was_simple_compress(s) == nullptr || !was_simple_end(s))
+        abort();
+
+    client.ExpectStatus(HTTP_STATUS_OK);
+    client.ExpectHeader("content-encoding=gzip");
+    client.ExpectHeader("vary=accept-encoding");
+    client.ExpectControl(WAS_COMMAND_DATA);
+    ExpectGzipInput(client, "", 0);
+    client.ExpectControlEmpty();
+}
+
+/**
+ * was_simple_flush() makes everything written so far decompressible
+ * before the response ends.
+ */
+static void
+TestCompressFlush(FakeWasClient &client, struct was_simple *s)
+{
+    client.SendControl(WAS_COMMAND_REQUEST);
+    client.SendControl(WAS_COMMAND_URI, __func__);
+    client.SendControl(WAS_COMMAND_HEADER, "accept-encoding=gzip");
+    client.SendControl(WAS_COMMAND_NO_DATA);
+
+    const char *uri = was_simple_accept(s);
+    if (uri == nullptr || strcmp(uri, __func__) != 0)
+        abort();
+
+    if (was_simple_compress(s) == nullptr ||
+        !was_simple_puts(s, "hello") ||
+        !was_simple_flush(s))
+        abort();
+
+    client.ExpectStatus(HTTP_STATUS_OK);
+    client.ExpectHeader("content-encoding=gzip");
+    client.ExpectHeader("vary=accept-encoding");
+    client.ExpectControl(WAS_COMMAND_DATA);
+    client.ExpectControlEmpty();
+
+    const ssize_t flushed = read(client.input_fd, compressed,
+                                 sizeof(compressed));
+    if (flushed <= 0)
+        abort();
+
+    char buffer[64];
+    z_stream z{};
+    if (inflateInit2(&z, 15 + 16) != Z_OK)
+        abort();
+
+    z.next_in = (Bytef *)compressed;
+    z.avail_in = flushed;
+    z.next_out = (Bytef *)buffer;
+    z.avail_out = sizeof(buffer);
+
+    if (inflate(&z, Z_SYNC_FLUSH) != Z_OK || z.avail_in != 0 ||
+        sizeof(buffer) - z.avail_out != 5 ||
+        memcmp(buffer, "hello", 5) != 0)
+        abort();
+
+    if (!was_simple_puts(s, " world") || !was_simple_end(s))
+        abort();
+
+    const size_t length = ReceiveCompressedInput(client, flushed);
+    client.ExpectControlEmpty();
+
+    z.next_in = (Bytef *)compressed + flushed;
+    z.avail_in = length - flushed;
+
+    if (inflate(&z, Z_FINISH) != Z_STREAM_END ||
+        sizeof(buffer) - z.avail_out != 11 ||
+        memcmp(buffer, "hello world", 11) != 0)
+        abort();
+
+    inflateEnd(&z);
+}
+
+/**
+ * A compressed body which is shorter than the declared uncompressed
+ * length is aborted with PREMATURE.
+ */
+static void
+TestCompressPremature(FakeWasClient &client, struct was_simple *s)
+{
+    client.SendControl(WAS_COMMAND_REQUEST);
+    client.SendControl(WAS_COMMAND_URI, __func__);
+    client.SendControl(WAS_COMMAND_HEADER, "accept-encoding=gzip");
+    client.SendControl(WAS_COMMAND_NO_DATA);
+
+    const char *uri = was_simple_accept(s);
+    if (uri == nullptr || strcmp(uri, __func__) != 0)
+        abort();
+
+    if (was_simple_compress(s) == nullptr ||
+        !was_simple_set_length(s, 100) ||
+        !was_simple_puts(s, "hello"))
+        abort();
+
+    was_simple_end(s);
+
+    client.ExpectStatus(HTTP_STATUS_OK);
+    client.ExpectHeader("content-encoding=gzip");
+    client.ExpectHeader("vary=accept-encoding");
+    client.ExpectControl(WAS_COMMAND_DATA);
+
+    client.ExpectControlHeader(WAS_COMMAND_PREMATURE, sizeof(uint64_t));
+    uint64_t sent;
+    client.ReceiveControlT(sent);
+    client.ExpectControlEmpty();
+
+    if (ReadAvailable(client) != sent)
+        abort();
+}
+
+#endif
+
+#ifdef HAVE_BROTLI
+
+static void
+TestCompressBrotli(FakeWasClient &client, struct was_simple *s)
+{
+    client.SendControl(WAS_COMMAND_REQUEST);
+    client.SendControl(WAS_COMMAND_URI, __func__);
+    client.SendControl(WAS_COMMAND_HEADER, "accept-encoding=gzip;q=0.5, br");
+    client.SendControl(WAS_COMMAND_NO_DATA);
+
+    const char *uri = was_simple_accept(s);
+    if (uri == nullptr || strcmp(uri, __func__) != 0)
+        abort();
+
+    const char *encoding = was_simple_compress(s);
+    if (encoding == nullptr || strcmp(encoding, "br") != 0)
+        abort();
+
+    static constexpr char body[] = "hello brotli";
+    if (!was_simple_puts(s, body) || !was_simple_end(s))
+        abort();
+
+    client.ExpectStatus(HTTP_STATUS_OK);
+    client.ExpectHeader("content-encoding=br");
+    client.ExpectHeader("vary=accept-encoding");
+    client.ExpectControl(WAS_COMMAND_DATA);
+
+    const size_t length = ReceiveCompressedInput(client);
+    client.ExpectControlEmpty();
+
+    uint8_t buffer[64];
+    size_t buffer_size = sizeof(buffer);
+    if (BrotliDecoderDecompress(length, (const uint8_t *)compressed,
+                                &buffer_size, buffer) !=
+        BROTLI_DECODER_RESULT_SUCCESS ||
+        buffer_size != sizeof(body) - 1 ||
+        memcmp(buffer, body, buffer_size) != 0)
+        abort();
+}
+
+#endif
+
+#ifdef HAVE_ZSTD
+
+static void
+TestCompressZstd(FakeWasClient &client, struct was_simple *s)
+{
+    client.SendControl(WAS_COMMAND_REQUEST);
+    client.SendControl(WAS_COMMAND_URI, __func__);
+    client.SendControl(WAS_COMMAND_HEADER, "accept-encoding=br;q=0.5, zstd");
+    client.SendControl(WAS_COMMAND_NO_DATA);
+
+    const char *uri = was_simple_accept(s);
+    if (uri == nullptr || strcmp(uri, __func__) != 0)
+        abort();
+
+    const char *encoding = was_simple_compress(s);
+    if (encoding == nullptr || strcmp(encoding, "zstd") != 0)
+        abort();
+
+    static constexpr char body[] = "hello zstd";
+    if (!was_simple_puts(s, body) || !was_simple_end(s))
+        abort();
+
+    client.ExpectStatus(HTTP_STATUS_OK);
+    client.ExpectHeader("content-encoding=zstd");
+    client.ExpectHeader("vary=accept-encoding");
+    client.ExpectControl(WAS_COMMAND_DATA);
+
+    const size_t length = ReceiveCompressedInput(client);
+    client.ExpectControlEmpty();
+
+    char buffer[64];
+    const size_t nbytes = ZSTD_decompress(buffer, sizeof(buffer),
+                                          compressed, length);
+    if (ZSTD_isError(nbytes) || nbytes != sizeof(body) - 1 ||
+        memcmp(buffer, body, nbytes) != 0)
+        abort();
+}
+
+#endif
+
+static void
+TestCompressRefused(FakeWasClient &client, struct was_simple *s)
+{
+    client.SendControl(WAS_COMMAND_REQUEST);
+    client.SendControl(WAS_COMMAND_URI, __func__);
+    client.SendControl(WAS_COMMAND_HEADER, "accept-encoding=gzip;q=0, identity");
+    client.SendControl(WAS_COMMAND_NO_DATA);
+
+    const char *uri = was_simple_accept(s);
+    if (uri == nullptr || strcmp(uri, __func__) != 0)
+        abort();
+
+    if (was_simple_compress(s) != nullptr ||
+        !was_simple_puts(s, "foo"))
+        abort();
+
+    was_simple_end(s);
+
+    client.ExpectStatus(HTTP_STATUS_OK);
+    client.ExpectControl(WAS_COMMAND_DATA);
+    client.ExpectLength(3);
+    client.ExpectControlEmpty();
+    ExpectInput(client, "foo");
+}
+
+/**
+ * A response stored with was_simple_cache_response() is sent again
+ * by was_simple_accept() for the next identical request; a different
+ * key header value misses the cache.
+ */
+static void
+TestCache(FakeWasClient &client, struct was_simple *s,
+          struct was_simple_cache *cache)
+{
+    struct was_simple_stats before, after;
+    was_simple_get_stats(&before);
+
+    was_simple_set_cache(s, cache);
+
+    client.SendControl(WAS_COMMAND_REQUEST);
+    client.SendControl(WAS_COMMAND_URI, __func__);
+    client.SendControl(WAS_COMMAND_HEADER, "accept-language=de");
+    client.SendControl(WAS_COMMAND_NO_DATA);
+
+    const char *uri = was_simple_accept(s);
+    if (uri == nullptr || strcmp(uri, __func__) != 0)
+        abort();
+
+    if (!was_simple_cache_response(s, 60000) ||
+        !was_simple_set_header(s, "content-type", "text/plain") ||
+        !was_simple_puts(s, "cached") ||
+        !was_simple_end(s))
+        abort();
+
+    client.ExpectStatus(HTTP_STATUS_OK);
+    client.ExpectHeader("content-type=text/plain");
+    client.ExpectControl(WAS_COMMAND_DATA);
+    client.ExpectLength(6);
+    ExpectInput(client, "cached");
+    client.ExpectControlEmpty();
+
+    /* the same request again: it is answered inside
+       was_simple_accept_non_block(), which then returns because the
+       connection is idle */
+    client.SendControl(WAS_COMMAND_REQUEST);
+    client.SendControl(WAS_COMMAND_URI, __func__);
+    client.SendControl(WAS_COMMAND_HEADER, "accept-language=de");
+    client.SendControl(WAS_COMMAND_NO_DATA);
+
+    static const char would_block[] = "would_block";
+    if (was_simple_accept_non_block(s, would_block) != would_block)
+        abort();
+
+    client.ExpectStatus(HTTP_STATUS_OK);
+    client.ExpectHeader("content-type=text/plain");
+    client.ExpectControl(WAS_COMMAND_DATA);
+    client.ExpectLength(6);
+    ExpectInput(client, "cached");
+    client.ExpectControlEmpty();
+
+    /* a different "accept-language" value misses the cache */
+    client.SendControl(WAS_COMMAND_REQUEST);
+    client.SendControl(WAS_COMMAND_URI, __func__);
+    client.SendControl(WAS_COMMAND_HEADER, "accept-language=en");
+    client.SendControl(WAS_COMMAND_NO_DATA);
+
+    uri = was_simple_accept(s);
+    if (uri == nullptr || strcmp(uri, __func__) != 0)
+        abort();
+
+    const char *language = was_simple_get_header(s, "accept-language");
+    if (language == nullptr || strcmp(language, "en") != 0)
+        abort();
+
+    was_simple_end(s);
+
+    client.ExpectStatus(HTTP_STATUS_NO_CONTENT);
+    client.ExpectControl(WAS_COMMAND_NO_DATA);
+    client.ExpectControlEmpty();
+
+    was_simple_set_cache(s, nullptr);
+
+    was_simple_get_stats(&after);
+
+    if (after.requests != before.requests + 2 ||
+        after.cache_hits != before.cache_hits + 1 ||
+        after.cache_misses != before.cache_misses + 2 ||
+        after.cache_stores != before.cache_stores + 1 ||
+        /* such a small body is copied from memory, not from a pipe */
+        after.pipe_splices != before.pipe_splices)
+        abort();
+}
+
+static void
+TestAutoMetrics(FakeWasClient &client, struct was_simple *s)
+{
+    client.SendControl(WAS_COMMAND_REQUEST);
+    client.SendControl(WAS_COMMAND_URI, __func__);
+    client.SendControl(WAS_COMMAND_METRIC);
+    client.SendControl(WAS_COMMAND_DATA);
+    client.SendLength(5);
+    client.SendOutput("hello");
+
+    was_simple_set_auto_metrics(s, true);
+
+    const char *uri = was_simple_accept(s);
+    if (uri == nullptr || strcmp(uri, __func__) != 0)
+        abort();
+
+    char buffer[8];
+    if (was_simple_read(s, buffer, sizeof(buffer)) != 5)
+        abort();
+
+    was_simple_puts(s, "foo");
+    was_simple_end(s);
+
+    was_simple_set_auto_metrics(s, false);
+
+    client.ExpectStatus(HTTP_STATUS_OK);
+    client.ExpectControl(WAS_COMMAND_DATA);
+
+    const float handler = client.ExpectMetric("was_handler_seconds");
+    const float first_byte = client.ExpectMetric("was_first_byte_seconds");
+    if (handler < 0 || first_byte < 0 || first_byte > handler)
+        abort();
+
+    /* byte counts are exact in a float; compare them as integers */
+    if (unsigned(client.ExpectMetric("was_request_body_bytes")) != 5 ||
+        unsigned(client.ExpectMetric("was_response_body_bytes")) != 3 ||
+        unsigned(client.ExpectMetric("was_response_body_spliced_bytes")) != 0 ||
+        unsigned(client.ExpectMetric("was_response_body_copied_bytes")) != 3)
+        abort();
+
+    client.ExpectMetric("was_waits");
+
+    client.ExpectLength(3);
+    client.ExpectControlEmpty();
+    client.DiscardAllInput(3);
+}
+
+static void
+TestStopEarly(FakeWasClient &client, struct was_simple *s)
+{
+    client.SendControl(WAS_COMMAND_REQUEST);
+    client.SendControl(WAS_COMMAND_URI, __func__);
+    client.SendControl(WAS_COMMAND_NO_DATA);
+    client.SendControl(WAS_COMMAND_STOP);
+
+    const char *uri = was_simple_accept(s);
+    if (uri == nullptr || strcmp(uri, __func__) != 0)
+        abort();
+
+    if (was_simple_has_body(s))
+        abort();
+
+    was_simple_end(s);
+
+    client.ExpectPremature(0);
+    client.ExpectControlEmpty();
+}
+
+static void
+TestStopLate(FakeWasClient &client, struct was_simple *s, bool poll)
+{
+    client.SendControl(WAS_COMMAND_REQUEST);
+    client.SendControl(WAS_COMMAND_URI, __func__);
+    client.SendControl(WAS_COMMAND_HEADER, "foo=bar");
+    client.SendControl(WAS_COMMAND_NO_DATA);
+
+    const char *uri = was_simple_accept(s);
+    if (uri == nullptr || strcmp(uri, __func__) != 0)
+        abort();
+
+    if (was_simple_has_body(s))
+        abort();
+
+    client.ExpectControlEmpty();
+
+    bool success = was_simple_puts(s, "foo");
+    if (!success)
+        abort();
+
+    client.ExpectStatus(HTTP_STATUS_OK);
+    client.ExpectControl(WAS_COMMAND_DATA);
+    client.ExpectControlEmpty();
+
+    client.SendControl(WAS_COMMAND_STOP);
+
+    if (poll) {
+        auto poll_result = was_simple_output_poll(s, 0);
+        if (poll_result != WAS_SIMPLE_POLL_ERROR)
+            abort();
+    } else {
+        char buffer[4096];
+        memset(buffer, '0', sizeof(buffer));
+
+        success = was_simple_write(s, buffer, 4090);
+        if (!success)
+            abort();
+
+        success = was_simple_write(s, buffer, 8);
+        if (success)
+            abort();
+    }
+
+    /* after receiving STOP, all method calls for this request must fail */
+
+    if (was_simple_status(s, HTTP_STATUS_NOT_FOUND))
+        abort();
+
+    if (was_simple_set_header(s, "foo", "bar"))
+        abort();
+
+    if (was_simple_copy_all_headers(s))
+        abort();
+
+    if (was_simple_set_length(s, 42))
+        abort();
+
+    if (was_simple_output_begin(s))
+        abort();
+
+    if (was_simple_output_poll(s, 0) != WAS_SIMPLE_POLL_ERROR)
+        abort();
+
+    if (was_simple_output_fd(s) != -1)
+        abort();
+
+    if (was_simple_set_length(s, 1))
+        abort();
+
+    if (was_simple_puts(s, "foo"))
+        abort();
+
+    was_simple_end(s);
+
+    client.ExpectPremature(poll ? 3 : 4093);
+    client.ExpectControlEmpty();
+    client.DiscardAllInput(poll ? 3 : 4093);
+}
+
+static void
+TestAbort(FakeWasClient &client, struct was_simple *s, bool length)
+{
+    client.SendControl(WAS_COMMAND_REQUEST);
+    client.SendControl(WAS_COMMAND_URI, __func__);
+    client.SendControl(WAS_COMMAND_NO_DATA);
+
+    const char *uri = was_simple_accept(s);
+    if (uri == nullptr || strcmp(uri, __func__) != 0)
+        abort();
+
+    if (was_simple_has_body(s))
+        abort();
+
+    client.ExpectControlEmpty();
+
+    bool success = was_simple_puts(s, "foo");
+    if (!success)
+        abort();
+
+    if (length && !was_simple_set_length(s, 1024))
+        abort();
+
+    client.ExpectStatus(HTTP_STATUS_OK);
+    client.ExpectControl(WAS_COMMAND_DATA);
+
+    if (length)
+        client.ExpectLength(1024);
+
+    client.ExpectControlEmpty();
+
+    was_simple_abort(s);
+
+    client.ExpectPremature(3);
+    client.ExpectControlEmpty();
+    client.DiscardAllInput(3);
+}
+
+static void
+TestStopTooLate(FakeWasClient &client, struct was_simple *s)
+{
+    client.SendControl(WAS_COMMAND_REQUEST);
+    client.SendControl(WAS_COMMAND_URI, __func__);
+    client.SendControl(WAS_COMMAND_NO_DATA);
+
+    const char *uri = was_simple_accept(s);
+    if (uri == nullptr || strcmp(uri, __func__) != 0)
+        abort();
+
+    if (was_simple_has_body(s))
         abort();
 
     client.ExpectControlEmpty();
@@ -588,6 +2402,52 @@ TestStopTooLate(FakeWasClient &client, struct was_simple *s)
     client.DiscardAllInput(0);
 }
 
+/**
+ * With io_uring, the next request may be received in the background
+ * while the response is being sent; was_simple_control_fd() must
+ * report it although the ring holds no completions anymore.
+ */
+static void
+TestControlFdQueued(FakeWasClient &client, struct was_simple *s)
+{
+    client.SendControl(WAS_COMMAND_REQUEST);
+    client.SendControl(WAS_COMMAND_URI, __func__);
+    client.SendControl(WAS_COMMAND_NO_DATA);
+
+    const char *uri = was_simple_accept(s);
+    if (uri == nullptr || strcmp(uri, __func__) != 0)
+        abort();
+
+    client.SendControl(WAS_COMMAND_REQUEST);
+    client.SendControl(WAS_COMMAND_URI, "/next");
+    client.SendControl(WAS_COMMAND_NO_DATA);
+
+    if (!was_simple_puts(s, "foo") || !was_simple_end(s))
+        abort();
+
+    struct pollfd pfd{};
+    pfd.fd = was_simple_control_fd(s);
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, 0) != 1)
+        abort();
+
+    client.ExpectStatus(HTTP_STATUS_OK);
+    client.ExpectControl(WAS_COMMAND_DATA);
+    client.ExpectLength(3);
+    client.ExpectControlEmpty();
+    ExpectInput(client, "foo");
+
+    uri = was_simple_accept(s);
+    if (uri == nullptr || strcmp(uri, "/next") != 0)
+        abort();
+
+    was_simple_end(s);
+
+    client.ExpectStatus(HTTP_STATUS_NO_CONTENT);
+    client.ExpectControl(WAS_COMMAND_NO_DATA);
+    client.ExpectControlEmpty();
+}
+
 static void
 TestAll()
 {
@@ -597,11 +2457,83 @@ TestAll()
 
     TestEmpty(client, s);
     TestSimple(client, s);
+    TestStats(client, s);
+    TestHeaders(client, s);
+    TestHeaders(client, s);
+    TestHeaderTokens(client, s);
+
+    auto *header_block = was_simple_header_block_new();
+    if (!was_simple_header_block_add(header_block, "content-type", "text/plain") ||
+        !was_simple_header_block_add(header_block, "cache-control", "no-cache"))
+        abort();
+
+    /* the block is reused */
+    TestHeaderBlock(client, s, header_block);
+    TestHeaderBlock(client, s, header_block);
+
+    TestManyHeaders(client, s);
+    TestManyHeaders(client, s);
+    TestOversizedHeader(client, s);
+    TestLargeResponseHeader(client, s);
+    TestOutputBuffer(client, s);
+    TestOutputBufferLength(client, s);
+    TestWriteV(client, s, false);
+    TestWriteV(client, s, true);
+    TestWriteGift(client, s);
+    TestPipeAuto(client, s);
+    TestNonBlock(client, s);
+    TestNonBlockStop(client, s);
+    TestSendFile(client, s);
+    TestNonBlockSendFile(client, s);
+    TestSendFileRange(client, s, nullptr, HTTP_STATUS_OK, nullptr,
+                      "0123456789");
+    TestSendFileRange(client, s, "bytes=2-4", HTTP_STATUS_PARTIAL_CONTENT,
+                      "bytes 2-4/10", "234");
+    TestSendFileRange(client, s, "bytes=7-", HTTP_STATUS_PARTIAL_CONTENT,
+                      "bytes 7-9/10", "789");
+    TestSendFileRange(client, s, "bytes=-2", HTTP_STATUS_PARTIAL_CONTENT,
+                      "bytes 8-9/10", "89");
+    TestSendFileRange(client, s, "bytes=5-100", HTTP_STATUS_PARTIAL_CONTENT,
+                      "bytes 5-9/10", "56789");
+    TestSendFileRange(client, s, "bytes=0-1,5-6", HTTP_STATUS_OK, nullptr,
+                      "0123456789");
+    TestSendFileRange(client, s, "bytes=20-30",
+                      HTTP_STATUS_REQUESTED_RANGE_NOT_SATISFIABLE,
+                      "bytes */10", "");
     TestDiscardedRequestBody(client, s);
     TestPrematureDiscardedRequestBody(client, s, false);
     TestPrematureDiscardedRequestBody(client, s, true);
     TestPrematureConsumedRequestBody(client, s, false);
     TestPrematureConsumedRequestBody(client, s, true);
+    TestReadLine(client, s);
+    TestInputMap(client, s, 4096);
+    TestInputMap(client, s, 100000);
+    TestInputMapUnknownLength(client, s);
+    TestInputMapPremature(client, s, 100);
+    TestInputMapPremature(client, s, 100000);
+    TestSpliceTo(client, s);
+    TestSpliceFrom(client, s);
+#ifdef HAVE_ZLIB
+    TestCompress(client, s);
+    TestCompressLength(client, s);
+    TestCompressEmpty(client, s);
+    TestCompressFlush(client, s);
+    TestCompressPremature(client, s);
+#endif
+#ifdef HAVE_BROTLI
+    TestCompressBrotli(client, s);
+#endif
+#ifdef HAVE_ZSTD
+    TestCompressZstd(client, s);
+#endif
+    TestCompressRefused(client, s);
+
+    auto *cache = was_simple_cache_new(1024 * 1024, 65536);
+    was_simple_cache_add_key_header(cache, "accept-language");
+    TestCache(client, s, cache);
+    was_simple_cache_flush(cache);
+
+    TestAutoMetrics(client, s);
     TestStopEarly(client, s);
     TestStopLate(client, s, false);
     TestStopLate(client, s, true);
@@ -613,6 +2545,34 @@ TestAll()
        still alive */
     TestEmpty(client, s);
 
+    /* run the protocol tests again with the io_uring backend */
+    if (was_simple_enable_io_uring(s)) {
+        TestSimple(client, s);
+        TestHeaders(client, s);
+        TestHeaderTokens(client, s);
+        TestHeaderBlock(client, s, header_block);
+        TestLargeResponseHeader(client, s);
+        TestOutputBuffer(client, s);
+        TestOutputBufferLength(client, s);
+        TestWriteV(client, s, true);
+        TestNonBlock(client, s);
+        TestNonBlockStop(client, s);
+        TestControlFdQueued(client, s);
+        TestDiscardedRequestBody(client, s);
+        TestPrematureDiscardedRequestBody(client, s, true);
+        TestPrematureConsumedRequestBody(client, s, true);
+        TestReadLine(client, s);
+        TestStopEarly(client, s);
+        TestStopLate(client, s, true);
+        TestAbort(client, s, false);
+        TestStopTooLate(client, s);
+        TestCache(client, s, cache);
+        TestEmpty(client, s);
+    } else if (errno != ENOSYS && errno != EPERM)
+        abort();
+
+    was_simple_cache_free(cache);
+    was_simple_header_block_free(header_block);
     was_simple_free(s);
 }
 